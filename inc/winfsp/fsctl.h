@@ -65,6 +65,12 @@ extern const __declspec(selectany) GUID FspFsvrtDeviceClassGuid =
 #define FSP_FSCTL_STOP                  \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'S', METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+/* FSCTL_DUPLICATE_EXTENTS_TO_FILE is missing on some SDK's/WDK's */
+#if !defined(FSCTL_DUPLICATE_EXTENTS_TO_FILE)
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 209, METHOD_BUFFERED, FILE_WRITE_DATA)
+#endif
+
 #define FSP_FSCTL_VOLUME_PARAMS_PREFIX  "\\VolumeParams="
 
 #define FSP_FSCTL_VOLUME_NAME_SIZE      (64 * sizeof(WCHAR))
@@ -83,6 +89,12 @@ FSP_FSCTL_STATIC_ASSERT(FSP_FSCTL_VOLUME_NAME_SIZEMAX <= 260 * sizeof(WCHAR),
 #define FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN (64 * 1024)
 #define FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN       FSP_FSCTL_TRANSACT_REQ_SIZEMAX
 
+#define FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX    64
+#define FSP_FSCTL_REGISTERED_BUFFER_SIZEMIN     (64 * 1024)
+#define FSP_FSCTL_REGISTERED_BUFFER_SIZEDEFAULT (1024 * 1024)
+#define FSP_FSCTL_REGISTERED_BUFFER_SIZEMAX     (16 * 1024 * 1024)
+#define FSP_FSCTL_REGISTERED_BUFFER_TOTALMAX    (256 * 1024 * 1024)
+
 #define FSP_FSCTL_TRANSACT_REQ_TOKEN_HANDLE(T)  ((HANDLE)((T) & 0xffffffff))
 #define FSP_FSCTL_TRANSACT_REQ_TOKEN_PID(T)     ((UINT32)(((T) >> 32) & 0xffffffff))
 
@@ -164,12 +176,15 @@ enum
     /* user-mode flags */\
     UINT32 UmFileContextIsUserContext2:1;   /* user mode: FileContext parameter is UserContext2 */\
     UINT32 UmFileContextIsFullContext:1;    /* user mode: FileContext parameter is FullContext */\
-    UINT32 UmReservedFlags:6;\
+    UINT32 UmBatchDispatch:1;               /* user mode: dispatch requests in batches (ReadV, etc.) */\
+    UINT32 UmReparseCache:1;                /* user mode: cache reparse point resolutions */\
+    UINT32 UmReservedFlags:4;\
     /* additional kernel-mode flags */\
     UINT32 AllowOpenInKernelMode:1;         /* allow kernel mode to open files when possible */\
     UINT32 CasePreservedExtendedAttributes:1;   /* preserve case of EA (default is UPPERCASE) */\
     UINT32 WslFeatures:1;                   /* support features required for WSLinux */\
-    UINT32 KmReservedFlags:5;\
+    UINT32 DuplicateExtents:1;              /* support FSCTL_DUPLICATE_EXTENTS_TO_FILE (range clone) */\
+    UINT32 KmReservedFlags:4;\
     WCHAR Prefix[FSP_FSCTL_VOLUME_PREFIX_SIZE / sizeof(WCHAR)]; /* UNC prefix (\Server\Share) */\
     WCHAR FileSystemName[FSP_FSCTL_VOLUME_FSNAME_SIZE / sizeof(WCHAR)];
 #define FSP_FSCTL_VOLUME_PARAMS_V1_FIELD_DEFN\
@@ -185,8 +200,11 @@ enum
     UINT32 SecurityTimeout;             /* security info timeout (millis); overrides FileInfoTimeout */\
     UINT32 StreamInfoTimeout;           /* stream info timeout (millis); overrides FileInfoTimeout */\
     UINT32 EaTimeout;                   /* EA timeout (millis); overrides FileInfoTimeout */\
-    UINT32 Reserved32[2];\
-    UINT64 Reserved64[2];
+    UINT32 RegisteredBufferCount;       /* number of registered data buffers (0: do not register) */\
+    UINT32 RegisteredBufferSize;        /* size of each registered data buffer (bytes; 0: default) */\
+    UINT32 NegativeLookupTimeout;       /* user mode: cache name lookup misses (millis; 0: disabled) */\
+    UINT32 Reserved32[1];\
+    UINT64 Reserved64[1];
 typedef struct
 {
     FSP_FSCTL_VOLUME_PARAMS_V0_FIELD_DEFN
@@ -256,6 +274,15 @@ typedef struct
     UINT64 UserContext2;
 } FSP_FSCTL_TRANSACT_FULL_CONTEXT;
 typedef struct
+{
+    FSP_FSCTL_TRANSACT_FULL_CONTEXT Source;
+    UINT64 SourceOffset;
+    UINT64 TargetOffset;
+    UINT64 Length;
+} FSP_FSCTL_DUPLICATE_EXTENTS_DATA;
+FSP_FSCTL_STATIC_ASSERT(40 == sizeof(FSP_FSCTL_DUPLICATE_EXTENTS_DATA),
+    "sizeof(FSP_FSCTL_DUPLICATE_EXTENTS_DATA) must be exactly 40.");
+typedef struct
 {
     UINT16 Offset;
     UINT16 Size;
@@ -447,7 +474,7 @@ typedef struct
         } QueryStreamInformation;
     } Req;
     FSP_FSCTL_TRANSACT_BUF FileName;
-        /* Create,Cleanup,SetInformation{Disposition,Rename},FileSystemControl{ReparsePoint} */
+        /* Create,Cleanup,SetInformation{Disposition,Rename},FileSystemControl{ReparsePoint,DuplicateExtents} */
     FSP_FSCTL_DECLSPEC_ALIGN UINT8 Buffer[];
 } FSP_FSCTL_TRANSACT_REQ;
 typedef struct
@@ -523,6 +550,7 @@ typedef struct
         struct
         {
             FSP_FSCTL_TRANSACT_BUF Buffer;
+            FSP_FSCTL_FILE_INFO FileInfo;   /* FSCTL_DUPLICATE_EXTENTS_TO_FILE: target file */
         } FileSystemControl;
         struct
         {
@@ -588,6 +616,57 @@ static inline FSP_FSCTL_TRANSACT_RSP *FspFsctlTransactConsumeResponse(
     return NextResponse <= ResponseBufEnd ? (FSP_FSCTL_TRANSACT_RSP *)NextResponse : 0;
 }
 
+
+/*
+ * Registered buffer slots
+ *
+ * When VolumeParams.RegisteredBufferCount is non-zero, the driver creates a pool of
+ * RegisteredBufferCount pinned data buffers of RegisteredBufferSize bytes each at volume
+ * creation time and maps it once into the file system process. Read and Write requests
+ * that fit into a buffer acquire a free slot; their Address then points into the pool and
+ * the slot is released when the request completes. Requests that do not fit or that find
+ * all slots busy use the regular per-request buffer.
+ */
+typedef struct
+{
+    UINT32 SlotCount;
+    volatile LONG64 BusyMask;
+} FSP_FSCTL_BUFFER_SLOTS;
+static inline VOID FspFsctlBufferSlotsInitialize(
+    FSP_FSCTL_BUFFER_SLOTS *Slots, UINT32 SlotCount)
+{
+    Slots->SlotCount = 64 > SlotCount ? SlotCount : 64;
+    Slots->BusyMask = 0;
+}
+static inline BOOLEAN FspFsctlBufferSlotsAcquire(
+    FSP_FSCTL_BUFFER_SLOTS *Slots, PUINT32 PSlot)
+{
+    LONG64 BusyMask, PrevBusyMask;
+    UINT32 Slot;
+    BusyMask = Slots->BusyMask;
+    for (;;)
+    {
+        for (Slot = 0; Slots->SlotCount > Slot; Slot++)
+            if (0 == (BusyMask & (1LL << Slot)))
+                break;
+        if (Slots->SlotCount == Slot)
+            return FALSE;
+        PrevBusyMask = InterlockedCompareExchange64(&Slots->BusyMask,
+            BusyMask | (1LL << Slot), BusyMask);
+        if (PrevBusyMask == BusyMask)
+        {
+            *PSlot = Slot;
+            return TRUE;
+        }
+        BusyMask = PrevBusyMask;
+    }
+}
+static inline VOID FspFsctlBufferSlotsRelease(
+    FSP_FSCTL_BUFFER_SLOTS *Slots, UINT32 Slot)
+{
+    InterlockedAnd64(&Slots->BusyMask, ~(1LL << Slot));
+}
+
 #if !defined(WINFSP_SYS_INTERNAL)
 FSP_API NTSTATUS FspFsctlCreateVolume(PWSTR DevicePath,
     const FSP_FSCTL_VOLUME_PARAMS *VolumeParams,
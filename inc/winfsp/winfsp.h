@@ -110,6 +110,7 @@ typedef struct _FILE_FULL_EA_INFORMATION
  * FSP_FILE_SYSTEM_INTERFACE operations.
  */
 typedef struct _FSP_FILE_SYSTEM FSP_FILE_SYSTEM;
+typedef struct _FSP_FILE_SYSTEM_OPERATION_CONTEXT FSP_FILE_SYSTEM_OPERATION_CONTEXT;
 typedef NTSTATUS FSP_FILE_SYSTEM_OPERATION_GUARD(FSP_FILE_SYSTEM *,
     FSP_FSCTL_TRANSACT_REQ *, FSP_FSCTL_TRANSACT_RSP *);
 typedef NTSTATUS FSP_FILE_SYSTEM_OPERATION(FSP_FILE_SYSTEM *,
@@ -153,6 +154,55 @@ enum
     FspCleanupSetLastWriteTime          = 0x40,
     FspCleanupSetChangeTime             = 0x80,
 };
+/**
+ * I/O segment of a vectored read or write (ReadV, WriteV).
+ *
+ * Each segment corresponds to a single Read or Write request. The file system
+ * reports the outcome of each segment in its Status and BytesTransferred fields.
+ */
+typedef struct
+{
+    PVOID Buffer;
+    UINT64 Offset;
+    ULONG Length;
+    BOOLEAN WriteToEndOfFile;           /* WriteV only */
+    BOOLEAN ConstrainedIo;              /* WriteV only */
+    NTSTATUS Status;                    /* [out] */
+    ULONG BytesTransferred;             /* [out] */
+} FSP_FILE_SYSTEM_IO_SEGMENT;
+#define FSP_FILE_SYSTEM_IO_SEGMENT_MAX  64
+/**
+ * Entry of a batched file create (CreateMany).
+ *
+ * Each entry corresponds to a single Create request with a FILE_CREATE disposition. The
+ * file system reports the outcome of each entry in its Status field and on success also
+ * sets FileContext and OpenFileInfo. OpenFileInfo.NormalizedName points to a buffer of
+ * OpenFileInfo.NormalizedNameSize bytes that may receive the normalized file name.
+ */
+typedef struct
+{
+    PWSTR FileName;
+    UINT32 CreateOptions;
+    UINT32 GrantedAccess;
+    UINT32 FileAttributes;
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    UINT64 AllocationSize;
+    PVOID FileContext;                  /* [out] */
+    FSP_FSCTL_OPEN_FILE_INFO OpenFileInfo;  /* [out] */
+    NTSTATUS Status;                    /* [out] */
+} FSP_FILE_SYSTEM_CREATE_ENTRY;
+/**
+ * Entry of a batched file delete (DeleteMany).
+ *
+ * Each entry corresponds to a single Cleanup request that has the FspCleanupDelete flag set.
+ */
+typedef struct
+{
+    PVOID FileContext;
+    PWSTR FileName;
+    ULONG Flags;
+} FSP_FILE_SYSTEM_DELETE_ENTRY;
+#define FSP_FILE_SYSTEM_NAMESPACE_BATCH_MAX 16
 /**
  * @class FSP_FILE_SYSTEM
  * File system interface.
@@ -1038,12 +1088,258 @@ typedef struct _FSP_FILE_SYSTEM_INTERFACE
         PVOID FileContext,
         PFILE_FULL_EA_INFORMATION Ea, ULONG EaLength,
         FSP_FSCTL_FILE_INFO *FileInfo);
+    /**
+     * Duplicate a range of a source file into a range of a target file.
+     *
+     * This function is called in response to FSCTL_DUPLICATE_EXTENTS_TO_FILE, which is used
+     * by CopyFile and other applications to copy file data without reading it into and
+     * writing it out of the application. It is only called when the VolumeParams
+     * DuplicateExtents flag is set. The source and target files are open files on this
+     * file system and may be the same file.
+     *
+     * The range to copy may extend past the end of the target file, in which case the
+     * target file is extended. The range must lie within the source file.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param FileContext
+     *     The file context of the target file.
+     * @param SourceFileContext
+     *     The file context of the source file.
+     * @param SourceOffset
+     *     Offset within the source file to copy from.
+     * @param TargetOffset
+     *     Offset within the target file to copy to.
+     * @param Length
+     *     Number of bytes to copy.
+     * @param FileInfo [out]
+     *     Pointer to a structure that will receive the target file information on successful
+     *     return from this call. This information includes file attributes, file times, etc.
+     * @return
+     *     STATUS_SUCCESS or error code.
+     */
+    NTSTATUS (*DuplicateExtents)(FSP_FILE_SYSTEM *FileSystem,
+        PVOID FileContext, PVOID SourceFileContext,
+        UINT64 SourceOffset, UINT64 TargetOffset, UINT64 Length,
+        FSP_FSCTL_FILE_INFO *FileInfo);
+    /**
+     * Read a file at multiple offsets.
+     *
+     * When the VolumeParams UmBatchDispatch flag is set the dispatcher retrieves requests
+     * from the FSD in batches. Consecutive read requests in a batch that are for the same
+     * open file are then passed to ReadV as a single list of segments (up to
+     * FSP_FILE_SYSTEM_IO_SEGMENT_MAX); a read request that cannot be grouped is passed to
+     * Read as usual. This operation is not used unless UmBatchDispatch is set.
+     *
+     * Unlike Read this operation must complete synchronously; it may not return
+     * STATUS_PENDING.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param FileContext
+     *     The file context of the file to be read.
+     * @param Segments
+     *     The segments to read. On return the file system must have set the Status and
+     *     BytesTransferred of every segment.
+     * @param SegmentCount
+     *     Number of segments.
+     * @return
+     *     STATUS_SUCCESS or error code. An error code fails all segments.
+     * @see
+     *     Read
+     */
+    NTSTATUS (*ReadV)(FSP_FILE_SYSTEM *FileSystem,
+        PVOID FileContext, FSP_FILE_SYSTEM_IO_SEGMENT *Segments, ULONG SegmentCount);
+    /**
+     * Write a file at multiple offsets.
+     *
+     * Consecutive write requests in a batch that are for the same open file are passed to
+     * WriteV as a single list of segments. Segments must be applied in order. See ReadV.
+     *
+     * Unlike Write this operation must complete synchronously; it may not return
+     * STATUS_PENDING.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param FileContext
+     *     The file context of the file to be written.
+     * @param Segments
+     *     The segments to write. On return the file system must have set the Status and
+     *     BytesTransferred of every segment.
+     * @param SegmentCount
+     *     Number of segments.
+     * @param FileInfo [out]
+     *     Pointer to a structure that will receive the file information after all segments
+     *     have been written. This information includes file attributes, file times, etc.
+     * @return
+     *     STATUS_SUCCESS or error code. An error code fails all segments.
+     * @see
+     *     Write
+     */
+    NTSTATUS (*WriteV)(FSP_FILE_SYSTEM *FileSystem,
+        PVOID FileContext, FSP_FILE_SYSTEM_IO_SEGMENT *Segments, ULONG SegmentCount,
+        FSP_FSCTL_FILE_INFO *FileInfo);
+    /**
+     * Create multiple new files or directories in the same directory.
+     *
+     * When the VolumeParams UmBatchDispatch flag is set the dispatcher retrieves requests
+     * from the FSD in batches. Consecutive create requests in a batch that have a FILE_CREATE
+     * disposition, no extended attributes and that are for files in the same directory are
+     * then passed to CreateMany (up to FSP_FILE_SYSTEM_NAMESPACE_BATCH_MAX); the operation guard is
+     * acquired once for the whole group. A create request that cannot be grouped is passed
+     * to Create or CreateEx as usual. Entries are not passed to CreateMany when the file
+     * system uses full file contexts (UmFileContextIsFullContext).
+     *
+     * Each entry must be processed in order as if by a call to Create. Unlike Create this
+     * operation must complete synchronously; no entry may have a Status of STATUS_PENDING.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param Entries
+     *     The files to create. On return the file system must have set the Status of every
+     *     entry and the FileContext and OpenFileInfo of every entry that succeeded.
+     * @param EntryCount
+     *     Number of entries.
+     * @return
+     *     STATUS_SUCCESS or error code. An error code fails all entries.
+     * @see
+     *     Create
+     */
+    NTSTATUS (*CreateMany)(FSP_FILE_SYSTEM *FileSystem,
+        FSP_FILE_SYSTEM_CREATE_ENTRY *Entries, ULONG EntryCount);
+    /**
+     * Delete multiple files or directories in the same directory.
+     *
+     * Consecutive cleanup requests in a batch that have the FspCleanupDelete flag set and
+     * that are for files in the same directory are passed to DeleteMany (up to
+     * FSP_FILE_SYSTEM_NAMESPACE_BATCH_MAX). Each entry must be processed in order exactly
+     * as if by a call to Cleanup with the entry's FileContext, FileName and Flags.
+     * See CreateMany.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param Entries
+     *     The files to clean up and delete.
+     * @param EntryCount
+     *     Number of entries.
+     * @see
+     *     Cleanup
+     */
+    VOID (*DeleteMany)(FSP_FILE_SYSTEM *FileSystem,
+        FSP_FILE_SYSTEM_DELETE_ENTRY *Entries, ULONG EntryCount);
+    /**
+     * Read a file.
+     *
+     * This operation is the same as Read, except that the operation context is passed
+     * explicitly rather than retrieved from thread local storage with
+     * FspFileSystemGetOperationContext. A file system that completes reads asynchronously
+     * can take the request Hint from here. If both ReadEx and Read are defined, ReadEx
+     * takes precedence.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param OperationContext
+     *     The operation context of this request. It is valid only for the duration of this
+     *     call; a file system that returns STATUS_PENDING must copy anything it needs from it.
+     * @param FileContext
+     *     The file context of the file to be read.
+     * @param Buffer
+     *     Pointer to a buffer that will receive the results of the read operation.
+     * @param Offset
+     *     Offset within the file to read from.
+     * @param Length
+     *     Length of data to read.
+     * @param PBytesTransferred [out]
+     *     Pointer to a memory location that will receive the actual number of bytes read.
+     * @return
+     *     STATUS_SUCCESS or error code. STATUS_PENDING is supported allowing for asynchronous
+     *     operation.
+     * @see
+     *     Read
+     */
+    NTSTATUS (*ReadEx)(FSP_FILE_SYSTEM *FileSystem,
+        FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+        PVOID FileContext, PVOID Buffer, UINT64 Offset, ULONG Length,
+        PULONG PBytesTransferred);
+    /**
+     * Write a file.
+     *
+     * This operation is the same as Write, except that the operation context is passed
+     * explicitly. If both WriteEx and Write are defined, WriteEx takes precedence.
+     * See ReadEx.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param OperationContext
+     *     The operation context of this request. It is valid only for the duration of this call.
+     * @param FileContext
+     *     The file context of the file to be written.
+     * @param Buffer
+     *     Pointer to a buffer that contains the data to write.
+     * @param Offset
+     *     Offset within the file to write to.
+     * @param Length
+     *     Length of data to write.
+     * @param WriteToEndOfFile
+     *     When TRUE the file system must write to the current end of file. In this case the Offset
+     *     parameter will contain the value -1.
+     * @param ConstrainedIo
+     *     When TRUE the file system must not extend the file (i.e. change the file size).
+     * @param PBytesTransferred [out]
+     *     Pointer to a memory location that will receive the actual number of bytes written.
+     * @param FileInfo [out]
+     *     Pointer to a structure that will receive the file information on successful return
+     *     from this call. This information includes file attributes, file times, etc.
+     * @return
+     *     STATUS_SUCCESS or error code. STATUS_PENDING is supported allowing for asynchronous
+     *     operation.
+     * @see
+     *     Write
+     */
+    NTSTATUS (*WriteEx)(FSP_FILE_SYSTEM *FileSystem,
+        FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+        PVOID FileContext, PVOID Buffer, UINT64 Offset, ULONG Length,
+        BOOLEAN WriteToEndOfFile, BOOLEAN ConstrainedIo,
+        PULONG PBytesTransferred, FSP_FSCTL_FILE_INFO *FileInfo);
+    /**
+     * Read a directory.
+     *
+     * This operation is the same as ReadDirectory, except that the operation context is
+     * passed explicitly. If both ReadDirectoryEx and ReadDirectory are defined,
+     * ReadDirectoryEx takes precedence. See ReadEx.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param OperationContext
+     *     The operation context of this request. It is valid only for the duration of this call.
+     * @param FileContext
+     *     The file context of the directory to be read.
+     * @param Pattern
+     *     The pattern to match against files in this directory. Can be NULL.
+     * @param Marker
+     *     A file name that marks where in the directory to start reading. Can be NULL.
+     * @param Buffer
+     *     Pointer to a buffer that will receive the results of the read operation.
+     * @param Length
+     *     Length of data to read.
+     * @param PBytesTransferred [out]
+     *     Pointer to a memory location that will receive the actual number of bytes read.
+     * @return
+     *     STATUS_SUCCESS or error code. STATUS_PENDING is supported allowing for asynchronous
+     *     operation.
+     * @see
+     *     ReadDirectory
+     */
+    NTSTATUS (*ReadDirectoryEx)(FSP_FILE_SYSTEM *FileSystem,
+        FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+        PVOID FileContext, PWSTR Pattern, PWSTR Marker,
+        PVOID Buffer, ULONG Length, PULONG PBytesTransferred);
 
     /*
      * This ensures that this interface will always contain 64 function pointers.
      * Please update when changing the interface as it is important for future compatibility.
      */
-    NTSTATUS (*Reserved[33])();
+    NTSTATUS (*Reserved[25])();
 } FSP_FILE_SYSTEM_INTERFACE;
 FSP_FSCTL_STATIC_ASSERT(sizeof(FSP_FILE_SYSTEM_INTERFACE) == 64 * sizeof(NTSTATUS (*)()),
     "FSP_FILE_SYSTEM_INTERFACE must have 64 entries.");
@@ -1065,12 +1361,17 @@ typedef struct _FSP_FILE_SYSTEM
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY OpGuardStrategy;
     SRWLOCK OpGuardLock;
     BOOLEAN UmFileContextIsUserContext2, UmFileContextIsFullContext;
+    BOOLEAN UmBatchDispatch;
+    BOOLEAN CaseSensitiveSearch;
+    struct _FSP_TRAVERSE_CACHE *TraverseCache;
+    struct _FSP_REPARSE_CACHE *ReparseCache;
+    struct _FSP_NEGATIVE_CACHE *NegativeCache;
 } FSP_FILE_SYSTEM;
-typedef struct _FSP_FILE_SYSTEM_OPERATION_CONTEXT
+struct _FSP_FILE_SYSTEM_OPERATION_CONTEXT
 {
     FSP_FSCTL_TRANSACT_REQ *Request;
     FSP_FSCTL_TRANSACT_RSP *Response;
-} FSP_FILE_SYSTEM_OPERATION_CONTEXT;
+};
 /**
  * Check whether creating a file system object is possible.
  *
@@ -1193,6 +1494,9 @@ FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
  * The current operation context is stored in thread local storage. It allows access to the
  * Request and Response associated with this operation.
  *
+ * The ReadEx, WriteEx and ReadDirectoryEx operations receive the operation context as a
+ * parameter and need not call this function.
+ *
  * @return
  *     The current operation context.
  */
@@ -1502,7 +1806,11 @@ FSP_API BOOLEAN FspFileSystemFindReparsePoint(FSP_FILE_SYSTEM *FileSystem,
  *     should return STATUS_SUCCESS if the passed FileName is a reparse point or
  *     STATUS_NOT_A_REPARSE_POINT (or other error code) otherwise.
  * @param Context
- *     User context to supply to GetReparsePointByName.
+ *     User context to supply to GetReparsePointByName. When Context is NULL and the volume
+ *     has the UmReparseCache flag and a non-zero FileInfoTimeout, resolutions are cached by
+ *     file name until the timeout (at most one second) expires or a reparse point is changed
+ *     through the dispatcher. Only set UmReparseCache if all changes to reparse points go
+ *     through the dispatcher.
  * @param FileName
  *     The name of the file or directory to have its reparse points resolved.
  * @param ReparsePointIndex
@@ -1657,6 +1965,26 @@ FSP_API VOID FspFileSystemReleaseDirectoryBuffer(PVOID *PDirBuffer);
 FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
     PWSTR Marker,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred);
+/**
+ * Find a single directory entry in a directory buffer by file name.
+ *
+ * This function can be used to implement GetDirInfoByName on top of a directory buffer
+ * that has been filled by a previous enumeration. Lookups use a hash index that is built
+ * on first use and discarded when the buffer is reset.
+ *
+ * @param PDirBuffer
+ *     The directory buffer.
+ * @param FileName
+ *     The file name to look for.
+ * @param IgnoreCase
+ *     Whether to compare file names case-insensitively.
+ * @param DirInfo [out]
+ *     Receives the directory entry. Must have room for a file name of 255 characters.
+ * @return
+ *     TRUE if the file name was found.
+ */
+FSP_API BOOLEAN FspFileSystemFindDirectoryBuffer(PVOID *PDirBuffer,
+    PWSTR FileName, BOOLEAN IgnoreCase, FSP_FSCTL_DIR_INFO *DirInfo);
 FSP_API VOID FspFileSystemDeleteDirectoryBuffer(PVOID *PDirBuffer);
 
 /*
@@ -1708,7 +2036,7 @@ FSP_API NTSTATUS FspSetSecurityDescriptor(
  *     The security descriptor to be deleted.
  * @param CreateFunc
  *     Function used to create the security descriptor. This parameter should be
- *     set to FspSetSecurityDescriptor for the public API.
+ *     set to FspSetSecurityDescriptor or FspInternSecurityDescriptor for the public API.
  * @return
  *     STATUS_SUCCESS or error code.
  * @see
@@ -1717,6 +2045,28 @@ FSP_API NTSTATUS FspSetSecurityDescriptor(
  */
 FSP_API VOID FspDeleteSecurityDescriptor(PSECURITY_DESCRIPTOR SecurityDescriptor,
     NTSTATUS (*CreateFunc)());
+/**
+ * Intern security descriptor.
+ *
+ * This is a helper for file systems that keep a security descriptor per file. It returns
+ * a shared read-only copy of the passed security descriptor; security descriptors that
+ * are equal byte for byte share the same copy. Interned security descriptors are also
+ * recognized by the access check cache used in FspAccessCheckEx.
+ *
+ * @param SecurityDescriptor
+ *     The self-relative security descriptor to intern. May be NULL.
+ * @param PInternedDescriptor [out]
+ *     Pointer to a memory location that will receive the interned security descriptor.
+ *     This security descriptor must not be modified and must be freed using
+ *     FspDeleteSecurityDescriptor with CreateFunc set to FspInternSecurityDescriptor.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ * @see
+ *     FspDeleteSecurityDescriptor
+ */
+FSP_API NTSTATUS FspInternSecurityDescriptor(
+    PSECURITY_DESCRIPTOR SecurityDescriptor,
+    PSECURITY_DESCRIPTOR *PInternedDescriptor);
 static inline
 NTSTATUS FspAccessCheck(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request,
@@ -1780,6 +2130,33 @@ VOID FspPosixUnixTimeToFileTime(const __int3264 UnixTime[2], PUINT64 PFileTime)
 FSP_API VOID FspPathPrefix(PWSTR Path, PWSTR *PPrefix, PWSTR *PRemain, PWSTR Root);
 FSP_API VOID FspPathSuffix(PWSTR Path, PWSTR *PRemain, PWSTR *PSuffix, PWSTR Root);
 FSP_API VOID FspPathCombine(PWSTR Prefix, PWSTR Suffix);
+/**
+ * Determine whether a file name matches a wildcard expression.
+ *
+ * This function uses the same semantics as the kernel's FsRtlIsNameInExpression,
+ * including the DOS wildcards DOS_STAR ('<'), DOS_QM ('>') and DOS_DOT ('"'). It can be used
+ * by file systems that set PassQueryDirectoryPattern to filter directory entries against
+ * the Pattern passed to ReadDirectory.
+ *
+ * Unlike FsRtlIsNameInExpression the Expression need not be upper case when IgnoreCase is TRUE.
+ *
+ * @param Expression
+ *     The wildcard expression. Need not be NULL-terminated.
+ * @param ExpressionLength
+ *     The length of the expression in characters.
+ * @param Name
+ *     The file name to test. Need not be NULL-terminated.
+ * @param NameLength
+ *     The length of the file name in characters.
+ * @param IgnoreCase
+ *     Whether to compare characters case-insensitively.
+ * @return
+ *     TRUE if the name matches the expression.
+ */
+FSP_API BOOLEAN FspPathIsNameInExpression(
+    PWSTR Expression, ULONG ExpressionLength,
+    PWSTR Name, ULONG NameLength,
+    BOOLEAN IgnoreCase);
 
 /**
  * @group Service Framework
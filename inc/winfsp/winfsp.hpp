@@ -480,7 +480,8 @@ class FileSystemHost
 public:
     /* ctor/dtor */
     FileSystemHost(FileSystemBase &FileSystem) :
-        _VolumeParams(), _FileSystemPtr(0), _FileSystem(&FileSystem)
+        _VolumeParams(), _FileSystemPtr(0), _FileSystem(&FileSystem),
+        _Interface(Interface()), _SetOperations(0)
     {
         Initialize();
         _VolumeParams.UmFileContextIsFullContext = 1;
@@ -670,10 +671,12 @@ public:
             return Result;
         Result = FspFileSystemCreate(
             _VolumeParams.Prefix[0] ? L"WinFsp.Net" : L"WinFsp.Disk",
-            &_VolumeParams, Interface(), &_FileSystemPtr);
+            &_VolumeParams, _Interface, &_FileSystemPtr);
         if (!NT_SUCCESS(Result))
             return Result;
         _FileSystemPtr->UserContext = _FileSystem;
+        if (0 != _SetOperations)
+            _SetOperations(_FileSystemPtr);
         FspFileSystemSetOperationGuardStrategy(_FileSystemPtr, Synchronized ?
             FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE :
             FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE);
@@ -757,6 +760,17 @@ public:
         return STATUS_SUCCESS;
     }
 
+protected:
+    /* used by FileSystemHostT to supply a specialized interface and operations */
+    FileSystemHost(FileSystemBase &FileSystem,
+        FSP_FILE_SYSTEM_INTERFACE *Interface, VOID (*SetOperations)(FSP_FILE_SYSTEM *)) :
+        _VolumeParams(), _FileSystemPtr(0), _FileSystem(&FileSystem),
+        _Interface(Interface), _SetOperations(SetOperations)
+    {
+        Initialize();
+        _VolumeParams.UmFileContextIsFullContext = 1;
+    }
+
 private:
     /* FSP_FILE_SYSTEM_INTERFACE */
     static NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem0,
@@ -1192,6 +1206,573 @@ private:
     FSP_FSCTL_VOLUME_PARAMS _VolumeParams;
     FSP_FILE_SYSTEM *_FileSystemPtr;
     FileSystemBase *_FileSystem;
+    FSP_FILE_SYSTEM_INTERFACE *_Interface;
+    VOID (*_SetOperations)(FSP_FILE_SYSTEM *);
+};
+
+namespace Detail {
+template <typename A, typename B>
+struct IsSame
+{
+    enum { Value = 0 };
+};
+template <typename A>
+struct IsSame<A, A>
+{
+    enum { Value = 1 };
+};
+}
+
+/* true if class T (or a base class other than FileSystemBase) overrides method M */
+#define FSP_CPP_OVERRIDES(T, M)\
+    (!Fsp::Detail::IsSame<decltype(&T::M), decltype(&FileSystemBase::M)>::Value)
+
+/*
+ * FileSystemHostT
+ *
+ * A FileSystemHost bound at compile time to a concrete file system class T.
+ * Operations are dispatched through non-virtual calls to T's methods. Operations
+ * that T does not override are left out of the FSP_FILE_SYSTEM_INTERFACE when
+ * the DLL treats a missing operation the same way as the FileSystemBase default;
+ * the DLL then fails them without calling into the file system at all. The Read,
+ * Write and QueryInformation operations are dispatched by specialized handlers
+ * that know that file contexts are full contexts and that the operation exists.
+ */
+template <typename T>
+class FileSystemHostT : public FileSystemHost
+{
+public:
+    /* ctor/dtor */
+    FileSystemHostT(T &FileSystem) :
+        FileSystemHost(FileSystem, Interface(), SetOperations)
+    {
+    }
+
+    /* control */
+    T &FileSystem()
+    {
+        return static_cast<T &>(FileSystemHost::FileSystem());
+    }
+
+private:
+    static T *Self(FSP_FILE_SYSTEM *FileSystem0)
+    {
+        return static_cast<T *>((FileSystemBase *)FileSystem0->UserContext);
+    }
+
+    /* FSP_FILE_SYSTEM_OPERATION */
+    static NTSTATUS OpRead(FSP_FILE_SYSTEM *FileSystem0,
+        FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+    {
+        T *self = Self(FileSystem0);
+        ULONG BytesTransferred = 0;
+        NTSTATUS Result;
+        FSP_CPP_EXCEPTION_GUARD(
+            Result = self->T::Read(
+                (PVOID)(UINT_PTR)Request->Req.Read.UserContext,
+                (PVOID)(UINT_PTR)Request->Req.Read.UserContext2,
+                (PVOID)(UINT_PTR)Request->Req.Read.Address,
+                Request->Req.Read.Offset,
+                Request->Req.Read.Length,
+                &BytesTransferred);
+        )
+        if (!NT_SUCCESS(Result))
+            return Result;
+        if (STATUS_PENDING != Result)
+            Response->IoStatus.Information = BytesTransferred;
+        return Result;
+    }
+    static NTSTATUS OpWrite(FSP_FILE_SYSTEM *FileSystem0,
+        FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+    {
+        T *self = Self(FileSystem0);
+        ULONG BytesTransferred = 0;
+        FileSystemBase::FileInfo FileInfo;
+        NTSTATUS Result;
+        FSP_CPP_EXCEPTION_GUARD(
+            Result = self->T::Write(
+                (PVOID)(UINT_PTR)Request->Req.Write.UserContext,
+                (PVOID)(UINT_PTR)Request->Req.Write.UserContext2,
+                (PVOID)(UINT_PTR)Request->Req.Write.Address,
+                Request->Req.Write.Offset,
+                Request->Req.Write.Length,
+                (UINT64)-1LL == Request->Req.Write.Offset,
+                0 != Request->Req.Write.ConstrainedIo,
+                &BytesTransferred,
+                &FileInfo);
+        )
+        if (!NT_SUCCESS(Result))
+            return Result;
+        if (STATUS_PENDING != Result)
+        {
+            Response->IoStatus.Information = BytesTransferred;
+            memcpy(&Response->Rsp.Write.FileInfo, &FileInfo, sizeof FileInfo);
+        }
+        return Result;
+    }
+    static NTSTATUS OpQueryInformation(FSP_FILE_SYSTEM *FileSystem0,
+        FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+    {
+        T *self = Self(FileSystem0);
+        FileSystemBase::FileInfo FileInfo;
+        NTSTATUS Result;
+        memset(&FileInfo, 0, sizeof FileInfo);
+        FSP_CPP_EXCEPTION_GUARD(
+            Result = self->T::GetFileInfo(
+                (PVOID)(UINT_PTR)Request->Req.QueryInformation.UserContext,
+                (PVOID)(UINT_PTR)Request->Req.QueryInformation.UserContext2,
+                &FileInfo);
+        )
+        if (!NT_SUCCESS(Result))
+            return Result;
+        memcpy(&Response->Rsp.QueryInformation.FileInfo, &FileInfo, sizeof FileInfo);
+        return STATUS_SUCCESS;
+    }
+    static VOID SetOperations(FSP_FILE_SYSTEM *FileSystem0)
+    {
+        if (FSP_CPP_OVERRIDES(T, Read))
+            FspFileSystemSetOperation(FileSystem0, FspFsctlTransactReadKind, OpRead);
+        if (FSP_CPP_OVERRIDES(T, Write))
+            FspFileSystemSetOperation(FileSystem0, FspFsctlTransactWriteKind, OpWrite);
+        if (FSP_CPP_OVERRIDES(T, GetFileInfo))
+            FspFileSystemSetOperation(FileSystem0, FspFsctlTransactQueryInformationKind,
+                OpQueryInformation);
+    }
+
+    /* FSP_FILE_SYSTEM_INTERFACE */
+    static NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem0,
+        FSP_FSCTL_VOLUME_INFO *VolumeInfo)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::GetVolumeInfo(
+                VolumeInfo);
+        )
+    }
+    static NTSTATUS SetVolumeLabel_(FSP_FILE_SYSTEM *FileSystem0,
+        PWSTR VolumeLabel,
+        FSP_FSCTL_VOLUME_INFO *VolumeInfo)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::SetVolumeLabel_(
+                VolumeLabel,
+                VolumeInfo);
+        )
+    }
+    static NTSTATUS GetSecurityByName(FSP_FILE_SYSTEM *FileSystem0,
+        PWSTR FileName,
+        PUINT32 PFileAttributes/* or ReparsePointIndex */,
+        PSECURITY_DESCRIPTOR SecurityDescriptor,
+        SIZE_T *PSecurityDescriptorSize)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::GetSecurityByName(
+                FileName,
+                PFileAttributes,
+                SecurityDescriptor,
+                PSecurityDescriptorSize);
+        )
+    }
+    static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem0,
+        PWSTR FileName,
+        UINT32 CreateOptions,
+        UINT32 GrantedAccess,
+        UINT32 FileAttributes,
+        PSECURITY_DESCRIPTOR SecurityDescriptor,
+        UINT64 AllocationSize,
+        PVOID *FullContext,
+        FSP_FSCTL_FILE_INFO *FileInfo)
+    {
+        T *self = Self(FileSystem0);
+        PVOID FileNode, FileDesc;
+        NTSTATUS Result;
+        FSP_CPP_EXCEPTION_GUARD(
+            Result = self->T::Create(
+                FileName,
+                CreateOptions,
+                GrantedAccess,
+                FileAttributes,
+                SecurityDescriptor,
+                AllocationSize,
+                &FileNode,
+                &FileDesc,
+                FspFileSystemGetOpenFileInfo(FileInfo));
+        )
+        ((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext = (UINT64)(UINT_PTR)FileNode;
+        ((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2 = (UINT64)(UINT_PTR)FileDesc;
+        return Result;
+    }
+    static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem0,
+        PWSTR FileName,
+        UINT32 CreateOptions,
+        UINT32 GrantedAccess,
+        PVOID *FullContext,
+        FSP_FSCTL_FILE_INFO *FileInfo)
+    {
+        T *self = Self(FileSystem0);
+        PVOID FileNode, FileDesc;
+        NTSTATUS Result;
+        FSP_CPP_EXCEPTION_GUARD(
+            Result = self->T::Open(
+                FileName,
+                CreateOptions,
+                GrantedAccess,
+                &FileNode,
+                &FileDesc,
+                FspFileSystemGetOpenFileInfo(FileInfo));
+        )
+        ((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext = (UINT64)(UINT_PTR)FileNode;
+        ((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2 = (UINT64)(UINT_PTR)FileDesc;
+        return Result;
+    }
+    static NTSTATUS Overwrite(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        UINT32 FileAttributes,
+        BOOLEAN ReplaceFileAttributes,
+        UINT64 AllocationSize,
+        FSP_FSCTL_FILE_INFO *FileInfo)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::Overwrite(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileAttributes,
+                ReplaceFileAttributes,
+                AllocationSize,
+                FileInfo);
+        )
+    }
+    static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PWSTR FileName,
+        ULONG Flags)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD_VOID(
+            return self->T::Cleanup(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileName,
+                Flags);
+        )
+    }
+    static VOID Close(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD_VOID(
+            return self->T::Close(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2);
+        )
+    }
+    static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PVOID Buffer,
+        UINT64 Offset,
+        ULONG Length,
+        PULONG PBytesTransferred)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::Read(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                Buffer,
+                Offset,
+                Length,
+                PBytesTransferred);
+        )
+    }
+    static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PVOID Buffer,
+        UINT64 Offset,
+        ULONG Length,
+        BOOLEAN WriteToEndOfFile,
+        BOOLEAN ConstrainedIo,
+        PULONG PBytesTransferred,
+        FSP_FSCTL_FILE_INFO *FileInfo)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::Write(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                Buffer,
+                Offset,
+                Length,
+                WriteToEndOfFile,
+                ConstrainedIo,
+                PBytesTransferred,
+                FileInfo);
+        )
+    }
+    static NTSTATUS Flush(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        FSP_FSCTL_FILE_INFO *FileInfo)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::Flush(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileInfo);
+        )
+    }
+    static NTSTATUS GetFileInfo(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        FSP_FSCTL_FILE_INFO *FileInfo)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::GetFileInfo(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileInfo);
+        )
+    }
+    static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        UINT32 FileAttributes,
+        UINT64 CreationTime,
+        UINT64 LastAccessTime,
+        UINT64 LastWriteTime,
+        UINT64 ChangeTime,
+        FSP_FSCTL_FILE_INFO *FileInfo)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::SetBasicInfo(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileAttributes,
+                CreationTime,
+                LastAccessTime,
+                LastWriteTime,
+                ChangeTime,
+                FileInfo);
+        )
+    }
+    static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        UINT64 NewSize,
+        BOOLEAN SetAllocationSize,
+        FSP_FSCTL_FILE_INFO *FileInfo)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::SetFileSize(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                NewSize,
+                SetAllocationSize,
+                FileInfo);
+        )
+    }
+    static NTSTATUS CanDelete(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PWSTR FileName)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::CanDelete(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileName);
+        )
+    }
+    static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PWSTR FileName,
+        PWSTR NewFileName,
+        BOOLEAN ReplaceIfExists)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::Rename(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileName,
+                NewFileName,
+                ReplaceIfExists);
+        )
+    }
+    static NTSTATUS GetSecurity(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PSECURITY_DESCRIPTOR SecurityDescriptor,
+        SIZE_T *PSecurityDescriptorSize)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::GetSecurity(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                SecurityDescriptor,
+                PSecurityDescriptorSize);
+        )
+    }
+    static NTSTATUS SetSecurity(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        SECURITY_INFORMATION SecurityInformation,
+        PSECURITY_DESCRIPTOR ModificationDescriptor)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::SetSecurity(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                SecurityInformation,
+                ModificationDescriptor);
+        )
+    }
+    static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PWSTR Pattern,
+        PWSTR Marker,
+        PVOID Buffer,
+        ULONG Length,
+        PULONG PBytesTransferred)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::ReadDirectory(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                Pattern,
+                Marker,
+                Buffer,
+                Length,
+                PBytesTransferred);
+        )
+    }
+    static NTSTATUS ResolveReparsePoints(FSP_FILE_SYSTEM *FileSystem0,
+        PWSTR FileName,
+        UINT32 ReparsePointIndex,
+        BOOLEAN ResolveLastPathComponent,
+        PIO_STATUS_BLOCK PIoStatus,
+        PVOID Buffer,
+        PSIZE_T PSize)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::ResolveReparsePoints(
+                FileName,
+                ReparsePointIndex,
+                ResolveLastPathComponent,
+                PIoStatus,
+                Buffer,
+                PSize);
+        )
+    }
+    static NTSTATUS GetReparsePoint(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PWSTR FileName,
+        PVOID Buffer,
+        PSIZE_T PSize)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::GetReparsePoint(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileName,
+                Buffer,
+                PSize);
+        )
+    }
+    static NTSTATUS SetReparsePoint(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PWSTR FileName,
+        PVOID Buffer,
+        SIZE_T Size)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::SetReparsePoint(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileName,
+                Buffer,
+                Size);
+        )
+    }
+    static NTSTATUS DeleteReparsePoint(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PWSTR FileName,
+        PVOID Buffer,
+        SIZE_T Size)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::DeleteReparsePoint(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                FileName,
+                Buffer,
+                Size);
+        )
+    }
+    static NTSTATUS GetStreamInfo(FSP_FILE_SYSTEM *FileSystem0,
+        PVOID FullContext,
+        PVOID Buffer,
+        ULONG Length,
+        PULONG PBytesTransferred)
+    {
+        T *self = Self(FileSystem0);
+        FSP_CPP_EXCEPTION_GUARD(
+            return self->T::GetStreamInfo(
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext,
+                (PVOID)(UINT_PTR)((FSP_FSCTL_TRANSACT_FULL_CONTEXT *)FullContext)->UserContext2,
+                Buffer,
+                Length,
+                PBytesTransferred);
+        )
+    }
+    static FSP_FILE_SYSTEM_INTERFACE *Interface()
+    {
+        /*
+         * Create, Open, Overwrite, CanDelete, Flush, ReadDirectory and ResolveReparsePoints
+         * are always present: either FileSystemBase provides a real default or the DLL
+         * does not treat a missing operation as "invalid device request".
+         */
+        static FSP_FILE_SYSTEM_INTERFACE _Interface =
+        {
+            FSP_CPP_OVERRIDES(T, GetVolumeInfo) ? GetVolumeInfo : 0,
+            FSP_CPP_OVERRIDES(T, SetVolumeLabel_) ? SetVolumeLabel_ : 0,
+            GetSecurityByName,
+            Create,
+            Open,
+            Overwrite,
+            FSP_CPP_OVERRIDES(T, Cleanup) ? Cleanup : 0,
+            FSP_CPP_OVERRIDES(T, Close) ? Close : 0,
+            FSP_CPP_OVERRIDES(T, Read) ? Read : 0,
+            FSP_CPP_OVERRIDES(T, Write) ? Write : 0,
+            Flush,
+            FSP_CPP_OVERRIDES(T, GetFileInfo) ? GetFileInfo : 0,
+            FSP_CPP_OVERRIDES(T, SetBasicInfo) ? SetBasicInfo : 0,
+            FSP_CPP_OVERRIDES(T, SetFileSize) ? SetFileSize : 0,
+            CanDelete,
+            FSP_CPP_OVERRIDES(T, Rename) ? Rename : 0,
+            FSP_CPP_OVERRIDES(T, GetSecurity) ? GetSecurity : 0,
+            FSP_CPP_OVERRIDES(T, SetSecurity) ? SetSecurity : 0,
+            ReadDirectory,
+            ResolveReparsePoints,
+            FSP_CPP_OVERRIDES(T, GetReparsePoint) ? GetReparsePoint : 0,
+            FSP_CPP_OVERRIDES(T, SetReparsePoint) ? SetReparsePoint : 0,
+            FSP_CPP_OVERRIDES(T, DeleteReparsePoint) ? DeleteReparsePoint : 0,
+            FSP_CPP_OVERRIDES(T, GetStreamInfo) ? GetStreamInfo : 0,
+        };
+        return &_Interface;
+    }
+
+private:
+    /* disallow copy and assignment */
+    FileSystemHostT(const FileSystemHostT &);
+    FileSystemHostT &operator=(const FileSystemHostT &);
 };
 
 class Service
@@ -587,6 +587,27 @@ FSP_API VOID FspDebugLogRequest(FSP_FSCTL_TRANSACT_REQ *Request)
                 FspDebugLogReparseDataString(Request->Buffer + Request->Req.FileSystemControl.Buffer.Offset,
                     InfoBuf));
             break;
+        case FSCTL_DUPLICATE_EXTENTS_TO_FILE:
+            {
+                FSP_FSCTL_DUPLICATE_EXTENTS_DATA *DuplicateExtentsData = (PVOID)
+                    (Request->Buffer + Request->Req.FileSystemControl.Buffer.Offset);
+                FspDebugLog("%S[TID=%04lx]: %p: >>FileSystemControl [FSCTL_DUPLICATE_EXTENTS_TO_FILE] %s%S%s%s, "
+                    "Source=%s, SourceOffset=%lx:%lx, TargetOffset=%lx:%lx, Length=%lx:%lx\n",
+                    FspDiagIdent(), GetCurrentThreadId(), (PVOID)Request->Hint,
+                    Request->FileName.Size ? "\"" : "",
+                    Request->FileName.Size ? (PWSTR)Request->Buffer : L"",
+                    Request->FileName.Size ? "\", " : "",
+                    FspDebugLogUserContextString(
+                        Request->Req.FileSystemControl.UserContext, Request->Req.FileSystemControl.UserContext2,
+                        UserContextBuf),
+                    FspDebugLogUserContextString(
+                        DuplicateExtentsData->Source.UserContext, DuplicateExtentsData->Source.UserContext2,
+                        InfoBuf),
+                    MAKE_UINT32_PAIR(DuplicateExtentsData->SourceOffset),
+                    MAKE_UINT32_PAIR(DuplicateExtentsData->TargetOffset),
+                    MAKE_UINT32_PAIR(DuplicateExtentsData->Length));
+            }
+            break;
         default:
             FspDebugLog("%S[TID=%04lx]: %p: >>FileSystemControl [INVALID] %s%S%s%s\n",
                 FspDiagIdent(), GetCurrentThreadId(), (PVOID)Request->Hint,
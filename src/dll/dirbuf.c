@@ -29,11 +29,18 @@
         return B;                       \
     } while (0,0)
 
+typedef struct
+{
+    ULONG Count;
+    ULONG Slots[];                      /* Buffer offset + 1 of each DirInfo; 0 if empty */
+} FSP_FILE_SYSTEM_DIRECTORY_BUFFER_HASH_INDEX;
+
 typedef struct
 {
     SRWLOCK Lock;
     ULONG Capacity, LoMark, HiMark;
     PUINT8 Buffer;
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_HASH_INDEX *volatile HashIndex;
 } FSP_FILE_SYSTEM_DIRECTORY_BUFFER;
 
 static int FspFileSystemDirectoryBufferFileNameCmp(PWSTR a, int alen, PWSTR b, int blen)
@@ -263,6 +270,9 @@ FSP_API BOOLEAN FspFileSystemAcquireDirectoryBuffer(PVOID *PDirBuffer,
         DirBuffer->LoMark = 0;
         DirBuffer->HiMark = DirBuffer->Capacity;
 
+        MemFree(DirBuffer->HashIndex);
+        DirBuffer->HashIndex = 0;
+
         RETURN(STATUS_SUCCESS, TRUE);
     }
 
@@ -340,6 +350,34 @@ FSP_API VOID FspFileSystemReleaseDirectoryBuffer(PVOID *PDirBuffer)
     ReleaseSRWLockExclusive(&DirBuffer->Lock);
 }
 
+static PWSTR FspFileSystemDirectoryBufferPattern(PULONG PPatternLength, PBOOLEAN PIgnoreCase)
+{
+    /*
+     * If we are servicing a QueryDirectory request that carries a pattern (the file system
+     * has set PassQueryDirectoryPattern), return the pattern so that entries that cannot
+     * match are not copied to the response. The kernel still applies the pattern itself,
+     * so it is fine for this filter to let through more than it should.
+     */
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext = FspFileSystemGetOperationContext();
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    PWSTR Pattern;
+    ULONG PatternLength;
+
+    if (0 == OperationContext || 0 == (Request = OperationContext->Request) ||
+        FspFsctlTransactQueryDirectoryKind != Request->Kind ||
+        sizeof(WCHAR) >= Request->Req.QueryDirectory.Pattern.Size)
+        return 0;
+
+    Pattern = (PWSTR)(Request->Buffer + Request->Req.QueryDirectory.Pattern.Offset);
+    PatternLength = Request->Req.QueryDirectory.Pattern.Size / sizeof(WCHAR) - 1;
+    if (1 == PatternLength && L'*' == Pattern[0])
+        return 0;
+
+    *PPatternLength = PatternLength;
+    *PIgnoreCase = !Request->Req.QueryDirectory.CaseSensitive;
+    return Pattern;
+}
+
 FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
     PWSTR Marker,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
@@ -355,6 +393,11 @@ FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
         ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
         ULONG IndexNum;
         FSP_FSCTL_DIR_INFO *DirInfo;
+        PWSTR Pattern;
+        ULONG PatternLength = 0;
+        BOOLEAN IgnoreCase = FALSE;
+
+        Pattern = FspFileSystemDirectoryBufferPattern(&PatternLength, &IgnoreCase);
 
         if (0 == Marker)
             IndexNum = 0;
@@ -369,6 +412,10 @@ FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
         for (; IndexNum < Count; IndexNum++)
         {
             DirInfo = (PVOID)(DirBuffer->Buffer + Index[IndexNum]);
+            if (0 != Pattern && !FspPathIsNameInExpression(Pattern, PatternLength,
+                DirInfo->FileNameBuf, (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR),
+                IgnoreCase))
+                continue;
             if (!FspFileSystemAddDirInfo(DirInfo, Buffer, Length, PBytesTransferred))
             {
                 ReleaseSRWLockShared(&DirBuffer->Lock);
@@ -382,6 +429,148 @@ FSP_API VOID FspFileSystemReadDirectoryBuffer(PVOID *PDirBuffer,
     FspFileSystemAddDirInfo(0, Buffer, Length, PBytesTransferred);
 }
 
+static inline ULONG FspFileSystemDirectoryBufferHash(PWSTR FileName, ULONG FileNameLength)
+{
+    /*
+     * FNV-1a. ASCII letters are folded and other non-ASCII characters are skipped,
+     * so that names that differ only in case land in the same slot chain.
+     */
+    ULONG Hash = 2166136261;
+    WCHAR C;
+
+    for (ULONG Index = 0; FileNameLength > Index; Index++)
+    {
+        C = FileName[Index];
+        if (0x80 <= C)
+            continue;
+        if (L'a' <= C && C <= L'z')
+            C -= L'a' - L'A';
+        Hash = (Hash ^ C) * 16777619;
+    }
+
+    return Hash;
+}
+
+static inline BOOLEAN FspFileSystemDirectoryBufferFileNameEqual(
+    PWSTR a, ULONG alen, PWSTR b, ULONG blen, BOOLEAN IgnoreCase)
+{
+    if (IgnoreCase)
+        return CSTR_EQUAL == CompareStringOrdinal(a, alen, b, blen, TRUE);
+    else
+        return alen == blen && 0 == memcmp(a, b, alen * sizeof(WCHAR));
+}
+
+static FSP_FILE_SYSTEM_DIRECTORY_BUFFER_HASH_INDEX *FspFileSystemHashDirectoryBuffer(
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer)
+{
+    /* assume that the DirBuffer lock is held (shared is enough) */
+
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_HASH_INDEX *HashIndex, *OldHashIndex;
+    PULONG Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
+    ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
+    ULONG SlotCount, Slot;
+    FSP_FSCTL_DIR_INFO *DirInfo;
+
+    HashIndex = DirBuffer->HashIndex;
+    MemoryBarrier();
+    if (0 != HashIndex)
+        return HashIndex;
+
+    /* open addressing with linear probing; keep the load factor at or below 1/2 */
+    for (SlotCount = 16; SlotCount < 2 * Count; SlotCount <<= 1)
+        ;
+
+    HashIndex = MemAlloc(sizeof *HashIndex + SlotCount * sizeof(ULONG));
+    if (0 == HashIndex)
+        return 0;
+    memset(HashIndex, 0, sizeof *HashIndex + SlotCount * sizeof(ULONG));
+    HashIndex->Count = SlotCount;
+
+    for (ULONG IndexNum = 0; Count > IndexNum; IndexNum++)
+    {
+        DirInfo = (PVOID)(DirBuffer->Buffer + Index[IndexNum]);
+        Slot = FspFileSystemDirectoryBufferHash(
+            DirInfo->FileNameBuf, (DirInfo->Size - sizeof *DirInfo) / sizeof(WCHAR));
+        for (Slot &= SlotCount - 1; 0 != HashIndex->Slots[Slot]; Slot = (Slot + 1) & (SlotCount - 1))
+            ;
+        HashIndex->Slots[Slot] = Index[IndexNum] + 1;
+    }
+
+    /* concurrent readers may race to build the index; the first one wins */
+    OldHashIndex = InterlockedCompareExchangePointer(
+        (PVOID volatile *)&DirBuffer->HashIndex, HashIndex, 0);
+    if (0 != OldHashIndex)
+    {
+        MemFree(HashIndex);
+        HashIndex = OldHashIndex;
+    }
+
+    return HashIndex;
+}
+
+FSP_API BOOLEAN FspFileSystemFindDirectoryBuffer(PVOID *PDirBuffer,
+    PWSTR FileName, BOOLEAN IgnoreCase, FSP_FSCTL_DIR_INFO *DirInfo)
+{
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
+    MemoryBarrier();
+
+    if (0 == DirBuffer)
+        return FALSE;
+
+    FSP_FILE_SYSTEM_DIRECTORY_BUFFER_HASH_INDEX *HashIndex;
+    FSP_FSCTL_DIR_INFO *Entry = 0, *Candidate;
+    ULONG FileNameLength = lstrlenW(FileName);
+    ULONG Slot;
+
+    AcquireSRWLockShared(&DirBuffer->Lock);
+
+    HashIndex = FspFileSystemHashDirectoryBuffer(DirBuffer);
+    if (0 != HashIndex)
+    {
+        Slot = FspFileSystemDirectoryBufferHash(FileName, FileNameLength);
+        for (Slot &= HashIndex->Count - 1;
+            0 != HashIndex->Slots[Slot];
+            Slot = (Slot + 1) & (HashIndex->Count - 1))
+        {
+            Candidate = (PVOID)(DirBuffer->Buffer + HashIndex->Slots[Slot] - 1);
+            if (FspFileSystemDirectoryBufferFileNameEqual(
+                Candidate->FileNameBuf, (Candidate->Size - sizeof *Candidate) / sizeof(WCHAR),
+                FileName, FileNameLength, IgnoreCase))
+            {
+                Entry = Candidate;
+                break;
+            }
+        }
+    }
+    else
+    {
+        /* could not allocate the hash index; fall back to a linear scan */
+        PULONG Index = (PULONG)(DirBuffer->Buffer + DirBuffer->HiMark);
+        ULONG Count = (DirBuffer->Capacity - DirBuffer->HiMark) / sizeof(ULONG);
+
+        for (ULONG IndexNum = 0; Count > IndexNum; IndexNum++)
+        {
+            Candidate = (PVOID)(DirBuffer->Buffer + Index[IndexNum]);
+            if (FspFileSystemDirectoryBufferFileNameEqual(
+                Candidate->FileNameBuf, (Candidate->Size - sizeof *Candidate) / sizeof(WCHAR),
+                FileName, FileNameLength, IgnoreCase))
+            {
+                Entry = Candidate;
+                break;
+            }
+        }
+    }
+
+    if (0 != Entry && sizeof(FSP_FSCTL_DIR_INFO) + 255 * sizeof(WCHAR) >= Entry->Size)
+        memcpy(DirInfo, Entry, Entry->Size);
+    else
+        Entry = 0;
+
+    ReleaseSRWLockShared(&DirBuffer->Lock);
+
+    return 0 != Entry;
+}
+
 FSP_API VOID FspFileSystemDeleteDirectoryBuffer(PVOID *PDirBuffer)
 {
     FSP_FILE_SYSTEM_DIRECTORY_BUFFER *DirBuffer = *PDirBuffer;
@@ -389,6 +578,7 @@ FSP_API VOID FspFileSystemDeleteDirectoryBuffer(PVOID *PDirBuffer)
 
     if (0 != DirBuffer)
     {
+        MemFree(DirBuffer->HashIndex);
         MemFree(DirBuffer->Buffer);
         MemFree(DirBuffer);
         *PDirBuffer = 0;
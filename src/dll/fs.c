@@ -24,6 +24,36 @@
 enum
 {
     FspFileSystemDispatcherThreadCountMin = 2,
+    FspFileSystemScratchArenaSize = 64 * 1024,
+    /* room for a full size response for every request of a CreateMany group */
+    FspFileSystemBatchResponseBufferSize =
+        FSP_FILE_SYSTEM_NAMESPACE_BATCH_MAX * FSP_FSCTL_TRANSACT_RSP_SIZEMAX,
+};
+FSP_FSCTL_STATIC_ASSERT(
+    FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN <= FspFileSystemBatchResponseBufferSize,
+    "FspFileSystemBatchResponseBufferSize must not be less than the batch buffer size.");
+
+/*
+ * Scratch arena
+ *
+ * Every dispatcher thread owns a small bump allocator that is used for memory that only
+ * lives while a single request is being processed: security descriptors and fake requests
+ * in the Create path, reparse point buffers, etc. The arena is reset after every request.
+ * Freeing the most recent allocation gives its memory back immediately, which keeps the
+ * grow-and-retry pattern of GetSecurityByName from wasting space.
+ *
+ * The dispatcher context is passed explicitly down the Create path (see
+ * FspFileSystemOpCreateInternal); only entry points that are reached through the public
+ * API (e.g. FspFileSystemResolveReparsePoints) look it up in TLS, once per call.
+ *
+ * Allocations made without a dispatcher context, or that do not fit, come from the heap;
+ * FspScratchFree tells the two apart. Scratch memory never leaves the DLL: public API's
+ * such as FspAccessCheckEx return heap memory to their callers.
+ */
+struct _FSP_FILE_SYSTEM_DISPATCHER_CONTEXT
+{
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT OperationContext; /* must be first */
+    PUINT8 ScratchBuffer, ScratchPointer, ScratchLast, ScratchEnd;
 };
 
 static FSP_FILE_SYSTEM_INTERFACE FspFileSystemNullInterface;
@@ -76,6 +106,52 @@ VOID FspFileSystemFinalize(BOOLEAN Dynamic)
         TlsFree(FspFileSystemTlsKey);
 }
 
+FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *FspFileSystemGetDispatcherContext(VOID)
+{
+    /* only dispatcher threads set our TLS key */
+    return TLS_OUT_OF_INDEXES != FspFileSystemTlsKey ?
+        TlsGetValue(FspFileSystemTlsKey) : 0;
+}
+
+PVOID FspScratchAlloc(FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext, SIZE_T Size)
+{
+    PUINT8 Pointer;
+
+    if (0 != DispatcherContext)
+    {
+        Pointer = DispatcherContext->ScratchPointer;
+        Size = FSP_FSCTL_ALIGN_UP(Size, MEMORY_ALLOCATION_ALIGNMENT);
+        if ((SIZE_T)(DispatcherContext->ScratchEnd - Pointer) >= Size)
+        {
+            DispatcherContext->ScratchLast = Pointer;
+            DispatcherContext->ScratchPointer = Pointer + Size;
+            return Pointer;
+        }
+    }
+
+    return MemAlloc(Size);
+}
+
+VOID FspScratchFree(FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext, PVOID Pointer)
+{
+    if (0 != DispatcherContext &&
+        DispatcherContext->ScratchBuffer <= (PUINT8)Pointer &&
+        DispatcherContext->ScratchEnd > (PUINT8)Pointer)
+    {
+        if (DispatcherContext->ScratchLast == Pointer)
+            DispatcherContext->ScratchPointer = Pointer;
+        return;
+    }
+
+    MemFree(Pointer);
+}
+
+static inline VOID FspScratchReset(FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext)
+{
+    DispatcherContext->ScratchPointer = DispatcherContext->ScratchBuffer;
+    DispatcherContext->ScratchLast = 0;
+}
+
 FSP_API NTSTATUS FspFileSystemPreflight(PWSTR DevicePath,
     PWSTR MountPoint)
 {
@@ -144,11 +220,38 @@ FSP_API NTSTATUS FspFileSystemCreate(PWSTR DevicePath,
         return STATUS_INSUFFICIENT_RESOURCES;
     memset(FileSystem, 0, sizeof *FileSystem);
 
+    Result = FspTraverseCacheCreate(VolumeParams, &FileSystem->TraverseCache);
+    if (!NT_SUCCESS(Result))
+    {
+        MemFree(FileSystem);
+        return Result;
+    }
+
+    Result = FspReparseCacheCreate(VolumeParams, &FileSystem->ReparseCache);
+    if (!NT_SUCCESS(Result))
+    {
+        FspTraverseCacheDelete(FileSystem->TraverseCache);
+        MemFree(FileSystem);
+        return Result;
+    }
+
+    Result = FspNegativeCacheCreate(VolumeParams, &FileSystem->NegativeCache);
+    if (!NT_SUCCESS(Result))
+    {
+        FspReparseCacheDelete(FileSystem->ReparseCache);
+        FspTraverseCacheDelete(FileSystem->TraverseCache);
+        MemFree(FileSystem);
+        return Result;
+    }
+
     Result = FspFsctlCreateVolume(DevicePath, VolumeParams,
         FileSystem->VolumeName, sizeof FileSystem->VolumeName,
         &FileSystem->VolumeHandle);
     if (!NT_SUCCESS(Result))
     {
+        FspNegativeCacheDelete(FileSystem->NegativeCache);
+        FspReparseCacheDelete(FileSystem->ReparseCache);
+        FspTraverseCacheDelete(FileSystem->TraverseCache);
         MemFree(FileSystem);
         return Result;
     }
@@ -181,6 +284,8 @@ FSP_API NTSTATUS FspFileSystemCreate(PWSTR DevicePath,
 
     FileSystem->UmFileContextIsUserContext2 = !!VolumeParams->UmFileContextIsUserContext2;
     FileSystem->UmFileContextIsFullContext = !!VolumeParams->UmFileContextIsFullContext;
+    FileSystem->UmBatchDispatch = !!VolumeParams->UmBatchDispatch;
+    FileSystem->CaseSensitiveSearch = !!VolumeParams->CaseSensitiveSearch;
 
     *PFileSystem = FileSystem;
 
@@ -191,6 +296,9 @@ FSP_API VOID FspFileSystemDelete(FSP_FILE_SYSTEM *FileSystem)
 {
     FspFileSystemRemoveMountPoint(FileSystem);
     CloseHandle(FileSystem->VolumeHandle);
+    FspNegativeCacheDelete(FileSystem->NegativeCache);
+    FspReparseCacheDelete(FileSystem->ReparseCache);
+    FspTraverseCacheDelete(FileSystem->TraverseCache);
     MemFree(FileSystem);
 }
 
@@ -509,19 +617,394 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem)
     FileSystem->MountHandle = 0;
 }
 
+static VOID FspFileSystemDispatchRequest(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    /* the OperationContext is the first member of the FSP_FILE_SYSTEM_DISPATCHER_CONTEXT */
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext =
+        (FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *)OperationContext;
+    SIZE_T ResponseSize;
+
+    OperationContext->Request = Request;
+    OperationContext->Response = Response;
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Request->Kind ||
+            (FileSystem->DebugLog & (1 << Request->Kind)))
+            FspDebugLogRequest(Request);
+    }
+
+    memset(Response, 0, sizeof *Response);
+    Response->Size = sizeof *Response;
+    Response->Kind = Request->Kind;
+    Response->Hint = Request->Hint;
+    if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
+    {
+        Response->IoStatus.Status =
+            FspFileSystemEnterOperation(FileSystem, Request, Response);
+        if (NT_SUCCESS(Response->IoStatus.Status))
+        {
+            /* the default Create operation gets our context rather than look it up in TLS */
+            if (FspFileSystemOpCreate == FileSystem->Operations[Request->Kind])
+                Response->IoStatus.Status =
+                    FspFileSystemOpCreateInternal(FileSystem, DispatcherContext, Request, Response);
+            else
+                Response->IoStatus.Status =
+                    FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
+            FspFileSystemLeaveOperation(FileSystem, Request, Response);
+        }
+
+        FspScratchReset(DispatcherContext);
+    }
+    else
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Response->Kind ||
+            (FileSystem->DebugLog & (1 << Response->Kind)))
+            FspDebugLogResponse(Response);
+    }
+
+    ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
+    if (FSP_FSCTL_TRANSACT_RSP_SIZEMAX < ResponseSize/* should NOT happen */)
+    {
+        memset(Response, 0, sizeof *Response);
+        Response->Size = sizeof *Response;
+        Response->Kind = Request->Kind;
+        Response->Hint = Request->Hint;
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    else if (STATUS_PENDING == Response->IoStatus.Status)
+        memset(Response, 0, sizeof *Response);
+    else
+    {
+        memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
+        Response->Size = (UINT16)ResponseSize;
+    }
+}
+
+/* a group of Read/Write/Cleanup responses is produced into a single response slot */
+FSP_FSCTL_STATIC_ASSERT(
+    FSP_FILE_SYSTEM_IO_SEGMENT_MAX * FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof(FSP_FSCTL_TRANSACT_RSP)) <=
+        FSP_FSCTL_TRANSACT_RSP_SIZEMAX,
+    "FSP_FSCTL_TRANSACT_RSP_SIZEMAX must fit FSP_FILE_SYSTEM_IO_SEGMENT_MAX responses.");
+
+static FSP_FSCTL_TRANSACT_RSP *FspFileSystemDispatchVectored(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+    FSP_FSCTL_TRANSACT_REQ **Requests, ULONG Count, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    FSP_FSCTL_TRANSACT_RSP *Responses[FSP_FILE_SYSTEM_IO_SEGMENT_MAX];
+    NTSTATUS Result;
+    ULONG Index;
+
+    for (Index = 0; Count > Index; Index++)
+    {
+        if (FileSystem->DebugLog)
+        {
+            if (FileSystem->DebugLog & (1 << Requests[Index]->Kind))
+                FspDebugLogRequest(Requests[Index]);
+        }
+
+        /* Read/Write/Cleanup responses have no variable size part */
+        Responses[Index] = Response;
+        memset(Response, 0, FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof *Response));
+        Response->Size = (UINT16)FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof *Response);
+        Response->Kind = Requests[Index]->Kind;
+        Response->Hint = Requests[Index]->Hint;
+        Response = FspFsctlTransactProduceResponse(Response, Response->Size);
+    }
+
+    OperationContext->Request = Requests[0];
+    OperationContext->Response = Responses[0];
+    Result = FspFileSystemEnterOperation(FileSystem, Requests[0], Responses[0]);
+    if (NT_SUCCESS(Result))
+    {
+        if (FspFsctlTransactCleanupKind == Requests[0]->Kind)
+            FspFileSystemOpCleanupV(FileSystem, Requests, Responses, Count);
+        else
+            FspFileSystemOpReadWriteV(FileSystem, Requests, Responses, Count);
+        FspFileSystemLeaveOperation(FileSystem, Requests[0], Responses[0]);
+
+        FspScratchReset((FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *)OperationContext);
+    }
+    else
+        for (Index = 0; Count > Index; Index++)
+            Responses[Index]->IoStatus.Status = Result;
+
+    for (Index = 0; Count > Index; Index++)
+    {
+        if (FileSystem->DebugLog)
+        {
+            if (FileSystem->DebugLog & (1 << Responses[Index]->Kind))
+                FspDebugLogResponse(Responses[Index]);
+        }
+    }
+
+    return Response;
+}
+
+static inline NTSTATUS FspFileSystemReserveResponse(FSP_FILE_SYSTEM *FileSystem,
+    PUINT8 ResponseBuf, PUINT8 ResponseBufEnd, ULONG Count, FSP_FSCTL_TRANSACT_RSP **PResponse)
+{
+    NTSTATUS Result;
+
+    /* make room for Count full size responses */
+    if ((SIZE_T)(ResponseBufEnd - (PUINT8)*PResponse) < Count * FSP_FSCTL_TRANSACT_RSP_SIZEMAX)
+    {
+        /* send the responses we have so far without asking for more requests */
+        Result = FspFsctlTransact(FileSystem->VolumeHandle,
+            ResponseBuf, (PUINT8)*PResponse - ResponseBuf, 0, 0, FALSE);
+        if (!NT_SUCCESS(Result))
+            return Result;
+        *PResponse = (PVOID)ResponseBuf;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static FSP_FSCTL_TRANSACT_RSP *FspFileSystemDispatchCreateMany(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+    FSP_FSCTL_TRANSACT_REQ **Requests, PULONG PCount,
+    PUINT8 ResponseBuf, PUINT8 ResponseBufEnd, FSP_FSCTL_TRANSACT_RSP *Response,
+    PNTSTATUS PResult)
+{
+    /*
+     * Create responses have a variable size part, so unlike FspFileSystemDispatchVectored
+     * we produce them one at a time. Room for a full size response for every request of the
+     * group is reserved before CreateMany is called, so that every file it opens is reported
+     * to the FSD. The operation guard is held for the whole group.
+     *
+     * The group ends at the first request that fails the Create checks; that request is
+     * completed in place by FspFileSystemOpCreateMany. On return *PCount is the number of
+     * requests processed; the caller dispatches the requests after them in order.
+     */
+
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext =
+        (FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *)OperationContext;
+    FSP_FILE_SYSTEM_CREATE_ENTRY Entries[FSP_FILE_SYSTEM_NAMESPACE_BATCH_MAX];
+    FSP_FSCTL_TRANSACT_REQ *Request0 = Requests[0];
+    FSP_FSCTL_TRANSACT_RSP *CheckResponse;
+    PWSTR NameBuf;
+    SIZE_T ResponseSize;
+    NTSTATUS Result;
+    ULONG Count = *PCount, Index, ReadyCount, ProcessedCount = 0;
+
+    *PResult = FspFileSystemReserveResponse(FileSystem,
+        ResponseBuf, ResponseBufEnd, Count, &Response);
+    if (!NT_SUCCESS(*PResult))
+        return Response;
+
+    NameBuf = FspScratchAlloc(DispatcherContext, Count * FSP_FILE_SYSTEM_CREATE_NAME_SIZE);
+    CheckResponse = FspScratchAlloc(DispatcherContext, FSP_FSCTL_TRANSACT_RSP_SIZEMAX);
+    if (0 != NameBuf && 0 != CheckResponse)
+    {
+        memset(CheckResponse, 0, sizeof *CheckResponse);
+        CheckResponse->Size = sizeof *CheckResponse;
+        CheckResponse->Kind = Request0->Kind;
+        CheckResponse->Hint = Request0->Hint;
+        OperationContext->Request = Request0;
+        OperationContext->Response = CheckResponse;
+        Result = FspFileSystemEnterOperation(FileSystem, Request0, CheckResponse);
+        if (NT_SUCCESS(Result))
+        {
+            ReadyCount = FspFileSystemOpCreateMany(FileSystem, DispatcherContext,
+                Requests, CheckResponse, Entries, NameBuf, Count);
+            for (Index = 0; ReadyCount > Index; Index++)
+            {
+                if (FileSystem->DebugLog & (1 << Requests[Index]->Kind))
+                    FspDebugLogRequest(Requests[Index]);
+
+                memset(Response, 0, sizeof *Response);
+                Response->Size = sizeof *Response;
+                Response->Kind = Requests[Index]->Kind;
+                Response->Hint = Requests[Index]->Hint;
+                OperationContext->Request = Requests[Index];
+                OperationContext->Response = Response;
+                FspFileSystemOpCreateManyResponse(FileSystem, Requests[Index], Response,
+                    &Entries[Index]);
+
+                if (FileSystem->DebugLog & (1 << Response->Kind))
+                    FspDebugLogResponse(Response);
+
+                ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
+                memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
+                Response->Size = (UINT16)ResponseSize;
+                Response = FspFsctlTransactProduceResponse(Response, Response->Size);
+            }
+            ProcessedCount = ReadyCount;
+
+            if (Count > ReadyCount)
+            {
+                /* the request that ended the group has its response in CheckResponse */
+                if (FileSystem->DebugLog & (1 << Requests[ReadyCount]->Kind))
+                    FspDebugLogRequest(Requests[ReadyCount]);
+
+                memcpy(Response, CheckResponse, CheckResponse->Size);
+
+                if (FileSystem->DebugLog & (1 << Response->Kind))
+                    FspDebugLogResponse(Response);
+
+                ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
+                memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
+                Response->Size = (UINT16)ResponseSize;
+                Response = FspFsctlTransactProduceResponse(Response, Response->Size);
+                ProcessedCount++;
+            }
+
+            FspFileSystemLeaveOperation(FileSystem, Request0, CheckResponse);
+        }
+    }
+
+    /* the group is done; this also releases whatever its operations left in the arena */
+    FspScratchFree(DispatcherContext, CheckResponse);
+    FspScratchFree(DispatcherContext, NameBuf);
+    FspScratchReset(DispatcherContext);
+
+    if (0 == ProcessedCount)
+    {
+        /* the group could not be started; dispatch its first request individually */
+        FspFileSystemDispatchRequest(FileSystem, OperationContext, Request0, Response);
+        if (0 != Response->Size)
+            Response = FspFsctlTransactProduceResponse(Response, Response->Size);
+        ProcessedCount = 1;
+    }
+
+    *PCount = ProcessedCount;
+
+    return Response;
+}
+
+static NTSTATUS FspFileSystemDispatcherBatchLoop(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext)
+{
+    /*
+     * Batch dispatching is used when the VolumeParams UmBatchDispatch flag is set.
+     *
+     * Requests are retrieved from the FSD with FSP_FSCTL_TRANSACT_BATCH, which returns
+     * as many pending requests as fit in the request buffer. Consecutive Read or Write
+     * requests in the batch that are for the same open file are grouped and passed to
+     * ReadV/WriteV in a single call; consecutive new file Create and delete Cleanup requests
+     * for the same directory are grouped and passed to CreateMany/DeleteMany. A group never
+     * reaches past a request that cannot join it, so requests are processed in the order
+     * in which the FSD returned them. All other requests are dispatched one at a time.
+     * Responses are accumulated and sent back with the next batch transact; they are sent
+     * early if the response buffer fills up.
+     */
+
+    NTSTATUS Result;
+    SIZE_T RequestBufSize, ResponseBufSize;
+    PUINT8 RequestBuf = 0, ResponseBuf = 0, RequestBufEnd, ResponseBufEnd;
+    FSP_FSCTL_TRANSACT_REQ **Requests = 0, *Request, *NextRequest;
+    FSP_FSCTL_TRANSACT_REQ *Group[FSP_FILE_SYSTEM_IO_SEGMENT_MAX];
+    FSP_FSCTL_TRANSACT_RSP *Response;
+    ULONG RequestCount, RequestCountMax, GroupCount, GroupCountMax, Index, J;
+
+    RequestCountMax = FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN /
+        FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof(FSP_FSCTL_TRANSACT_REQ));
+    RequestBuf = MemAlloc(FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN);
+    ResponseBuf = MemAlloc(FspFileSystemBatchResponseBufferSize);
+    Requests = MemAlloc(RequestCountMax * sizeof Requests[0]);
+    if (0 == RequestBuf || 0 == ResponseBuf || 0 == Requests)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    ResponseBufEnd = ResponseBuf + FspFileSystemBatchResponseBufferSize;
+    ResponseBufSize = 0;
+    for (;;)
+    {
+        RequestBufSize = FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN;
+        Result = FspFsctlTransact(FileSystem->VolumeHandle,
+            ResponseBuf, ResponseBufSize, RequestBuf, &RequestBufSize, TRUE);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+
+        ResponseBufSize = 0;
+        if (0 == RequestBufSize)
+            continue;
+
+        RequestCount = 0;
+        RequestBufEnd = RequestBuf + RequestBufSize;
+        for (Request = (PVOID)RequestBuf;
+            RequestCountMax > RequestCount &&
+                0 != (NextRequest = FspFsctlTransactConsumeRequest(Request, RequestBufEnd));
+            Request = NextRequest)
+            Requests[RequestCount++] = Request;
+
+        Response = (PVOID)ResponseBuf;
+        for (Index = 0; RequestCount > Index; Index++)
+        {
+            Request = Requests[Index];
+
+            Result = FspFileSystemReserveResponse(FileSystem,
+                ResponseBuf, ResponseBufEnd, 1, &Response);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+
+            GroupCountMax =
+                FspFsctlTransactReadKind == Request->Kind ||
+                FspFsctlTransactWriteKind == Request->Kind ?
+                    FSP_FILE_SYSTEM_IO_SEGMENT_MAX : FSP_FILE_SYSTEM_NAMESPACE_BATCH_MAX;
+            GroupCount = 0;
+            Group[GroupCount++] = Request;
+            for (J = Index + 1;
+                RequestCount > J && GroupCountMax > GroupCount &&
+                    FspFileSystemOpCanVectorize(FileSystem, Request, Requests[J]);
+                J++)
+                Group[GroupCount++] = Requests[J];
+
+            if (1 < GroupCount && FspFsctlTransactCreateKind == Request->Kind)
+            {
+                /* may process fewer requests than grouped; the next iteration regroups the rest */
+                Response = FspFileSystemDispatchCreateMany(FileSystem, OperationContext,
+                    Group, &GroupCount, ResponseBuf, ResponseBufEnd, Response, &Result);
+                if (!NT_SUCCESS(Result))
+                    goto exit;
+            }
+            else if (1 < GroupCount)
+                Response = FspFileSystemDispatchVectored(FileSystem, OperationContext,
+                    Group, GroupCount, Response);
+            else
+            {
+                FspFileSystemDispatchRequest(FileSystem, OperationContext, Request, Response);
+                if (0 != Response->Size)
+                    Response = FspFsctlTransactProduceResponse(Response, Response->Size);
+            }
+
+            Index += GroupCount - 1;
+        }
+
+        ResponseBufSize = (PUINT8)Response - ResponseBuf;
+    }
+
+exit:
+    MemFree(Requests);
+    MemFree(ResponseBuf);
+    MemFree(RequestBuf);
+
+    return Result;
+}
+
 static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
 {
     FSP_FILE_SYSTEM *FileSystem = FileSystem0;
     NTSTATUS Result;
-    SIZE_T RequestSize, ResponseSize;
+    SIZE_T RequestSize;
     FSP_FSCTL_TRANSACT_REQ *Request = 0;
     FSP_FSCTL_TRANSACT_RSP *Response = 0;
-    FSP_FILE_SYSTEM_OPERATION_CONTEXT OperationContext;
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT DispatcherContext;
     HANDLE DispatcherThread = 0;
 
+    memset(&DispatcherContext, 0, sizeof DispatcherContext);
+
     Request = MemAlloc(FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN);
     Response = MemAlloc(FSP_FSCTL_TRANSACT_RSP_SIZEMAX);
-    if (0 == Request || 0 == Response)
+    DispatcherContext.ScratchBuffer = MemAlloc(FspFileSystemScratchArenaSize);
+    if (0 == Request || 0 == Response || 0 == DispatcherContext.ScratchBuffer)
     {
         Result = STATUS_INSUFFICIENT_RESOURCES;
         goto exit;
@@ -538,9 +1021,17 @@ static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
         }
     }
 
-    OperationContext.Request = Request;
-    OperationContext.Response = Response;
-    TlsSetValue(FspFileSystemTlsKey, &OperationContext);
+    DispatcherContext.ScratchPointer = DispatcherContext.ScratchBuffer;
+    DispatcherContext.ScratchEnd = DispatcherContext.ScratchBuffer + FspFileSystemScratchArenaSize;
+    DispatcherContext.OperationContext.Request = Request;
+    DispatcherContext.OperationContext.Response = Response;
+    TlsSetValue(FspFileSystemTlsKey, &DispatcherContext);
+
+    if (FileSystem->UmBatchDispatch)
+    {
+        Result = FspFileSystemDispatcherBatchLoop(FileSystem, &DispatcherContext.OperationContext);
+        goto exit;
+    }
 
     memset(Response, 0, sizeof *Response);
     for (;;)
@@ -555,57 +1046,13 @@ static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
         if (0 == RequestSize)
             continue;
 
-        if (FileSystem->DebugLog)
-        {
-            if (FspFsctlTransactKindCount <= Request->Kind ||
-                (FileSystem->DebugLog & (1 << Request->Kind)))
-                FspDebugLogRequest(Request);
-        }
-
-        Response->Size = sizeof *Response;
-        Response->Kind = Request->Kind;
-        Response->Hint = Request->Hint;
-        if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
-        {
-            Response->IoStatus.Status =
-                FspFileSystemEnterOperation(FileSystem, Request, Response);
-            if (NT_SUCCESS(Response->IoStatus.Status))
-            {
-                Response->IoStatus.Status =
-                    FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
-                FspFileSystemLeaveOperation(FileSystem, Request, Response);
-            }
-        }
-        else
-            Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
-
-        if (FileSystem->DebugLog)
-        {
-            if (FspFsctlTransactKindCount <= Response->Kind ||
-                (FileSystem->DebugLog & (1 << Response->Kind)))
-                FspDebugLogResponse(Response);
-        }
-
-        ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
-        if (FSP_FSCTL_TRANSACT_RSP_SIZEMAX < ResponseSize/* should NOT happen */)
-        {
-            memset(Response, 0, sizeof *Response);
-            Response->Size = sizeof *Response;
-            Response->Kind = Request->Kind;
-            Response->Hint = Request->Hint;
-            Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
-        }
-        else if (STATUS_PENDING == Response->IoStatus.Status)
-            memset(Response, 0, sizeof *Response);
-        else
-        {
-            memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
-            Response->Size = (UINT16)ResponseSize;
-        }
+        FspFileSystemDispatchRequest(FileSystem, &DispatcherContext.OperationContext,
+            Request, Response);
     }
 
 exit:
     TlsSetValue(FspFileSystemTlsKey, 0);
+    MemFree(DispatcherContext.ScratchBuffer);
     MemFree(Response);
     MemFree(Request);
 
@@ -674,6 +1121,20 @@ FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
             FspDebugLogResponse(Response);
     }
 
+    /*
+     * Operations completed asynchronously bypass the cache invalidation in fsop.c.
+     * A Create that created a file or a SetInformation that may have been a Rename
+     * can add names (or reparse points) that our caches may think do not exist.
+     */
+    if (STATUS_SUCCESS == Response->IoStatus.Status &&
+        ((FspFsctlTransactCreateKind == Response->Kind &&
+            FILE_CREATED == Response->IoStatus.Information) ||
+        FspFsctlTransactSetInformationKind == Response->Kind))
+    {
+        FspNegativeCacheInvalidate(FileSystem->NegativeCache);
+        FspReparseCacheInvalidate(FileSystem->ReparseCache);
+    }
+
     Result = FspFsctlTransact(FileSystem->VolumeHandle,
         Response, Response->Size, 0, 0, FALSE);
     if (!NT_SUCCESS(Result))
@@ -158,6 +158,7 @@ NTSTATUS FspFileSystemCallResolveReparsePoints(FSP_FILE_SYSTEM *FileSystem,
 
 static inline
 NTSTATUS FspFileSystemCreateCheck(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response,
     BOOLEAN AllowTraverseCheck, PUINT32 PGrantedAccess,
     PSECURITY_DESCRIPTOR *PSecurityDescriptor)
@@ -200,7 +201,8 @@ NTSTATUS FspFileSystemCreateCheck(FSP_FILE_SYSTEM *FileSystem,
             (Request->Req.Create.CreateOptions & FILE_DELETE_ON_CLOSE))
             Result = STATUS_CANNOT_DELETE;
         else
-            Result = FspAccessCheckEx(FileSystem, Request, TRUE, AllowTraverseCheck,
+            Result = FspAccessCheckScratch(FileSystem, DispatcherContext,
+                Request, TRUE, AllowTraverseCheck,
                 ParentDesiredAccess,
                 &GrantedAccess, PSecurityDescriptor);
         if (STATUS_REPARSE == Result)
@@ -219,7 +221,8 @@ NTSTATUS FspFileSystemCreateCheck(FSP_FILE_SYSTEM *FileSystem,
         if (Request->Req.Create.HasTrailingBackslash)
             Result = STATUS_OBJECT_NAME_INVALID;
         else
-            Result = FspAccessCheckEx(FileSystem, Request, TRUE, AllowTraverseCheck,
+            Result = FspAccessCheckScratch(FileSystem, DispatcherContext,
+                Request, TRUE, AllowTraverseCheck,
                 Request->Req.Create.DesiredAccess |
                     FILE_WRITE_DATA |
                     ((Request->Req.Create.CreateOptions & FILE_DELETE_ON_CLOSE) ? DELETE : 0),
@@ -241,6 +244,7 @@ NTSTATUS FspFileSystemCreateCheck(FSP_FILE_SYSTEM *FileSystem,
 
 static inline
 NTSTATUS FspFileSystemOpenCheck(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response,
     BOOLEAN AllowTraverseCheck, PUINT32 PGrantedAccess,
     PSECURITY_DESCRIPTOR *PSecurityDescriptor)
@@ -258,7 +262,8 @@ NTSTATUS FspFileSystemOpenCheck(FSP_FILE_SYSTEM *FileSystem,
      * requested in DesiredAccess.
      */
 
-    Result = FspAccessCheckEx(FileSystem, Request, FALSE, AllowTraverseCheck,
+    Result = FspAccessCheckScratch(FileSystem, DispatcherContext,
+        Request, FALSE, AllowTraverseCheck,
         Request->Req.Create.DesiredAccess |
             ((Request->Req.Create.CreateOptions & FILE_DELETE_ON_CLOSE) ? DELETE : 0),
         &GrantedAccess,
@@ -278,6 +283,7 @@ NTSTATUS FspFileSystemOpenCheck(FSP_FILE_SYSTEM *FileSystem,
 
 static inline
 NTSTATUS FspFileSystemOverwriteCheck(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response,
     BOOLEAN AllowTraverseCheck, PUINT32 PGrantedAccess)
 {
@@ -296,11 +302,12 @@ NTSTATUS FspFileSystemOverwriteCheck(FSP_FILE_SYSTEM *FileSystem,
      * they were actually requested in DesiredAccess.
      */
 
-    Result = FspAccessCheck(FileSystem, Request, FALSE, AllowTraverseCheck,
+    Result = FspAccessCheckScratch(FileSystem, DispatcherContext,
+        Request, FALSE, AllowTraverseCheck,
         Request->Req.Create.DesiredAccess |
             (Supersede ? DELETE : FILE_WRITE_DATA) |
             ((Request->Req.Create.CreateOptions & FILE_DELETE_ON_CLOSE) ? DELETE : 0),
-        &GrantedAccess);
+        &GrantedAccess, 0);
     if (STATUS_REPARSE == Result)
         Result = FspFileSystemCallResolveReparsePoints(FileSystem, Request, Response, GrantedAccess);
     else if (NT_SUCCESS(Result))
@@ -317,6 +324,7 @@ NTSTATUS FspFileSystemOverwriteCheck(FSP_FILE_SYSTEM *FileSystem,
 
 static inline
 NTSTATUS FspFileSystemOpenTargetDirectoryCheck(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response,
     PUINT32 PGrantedAccess)
 {
@@ -328,8 +336,8 @@ NTSTATUS FspFileSystemOpenTargetDirectoryCheck(FSP_FILE_SYSTEM *FileSystem,
      * for the desired access.
      */
 
-    Result = FspAccessCheck(FileSystem, Request, TRUE, TRUE, Request->Req.Create.DesiredAccess,
-        &GrantedAccess);
+    Result = FspAccessCheckScratch(FileSystem, DispatcherContext, Request, TRUE, TRUE,
+        Request->Req.Create.DesiredAccess, &GrantedAccess, 0);
     if (STATUS_REPARSE == Result)
         Result = FspFileSystemCallResolveReparsePoints(FileSystem, Request, Response, GrantedAccess);
     else if (NT_SUCCESS(Result))
@@ -342,6 +350,7 @@ static inline
 NTSTATUS FspFileSystemRenameCheck(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request)
 {
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext = FspFileSystemGetDispatcherContext();
     NTSTATUS Result;
     FSP_FSCTL_TRANSACT_REQ *CreateRequest = 0;
     UINT32 GrantedAccess;
@@ -363,7 +372,7 @@ NTSTATUS FspFileSystemRenameCheck(FSP_FILE_SYSTEM *FileSystem,
      * a fake one just for that purpose. Sigh!
      */
 
-    CreateRequest = MemAlloc(sizeof *CreateRequest +
+    CreateRequest = FspScratchAlloc(DispatcherContext, sizeof *CreateRequest +
         Request->Req.SetInformation.Info.Rename.NewFileName.Size);
     if (0 == CreateRequest)
         return STATUS_INSUFFICIENT_RESOURCES;
@@ -383,9 +392,10 @@ NTSTATUS FspFileSystemRenameCheck(FSP_FILE_SYSTEM *FileSystem,
         Request->Buffer + Request->Req.SetInformation.Info.Rename.NewFileName.Offset,
         Request->Req.SetInformation.Info.Rename.NewFileName.Size);
 
-    Result = FspAccessCheck(FileSystem, CreateRequest, FALSE, FALSE, DELETE, &GrantedAccess);
+    Result = FspAccessCheckScratch(FileSystem, DispatcherContext, CreateRequest, FALSE, FALSE,
+        DELETE, &GrantedAccess, 0);
 
-    MemFree(CreateRequest);
+    FspScratchFree(DispatcherContext, CreateRequest);
 
     if (STATUS_REPARSE == Result)
         Result = STATUS_SUCCESS; /* file system should not return STATUS_REPARSE during rename */
@@ -412,6 +422,7 @@ VOID FspFileSystemOpCreate_SetOpenDescriptor(FSP_FSCTL_TRANSACT_RSP *Response,
 }
 
 static NTSTATUS FspFileSystemOpCreate_FileCreate(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     NTSTATUS Result;
@@ -421,13 +432,13 @@ static NTSTATUS FspFileSystemOpCreate_FileCreate(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_OPEN_FILE_INFO OpenFileInfo;
     PSECURITY_DESCRIPTOR OpenDescriptor = 0;
 
-    Result = FspFileSystemCreateCheck(FileSystem, Request, Response, TRUE,
+    Result = FspFileSystemCreateCheck(FileSystem, DispatcherContext, Request, Response, TRUE,
         &GrantedAccess, &ParentDescriptor);
     if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
         return Result;
 
     Result = FspCreateSecurityDescriptor(FileSystem, Request, ParentDescriptor, &OpenDescriptor);
-    FspDeleteSecurityDescriptor(ParentDescriptor, FspAccessCheckEx);
+    FspScratchFree(DispatcherContext, ParentDescriptor);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -478,6 +489,7 @@ static NTSTATUS FspFileSystemOpCreate_FileCreate(FSP_FILE_SYSTEM *FileSystem,
 }
 
 static NTSTATUS FspFileSystemOpCreate_FileOpen(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     NTSTATUS Result;
@@ -486,7 +498,8 @@ static NTSTATUS FspFileSystemOpCreate_FileOpen(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_OPEN_FILE_INFO OpenFileInfo;
     PSECURITY_DESCRIPTOR OpenDescriptor = 0;
 
-    Result = FspFileSystemOpenCheck(FileSystem, Request, Response, TRUE, &GrantedAccess,
+    Result = FspFileSystemOpenCheck(FileSystem, DispatcherContext,
+        Request, Response, TRUE, &GrantedAccess,
         &OpenDescriptor);
     if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
         return Result;
@@ -501,7 +514,7 @@ static NTSTATUS FspFileSystemOpCreate_FileOpen(FSP_FILE_SYSTEM *FileSystem,
         AddrOfFileContext(FullContext), &OpenFileInfo.FileInfo);
     if (!NT_SUCCESS(Result))
     {
-        FspDeleteSecurityDescriptor(OpenDescriptor, FspAccessCheckEx);
+        FspScratchFree(DispatcherContext, OpenDescriptor);
         return Result;
     }
 
@@ -515,7 +528,7 @@ static NTSTATUS FspFileSystemOpCreate_FileOpen(FSP_FILE_SYSTEM *FileSystem,
     if (0 != OpenDescriptor)
     {
         FspFileSystemOpCreate_SetOpenDescriptor(Response, OpenDescriptor);
-        FspDeleteSecurityDescriptor(OpenDescriptor, FspAccessCheckEx);
+        FspScratchFree(DispatcherContext, OpenDescriptor);
     }
 
     Response->IoStatus.Information = FILE_OPENED;
@@ -527,6 +540,7 @@ static NTSTATUS FspFileSystemOpCreate_FileOpen(FSP_FILE_SYSTEM *FileSystem,
 }
 
 static NTSTATUS FspFileSystemOpCreate_FileOpenIf(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     NTSTATUS Result;
@@ -537,7 +551,8 @@ static NTSTATUS FspFileSystemOpCreate_FileOpenIf(FSP_FILE_SYSTEM *FileSystem,
     PSECURITY_DESCRIPTOR OpenDescriptor = 0;
     BOOLEAN Create = FALSE;
 
-    Result = FspFileSystemOpenCheck(FileSystem, Request, Response, TRUE, &GrantedAccess,
+    Result = FspFileSystemOpenCheck(FileSystem, DispatcherContext,
+        Request, Response, TRUE, &GrantedAccess,
         &OpenDescriptor);
     if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
     {
@@ -558,7 +573,7 @@ static NTSTATUS FspFileSystemOpCreate_FileOpenIf(FSP_FILE_SYSTEM *FileSystem,
             AddrOfFileContext(FullContext), &OpenFileInfo.FileInfo);
         if (!NT_SUCCESS(Result))
         {
-            FspDeleteSecurityDescriptor(OpenDescriptor, FspAccessCheckEx);
+            FspScratchFree(DispatcherContext, OpenDescriptor);
             OpenDescriptor = 0;
 
             if (STATUS_OBJECT_NAME_NOT_FOUND != Result)
@@ -569,13 +584,13 @@ static NTSTATUS FspFileSystemOpCreate_FileOpenIf(FSP_FILE_SYSTEM *FileSystem,
 
     if (Create)
     {
-        Result = FspFileSystemCreateCheck(FileSystem, Request, Response, FALSE,
+        Result = FspFileSystemCreateCheck(FileSystem, DispatcherContext, Request, Response, FALSE,
             &GrantedAccess, &ParentDescriptor);
         if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
             return Result;
 
         Result = FspCreateSecurityDescriptor(FileSystem, Request, ParentDescriptor, &OpenDescriptor);
-        FspDeleteSecurityDescriptor(ParentDescriptor, FspAccessCheckEx);
+        FspScratchFree(DispatcherContext, ParentDescriptor);
         if (!NT_SUCCESS(Result))
             return Result;
 
@@ -615,8 +630,10 @@ static NTSTATUS FspFileSystemOpCreate_FileOpenIf(FSP_FILE_SYSTEM *FileSystem,
     if (0 != OpenDescriptor)
     {
         FspFileSystemOpCreate_SetOpenDescriptor(Response, OpenDescriptor);
-        FspDeleteSecurityDescriptor(OpenDescriptor, Create ?
-            (NTSTATUS (*)())FspCreateSecurityDescriptor : (NTSTATUS (*)())FspAccessCheckEx);
+        if (Create)
+            FspDeleteSecurityDescriptor(OpenDescriptor, FspCreateSecurityDescriptor);
+        else
+            FspScratchFree(DispatcherContext, OpenDescriptor);
     }
 
     Response->IoStatus.Information = Create ? FILE_CREATED : FILE_OPENED;
@@ -628,6 +645,7 @@ static NTSTATUS FspFileSystemOpCreate_FileOpenIf(FSP_FILE_SYSTEM *FileSystem,
 }
 
 static NTSTATUS FspFileSystemOpCreate_FileOverwrite(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     NTSTATUS Result;
@@ -635,7 +653,8 @@ static NTSTATUS FspFileSystemOpCreate_FileOverwrite(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_FULL_CONTEXT FullContext;
     FSP_FSCTL_OPEN_FILE_INFO OpenFileInfo;
 
-    Result = FspFileSystemOverwriteCheck(FileSystem, Request, Response, TRUE, &GrantedAccess);
+    Result = FspFileSystemOverwriteCheck(FileSystem, DispatcherContext,
+        Request, Response, TRUE, &GrantedAccess);
     if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
         return Result;
 
@@ -666,6 +685,7 @@ static NTSTATUS FspFileSystemOpCreate_FileOverwrite(FSP_FILE_SYSTEM *FileSystem,
 }
 
 static NTSTATUS FspFileSystemOpCreate_FileOverwriteIf(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     NTSTATUS Result;
@@ -676,7 +696,8 @@ static NTSTATUS FspFileSystemOpCreate_FileOverwriteIf(FSP_FILE_SYSTEM *FileSyste
     BOOLEAN Supersede = FILE_SUPERSEDE == ((Request->Req.Create.CreateOptions >> 24) & 0xff);
     BOOLEAN Create = FALSE;
 
-    Result = FspFileSystemOverwriteCheck(FileSystem, Request, Response, TRUE, &GrantedAccess);
+    Result = FspFileSystemOverwriteCheck(FileSystem, DispatcherContext,
+        Request, Response, TRUE, &GrantedAccess);
     if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
     {
         if (STATUS_OBJECT_NAME_NOT_FOUND != Result)
@@ -704,13 +725,13 @@ static NTSTATUS FspFileSystemOpCreate_FileOverwriteIf(FSP_FILE_SYSTEM *FileSyste
 
     if (Create)
     {
-        Result = FspFileSystemCreateCheck(FileSystem, Request, Response,
+        Result = FspFileSystemCreateCheck(FileSystem, DispatcherContext, Request, Response,
             FALSE, &GrantedAccess, &ParentDescriptor);
         if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
             return Result;
 
         Result = FspCreateSecurityDescriptor(FileSystem, Request, ParentDescriptor, &ObjectDescriptor);
-        FspDeleteSecurityDescriptor(ParentDescriptor, FspAccessCheckEx);
+        FspScratchFree(DispatcherContext, ParentDescriptor);
         if (!NT_SUCCESS(Result))
             return Result;
 
@@ -755,6 +776,7 @@ static NTSTATUS FspFileSystemOpCreate_FileOverwriteIf(FSP_FILE_SYSTEM *FileSyste
 }
 
 static NTSTATUS FspFileSystemOpCreate_FileOpenTargetDirectory(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     NTSTATUS Result;
@@ -765,7 +787,8 @@ static NTSTATUS FspFileSystemOpCreate_FileOpenTargetDirectory(FSP_FILE_SYSTEM *F
     FSP_FSCTL_OPEN_FILE_INFO OpenFileInfo;
     UINT32 Information;
 
-    Result = FspFileSystemOpenTargetDirectoryCheck(FileSystem, Request, Response, &GrantedAccess);
+    Result = FspFileSystemOpenTargetDirectoryCheck(FileSystem, DispatcherContext,
+        Request, Response, &GrantedAccess);
     if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
         return Result;
 
@@ -890,7 +913,8 @@ static NTSTATUS FspFileSystemOpCreate_CollisionCheck(FSP_FILE_SYSTEM *FileSystem
     return STATUS_REPARSE;
 }
 
-FSP_API NTSTATUS FspFileSystemOpCreate(FSP_FILE_SYSTEM *FileSystem,
+NTSTATUS FspFileSystemOpCreateInternal(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     NTSTATUS Result;
@@ -901,25 +925,28 @@ FSP_API NTSTATUS FspFileSystemOpCreate(FSP_FILE_SYSTEM *FileSystem,
         return STATUS_INVALID_DEVICE_REQUEST;
 
     if (Request->Req.Create.OpenTargetDirectory)
-        return FspFileSystemOpCreate_FileOpenTargetDirectory(FileSystem, Request, Response);
+        return FspFileSystemOpCreate_FileOpenTargetDirectory(FileSystem, DispatcherContext,
+            Request, Response);
 
     switch ((Request->Req.Create.CreateOptions >> 24) & 0xff)
     {
     case FILE_CREATE:
-        Result = FspFileSystemOpCreate_FileCreate(FileSystem, Request, Response);
+        Result = FspFileSystemOpCreate_FileCreate(FileSystem, DispatcherContext, Request, Response);
         break;
     case FILE_OPEN:
-        Result = FspFileSystemOpCreate_FileOpen(FileSystem, Request, Response);
+        Result = FspFileSystemOpCreate_FileOpen(FileSystem, DispatcherContext, Request, Response);
         break;
     case FILE_OPEN_IF:
-        Result = FspFileSystemOpCreate_FileOpenIf(FileSystem, Request, Response);
+        Result = FspFileSystemOpCreate_FileOpenIf(FileSystem, DispatcherContext, Request, Response);
         break;
     case FILE_OVERWRITE:
-        Result = FspFileSystemOpCreate_FileOverwrite(FileSystem, Request, Response);
+        Result = FspFileSystemOpCreate_FileOverwrite(FileSystem, DispatcherContext,
+            Request, Response);
         break;
     case FILE_OVERWRITE_IF:
     case FILE_SUPERSEDE:
-        Result = FspFileSystemOpCreate_FileOverwriteIf(FileSystem, Request, Response);
+        Result = FspFileSystemOpCreate_FileOverwriteIf(FileSystem, DispatcherContext,
+            Request, Response);
         break;
     default:
         Result = STATUS_INVALID_PARAMETER;
@@ -930,10 +957,170 @@ FSP_API NTSTATUS FspFileSystemOpCreate(FSP_FILE_SYSTEM *FileSystem,
         Result = FspFileSystemOpCreate_NotFoundCheck(FileSystem, Request, Response);
     else if (STATUS_OBJECT_NAME_COLLISION == Result)
         Result = FspFileSystemOpCreate_CollisionCheck(FileSystem, Request, Response);
+    else if (STATUS_SUCCESS == Result)
+    {
+        if (FILE_CREATED == Response->IoStatus.Information)
+            /* misses in the parent directory are no longer valid */
+            FspNegativeCacheInvalidateDirectory(FileSystem->NegativeCache, (PWSTR)Request->Buffer);
+        if (Request->Req.Create.EaIsReparsePoint)
+        {
+            /* the file was created with a reparse point */
+            FspReparseCacheInvalidate(FileSystem->ReparseCache);
+            FspNegativeCacheInvalidate(FileSystem->NegativeCache);
+        }
+    }
 
     return Result;
 }
 
+FSP_API NTSTATUS FspFileSystemOpCreate(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    /* the dispatcher calls FspFileSystemOpCreateInternal directly; this is for custom Create ops */
+    return FspFileSystemOpCreateInternal(FileSystem, FspFileSystemGetDispatcherContext(),
+        Request, Response);
+}
+
+ULONG FspFileSystemOpCreateMany(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
+    FSP_FSCTL_TRANSACT_REQ **Requests, FSP_FSCTL_TRANSACT_RSP *Response,
+    FSP_FILE_SYSTEM_CREATE_ENTRY *Entries, PWSTR NameBuf, ULONG Count)
+{
+    /*
+     * The requests have been grouped by FspFileSystemOpCanVectorize. The checks of
+     * FspFileSystemOpCreate_FileCreate are performed for every request in order and the
+     * requests that pass them are passed to CreateMany; their count is returned. The group
+     * ends at the first request that fails the checks (e.g. one that needs reparse point
+     * resolution). That request is Requests[ReadyCount]; on return Response holds its
+     * complete response, exactly as FspFileSystemOpCreate would have produced it, so the
+     * caller does not dispatch it again. Requests after it are not looked at.
+     *
+     * Response must have room for FSP_FSCTL_TRANSACT_RSP_SIZEMAX bytes. NameBuf must have
+     * room for Count normalized names of FSP_FILE_SYSTEM_CREATE_NAME_SIZE bytes each.
+     * Count must not exceed FSP_FILE_SYSTEM_NAMESPACE_BATCH_MAX.
+     */
+
+    NTSTATUS Result, CheckResult = STATUS_SUCCESS;
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    FSP_FILE_SYSTEM_CREATE_ENTRY *Entry;
+    UINT32 GrantedAccess;
+    PSECURITY_DESCRIPTOR ParentDescriptor, OpenDescriptor;
+    BOOLEAN Created = FALSE;
+    ULONG Index, ReadyCount;
+
+    for (ReadyCount = 0; Count > ReadyCount; ReadyCount++)
+    {
+        Request = Requests[ReadyCount];
+
+        memset(Response, 0, sizeof *Response);
+        Response->Size = sizeof *Response;
+        Response->Kind = Request->Kind;
+        Response->Hint = Request->Hint;
+
+        CheckResult = FspFileSystemCreateCheck(FileSystem, DispatcherContext, Request, Response,
+            TRUE, &GrantedAccess, &ParentDescriptor);
+        if (!NT_SUCCESS(CheckResult) || STATUS_REPARSE == CheckResult)
+            break;
+
+        OpenDescriptor = 0;
+        CheckResult = FspCreateSecurityDescriptor(FileSystem, Request, ParentDescriptor,
+            &OpenDescriptor);
+        FspScratchFree(DispatcherContext, ParentDescriptor);
+        if (!NT_SUCCESS(CheckResult))
+            break;
+
+        Entry = &Entries[ReadyCount];
+        memset(Entry, 0, sizeof *Entry);
+        Entry->FileName = (PWSTR)Request->Buffer;
+        Entry->CreateOptions = Request->Req.Create.CreateOptions;
+        Entry->GrantedAccess = GrantedAccess;
+        Entry->FileAttributes = Request->Req.Create.FileAttributes;
+        Entry->SecurityDescriptor = OpenDescriptor;
+        Entry->AllocationSize = Request->Req.Create.AllocationSize;
+        Entry->OpenFileInfo.NormalizedName = (PVOID)
+            ((PUINT8)NameBuf + ReadyCount * FSP_FILE_SYSTEM_CREATE_NAME_SIZE);
+        Entry->OpenFileInfo.NormalizedNameSize = FSP_FILE_SYSTEM_CREATE_NAME_SIZE;
+    }
+
+    if (0 != ReadyCount)
+    {
+        Result = FileSystem->Interface->CreateMany(FileSystem, Entries, ReadyCount);
+        for (Index = 0; ReadyCount > Index; Index++)
+        {
+            if (!NT_SUCCESS(Result))
+                Entries[Index].Status = Result;
+            else if (NT_SUCCESS(Entries[Index].Status))
+                Created = TRUE;
+        }
+
+        if (Created)
+            /* misses in the parent directory are no longer valid; all entries share it */
+            FspNegativeCacheInvalidateDirectory(FileSystem->NegativeCache,
+                (PWSTR)Requests[0]->Buffer);
+    }
+
+    if (Count > ReadyCount)
+    {
+        /* complete the request that ended the group after the ones before it */
+        Request = Requests[ReadyCount];
+        if (STATUS_OBJECT_NAME_NOT_FOUND == CheckResult)
+            CheckResult = FspFileSystemOpCreate_NotFoundCheck(FileSystem, Request, Response);
+        else if (STATUS_OBJECT_NAME_COLLISION == CheckResult)
+            CheckResult = FspFileSystemOpCreate_CollisionCheck(FileSystem, Request, Response);
+        Response->IoStatus.Status = CheckResult;
+    }
+
+    return ReadyCount;
+}
+
+VOID FspFileSystemOpCreateManyResponse(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response,
+    FSP_FILE_SYSTEM_CREATE_ENTRY *Entry)
+{
+    /*
+     * Complete the Response for an entry prepared by FspFileSystemOpCreateMany.
+     * The Response has been initialized by the caller; its IoStatus is set here.
+     */
+
+    NTSTATUS Result = Entry->Status;
+    FSP_FSCTL_TRANSACT_FULL_CONTEXT FullContext;
+
+    if (NT_SUCCESS(Result))
+    {
+        if (FSP_FSCTL_TRANSACT_PATH_SIZEMAX >= Entry->OpenFileInfo.NormalizedNameSize)
+        {
+            Response->Size = (UINT16)(sizeof *Response + Entry->OpenFileInfo.NormalizedNameSize);
+            Response->Rsp.Create.Opened.FileName.Offset = 0;
+            Response->Rsp.Create.Opened.FileName.Size = (UINT16)Entry->OpenFileInfo.NormalizedNameSize;
+            memcpy(Response->Buffer, Entry->OpenFileInfo.NormalizedName,
+                Entry->OpenFileInfo.NormalizedNameSize);
+        }
+
+        if (0 != Entry->SecurityDescriptor)
+            FspFileSystemOpCreate_SetOpenDescriptor(Response, Entry->SecurityDescriptor);
+
+        FullContext.UserContext = 0;
+        FullContext.UserContext2 = 0;
+        *(PVOID *)AddrOfFileContext(FullContext) = Entry->FileContext;
+
+        Response->IoStatus.Information = FILE_CREATED;
+        SetFileContext(Response->Rsp.Create.Opened, FullContext);
+        Response->Rsp.Create.Opened.GrantedAccess = Entry->GrantedAccess;
+        memcpy(&Response->Rsp.Create.Opened.FileInfo,
+            &Entry->OpenFileInfo.FileInfo, sizeof Entry->OpenFileInfo.FileInfo);
+        Result = STATUS_SUCCESS;
+    }
+    else if (STATUS_OBJECT_NAME_NOT_FOUND == Result)
+        Result = FspFileSystemOpCreate_NotFoundCheck(FileSystem, Request, Response);
+    else if (STATUS_OBJECT_NAME_COLLISION == Result)
+        Result = FspFileSystemOpCreate_CollisionCheck(FileSystem, Request, Response);
+
+    if (0 != Entry->SecurityDescriptor)
+        FspDeleteSecurityDescriptor(Entry->SecurityDescriptor, FspCreateSecurityDescriptor);
+
+    Response->IoStatus.Status = Result;
+}
+
 FSP_API NTSTATUS FspFileSystemOpOverwrite(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
@@ -973,6 +1160,18 @@ FSP_API NTSTATUS FspFileSystemOpOverwrite(FSP_FILE_SYSTEM *FileSystem,
     return STATUS_SUCCESS;
 }
 
+static inline
+ULONG FspFileSystemOpCleanup_Flags(FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    return
+        (0 != Request->Req.Cleanup.Delete ? FspCleanupDelete : 0) |
+        (0 != Request->Req.Cleanup.SetAllocationSize ? FspCleanupSetAllocationSize : 0) |
+        (0 != Request->Req.Cleanup.SetArchiveBit ? FspCleanupSetArchiveBit : 0) |
+        (0 != Request->Req.Cleanup.SetLastAccessTime ? FspCleanupSetLastAccessTime : 0) |
+        (0 != Request->Req.Cleanup.SetLastWriteTime ? FspCleanupSetLastWriteTime : 0) |
+        (0 != Request->Req.Cleanup.SetChangeTime ? FspCleanupSetChangeTime : 0);
+}
+
 FSP_API NTSTATUS FspFileSystemOpCleanup(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
@@ -980,12 +1179,13 @@ FSP_API NTSTATUS FspFileSystemOpCleanup(FSP_FILE_SYSTEM *FileSystem,
         FileSystem->Interface->Cleanup(FileSystem,
             (PVOID)ValOfFileContext(Request->Req.Cleanup),
             0 != Request->FileName.Size ? (PWSTR)Request->Buffer : 0,
-            (0 != Request->Req.Cleanup.Delete ? FspCleanupDelete : 0) |
-            (0 != Request->Req.Cleanup.SetAllocationSize ? FspCleanupSetAllocationSize : 0) |
-            (0 != Request->Req.Cleanup.SetArchiveBit ? FspCleanupSetArchiveBit : 0) |
-            (0 != Request->Req.Cleanup.SetLastAccessTime ? FspCleanupSetLastAccessTime : 0) |
-            (0 != Request->Req.Cleanup.SetLastWriteTime ? FspCleanupSetLastWriteTime : 0) |
-            (0 != Request->Req.Cleanup.SetChangeTime ? FspCleanupSetChangeTime : 0));
+            FspFileSystemOpCleanup_Flags(Request));
+
+    if (0 != Request->Req.Cleanup.Delete)
+    {
+        FspTraverseCacheInvalidate(FileSystem->TraverseCache);
+        FspReparseCacheInvalidate(FileSystem->ReparseCache);
+    }
 
     return STATUS_SUCCESS;
 }
@@ -1003,19 +1203,33 @@ FSP_API NTSTATUS FspFileSystemOpClose(FSP_FILE_SYSTEM *FileSystem,
 FSP_API NTSTATUS FspFileSystemOpRead(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT OperationContext;
     NTSTATUS Result;
     ULONG BytesTransferred;
 
-    if (0 == FileSystem->Interface->Read)
+    if (0 == FileSystem->Interface->Read && 0 == FileSystem->Interface->ReadEx)
         return STATUS_INVALID_DEVICE_REQUEST;
 
     BytesTransferred = 0;
-    Result = FileSystem->Interface->Read(FileSystem,
-        (PVOID)ValOfFileContext(Request->Req.Read),
-        (PVOID)Request->Req.Read.Address,
-        Request->Req.Read.Offset,
-        Request->Req.Read.Length,
-        &BytesTransferred);
+    if (0 != FileSystem->Interface->ReadEx)
+    {
+        OperationContext.Request = Request;
+        OperationContext.Response = Response;
+        Result = FileSystem->Interface->ReadEx(FileSystem,
+            &OperationContext,
+            (PVOID)ValOfFileContext(Request->Req.Read),
+            (PVOID)Request->Req.Read.Address,
+            Request->Req.Read.Offset,
+            Request->Req.Read.Length,
+            &BytesTransferred);
+    }
+    else
+        Result = FileSystem->Interface->Read(FileSystem,
+            (PVOID)ValOfFileContext(Request->Req.Read),
+            (PVOID)Request->Req.Read.Address,
+            Request->Req.Read.Offset,
+            Request->Req.Read.Length,
+            &BytesTransferred);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -1031,20 +1245,37 @@ FSP_API NTSTATUS FspFileSystemOpWrite(FSP_FILE_SYSTEM *FileSystem,
     NTSTATUS Result;
     ULONG BytesTransferred;
     FSP_FSCTL_FILE_INFO FileInfo;
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT OperationContext;
 
-    if (0 == FileSystem->Interface->Write)
+    if (0 == FileSystem->Interface->Write && 0 == FileSystem->Interface->WriteEx)
         return STATUS_INVALID_DEVICE_REQUEST;
 
     BytesTransferred = 0;
-    Result = FileSystem->Interface->Write(FileSystem,
-        (PVOID)ValOfFileContext(Request->Req.Write),
-        (PVOID)Request->Req.Write.Address,
-        Request->Req.Write.Offset,
-        Request->Req.Write.Length,
-        (UINT64)-1LL == Request->Req.Write.Offset,
-        0 != Request->Req.Write.ConstrainedIo,
-        &BytesTransferred,
-        &FileInfo);
+    if (0 != FileSystem->Interface->WriteEx)
+    {
+        OperationContext.Request = Request;
+        OperationContext.Response = Response;
+        Result = FileSystem->Interface->WriteEx(FileSystem,
+            &OperationContext,
+            (PVOID)ValOfFileContext(Request->Req.Write),
+            (PVOID)Request->Req.Write.Address,
+            Request->Req.Write.Offset,
+            Request->Req.Write.Length,
+            (UINT64)-1LL == Request->Req.Write.Offset,
+            0 != Request->Req.Write.ConstrainedIo,
+            &BytesTransferred,
+            &FileInfo);
+    }
+    else
+        Result = FileSystem->Interface->Write(FileSystem,
+            (PVOID)ValOfFileContext(Request->Req.Write),
+            (PVOID)Request->Req.Write.Address,
+            Request->Req.Write.Offset,
+            Request->Req.Write.Length,
+            (UINT64)-1LL == Request->Req.Write.Offset,
+            0 != Request->Req.Write.ConstrainedIo,
+            &BytesTransferred,
+            &FileInfo);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -1057,6 +1288,171 @@ FSP_API NTSTATUS FspFileSystemOpWrite(FSP_FILE_SYSTEM *FileSystem,
     return Result;
 }
 
+static inline
+BOOLEAN FspFileSystemOpCanCreateMany(FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    return
+        FILE_CREATE == ((Request->Req.Create.CreateOptions >> 24) & 0xff) &&
+        !Request->Req.Create.OpenTargetDirectory &&
+        0 == Request->Req.Create.Ea.Size;
+}
+
+static inline
+BOOLEAN FspFileSystemOpIsSameDirectory(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request0, FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    PWSTR FileName0 = (PWSTR)Request0->Buffer, FileName = (PWSTR)Request->Buffer;
+    ULONG Index0 = FspPathSuffixIndex(FileName0), Index = FspPathSuffixIndex(FileName);
+
+    /* the FSD passes names as the caller spelled them; fold case like the file system does */
+    return Index0 == Index &&
+        FspPathIsEqual(FileName0, FileName, Index, !FileSystem->CaseSensitiveSearch);
+}
+
+BOOLEAN FspFileSystemOpCanVectorize(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request0, FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    if (Request0->Kind != Request->Kind)
+        return FALSE;
+
+    switch (Request->Kind)
+    {
+    case FspFsctlTransactReadKind:
+        if (0 == FileSystem->Interface->ReadV)
+            return FALSE;
+        return FileSystem->UmFileContextIsFullContext ?
+            Request0->Req.Read.UserContext == Request->Req.Read.UserContext &&
+                Request0->Req.Read.UserContext2 == Request->Req.Read.UserContext2 :
+            ValOfFileContext(Request0->Req.Read) == ValOfFileContext(Request->Req.Read);
+    case FspFsctlTransactWriteKind:
+        if (0 == FileSystem->Interface->WriteV)
+            return FALSE;
+        return FileSystem->UmFileContextIsFullContext ?
+            Request0->Req.Write.UserContext == Request->Req.Write.UserContext &&
+                Request0->Req.Write.UserContext2 == Request->Req.Write.UserContext2 :
+            ValOfFileContext(Request0->Req.Write) == ValOfFileContext(Request->Req.Write);
+    case FspFsctlTransactCreateKind:
+        if (0 == FileSystem->Interface->CreateMany ||
+            FspFileSystemOpCreate != FileSystem->Operations[FspFsctlTransactCreateKind] ||
+            FileSystem->UmFileContextIsFullContext)
+            return FALSE;
+        return
+            FspFileSystemOpCanCreateMany(Request0) &&
+            FspFileSystemOpCanCreateMany(Request) &&
+            FspFileSystemOpIsSameDirectory(FileSystem, Request0, Request);
+    case FspFsctlTransactCleanupKind:
+        if (0 == FileSystem->Interface->DeleteMany ||
+            FspFileSystemOpCleanup != FileSystem->Operations[FspFsctlTransactCleanupKind])
+            return FALSE;
+        return
+            0 != Request0->Req.Cleanup.Delete && 0 != Request0->FileName.Size &&
+            0 != Request->Req.Cleanup.Delete && 0 != Request->FileName.Size &&
+            FspFileSystemOpIsSameDirectory(FileSystem, Request0, Request);
+    default:
+        return FALSE;
+    }
+}
+
+NTSTATUS FspFileSystemOpReadWriteV(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ **Requests, FSP_FSCTL_TRANSACT_RSP **Responses, ULONG Count)
+{
+    /*
+     * The requests have been grouped by FspFileSystemOpCanVectorize. The Responses
+     * have been initialized by the caller; their IoStatus is set here.
+     */
+
+    NTSTATUS Result;
+    FSP_FILE_SYSTEM_IO_SEGMENT Segments[FSP_FILE_SYSTEM_IO_SEGMENT_MAX];
+    FSP_FSCTL_FILE_INFO FileInfo;
+    BOOLEAN IsWrite = FspFsctlTransactWriteKind == Requests[0]->Kind;
+    ULONG Index;
+
+    if (FSP_FILE_SYSTEM_IO_SEGMENT_MAX < Count)
+        return STATUS_INVALID_PARAMETER;
+
+    memset(Segments, 0, Count * sizeof Segments[0]);
+    for (Index = 0; Count > Index; Index++)
+    {
+        FSP_FSCTL_TRANSACT_REQ *Request = Requests[Index];
+
+        if (IsWrite)
+        {
+            Segments[Index].Buffer = (PVOID)Request->Req.Write.Address;
+            Segments[Index].Offset = Request->Req.Write.Offset;
+            Segments[Index].Length = Request->Req.Write.Length;
+            Segments[Index].WriteToEndOfFile = (UINT64)-1LL == Request->Req.Write.Offset;
+            Segments[Index].ConstrainedIo = 0 != Request->Req.Write.ConstrainedIo;
+        }
+        else
+        {
+            Segments[Index].Buffer = (PVOID)Request->Req.Read.Address;
+            Segments[Index].Offset = Request->Req.Read.Offset;
+            Segments[Index].Length = Request->Req.Read.Length;
+        }
+    }
+
+    memset(&FileInfo, 0, sizeof FileInfo);
+    if (IsWrite)
+        Result = FileSystem->Interface->WriteV(FileSystem,
+            (PVOID)ValOfFileContext(Requests[0]->Req.Write),
+            Segments, Count,
+            &FileInfo);
+    else
+        Result = FileSystem->Interface->ReadV(FileSystem,
+            (PVOID)ValOfFileContext(Requests[0]->Req.Read),
+            Segments, Count);
+
+    for (Index = 0; Count > Index; Index++)
+    {
+        FSP_FSCTL_TRANSACT_RSP *Response = Responses[Index];
+
+        Response->IoStatus.Status = NT_SUCCESS(Result) ? Segments[Index].Status : Result;
+        if (NT_SUCCESS(Response->IoStatus.Status))
+        {
+            Response->IoStatus.Information = Segments[Index].BytesTransferred;
+            if (IsWrite)
+                memcpy(&Response->Rsp.Write.FileInfo, &FileInfo, sizeof FileInfo);
+        }
+    }
+
+    return Result;
+}
+
+NTSTATUS FspFileSystemOpCleanupV(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ **Requests, FSP_FSCTL_TRANSACT_RSP **Responses, ULONG Count)
+{
+    /*
+     * The requests have been grouped by FspFileSystemOpCanVectorize; they all delete
+     * a file in the same directory. The Responses have been initialized by the caller;
+     * their IoStatus is set here.
+     */
+
+    FSP_FILE_SYSTEM_DELETE_ENTRY Entries[FSP_FILE_SYSTEM_NAMESPACE_BATCH_MAX];
+    ULONG Index;
+
+    if (FSP_FILE_SYSTEM_NAMESPACE_BATCH_MAX < Count)
+        return STATUS_INVALID_PARAMETER;
+
+    for (Index = 0; Count > Index; Index++)
+    {
+        FSP_FSCTL_TRANSACT_REQ *Request = Requests[Index];
+
+        Entries[Index].FileContext = (PVOID)ValOfFileContext(Request->Req.Cleanup);
+        Entries[Index].FileName = (PWSTR)Request->Buffer;
+        Entries[Index].Flags = FspFileSystemOpCleanup_Flags(Request);
+    }
+
+    FileSystem->Interface->DeleteMany(FileSystem, Entries, Count);
+
+    FspTraverseCacheInvalidate(FileSystem->TraverseCache);
+    FspReparseCacheInvalidate(FileSystem->ReparseCache);
+
+    for (Index = 0; Count > Index; Index++)
+        Responses[Index]->IoStatus.Status = STATUS_SUCCESS;
+
+    return STATUS_SUCCESS;
+}
+
 FSP_API NTSTATUS FspFileSystemOpFlushBuffers(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
@@ -1175,6 +1571,9 @@ FSP_API NTSTATUS FspFileSystemOpSetInformation(FSP_FILE_SYSTEM *FileSystem,
                 (PWSTR)Request->Buffer,
                 (PWSTR)(Request->Buffer + Request->Req.SetInformation.Info.Rename.NewFileName.Offset),
                 0 != Request->Req.SetInformation.Info.Rename.AccessToken);
+            FspTraverseCacheInvalidate(FileSystem->TraverseCache);
+            FspReparseCacheInvalidate(FileSystem->ReparseCache);
+            FspNegativeCacheInvalidate(FileSystem->NegativeCache);
         }
         break;
     }
@@ -1307,8 +1706,9 @@ FSP_API NTSTATUS FspFileSystemOpQueryDirectory(FSP_FILE_SYSTEM *FileSystem,
 {
     NTSTATUS Result;
     ULONG BytesTransferred;
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT OperationContext;
 
-    if (0 == FileSystem->Interface->ReadDirectory)
+    if (0 == FileSystem->Interface->ReadDirectory && 0 == FileSystem->Interface->ReadDirectoryEx)
         return STATUS_INVALID_DEVICE_REQUEST;
 
     BytesTransferred = 0;
@@ -1320,6 +1720,21 @@ FSP_API NTSTATUS FspFileSystemOpQueryDirectory(FSP_FILE_SYSTEM *FileSystem,
             (PVOID)Request->Req.QueryDirectory.Address,
             Request->Req.QueryDirectory.Length,
             &BytesTransferred);
+    else if (0 != FileSystem->Interface->ReadDirectoryEx)
+    {
+        OperationContext.Request = Request;
+        OperationContext.Response = Response;
+        Result = FileSystem->Interface->ReadDirectoryEx(FileSystem,
+            &OperationContext,
+            (PVOID)ValOfFileContext(Request->Req.QueryDirectory),
+            0 != Request->Req.QueryDirectory.Pattern.Size ?
+                (PWSTR)(Request->Buffer + Request->Req.QueryDirectory.Pattern.Offset) : 0,
+            0 != Request->Req.QueryDirectory.Marker.Size ?
+                (PWSTR)(Request->Buffer + Request->Req.QueryDirectory.Marker.Offset) : 0,
+            (PVOID)Request->Req.QueryDirectory.Address,
+            Request->Req.QueryDirectory.Length,
+            &BytesTransferred);
+    }
     else
         Result = FileSystem->Interface->ReadDirectory(FileSystem,
             (PVOID)ValOfFileContext(Request->Req.QueryDirectory),
@@ -1344,6 +1759,7 @@ FSP_API NTSTATUS FspFileSystemOpFileSystemControl(FSP_FILE_SYSTEM *FileSystem,
 {
     NTSTATUS Result;
     PREPARSE_DATA_BUFFER ReparseData;
+    FSP_FSCTL_DUPLICATE_EXTENTS_DATA *DuplicateExtentsData;
     SIZE_T Size;
 
     Result = STATUS_INVALID_DEVICE_REQUEST;
@@ -1378,6 +1794,9 @@ FSP_API NTSTATUS FspFileSystemOpFileSystemControl(FSP_FILE_SYSTEM *FileSystem,
                 (PWSTR)Request->Buffer,
                 ReparseData,
                 Request->Req.FileSystemControl.Buffer.Size);
+            FspTraverseCacheInvalidate(FileSystem->TraverseCache);
+            FspReparseCacheInvalidate(FileSystem->ReparseCache);
+            FspNegativeCacheInvalidate(FileSystem->NegativeCache);
         }
         break;
     case FSCTL_DELETE_REPARSE_POINT:
@@ -1391,6 +1810,24 @@ FSP_API NTSTATUS FspFileSystemOpFileSystemControl(FSP_FILE_SYSTEM *FileSystem,
                 (PWSTR)Request->Buffer,
                 ReparseData,
                 Request->Req.FileSystemControl.Buffer.Size);
+            FspTraverseCacheInvalidate(FileSystem->TraverseCache);
+            FspReparseCacheInvalidate(FileSystem->ReparseCache);
+            FspNegativeCacheInvalidate(FileSystem->NegativeCache);
+        }
+        break;
+    case FSCTL_DUPLICATE_EXTENTS_TO_FILE:
+        if (0 != FileSystem->Interface->DuplicateExtents)
+        {
+            DuplicateExtentsData = (FSP_FSCTL_DUPLICATE_EXTENTS_DATA *)
+                (Request->Buffer + Request->Req.FileSystemControl.Buffer.Offset);
+
+            Result = FileSystem->Interface->DuplicateExtents(FileSystem,
+                (PVOID)ValOfFileContext(Request->Req.FileSystemControl),
+                (PVOID)ValOfFileContext(DuplicateExtentsData->Source),
+                DuplicateExtentsData->SourceOffset,
+                DuplicateExtentsData->TargetOffset,
+                DuplicateExtentsData->Length,
+                &Response->Rsp.FileSystemControl.FileInfo);
         }
         break;
     }
@@ -1447,13 +1884,20 @@ FSP_API NTSTATUS FspFileSystemOpQuerySecurity(FSP_FILE_SYSTEM *FileSystem,
 FSP_API NTSTATUS FspFileSystemOpSetSecurity(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
+    NTSTATUS Result;
+
     if (0 == FileSystem->Interface->SetSecurity)
         return STATUS_INVALID_DEVICE_REQUEST;
 
-    return FileSystem->Interface->SetSecurity(FileSystem,
+    Result = FileSystem->Interface->SetSecurity(FileSystem,
         (PVOID)ValOfFileContext(Request->Req.SetSecurity),
         Request->Req.SetSecurity.SecurityInformation,
         (PSECURITY_DESCRIPTOR)Request->Buffer);
+
+    /* invalidate after the change, so that no traverse check can cache the old security */
+    FspTraverseCacheInvalidate(FileSystem->TraverseCache);
+
+    return Result;
 }
 
 FSP_API NTSTATUS FspFileSystemOpQueryStreamInformation(FSP_FILE_SYSTEM *FileSystem,
@@ -1754,6 +2198,170 @@ reparse_data_exit:
     return STATUS_REPARSE;
 }
 
+/*
+ * Reparse point resolution cache
+ *
+ * Remembers the results of FspFileSystemResolveReparsePoints, so that hot paths through
+ * symbolic links resolve in a single lookup rather than a GetReparsePointByName call per
+ * path component. Entries are keyed by path (GetReparsePointByName, FileName,
+ * ReparsePointIndex, ResolveLastPathComponent) and generation, and hold the resolved reparse
+ * data. Only successful (STATUS_REPARSE) resolutions are cached.
+ *
+ * The Context pointer is not part of the key: it is opaque to us and its address may be
+ * reused for a different object once the caller frees it, which would hit a stale entry.
+ * So only resolutions with a null Context (the common case) are cached.
+ *
+ * Anything that can add, remove or move a reparse point (SetReparsePoint, DeleteReparsePoint,
+ * Rename, delete on Cleanup, Create with reparse point EA) bumps the generation and so drops
+ * all entries. Changes made behind the dispatcher's back are not seen, so the cache is only
+ * used when the file system asks for it with the VolumeParams UmReparseCache flag. Entries
+ * expire after FileInfoTimeout, but never later than FspReparseCacheTimeoutMax.
+ */
+#define FspReparseCacheBucketCount      256
+#define FspReparseCacheTimeoutMax       1000
+
+typedef struct _FSP_REPARSE_CACHE_ENTRY
+{
+    NTSTATUS (*GetReparsePointByName)();
+    LONG Generation;
+    UINT64 ExpirationTime;
+    UINT32 ReparsePointIndex;
+    BOOLEAN ResolveLastPathComponent;
+    ULONG_PTR Information;
+    ULONG FileNameLength;
+    SIZE_T Size;
+    UINT64 Buffer[]; /* FileName followed by resolved reparse data (aligned) */
+} FSP_REPARSE_CACHE_ENTRY;
+
+struct _FSP_REPARSE_CACHE
+{
+    SRWLOCK Lock;
+    UINT32 Timeout;
+    LONG volatile Generation;
+    FSP_REPARSE_CACHE_ENTRY *Buckets[FspReparseCacheBucketCount];
+};
+
+NTSTATUS FspReparseCacheCreate(const FSP_FSCTL_VOLUME_PARAMS *VolumeParams,
+    FSP_REPARSE_CACHE **PReparseCache)
+{
+    FSP_REPARSE_CACHE *ReparseCache;
+
+    *PReparseCache = 0;
+
+    if (!VolumeParams->UmReparseCache ||
+        !VolumeParams->ReparsePoints || 0 == VolumeParams->FileInfoTimeout)
+        return STATUS_SUCCESS;
+
+    ReparseCache = MemAlloc(sizeof *ReparseCache);
+    if (0 == ReparseCache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(ReparseCache, 0, sizeof *ReparseCache);
+    InitializeSRWLock(&ReparseCache->Lock);
+    ReparseCache->Timeout = FspReparseCacheTimeoutMax > VolumeParams->FileInfoTimeout ?
+        VolumeParams->FileInfoTimeout : FspReparseCacheTimeoutMax;
+
+    *PReparseCache = ReparseCache;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspReparseCacheDelete(FSP_REPARSE_CACHE *ReparseCache)
+{
+    if (0 == ReparseCache)
+        return;
+
+    for (ULONG Index = 0; FspReparseCacheBucketCount > Index; Index++)
+        MemFree(ReparseCache->Buckets[Index]);
+
+    MemFree(ReparseCache);
+}
+
+VOID FspReparseCacheInvalidate(FSP_REPARSE_CACHE *ReparseCache)
+{
+    if (0 == ReparseCache)
+        return;
+
+    InterlockedIncrement(&ReparseCache->Generation);
+}
+
+static inline ULONG FspReparseCacheHash(PWSTR FileName, ULONG FileNameLength,
+    UINT32 ReparsePointIndex)
+{
+    /* FNV-1a */
+    ULONG Hash = 2166136261;
+    for (ULONG Index = 0; FileNameLength > Index; Index++)
+        Hash = (Hash ^ FileName[Index]) * 16777619;
+    Hash = (Hash ^ ReparsePointIndex) * 16777619;
+    return Hash % FspReparseCacheBucketCount;
+}
+
+static BOOLEAN FspReparseCacheLookup(FSP_REPARSE_CACHE *ReparseCache, LONG Generation,
+    NTSTATUS (*GetReparsePointByName)(),
+    PWSTR FileName, ULONG FileNameLength, UINT32 ReparsePointIndex, BOOLEAN ResolveLastPathComponent,
+    PIO_STATUS_BLOCK PIoStatus, PVOID Buffer, PSIZE_T PSize)
+{
+    FSP_REPARSE_CACHE_ENTRY *Entry;
+    ULONG Index = FspReparseCacheHash(FileName, FileNameLength, ReparsePointIndex);
+    BOOLEAN Result = FALSE;
+
+    AcquireSRWLockShared(&ReparseCache->Lock);
+    Entry = ReparseCache->Buckets[Index];
+    if (0 != Entry &&
+        Generation == Entry->Generation &&
+        GetTickCount64() < Entry->ExpirationTime &&
+        GetReparsePointByName == Entry->GetReparsePointByName &&
+        ReparsePointIndex == Entry->ReparsePointIndex &&
+        ResolveLastPathComponent == Entry->ResolveLastPathComponent &&
+        FileNameLength == Entry->FileNameLength &&
+        0 == memcmp(FileName, Entry->Buffer, FileNameLength * sizeof(WCHAR)) &&
+        Entry->Size <= *PSize)
+    {
+        *PSize = Entry->Size;
+        memcpy(Buffer,
+            (PUINT8)Entry->Buffer + FSP_FSCTL_DEFAULT_ALIGN_UP(FileNameLength * sizeof(WCHAR)),
+            Entry->Size);
+        PIoStatus->Status = STATUS_REPARSE;
+        PIoStatus->Information = Entry->Information;
+        Result = TRUE;
+    }
+    ReleaseSRWLockShared(&ReparseCache->Lock);
+
+    return Result;
+}
+
+static VOID FspReparseCacheInsert(FSP_REPARSE_CACHE *ReparseCache, LONG Generation,
+    NTSTATUS (*GetReparsePointByName)(),
+    PWSTR FileName, ULONG FileNameLength, UINT32 ReparsePointIndex, BOOLEAN ResolveLastPathComponent,
+    PIO_STATUS_BLOCK PIoStatus, PVOID Buffer, SIZE_T Size)
+{
+    FSP_REPARSE_CACHE_ENTRY *Entry, *OldEntry;
+    ULONG Index = FspReparseCacheHash(FileName, FileNameLength, ReparsePointIndex);
+    SIZE_T FileNameSize = FSP_FSCTL_DEFAULT_ALIGN_UP(FileNameLength * sizeof(WCHAR));
+
+    Entry = MemAlloc(sizeof *Entry + FileNameSize + Size);
+    if (0 == Entry)
+        return; /* just do not cache */
+
+    Entry->GetReparsePointByName = GetReparsePointByName;
+    Entry->Generation = Generation;
+    Entry->ExpirationTime = GetTickCount64() + ReparseCache->Timeout;
+    Entry->ReparsePointIndex = ReparsePointIndex;
+    Entry->ResolveLastPathComponent = ResolveLastPathComponent;
+    Entry->Information = PIoStatus->Information;
+    Entry->FileNameLength = FileNameLength;
+    Entry->Size = Size;
+    memcpy(Entry->Buffer, FileName, FileNameLength * sizeof(WCHAR));
+    memcpy((PUINT8)Entry->Buffer + FileNameSize, Buffer, Size);
+
+    AcquireSRWLockExclusive(&ReparseCache->Lock);
+    OldEntry = ReparseCache->Buckets[Index];
+    ReparseCache->Buckets[Index] = Entry;
+    ReleaseSRWLockExclusive(&ReparseCache->Lock);
+
+    MemFree(OldEntry);
+}
+
 FSP_API NTSTATUS FspFileSystemResolveReparsePoints(FSP_FILE_SYSTEM *FileSystem,
     NTSTATUS (*GetReparsePointByName)(
         FSP_FILE_SYSTEM *FileSystem, PVOID Context,
@@ -1762,10 +2370,30 @@ FSP_API NTSTATUS FspFileSystemResolveReparsePoints(FSP_FILE_SYSTEM *FileSystem,
     PWSTR FileName, UINT32 ReparsePointIndex, BOOLEAN ResolveLastPathComponent,
     PIO_STATUS_BLOCK PIoStatus, PVOID Buffer, PSIZE_T PSize)
 {
+    FSP_REPARSE_CACHE *ReparseCache = 0 != FileSystem && 0 == Context ?
+        FileSystem->ReparseCache : 0;
+    LONG ReparseCacheGeneration = 0;
+    ULONG FileNameLength = 0;
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext;
     PREPARSE_DATA_BUFFER ReparseData;
     NTSTATUS Result;
 
-    ReparseData = MemAlloc(FSP_FSCTL_TRANSACT_RSP_BUFFER_SIZEMAX);
+    if (0 != ReparseCache)
+    {
+        /* read the generation first; anything that changes after this makes our entry stale */
+        ReparseCacheGeneration = ReparseCache->Generation;
+        MemoryBarrier();
+
+        FileNameLength = lstrlenW(FileName);
+        if (FspReparseCacheLookup(ReparseCache, ReparseCacheGeneration,
+            (NTSTATUS (*)())GetReparsePointByName,
+            FileName, FileNameLength, ReparsePointIndex, ResolveLastPathComponent,
+            PIoStatus, Buffer, PSize))
+            return STATUS_REPARSE;
+    }
+
+    DispatcherContext = FspFileSystemGetDispatcherContext();
+    ReparseData = FspScratchAlloc(DispatcherContext, FSP_FSCTL_TRANSACT_RSP_BUFFER_SIZEMAX);
     if (0 == ReparseData)
         return STATUS_INSUFFICIENT_RESOURCES;
 
@@ -1775,7 +2403,13 @@ FSP_API NTSTATUS FspFileSystemResolveReparsePoints(FSP_FILE_SYSTEM *FileSystem,
         FileName, ReparsePointIndex, ResolveLastPathComponent,
         PIoStatus, Buffer, PSize);
 
-    MemFree(ReparseData);
+    FspScratchFree(DispatcherContext, ReparseData);
+
+    if (STATUS_REPARSE == Result && 0 != ReparseCache)
+        FspReparseCacheInsert(ReparseCache, ReparseCacheGeneration,
+            (NTSTATUS (*)())GetReparsePointByName,
+            FileName, FileNameLength, ReparsePointIndex, ResolveLastPathComponent,
+            PIoStatus, Buffer, *PSize);
 
     return Result;
 }
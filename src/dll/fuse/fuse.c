@@ -66,7 +66,8 @@ static struct fuse_opt fsp_fuse_core_opts[] =
     FSP_FUSE_CORE_OPT("attr_timeout=", set_attr_timeout, 1),
     FSP_FUSE_CORE_OPT("attr_timeout=%d", attr_timeout, 0),
     FUSE_OPT_KEY("ac_attr_timeout", FUSE_OPT_KEY_DISCARD),
-    FUSE_OPT_KEY("negative_timeout", FUSE_OPT_KEY_DISCARD),
+    FSP_FUSE_CORE_OPT("negative_timeout=", set_negative_timeout, 1),
+    FSP_FUSE_CORE_OPT("negative_timeout=%d", negative_timeout, 0),
     FUSE_OPT_KEY("noforget", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("intr", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("intr_signal=", FUSE_OPT_KEY_DISCARD),
@@ -88,6 +89,8 @@ static struct fuse_opt fsp_fuse_core_opts[] =
     FSP_FUSE_CORE_OPT("VolumeSerialNumber=%lx", VolumeParams.VolumeSerialNumber, 0),
     FSP_FUSE_CORE_OPT("FileInfoTimeout=", set_FileInfoTimeout, 1),
     FSP_FUSE_CORE_OPT("FileInfoTimeout=%d", VolumeParams.FileInfoTimeout, 0),
+    FSP_FUSE_CORE_OPT("NegativeLookupTimeout=", set_NegativeLookupTimeout, 1),
+    FSP_FUSE_CORE_OPT("NegativeLookupTimeout=%d", VolumeParams.NegativeLookupTimeout, 0),
     FSP_FUSE_CORE_OPT("DirInfoTimeout=", set_DirInfoTimeout, 1),
     FSP_FUSE_CORE_OPT("DirInfoTimeout=%d", VolumeParams.DirInfoTimeout, 0),
     FSP_FUSE_CORE_OPT("EaTimeout=", set_EaTimeout, 1),
@@ -264,6 +267,7 @@ static int fsp_fuse_core_opt_proc(void *opt_data0, const char *arg, int key,
             FSP_FUSE_LIBRARY_NAME " advanced options:\n"
             "    -o FileInfoTimeout=N       metadata timeout (millis, -1 for data caching)\n"
             "    -o DirInfoTimeout=N        directory info timeout (millis)\n"
+            "    -o NegativeLookupTimeout=N lookup miss cache timeout (millis)\n"
             "    -o EaTimeout=N             extended attribute timeout (millis)\n"
             "    -o VolumeInfoTimeout=N     volume info timeout (millis)\n"
             "    -o KeepFileCache           do not discard cache when files are closed\n"
@@ -403,6 +407,8 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
 
     if (!opt_data.set_FileInfoTimeout && opt_data.set_attr_timeout)
         opt_data.VolumeParams.FileInfoTimeout = opt_data.attr_timeout * 1000;
+    if (!opt_data.set_NegativeLookupTimeout && opt_data.set_negative_timeout)
+        opt_data.VolumeParams.NegativeLookupTimeout = opt_data.negative_timeout * 1000;
     if (opt_data.set_DirInfoTimeout)
         opt_data.VolumeParams.DirInfoTimeoutValid = 1;
     if (opt_data.set_EaTimeout)
@@ -420,6 +426,8 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
     opt_data.VolumeParams.ReadOnlyVolume = FALSE;
     opt_data.VolumeParams.PostCleanupWhenModifiedOnly = TRUE;
     opt_data.VolumeParams.PassQueryDirectoryFileName = TRUE;
+    /* let the directory buffer filter by pattern unless the kernel caches full listings */
+    opt_data.VolumeParams.PassQueryDirectoryPattern = !opt_data.set_DirInfoTimeout;
     opt_data.VolumeParams.DeviceControl = TRUE;
     opt_data.VolumeParams.UmFileContextIsUserContext2 = TRUE;
     if (L'\0' == opt_data.VolumeParams.FileSystemName[0])
@@ -430,6 +438,7 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
         goto fail;
 
     f->env = env;
+    InitializeSRWLock(&f->DirIndexLock);
     f->set_umask = opt_data.set_umask; f->umask = opt_data.umask;
     f->set_create_umask = opt_data.set_create_umask; f->create_umask = opt_data.create_umask;
     f->set_create_file_umask = opt_data.set_create_file_umask; f->create_file_umask = opt_data.create_file_umask;
@@ -682,6 +682,102 @@ static NTSTATUS fsp_fuse_intf_SetEaEntry(
     FSP_FILE_SYSTEM *FileSystem, PVOID Context,
     PFILE_FULL_EA_INFORMATION SingleEa);
 
+/*
+ * Directory index
+ *
+ * GetDirInfoByName must return the file name with its proper case. On case-insensitive
+ * volumes we cannot get this from FUSE (Windows sends us an uppercase name), so we look
+ * up the name in the directory buffer of a recent enumeration of the same directory.
+ * Such directory buffers are kept in a small per-volume table indexed by POSIX path.
+ *
+ * An index is valid until FileInfoTimeout (or DirInfoTimeout if set) expires, or until
+ * any name is created, renamed or deleted through this volume.
+ */
+
+static inline UINT64 fsp_fuse_intf_DirIndexTimeout(struct fuse *f)
+{
+    return f->VolumeParams.DirInfoTimeoutValid ?
+        f->VolumeParams.DirInfoTimeout : f->VolumeParams.FileInfoTimeout;
+}
+
+static inline ULONG fsp_fuse_intf_DirIndexSlot(const char *PosixPath)
+{
+    /* FNV-1a */
+    ULONG Hash = 2166136261;
+    for (; '\0' != *PosixPath; PosixPath++)
+        Hash = (Hash ^ (UINT8)*PosixPath) * 16777619;
+    return Hash % FSP_FUSE_DIR_INDEX_COUNT;
+}
+
+static inline VOID fsp_fuse_intf_InvalidateDirIndex(struct fuse *f)
+{
+    InterlockedIncrement(&f->DirIndexGeneration);
+}
+
+static BOOLEAN fsp_fuse_intf_FindDirIndex(struct fuse *f, const char *PosixPath,
+    PWSTR FileName, FSP_FSCTL_DIR_INFO *DirInfo, PBOOLEAN PFound)
+{
+    struct fsp_fuse_dir_index *DirIndex = &f->DirIndex[fsp_fuse_intf_DirIndexSlot(PosixPath)];
+    BOOLEAN Valid = FALSE;
+
+    AcquireSRWLockShared(&f->DirIndexLock);
+    if (0 != DirIndex->PosixPath &&
+        f->DirIndexGeneration == DirIndex->Generation &&
+        GetTickCount64() < DirIndex->ExpirationTime &&
+        0 == invariant_strcmp(PosixPath, DirIndex->PosixPath))
+    {
+        Valid = TRUE;
+        *PFound = FspFileSystemFindDirectoryBuffer(&DirIndex->DirBuffer,
+            FileName, !f->VolumeParams.CaseSensitiveSearch, DirInfo);
+    }
+    ReleaseSRWLockShared(&f->DirIndexLock);
+
+    return Valid;
+}
+
+static VOID fsp_fuse_intf_DonateDirIndex(struct fuse *f,
+    struct fsp_fuse_file_desc *filedesc)
+{
+    struct fsp_fuse_dir_index *DirIndex;
+    UINT64 Timeout = fsp_fuse_intf_DirIndexTimeout(f);
+    char *PosixPath;
+    ULONG Size;
+
+    if (f->VolumeParams.CaseSensitiveSearch || 0 == filedesc->DirBuffer || 0 == Timeout ||
+        f->DirIndexGeneration != filedesc->DirBufferGeneration ||
+        GetTickCount64() >= filedesc->DirBufferTime + Timeout)
+        return;
+
+    Size = lstrlenA(filedesc->PosixPath) + 1;
+    PosixPath = MemAlloc(Size);
+    if (0 == PosixPath)
+        return;
+    memcpy(PosixPath, filedesc->PosixPath, Size);
+
+    DirIndex = &f->DirIndex[fsp_fuse_intf_DirIndexSlot(PosixPath)];
+
+    AcquireSRWLockExclusive(&f->DirIndexLock);
+    MemFree(DirIndex->PosixPath);
+    FspFileSystemDeleteDirectoryBuffer(&DirIndex->DirBuffer);
+    DirIndex->PosixPath = PosixPath;
+    DirIndex->DirBuffer = filedesc->DirBuffer;
+    DirIndex->Generation = filedesc->DirBufferGeneration;
+    DirIndex->ExpirationTime = filedesc->DirBufferTime + Timeout;
+    ReleaseSRWLockExclusive(&f->DirIndexLock);
+
+    filedesc->DirBuffer = 0;
+}
+
+VOID fsp_fuse_intf_DeleteDirIndex(struct fuse *f)
+{
+    for (ULONG Index = 0; FSP_FUSE_DIR_INDEX_COUNT > Index; Index++)
+    {
+        MemFree(f->DirIndex[Index].PosixPath);
+        f->DirIndex[Index].PosixPath = 0;
+        FspFileSystemDeleteDirectoryBuffer(&f->DirIndex[Index].DirBuffer);
+    }
+}
+
 static NTSTATUS fsp_fuse_intf_GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_VOLUME_INFO *VolumeInfo)
 {
@@ -960,6 +1056,8 @@ exit:
         MemFree(filedesc);
     }
 
+    fsp_fuse_intf_InvalidateDirIndex(f);
+
     return Result;
 }
 
@@ -1165,6 +1263,7 @@ static VOID fsp_fuse_intf_Cleanup(FSP_FILE_SYSTEM *FileSystem,
      */
 
     if (Flags & FspCleanupDelete)
+    {
         if (filedesc->IsDirectory && !filedesc->IsReparsePoint)
         {
             if (0 != f->ops.rmdir)
@@ -1175,6 +1274,9 @@ static VOID fsp_fuse_intf_Cleanup(FSP_FILE_SYSTEM *FileSystem,
             if (0 != f->ops.unlink)
                 f->ops.unlink(filedesc->PosixPath);
         }
+
+        fsp_fuse_intf_InvalidateDirIndex(f);
+    }
 }
 
 static VOID fsp_fuse_intf_Close(FSP_FILE_SYSTEM *FileSystem,
@@ -1205,6 +1307,9 @@ static VOID fsp_fuse_intf_Close(FSP_FILE_SYSTEM *FileSystem,
             f->ops.release(filedesc->PosixPath, &fi);
     }
 
+    if (filedesc->IsDirectory)
+        fsp_fuse_intf_DonateDirIndex(f, filedesc);
+
     FspFileSystemDeleteDirectoryBuffer(&filedesc->DirBuffer);
     MemFree(filedesc->PosixPath);
     MemFree(filedesc);
@@ -1614,6 +1719,7 @@ static NTSTATUS fsp_fuse_intf_Rename(FSP_FILE_SYSTEM *FileSystem,
     }
 
     err = f->ops.rename(filedesc->PosixPath, contexthdr->PosixPath);
+    fsp_fuse_intf_InvalidateDirIndex(f);
     return fsp_fuse_ntstatus_from_errno(f->env, err);
 }
 
@@ -1860,48 +1966,63 @@ exit:
     return Result;
 }
 
-static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
-    PVOID FileDesc, PWSTR Pattern, PWSTR Marker,
-    PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
+static NTSTATUS fsp_fuse_intf_FillDirBuffer(FSP_FILE_SYSTEM *FileSystem,
+    struct fsp_fuse_file_desc *filedesc)
 {
+    /* assume that FspFileSystemAcquireDirectoryBuffer has been called */
+
     struct fuse *f = FileSystem->UserContext;
-    struct fsp_fuse_file_desc *filedesc = FileDesc;
     struct fuse_dirhandle dh;
     struct fuse_file_info fi;
     int err;
     NTSTATUS Result;
 
-    if (FspFileSystemAcquireDirectoryBuffer(&filedesc->DirBuffer, 0 == Marker, &Result))
+    /* remember when the enumeration started; see fsp_fuse_intf_DonateDirIndex */
+    filedesc->DirBufferGeneration = f->DirIndexGeneration;
+    filedesc->DirBufferTime = GetTickCount64();
+    MemoryBarrier();
+
+    memset(&dh, 0, sizeof dh);
+    dh.filedesc = filedesc;
+    dh.FileSystem = FileSystem;
+    dh.ReaddirPlus = 0 != (f->conn_want & FSP_FUSE_CAP_READDIR_PLUS);
+    dh.Result = STATUS_SUCCESS;
+
+    if (0 != f->ops.readdir)
     {
-        memset(&dh, 0, sizeof dh);
-        dh.filedesc = filedesc;
-        dh.FileSystem = FileSystem;
-        dh.ReaddirPlus = 0 != (f->conn_want & FSP_FUSE_CAP_READDIR_PLUS);
-        dh.Result = STATUS_SUCCESS;
+        memset(&fi, 0, sizeof fi);
+        fi.flags = filedesc->OpenFlags;
+        fi.fh = filedesc->FileHandle;
 
-        if (0 != f->ops.readdir)
-        {
-            memset(&fi, 0, sizeof fi);
-            fi.flags = filedesc->OpenFlags;
-            fi.fh = filedesc->FileHandle;
+        err = f->ops.readdir(filedesc->PosixPath, &dh, fsp_fuse_intf_AddDirInfo, 0, &fi);
+        Result = fsp_fuse_ntstatus_from_errno(f->env, err);
+    }
+    else if (0 != f->ops.getdir)
+    {
+        err = f->ops.getdir(filedesc->PosixPath, &dh, fsp_fuse_intf_AddDirInfoOld);
+        Result = fsp_fuse_ntstatus_from_errno(f->env, err);
+    }
+    else
+        Result = STATUS_INVALID_DEVICE_REQUEST;
 
-            err = f->ops.readdir(filedesc->PosixPath, &dh, fsp_fuse_intf_AddDirInfo, 0, &fi);
-            Result = fsp_fuse_ntstatus_from_errno(f->env, err);
-        }
-        else if (0 != f->ops.getdir)
-        {
-            err = f->ops.getdir(filedesc->PosixPath, &dh, fsp_fuse_intf_AddDirInfoOld);
-            Result = fsp_fuse_ntstatus_from_errno(f->env, err);
-        }
-        else
-            Result = STATUS_INVALID_DEVICE_REQUEST;
+    if (NT_SUCCESS(Result))
+        Result = dh.Result;
 
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
+    PVOID FileDesc, PWSTR Pattern, PWSTR Marker,
+    PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
+{
+    struct fsp_fuse_file_desc *filedesc = FileDesc;
+    NTSTATUS Result;
+
+    if (FspFileSystemAcquireDirectoryBuffer(&filedesc->DirBuffer, 0 == Marker, &Result))
+    {
+        Result = fsp_fuse_intf_FillDirBuffer(FileSystem, filedesc);
         if (NT_SUCCESS(Result))
-        {
-            Result = dh.Result;
-            if (NT_SUCCESS(Result))
-                Result = fsp_fuse_intf_FixDirInfo(FileSystem, filedesc);
-        }
+            Result = fsp_fuse_intf_FixDirInfo(FileSystem, filedesc);
 
         FspFileSystemReleaseDirectoryBuffer(&filedesc->DirBuffer);
     }
@@ -1915,6 +2036,41 @@ static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS fsp_fuse_intf_GetDirInfoByNameIndexed(FSP_FILE_SYSTEM *FileSystem,
+    struct fsp_fuse_file_desc *filedesc, PWSTR FileName,
+    FSP_FSCTL_DIR_INFO *DirInfo)
+{
+    /*
+     * Find the name with its proper case in a directory index. If there is no valid
+     * index for this directory enumerate it (names only) and keep the result as the
+     * new index. Either way there is no need to stat every directory entry.
+     */
+
+    struct fuse *f = FileSystem->UserContext;
+    BOOLEAN Found = FALSE;
+    NTSTATUS Result;
+
+    if (fsp_fuse_intf_FindDirIndex(f, filedesc->PosixPath, FileName, DirInfo, &Found))
+        return Found ? STATUS_SUCCESS : STATUS_OBJECT_NAME_NOT_FOUND;
+
+    if (FspFileSystemAcquireDirectoryBuffer(&filedesc->DirBuffer, TRUE, &Result))
+    {
+        Result = fsp_fuse_intf_FillDirBuffer(FileSystem, filedesc);
+
+        FspFileSystemReleaseDirectoryBuffer(&filedesc->DirBuffer);
+    }
+
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    Found = FspFileSystemFindDirectoryBuffer(&filedesc->DirBuffer,
+        FileName, !f->VolumeParams.CaseSensitiveSearch, DirInfo);
+
+    fsp_fuse_intf_DonateDirIndex(f, filedesc);
+
+    return Found ? STATUS_SUCCESS : STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
 static NTSTATUS fsp_fuse_intf_GetDirInfoByName(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileDesc, PWSTR FileName,
     FSP_FSCTL_DIR_INFO *DirInfo)
@@ -1923,10 +2079,26 @@ static NTSTATUS fsp_fuse_intf_GetDirInfoByName(FSP_FILE_SYSTEM *FileSystem,
     struct fsp_fuse_file_desc *filedesc = FileDesc;
     char *PosixName = 0;
     char PosixPath[FSP_FSCTL_TRANSACT_PATH_SIZEMAX / sizeof(WCHAR)];
+    WCHAR FileNameBuf[255 + 1];
     int ParentLength, FSlashLength, PosixNameLength;
     UINT32 Uid, Gid, Mode;
     NTSTATUS Result;
 
+    if (!f->VolumeParams.CaseSensitiveSearch)
+    {
+        Result = fsp_fuse_intf_GetDirInfoByNameIndexed(FileSystem, filedesc, FileName, DirInfo);
+        if (!NT_SUCCESS(Result))
+        {
+            Result = STATUS_OBJECT_NAME_NOT_FOUND; //Result?
+            goto exit;
+        }
+
+        /* continue with the file name as found in the directory */
+        memcpy(FileNameBuf, DirInfo->FileNameBuf, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+        FileNameBuf[(DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO)) / sizeof(WCHAR)] = L'\0';
+        FileName = FileNameBuf;
+    }
+
     Result = FspPosixMapWindowsToPosixPath(FileName, &PosixName);
     if (!NT_SUCCESS(Result))
     {
@@ -1957,9 +2129,10 @@ static NTSTATUS fsp_fuse_intf_GetDirInfoByName(FSP_FILE_SYSTEM *FileSystem,
 
     /*
      * FUSE does not do FileName normalization; so just return the FileName as given to us!
+     * (On case-insensitive volumes this is the FileName as found in the directory index.)
      */
 
-    //memset(DirInfo->Padding, 0, sizeof DirInfo->Padding);
+    memset(DirInfo->Padding, 0, sizeof DirInfo->Padding);
     DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + lstrlenW(FileName) * sizeof(WCHAR));
     memcpy(DirInfo->FileNameBuf, FileName, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
 
@@ -94,14 +94,12 @@ static NTSTATUS fsp_fuse_loop_start(struct fuse *f)
         context->private_data = f->data = f->ops.init(&conn);
         f->VolumeParams.ReadOnlyVolume = 0 != (conn.want & FSP_FUSE_CAP_READ_ONLY);
         f->VolumeParams.CaseSensitiveSearch = 0 == (conn.want & FSP_FUSE_CAP_CASE_INSENSITIVE);
-        if (!f->VolumeParams.CaseSensitiveSearch)
-            /*
-             * Disable GetDirInfoByName when file system is case-insensitive.
-             * The reason is that Windows always sends us queries with uppercase
-             * file names in GetDirInfoByName and we have no way in FUSE to normalize
-             * those file names when embedding them in FSP_FSCTL_DIR_INFO.
-             */
-            f->VolumeParams.PassQueryDirectoryFileName = FALSE;
+        /*
+         * When the file system is case-insensitive Windows sends us queries with uppercase
+         * file names in GetDirInfoByName and we have no way in FUSE to normalize those file
+         * names when embedding them in FSP_FSCTL_DIR_INFO. GetDirInfoByName handles this
+         * by looking up the file name in a directory index (see fsp_fuse_intf_FindDirIndex).
+         */
         f->conn_want = conn.want;
     }
     f->fsinit = TRUE;
@@ -244,6 +242,8 @@ static void fsp_fuse_loop_cleanup(struct fuse *f)
         f->FileSystem = 0;
     }
 
+    fsp_fuse_intf_DeleteDirIndex(f);
+
     if (f->fsinit)
     {
         if (f->ops.destroy)
@@ -44,7 +44,16 @@
 #define NFS_SPECFILE_LNK                0x00000000014b4e4c
 #define NFS_SPECFILE_SOCK               0x000000004B434F53
 
+#define FSP_FUSE_DIR_INDEX_COUNT        16
+
 /* FUSE internal struct's */
+struct fsp_fuse_dir_index
+{
+    char *PosixPath;
+    PVOID DirBuffer;
+    LONG Generation;
+    UINT64 ExpirationTime;
+};
 struct fuse
 {
     struct fsp_fuse_env *env;
@@ -72,6 +81,9 @@ struct fuse
     FSP_FILE_SYSTEM *FileSystem;
     volatile int exited;
     struct fuse3 *fuse3;
+    SRWLOCK DirIndexLock;
+    LONG volatile DirIndexGeneration;
+    struct fsp_fuse_dir_index DirIndex[FSP_FUSE_DIR_INDEX_COUNT];
 };
 struct fsp_fuse_context_header
 {
@@ -85,6 +97,8 @@ struct fsp_fuse_file_desc
     int OpenFlags;
     UINT64 FileHandle;
     PVOID DirBuffer;
+    LONG DirBufferGeneration;
+    UINT64 DirBufferTime;
 };
 struct fuse_dirhandle
 {
@@ -145,9 +159,11 @@ struct fsp_fuse_core_opt_data
         set_uid, uid,
         set_gid, gid,
         set_attr_timeout, attr_timeout,
+        set_negative_timeout, negative_timeout,
         rellinks,
         dothidden;
     int set_FileInfoTimeout,
+        set_NegativeLookupTimeout,
         set_DirInfoTimeout,
         set_EaTimeout,
         set_VolumeInfoTimeout,
@@ -173,6 +189,7 @@ int fsp_fuse_intf_CanDeleteAddDirInfo(void *buf, const char *name,
     const struct fuse_stat *stbuf, fuse_off_t off);
 int fsp_fuse_intf_AddDirInfo(void *buf, const char *name,
     const struct fuse_stat *stbuf, fuse_off_t off);
+VOID fsp_fuse_intf_DeleteDirIndex(struct fuse *f);
 NTSTATUS fsp_fuse_get_token_uidgid(
     HANDLE Token,
     TOKEN_INFORMATION_CLASS UserOrOwnerClass, /* TokenUser|TokenOwner */
@@ -48,6 +48,7 @@ BOOL WINAPI DllMain(HINSTANCE Instance, DWORD Reason, PVOID Reserved)
         FspServiceFinalize(Dynamic);
         FspFileSystemFinalize(Dynamic);
         FspEventLogFinalize(Dynamic);
+        FspSecurityFinalize(Dynamic);
         FspPosixFinalize(Dynamic);
         FspWksidFinalize(Dynamic);
         break;
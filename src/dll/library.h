@@ -46,6 +46,7 @@
 
 VOID FspWksidFinalize(BOOLEAN Dynamic);
 VOID FspPosixFinalize(BOOLEAN Dynamic);
+VOID FspSecurityFinalize(BOOLEAN Dynamic);
 VOID FspEventLogFinalize(BOOLEAN Dynamic);
 VOID FspFileSystemFinalize(BOOLEAN Dynamic);
 VOID FspServiceFinalize(BOOLEAN Dynamic);
@@ -67,6 +68,54 @@ PWSTR FspDiagIdent(VOID);
 VOID FspFileSystemPeekInDirectoryBuffer(PVOID *PDirBuffer,
     PUINT8 *PBuffer, PULONG *PIndex, PULONG PCount);
 
+typedef struct _FSP_FILE_SYSTEM_DISPATCHER_CONTEXT FSP_FILE_SYSTEM_DISPATCHER_CONTEXT;
+FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *FspFileSystemGetDispatcherContext(VOID);
+PVOID FspScratchAlloc(FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext, SIZE_T Size);
+VOID FspScratchFree(FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext, PVOID Pointer);
+
+NTSTATUS FspFileSystemOpCreateInternal(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
+BOOLEAN FspFileSystemOpCanVectorize(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request0, FSP_FSCTL_TRANSACT_REQ *Request);
+NTSTATUS FspFileSystemOpReadWriteV(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ **Requests, FSP_FSCTL_TRANSACT_RSP **Responses, ULONG Count);
+NTSTATUS FspFileSystemOpCleanupV(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ **Requests, FSP_FSCTL_TRANSACT_RSP **Responses, ULONG Count);
+/* one WCHAR over FSP_FSCTL_TRANSACT_PATH_SIZEMAX, so that an unset NormalizedNameSize is ignored */
+#define FSP_FILE_SYSTEM_CREATE_NAME_SIZE (FSP_FSCTL_TRANSACT_PATH_SIZEMAX + sizeof(WCHAR))
+ULONG FspFileSystemOpCreateMany(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
+    FSP_FSCTL_TRANSACT_REQ **Requests, FSP_FSCTL_TRANSACT_RSP *Response,
+    FSP_FILE_SYSTEM_CREATE_ENTRY *Entries, PWSTR NameBuf, ULONG Count);
+VOID FspFileSystemOpCreateManyResponse(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response,
+    FSP_FILE_SYSTEM_CREATE_ENTRY *Entry);
+
+typedef struct _FSP_TRAVERSE_CACHE FSP_TRAVERSE_CACHE;
+NTSTATUS FspTraverseCacheCreate(const FSP_FSCTL_VOLUME_PARAMS *VolumeParams,
+    FSP_TRAVERSE_CACHE **PTraverseCache);
+VOID FspTraverseCacheDelete(FSP_TRAVERSE_CACHE *TraverseCache);
+VOID FspTraverseCacheInvalidate(FSP_TRAVERSE_CACHE *TraverseCache);
+typedef struct _FSP_REPARSE_CACHE FSP_REPARSE_CACHE;
+NTSTATUS FspReparseCacheCreate(const FSP_FSCTL_VOLUME_PARAMS *VolumeParams,
+    FSP_REPARSE_CACHE **PReparseCache);
+VOID FspReparseCacheDelete(FSP_REPARSE_CACHE *ReparseCache);
+VOID FspReparseCacheInvalidate(FSP_REPARSE_CACHE *ReparseCache);
+typedef struct _FSP_NEGATIVE_CACHE FSP_NEGATIVE_CACHE;
+NTSTATUS FspNegativeCacheCreate(const FSP_FSCTL_VOLUME_PARAMS *VolumeParams,
+    FSP_NEGATIVE_CACHE **PNegativeCache);
+VOID FspNegativeCacheDelete(FSP_NEGATIVE_CACHE *NegativeCache);
+VOID FspNegativeCacheInvalidate(FSP_NEGATIVE_CACHE *NegativeCache);
+VOID FspNegativeCacheInvalidateDirectory(FSP_NEGATIVE_CACHE *NegativeCache, PWSTR FileName);
+NTSTATUS FspAccessCheckScratch(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    BOOLEAN CheckParentOrMain, BOOLEAN AllowTraverseCheck,
+    UINT32 DesiredAccess, PUINT32 PGrantedAccess,
+    PSECURITY_DESCRIPTOR *PSecurityDescriptor);
+BOOLEAN FspPathIsEqual(PWSTR A, PWSTR B, ULONG Length, BOOLEAN IgnoreCase);
+
 BOOL WINAPI FspServiceConsoleCtrlHandler(DWORD CtrlType);
 
 static inline ULONG FspPathSuffixIndex(PWSTR FileName)
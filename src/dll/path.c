@@ -73,3 +73,211 @@ FSP_API VOID FspPathCombine(PWSTR Prefix, PWSTR Suffix)
         if (L'\0' == *Prefix)
             *Prefix = L'\\';
 }
+
+/*
+ * Wildcard matching
+ *
+ * FspPathIsNameInExpression implements the semantics of FsRtlIsNameInExpression:
+ *
+ * - '*' matches zero or more characters.
+ * - '?' matches exactly one character.
+ * - DOS_STAR ('<') matches zero or more characters, but never the last '.' in the name.
+ * - DOS_QM ('>') matches one character; at a '.' or at the end of the name it matches nothing.
+ * - DOS_DOT ('"') matches a '.'; at the end of the name it matches nothing.
+ *
+ * Matching is done by simulating the expression as an NFA over the name, so that the cost
+ * is O(ExpressionLength * NameLength) with no backtracking. Before that, a literal prefix is
+ * compared directly and the very common "*literal" form (e.g. "*.obj") is answered by a
+ * single suffix comparison.
+ */
+#define FspPathExpressionStateMax       256
+
+static INIT_ONCE FspPathInitOnce = INIT_ONCE_STATIC_INIT;
+static WCHAR (NTAPI *FspRtlUpcaseUnicodeChar)(WCHAR SourceCharacter);
+
+static BOOL WINAPI FspPathInitialize(
+    PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context)
+{
+    HANDLE Handle;
+
+    Handle = GetModuleHandleW(L"ntdll.dll");
+    if (0 != Handle)
+        FspRtlUpcaseUnicodeChar = (PVOID)GetProcAddress(Handle, "RtlUpcaseUnicodeChar");
+
+    return TRUE;
+}
+
+static inline WCHAR FspPathUpcase(WCHAR C)
+{
+    if (0x80 > C)
+        return (WCHAR)invariant_toupper(C);
+    return 0 != FspRtlUpcaseUnicodeChar ? FspRtlUpcaseUnicodeChar(C) : C;
+}
+
+static inline BOOLEAN FspPathIsWild(WCHAR C)
+{
+    return L'*' == C || L'?' == C || L'<' == C || L'>' == C || L'"' == C;
+}
+
+static inline BOOLEAN FspPathEqual(PWSTR A, PWSTR B, ULONG Length, BOOLEAN IgnoreCase)
+{
+    if (!IgnoreCase)
+        return 0 == memcmp(A, B, Length * sizeof(WCHAR));
+
+    for (ULONG Index = 0; Length > Index; Index++)
+        if (A[Index] != B[Index] && FspPathUpcase(A[Index]) != FspPathUpcase(B[Index]))
+            return FALSE;
+    return TRUE;
+}
+
+BOOLEAN FspPathIsEqual(PWSTR A, PWSTR B, ULONG Length, BOOLEAN IgnoreCase)
+{
+    if (IgnoreCase)
+        InitOnceExecuteOnce(&FspPathInitOnce, FspPathInitialize, 0, 0);
+
+    return FspPathEqual(A, B, Length, IgnoreCase);
+}
+
+static inline VOID FspPathExpressionClosure(PWSTR Expression, ULONG ExpressionLength,
+    PUINT8 State, BOOLEAN EndOfName, BOOLEAN AtDot)
+{
+    /* epsilon transitions only move forward, so one ascending pass suffices */
+    for (ULONG Index = 0; ExpressionLength > Index; Index++)
+        if (State[Index])
+            switch (Expression[Index])
+            {
+            case L'*':
+            case L'<':
+                State[Index + 1] = 1;
+                break;
+            case L'>':
+                if (EndOfName || AtDot)
+                    State[Index + 1] = 1;
+                break;
+            case L'"':
+                if (EndOfName)
+                    State[Index + 1] = 1;
+                break;
+            }
+}
+
+static BOOLEAN FspPathExpressionMatch(PWSTR Expression, ULONG ExpressionLength,
+    PWSTR Name, ULONG NameLength, BOOLEAN IgnoreCase, PUINT8 State, PUINT8 NextState)
+{
+    ULONG LastDot = (ULONG)-1;
+    WCHAR C, E;
+    BOOLEAN Match;
+
+    for (ULONG NameIndex = 0; NameLength > NameIndex; NameIndex++)
+        if (L'.' == Name[NameIndex])
+            LastDot = NameIndex;
+
+    memset(State, 0, ExpressionLength + 1);
+    State[0] = 1;
+
+    for (ULONG NameIndex = 0; NameLength > NameIndex; NameIndex++)
+    {
+        C = Name[NameIndex];
+        FspPathExpressionClosure(Expression, ExpressionLength, State, FALSE, L'.' == C);
+
+        Match = FALSE;
+        memset(NextState, 0, ExpressionLength + 1);
+        for (ULONG Index = 0; ExpressionLength > Index; Index++)
+        {
+            if (!State[Index])
+                continue;
+
+            E = Expression[Index];
+            switch (E)
+            {
+            case L'*':
+                Match = NextState[Index] = 1;
+                break;
+            case L'<':
+                if (LastDot != NameIndex)
+                    Match = NextState[Index] = 1;
+                break;
+            case L'?':
+                Match = NextState[Index + 1] = 1;
+                break;
+            case L'>':
+                if (L'.' != C)
+                    Match = NextState[Index + 1] = 1;
+                break;
+            case L'"':
+                if (L'.' == C)
+                    Match = NextState[Index + 1] = 1;
+                break;
+            default:
+                if (E == C || (IgnoreCase && FspPathUpcase(E) == FspPathUpcase(C)))
+                    Match = NextState[Index + 1] = 1;
+                break;
+            }
+        }
+
+        if (!Match)
+            return FALSE;
+
+        PUINT8 Temp = State; State = NextState; NextState = Temp;
+    }
+
+    FspPathExpressionClosure(Expression, ExpressionLength, State, TRUE, FALSE);
+
+    return !!State[ExpressionLength];
+}
+
+FSP_API BOOLEAN FspPathIsNameInExpression(
+    PWSTR Expression, ULONG ExpressionLength,
+    PWSTR Name, ULONG NameLength,
+    BOOLEAN IgnoreCase)
+{
+    UINT8 StateBuf[2 * (FspPathExpressionStateMax + 1)];
+    PUINT8 State;
+    ULONG Index, LiteralIndex;
+    BOOLEAN Result;
+
+    if (IgnoreCase)
+        InitOnceExecuteOnce(&FspPathInitOnce, FspPathInitialize, 0, 0);
+
+    /* FsRtlIsNameInExpression: an empty name or expression only matches its own kind */
+    if (0 == ExpressionLength || 0 == NameLength)
+        return ExpressionLength == NameLength;
+
+    /* literal prefix */
+    for (Index = 0; ExpressionLength > Index && !FspPathIsWild(Expression[Index]); Index++)
+        ;
+    if (Index > NameLength || !FspPathEqual(Expression, Name, Index, IgnoreCase))
+        return FALSE;
+    Expression += Index, ExpressionLength -= Index;
+    Name += Index, NameLength -= Index;
+    if (0 == ExpressionLength)
+        return 0 == NameLength;
+
+    /* "*literal" */
+    if (L'*' == Expression[0])
+    {
+        for (LiteralIndex = 1;
+            ExpressionLength > LiteralIndex && !FspPathIsWild(Expression[LiteralIndex]);
+            LiteralIndex++)
+            ;
+        if (ExpressionLength == LiteralIndex)
+        {
+            Index = ExpressionLength - 1;
+            return Index <= NameLength &&
+                FspPathEqual(Expression + 1, Name + NameLength - Index, Index, IgnoreCase);
+        }
+    }
+
+    if (FspPathExpressionStateMax >= ExpressionLength)
+        return FspPathExpressionMatch(Expression, ExpressionLength, Name, NameLength, IgnoreCase,
+            StateBuf, StateBuf + FspPathExpressionStateMax + 1);
+
+    State = MemAlloc(2 * (ExpressionLength + 1));
+    if (0 == State)
+        return TRUE; /* cannot tell: do not filter the name out */
+    Result = FspPathExpressionMatch(Expression, ExpressionLength, Name, NameLength, IgnoreCase,
+        State, State + ExpressionLength + 1);
+    MemFree(State);
+
+    return Result;
+}
@@ -34,30 +34,645 @@ FSP_API PGENERIC_MAPPING FspGetFileGenericMapping(VOID)
     return &FspFileGenericMapping;
 }
 
+/*
+ * Negative lookup cache
+ *
+ * Remembers the names for which GetSecurityByName returned STATUS_OBJECT_NAME_NOT_FOUND,
+ * so that repeated probes for files that do not exist (include paths, PATH searches, etc.)
+ * do not reach the file system. It is opt-in (FSP_FSCTL_VOLUME_PARAMS::NegativeLookupTimeout)
+ * and entries expire after that timeout, which bounds staleness for names created behind
+ * the dispatcher's back.
+ *
+ * Entries are keyed by the exact name and are stamped with two generations: a global one,
+ * bumped by operations that can change what a path resolves to (Rename, reparse point
+ * changes), and one for the parent directory, bumped when a file is created in it.
+ * Directory generations live in a small table indexed by a hash of the directory name;
+ * on case-insensitive volumes only ASCII characters (upper-cased) enter this hash, so that
+ * all case variants of a directory share a generation. Collisions only cause spurious
+ * invalidations.
+ */
+#define FspNegativeCacheBucketCount     1024
+#define FspNegativeCacheDirectoryCount  256
+
+typedef struct _FSP_NEGATIVE_CACHE_ENTRY
+{
+    LONG Generation, DirectoryGeneration;
+    UINT64 ExpirationTime;
+    ULONG PathLength;
+    WCHAR Path[];
+} FSP_NEGATIVE_CACHE_ENTRY;
+
+struct _FSP_NEGATIVE_CACHE
+{
+    SRWLOCK Lock;
+    UINT32 Timeout;
+    BOOLEAN CaseInsensitive;
+    LONG volatile Generation;
+    LONG volatile DirectoryGeneration[FspNegativeCacheDirectoryCount];
+    FSP_NEGATIVE_CACHE_ENTRY *Buckets[FspNegativeCacheBucketCount];
+};
+
+NTSTATUS FspNegativeCacheCreate(const FSP_FSCTL_VOLUME_PARAMS *VolumeParams,
+    FSP_NEGATIVE_CACHE **PNegativeCache)
+{
+    FSP_NEGATIVE_CACHE *NegativeCache;
+
+    *PNegativeCache = 0;
+
+    if (sizeof(FSP_FSCTL_VOLUME_PARAMS_V0) >= VolumeParams->Version ||
+        0 == VolumeParams->NegativeLookupTimeout)
+        return STATUS_SUCCESS;
+
+    NegativeCache = MemAlloc(sizeof *NegativeCache);
+    if (0 == NegativeCache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(NegativeCache, 0, sizeof *NegativeCache);
+    InitializeSRWLock(&NegativeCache->Lock);
+    NegativeCache->Timeout = VolumeParams->NegativeLookupTimeout;
+    NegativeCache->CaseInsensitive = !VolumeParams->CaseSensitiveSearch;
+
+    *PNegativeCache = NegativeCache;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspNegativeCacheDelete(FSP_NEGATIVE_CACHE *NegativeCache)
+{
+    if (0 == NegativeCache)
+        return;
+
+    for (ULONG Index = 0; FspNegativeCacheBucketCount > Index; Index++)
+        MemFree(NegativeCache->Buckets[Index]);
+
+    MemFree(NegativeCache);
+}
+
+VOID FspNegativeCacheInvalidate(FSP_NEGATIVE_CACHE *NegativeCache)
+{
+    if (0 == NegativeCache)
+        return;
+
+    InterlockedIncrement(&NegativeCache->Generation);
+}
+
+static ULONG FspNegativeCacheDirectoryIndex(FSP_NEGATIVE_CACHE *NegativeCache,
+    PWSTR FileName, PULONG PFileNameLength)
+{
+    /* FNV-1a over the parent directory name */
+    ULONG Hash = 2166136261;
+    ULONG Index, DirectoryLength = 0;
+    WCHAR C;
+
+    for (Index = 0; L'\0' != FileName[Index]; Index++)
+        if (L'\\' == FileName[Index])
+            DirectoryLength = Index;
+
+    for (Index = 0; DirectoryLength > Index; Index++)
+    {
+        C = FileName[Index];
+        if (NegativeCache->CaseInsensitive)
+        {
+            if (0x80 <= C)
+                continue;
+            if (L'a' <= C && C <= L'z')
+                C -= L'a' - L'A';
+        }
+        Hash = (Hash ^ C) * 16777619;
+    }
+
+    if (0 != PFileNameLength)
+        *PFileNameLength = Index;
+
+    return Hash % FspNegativeCacheDirectoryCount;
+}
+
+VOID FspNegativeCacheInvalidateDirectory(FSP_NEGATIVE_CACHE *NegativeCache, PWSTR FileName)
+{
+    if (0 == NegativeCache)
+        return;
+
+    InterlockedIncrement(&NegativeCache->DirectoryGeneration[
+        FspNegativeCacheDirectoryIndex(NegativeCache, FileName, 0)]);
+}
+
+static inline ULONG FspNegativeCacheHash(PWSTR Path, ULONG PathLength)
+{
+    /* FNV-1a */
+    ULONG Hash = 2166136261;
+    for (ULONG Index = 0; PathLength > Index; Index++)
+        Hash = (Hash ^ Path[Index]) * 16777619;
+    return Hash % FspNegativeCacheBucketCount;
+}
+
+static BOOLEAN FspNegativeCacheLookup(FSP_NEGATIVE_CACHE *NegativeCache,
+    PWSTR FileName, PLONG PGeneration, PLONG PDirectoryGeneration)
+{
+    FSP_NEGATIVE_CACHE_ENTRY *Entry;
+    ULONG DirectoryIndex, PathLength, Index;
+    BOOLEAN Result = FALSE;
+
+    /* read the generations first; anything that changes after this makes our entry stale */
+    DirectoryIndex = FspNegativeCacheDirectoryIndex(NegativeCache, FileName, &PathLength);
+    *PGeneration = NegativeCache->Generation;
+    *PDirectoryGeneration = NegativeCache->DirectoryGeneration[DirectoryIndex];
+    MemoryBarrier();
+
+    Index = FspNegativeCacheHash(FileName, PathLength);
+
+    AcquireSRWLockShared(&NegativeCache->Lock);
+    Entry = NegativeCache->Buckets[Index];
+    if (0 != Entry &&
+        *PGeneration == Entry->Generation &&
+        *PDirectoryGeneration == Entry->DirectoryGeneration &&
+        GetTickCount64() < Entry->ExpirationTime &&
+        PathLength == Entry->PathLength &&
+        0 == memcmp(FileName, Entry->Path, PathLength * sizeof(WCHAR)))
+        Result = TRUE;
+    ReleaseSRWLockShared(&NegativeCache->Lock);
+
+    return Result;
+}
+
+static VOID FspNegativeCacheInsert(FSP_NEGATIVE_CACHE *NegativeCache,
+    PWSTR FileName, LONG Generation, LONG DirectoryGeneration)
+{
+    FSP_NEGATIVE_CACHE_ENTRY *Entry, *OldEntry;
+    ULONG PathLength = lstrlenW(FileName);
+    ULONG Index = FspNegativeCacheHash(FileName, PathLength);
+
+    Entry = MemAlloc(sizeof *Entry + PathLength * sizeof(WCHAR));
+    if (0 == Entry)
+        return; /* just do not cache */
+
+    Entry->Generation = Generation;
+    Entry->DirectoryGeneration = DirectoryGeneration;
+    Entry->ExpirationTime = (UINT32)-1 == NegativeCache->Timeout ?
+        (UINT64)-1LL : GetTickCount64() + NegativeCache->Timeout;
+    Entry->PathLength = PathLength;
+    memcpy(Entry->Path, FileName, PathLength * sizeof(WCHAR));
+
+    AcquireSRWLockExclusive(&NegativeCache->Lock);
+    OldEntry = NegativeCache->Buckets[Index];
+    NegativeCache->Buckets[Index] = Entry;
+    ReleaseSRWLockExclusive(&NegativeCache->Lock);
+
+    MemFree(OldEntry);
+}
+
 static NTSTATUS FspGetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     PWSTR FileName, PUINT32 PFileAttributes,
     PSECURITY_DESCRIPTOR *PSecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
 {
+    FSP_NEGATIVE_CACHE *NegativeCache = FileSystem->NegativeCache;
+    LONG Generation = 0, DirectoryGeneration = 0;
+
+    if (0 != NegativeCache)
+    {
+        /* named streams are not cached: their existence is not a property of the directory */
+        for (PWSTR P = FileName; L'\0' != *P; P++)
+            if (L':' == *P)
+            {
+                NegativeCache = 0;
+                break;
+            }
+
+        if (0 != NegativeCache &&
+            FspNegativeCacheLookup(NegativeCache, FileName, &Generation, &DirectoryGeneration))
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
     for (;;)
     {
         NTSTATUS Result = FileSystem->Interface->GetSecurityByName(FileSystem,
             FileName, PFileAttributes, *PSecurityDescriptor, PSecurityDescriptorSize);
+        if (STATUS_OBJECT_NAME_NOT_FOUND == Result && 0 != NegativeCache)
+            FspNegativeCacheInsert(NegativeCache, FileName, Generation, DirectoryGeneration);
         if (STATUS_BUFFER_OVERFLOW != Result)
             return Result;
 
-        MemFree(*PSecurityDescriptor);
-        *PSecurityDescriptor = MemAlloc(*PSecurityDescriptorSize);
+        FspScratchFree(DispatcherContext, *PSecurityDescriptor);
+        *PSecurityDescriptor = FspScratchAlloc(DispatcherContext, *PSecurityDescriptorSize);
         if (0 == *PSecurityDescriptor)
             return STATUS_INSUFFICIENT_RESOURCES;
     }
 }
 
-FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
+/*
+ * Traverse check cache
+ *
+ * Remembers the directories that a token was found able to traverse, so that
+ * FspAccessCheckEx does not have to fetch and check the security of every ancestor
+ * directory on every open. A directory is only added after all of its ancestors have
+ * passed the traverse check as well; so a hit on a directory vouches for the whole
+ * path up to and including it.
+ *
+ * Entries are keyed by the exact directory path (no case folding; a case-insensitive
+ * file system just sees fewer hits) and by the TokenId/ModifiedId of the token. They
+ * are dropped wholesale when the generation changes (SetSecurity, Rename, reparse point
+ * changes and deletes all bump it) and expire after the volume's security timeout,
+ * which is also how long the kernel caches security descriptors.
+ */
+#define FspTraverseCacheBucketCount     1024
+
+typedef struct _FSP_TRAVERSE_CACHE_ENTRY
+{
+    LUID TokenId, ModifiedId;
+    LONG Generation;
+    UINT64 ExpirationTime;
+    ULONG PathLength;
+    WCHAR Path[];
+} FSP_TRAVERSE_CACHE_ENTRY;
+
+struct _FSP_TRAVERSE_CACHE
+{
+    SRWLOCK Lock;
+    UINT32 Timeout;
+    LONG volatile Generation;
+    FSP_TRAVERSE_CACHE_ENTRY *Buckets[FspTraverseCacheBucketCount];
+};
+
+NTSTATUS FspTraverseCacheCreate(const FSP_FSCTL_VOLUME_PARAMS *VolumeParams,
+    FSP_TRAVERSE_CACHE **PTraverseCache)
+{
+    FSP_TRAVERSE_CACHE *TraverseCache;
+    UINT32 Timeout;
+
+    *PTraverseCache = 0;
+
+    Timeout = sizeof(FSP_FSCTL_VOLUME_PARAMS_V0) < VolumeParams->Version &&
+        VolumeParams->SecurityTimeoutValid ?
+        VolumeParams->SecurityTimeout : VolumeParams->FileInfoTimeout;
+    if (0 == Timeout)
+        /* file system does not want security cached: no traverse cache */
+        return STATUS_SUCCESS;
+
+    TraverseCache = MemAlloc(sizeof *TraverseCache);
+    if (0 == TraverseCache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(TraverseCache, 0, sizeof *TraverseCache);
+    InitializeSRWLock(&TraverseCache->Lock);
+    TraverseCache->Timeout = Timeout;
+
+    *PTraverseCache = TraverseCache;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspTraverseCacheDelete(FSP_TRAVERSE_CACHE *TraverseCache)
+{
+    if (0 == TraverseCache)
+        return;
+
+    for (ULONG Index = 0; FspTraverseCacheBucketCount > Index; Index++)
+        MemFree(TraverseCache->Buckets[Index]);
+
+    MemFree(TraverseCache);
+}
+
+VOID FspTraverseCacheInvalidate(FSP_TRAVERSE_CACHE *TraverseCache)
+{
+    if (0 == TraverseCache)
+        return;
+
+    InterlockedIncrement(&TraverseCache->Generation);
+}
+
+static inline ULONG FspTraverseCacheHash(PWSTR Path, ULONG PathLength,
+    PTOKEN_STATISTICS TokenStats)
+{
+    /* FNV-1a; the path is compared in full on lookup, so this only needs to spread */
+    ULONG Hash = 2166136261;
+    for (ULONG Index = 0; PathLength > Index; Index++)
+        Hash = (Hash ^ Path[Index]) * 16777619;
+    Hash = (Hash ^ TokenStats->TokenId.LowPart) * 16777619;
+    return Hash % FspTraverseCacheBucketCount;
+}
+
+static BOOLEAN FspTraverseCacheLookup(FSP_TRAVERSE_CACHE *TraverseCache, LONG Generation,
+    PTOKEN_STATISTICS TokenStats, PWSTR Path, ULONG PathLength)
+{
+    FSP_TRAVERSE_CACHE_ENTRY *Entry;
+    ULONG Index = FspTraverseCacheHash(Path, PathLength, TokenStats);
+    BOOLEAN Result = FALSE;
+
+    AcquireSRWLockShared(&TraverseCache->Lock);
+    Entry = TraverseCache->Buckets[Index];
+    if (0 != Entry &&
+        Generation == Entry->Generation &&
+        GetTickCount64() < Entry->ExpirationTime &&
+        0 == memcmp(&TokenStats->TokenId, &Entry->TokenId, sizeof Entry->TokenId) &&
+        0 == memcmp(&TokenStats->ModifiedId, &Entry->ModifiedId, sizeof Entry->ModifiedId) &&
+        PathLength == Entry->PathLength &&
+        0 == memcmp(Path, Entry->Path, PathLength * sizeof(WCHAR)))
+        Result = TRUE;
+    ReleaseSRWLockShared(&TraverseCache->Lock);
+
+    return Result;
+}
+
+static VOID FspTraverseCacheInsert(FSP_TRAVERSE_CACHE *TraverseCache, LONG Generation,
+    PTOKEN_STATISTICS TokenStats, PWSTR Path, ULONG PathLength)
+{
+    FSP_TRAVERSE_CACHE_ENTRY *Entry, *OldEntry;
+    ULONG Index = FspTraverseCacheHash(Path, PathLength, TokenStats);
+
+    Entry = MemAlloc(sizeof *Entry + PathLength * sizeof(WCHAR));
+    if (0 == Entry)
+        return; /* just do not cache */
+
+    Entry->TokenId = TokenStats->TokenId;
+    Entry->ModifiedId = TokenStats->ModifiedId;
+    Entry->Generation = Generation;
+    Entry->ExpirationTime = (UINT32)-1 == TraverseCache->Timeout ?
+        (UINT64)-1LL : GetTickCount64() + TraverseCache->Timeout;
+    Entry->PathLength = PathLength;
+    memcpy(Entry->Path, Path, PathLength * sizeof(WCHAR));
+
+    AcquireSRWLockExclusive(&TraverseCache->Lock);
+    OldEntry = TraverseCache->Buckets[Index];
+    TraverseCache->Buckets[Index] = Entry;
+    ReleaseSRWLockExclusive(&TraverseCache->Lock);
+
+    MemFree(OldEntry);
+}
+
+static inline ULONG FspSecurityDescriptorHash(PSECURITY_DESCRIPTOR SecurityDescriptor,
+    ULONG Size)
+{
+    /* FNV-1a */
+    PUINT8 Bytes = SecurityDescriptor;
+    ULONG Hash = 2166136261;
+    for (ULONG Index = 0; Size > Index; Index++)
+        Hash = (Hash ^ Bytes[Index]) * 16777619;
+    return Hash;
+}
+
+/*
+ * Security descriptor interning
+ *
+ * Most file systems hand out the same few security descriptors for most of their
+ * files. FspInternSecurityDescriptor returns a shared, reference counted and read-only
+ * copy of a self-relative security descriptor; descriptors that are equal byte for byte
+ * share the same copy. The access check cache below also uses these copies as its
+ * security descriptor identity.
+ *
+ * References are only added under the shared lock and only dropped under the exclusive
+ * lock, so a lookup can never resurrect a descriptor that is being freed.
+ */
+#define FspInternTableBucketCount       256
+
+typedef struct _FSP_INTERNED_SECURITY_DESCRIPTOR
+{
+    struct _FSP_INTERNED_SECURITY_DESCRIPTOR *Next;
+    LONG volatile RefCount;
+    ULONG Hash;
+    ULONG Size;
+    UINT64 SecurityDescriptor[]; /* UINT64 for alignment */
+} FSP_INTERNED_SECURITY_DESCRIPTOR;
+
+static SRWLOCK FspInternLock = SRWLOCK_INIT;
+static FSP_INTERNED_SECURITY_DESCRIPTOR *FspInternTable[FspInternTableBucketCount];
+
+static FSP_INTERNED_SECURITY_DESCRIPTOR *FspInternLookup(
+    PSECURITY_DESCRIPTOR SecurityDescriptor, ULONG Size, ULONG Hash)
+{
+    FSP_INTERNED_SECURITY_DESCRIPTOR *Interned;
+
+    for (Interned = FspInternTable[Hash % FspInternTableBucketCount];
+        0 != Interned; Interned = Interned->Next)
+        if (Hash == Interned->Hash && Size == Interned->Size &&
+            0 == memcmp(SecurityDescriptor, Interned->SecurityDescriptor, Size))
+            return Interned;
+
+    return 0;
+}
+
+static NTSTATUS FspInternSecurityDescriptorEx(
+    PSECURITY_DESCRIPTOR SecurityDescriptor, ULONG Size, ULONG Hash,
+    FSP_INTERNED_SECURITY_DESCRIPTOR **PInterned)
+{
+    FSP_INTERNED_SECURITY_DESCRIPTOR *Interned, *NewInterned;
+
+    AcquireSRWLockShared(&FspInternLock);
+    Interned = FspInternLookup(SecurityDescriptor, Size, Hash);
+    if (0 != Interned)
+        InterlockedIncrement(&Interned->RefCount);
+    ReleaseSRWLockShared(&FspInternLock);
+
+    if (0 == Interned)
+    {
+        NewInterned = MemAlloc(sizeof *NewInterned + Size);
+        if (0 == NewInterned)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        NewInterned->RefCount = 1;
+        NewInterned->Hash = Hash;
+        NewInterned->Size = Size;
+        memcpy(NewInterned->SecurityDescriptor, SecurityDescriptor, Size);
+
+        AcquireSRWLockExclusive(&FspInternLock);
+        Interned = FspInternLookup(SecurityDescriptor, Size, Hash);
+        if (0 != Interned)
+            InterlockedIncrement(&Interned->RefCount);
+        else
+        {
+            Interned = NewInterned;
+            Interned->Next = FspInternTable[Hash % FspInternTableBucketCount];
+            FspInternTable[Hash % FspInternTableBucketCount] = Interned;
+            NewInterned = 0;
+        }
+        ReleaseSRWLockExclusive(&FspInternLock);
+
+        MemFree(NewInterned);
+    }
+
+    *PInterned = Interned;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FspInternRelease(FSP_INTERNED_SECURITY_DESCRIPTOR *Interned)
+{
+    FSP_INTERNED_SECURITY_DESCRIPTOR **P;
+    BOOLEAN Delete = FALSE;
+
+    AcquireSRWLockExclusive(&FspInternLock);
+    if (0 == InterlockedDecrement(&Interned->RefCount))
+    {
+        for (P = &FspInternTable[Interned->Hash % FspInternTableBucketCount]; Interned != *P;
+            P = &(*P)->Next)
+            ;
+        *P = Interned->Next;
+        Delete = TRUE;
+    }
+    ReleaseSRWLockExclusive(&FspInternLock);
+
+    if (Delete)
+        MemFree(Interned);
+}
+
+FSP_API NTSTATUS FspInternSecurityDescriptor(
+    PSECURITY_DESCRIPTOR SecurityDescriptor,
+    PSECURITY_DESCRIPTOR *PInternedDescriptor)
+{
+    FSP_INTERNED_SECURITY_DESCRIPTOR *Interned;
+    SECURITY_DESCRIPTOR_CONTROL Control;
+    DWORD Revision;
+    ULONG Size;
+    NTSTATUS Result;
+
+    *PInternedDescriptor = 0;
+
+    /* stream support: allow NULL security descriptors */
+    if (0 == SecurityDescriptor)
+        return STATUS_SUCCESS;
+
+    if (!IsValidSecurityDescriptor(SecurityDescriptor) ||
+        !GetSecurityDescriptorControl(SecurityDescriptor, &Control, &Revision) ||
+        0 == (Control & SE_SELF_RELATIVE))
+        return STATUS_INVALID_SECURITY_DESCR;
+
+    Size = GetSecurityDescriptorLength(SecurityDescriptor);
+    Result = FspInternSecurityDescriptorEx(SecurityDescriptor, Size,
+        FspSecurityDescriptorHash(SecurityDescriptor, Size), &Interned);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    *PInternedDescriptor = Interned->SecurityDescriptor;
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Access check cache
+ *
+ * A bounded, direct-mapped cache of AccessCheck results, keyed by the (interned)
+ * security descriptor, the TokenId/ModifiedId of the token and the desired access.
+ * The result of AccessCheck depends only on these (the generic mapping is fixed),
+ * so entries never have to be invalidated; changing the security of a file changes
+ * its security descriptor and adjusting the token changes its ModifiedId.
+ */
+#define FspAccessCacheEntryCount        1024
+
+typedef struct
+{
+    FSP_INTERNED_SECURITY_DESCRIPTOR *Interned;
+    LUID TokenId, ModifiedId;
+    UINT32 DesiredAccess;
+    UINT32 GrantedAccess;
+    BOOL AccessStatus;
+} FSP_ACCESS_CACHE_ENTRY;
+
+static SRWLOCK FspAccessCacheLock = SRWLOCK_INIT;
+static FSP_ACCESS_CACHE_ENTRY FspAccessCache[FspAccessCacheEntryCount];
+
+static BOOL FspAccessCheckCached(PSECURITY_DESCRIPTOR SecurityDescriptor,
+    HANDLE Token, PTOKEN_STATISTICS TokenStats,
+    UINT32 DesiredAccess,
+    PPRIVILEGE_SET PrivilegeSet, PDWORD PPrivilegeSetLength,
+    PUINT32 PGrantedAccess, PBOOL PAccessStatus)
+{
+    FSP_ACCESS_CACHE_ENTRY *Entry;
+    FSP_INTERNED_SECURITY_DESCRIPTOR *Interned, *OldInterned;
+    ULONG Size, Hash;
+    BOOLEAN Hit = FALSE;
+
+    if (0 == TokenStats)
+        return AccessCheck(SecurityDescriptor, Token, DesiredAccess,
+            &FspFileGenericMapping,
+            PrivilegeSet, PPrivilegeSetLength,
+            PGrantedAccess, PAccessStatus);
+
+    Size = GetSecurityDescriptorLength(SecurityDescriptor);
+    Hash = FspSecurityDescriptorHash(SecurityDescriptor, Size);
+    Entry = &FspAccessCache[
+        (Hash ^ (DesiredAccess * 2654435761U) ^ TokenStats->TokenId.LowPart) %
+        FspAccessCacheEntryCount];
+
+    AcquireSRWLockShared(&FspAccessCacheLock);
+    Interned = Entry->Interned;
+    if (0 != Interned &&
+        Hash == Interned->Hash &&
+        Size == Interned->Size &&
+        DesiredAccess == Entry->DesiredAccess &&
+        0 == memcmp(&TokenStats->TokenId, &Entry->TokenId, sizeof Entry->TokenId) &&
+        0 == memcmp(&TokenStats->ModifiedId, &Entry->ModifiedId, sizeof Entry->ModifiedId) &&
+        0 == memcmp(SecurityDescriptor, Interned->SecurityDescriptor, Size))
+    {
+        *PGrantedAccess = Entry->GrantedAccess;
+        *PAccessStatus = Entry->AccessStatus;
+        Hit = TRUE;
+    }
+    ReleaseSRWLockShared(&FspAccessCacheLock);
+
+    if (Hit)
+        return TRUE;
+
+    if (!AccessCheck(SecurityDescriptor, Token, DesiredAccess,
+        &FspFileGenericMapping,
+        PrivilegeSet, PPrivilegeSetLength,
+        PGrantedAccess, PAccessStatus))
+        return FALSE;
+
+    if (!NT_SUCCESS(FspInternSecurityDescriptorEx(SecurityDescriptor, Size, Hash, &Interned)))
+        return TRUE; /* just do not cache */
+
+    AcquireSRWLockExclusive(&FspAccessCacheLock);
+    OldInterned = Entry->Interned;
+    Entry->Interned = Interned;
+    Entry->TokenId = TokenStats->TokenId;
+    Entry->ModifiedId = TokenStats->ModifiedId;
+    Entry->DesiredAccess = DesiredAccess;
+    Entry->GrantedAccess = *PGrantedAccess;
+    Entry->AccessStatus = *PAccessStatus;
+    ReleaseSRWLockExclusive(&FspAccessCacheLock);
+
+    if (0 != OldInterned)
+        FspInternRelease(OldInterned);
+
+    return TRUE;
+}
+
+VOID FspSecurityFinalize(BOOLEAN Dynamic)
+{
+    /*
+     * This function is called during DLL_PROCESS_DETACH. We must therefore keep
+     * finalization tasks to a minimum.
+     *
+     * Interned security descriptors may still be referenced by the file system,
+     * but the process is going away (or unloading us) at this point.
+     */
+
+    if (Dynamic)
+    {
+        FSP_INTERNED_SECURITY_DESCRIPTOR *Interned, *NextInterned;
+
+        for (ULONG Index = 0; FspInternTableBucketCount > Index; Index++)
+            for (Interned = FspInternTable[Index]; 0 != Interned; Interned = NextInterned)
+            {
+                NextInterned = Interned->Next;
+                MemFree(Interned);
+            }
+    }
+}
+
+NTSTATUS FspAccessCheckScratch(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DISPATCHER_CONTEXT *DispatcherContext,
     FSP_FSCTL_TRANSACT_REQ *Request,
     BOOLEAN CheckParentOrMain, BOOLEAN AllowTraverseCheck,
     UINT32 DesiredAccess, PUINT32 PGrantedAccess,
     PSECURITY_DESCRIPTOR *PSecurityDescriptor)
 {
+    /*
+     * Same as FspAccessCheckEx, except that memory comes from the scratch arena of
+     * DispatcherContext (if not NULL). The returned security descriptor must be freed with
+     * FspScratchFree before the request completes. Only the dispatcher (fsop.c) passes a
+     * DispatcherContext.
+     */
+
     BOOLEAN CheckParentDirectory, CheckMainFile;
 
     CheckParentDirectory = CheckMainFile = FALSE;
@@ -100,6 +715,12 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
     UINT32 TraverseAccess, ParentAccess, DesiredAccess2;
     UINT16 NamedStreamSave;
     BOOL AccessStatus;
+    FSP_TRAVERSE_CACHE *TraverseCache;
+    LONG TraverseCacheGeneration = 0;
+    TOKEN_STATISTICS TokenStats;
+    PTOKEN_STATISTICS PTokenStats = 0;
+    DWORD TokenStatsLength;
+    PWSTR PrefixEnd;
 
     if (CheckParentDirectory)
         FspPathSuffix((PWSTR)Request->Buffer, &FileName, &Suffix, Root);
@@ -112,18 +733,57 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
         FileName = (PWSTR)Request->Buffer;
 
     SecurityDescriptorSize = 1024;
-    SecurityDescriptor = MemAlloc(SecurityDescriptorSize);
+    SecurityDescriptor = FspScratchAlloc(DispatcherContext, SecurityDescriptorSize);
     if (0 == SecurityDescriptor)
     {
         Result = STATUS_INSUFFICIENT_RESOURCES;
         goto exit;
     }
 
+    /* the token identity keys the traverse and access check caches */
+    if (Request->Req.Create.UserMode &&
+        GetTokenInformation(FSP_FSCTL_TRANSACT_REQ_TOKEN_HANDLE(Request->Req.Create.AccessToken),
+            TokenStatistics, &TokenStats, sizeof TokenStats, &TokenStatsLength))
+        PTokenStats = &TokenStats;
+
     if (Request->Req.Create.UserMode &&
         AllowTraverseCheck && !Request->Req.Create.HasTraversePrivilege &&
         !(L'\\' == FileName[0] && L'\0' == FileName[1])/* no need to traverse check for root */)
     {
+        TraverseCache = 0 != PTokenStats ? FileSystem->TraverseCache : 0;
+        if (0 != TraverseCache)
+        {
+            /* read the generation first; anything that changes after this makes our entries stale */
+            TraverseCacheGeneration = TraverseCache->Generation;
+            MemoryBarrier();
+        }
+
         Remain = FileName;
+
+        if (0 != TraverseCache)
+        {
+            /* start after the deepest ancestor that is already known to be traversable */
+            ULONG Index;
+            for (Index = 0; L'\0' != FileName[Index] && L':' != FileName[Index]; Index++)
+                ;
+            while (0 < Index--)
+            {
+                if (L'\\' != FileName[Index] || (0 < Index && L'\\' == FileName[Index - 1]))
+                    continue;
+
+                if (FspTraverseCacheLookup(TraverseCache, TraverseCacheGeneration, PTokenStats,
+                    0 < Index ? FileName : TraverseCheckRoot, 0 < Index ? Index : 1))
+                {
+                    Remain = FileName + Index;
+                    do
+                    {
+                        Remain++;
+                    } while (L'\\' == *Remain);
+                    break;
+                }
+            }
+        }
+
         for (;;)
         {
             while (L'\\' != *Remain)
@@ -135,9 +795,10 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
 
             *Remain = L'\0';
             Prefix = Remain > FileName ? FileName : TraverseCheckRoot;
+            PrefixEnd = Remain;
 
             FileAttributes = 0;
-            Result = FspGetSecurityByName(FileSystem, Prefix, &FileAttributes,
+            Result = FspGetSecurityByName(FileSystem, DispatcherContext, Prefix, &FileAttributes,
                 &SecurityDescriptor, &SecurityDescriptorSize);
 
             /*
@@ -176,10 +837,9 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
 
             if (0 < SecurityDescriptorSize)
             {
-                if (AccessCheck(SecurityDescriptor,
-                    FSP_FSCTL_TRANSACT_REQ_TOKEN_HANDLE(Request->Req.Create.AccessToken),
+                if (FspAccessCheckCached(SecurityDescriptor,
+                    FSP_FSCTL_TRANSACT_REQ_TOKEN_HANDLE(Request->Req.Create.AccessToken), PTokenStats,
                     FILE_TRAVERSE,
-                    &FspFileGenericMapping,
                     PrivilegeSet, &PrivilegeSetLength,
                     &TraverseAccess, &AccessStatus))
                     Result = AccessStatus ? STATUS_SUCCESS : STATUS_ACCESS_DENIED;
@@ -188,13 +848,18 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
                 if (!NT_SUCCESS(Result))
                     goto exit;
             }
+
+            if (0 != TraverseCache)
+                FspTraverseCacheInsert(TraverseCache, TraverseCacheGeneration, PTokenStats,
+                    PrefixEnd > FileName ? FileName : TraverseCheckRoot,
+                    PrefixEnd > FileName ? (ULONG)(PrefixEnd - FileName) : 1);
         }
     traverse_check_done:
         ;
     }
 
     FileAttributes = 0;
-    Result = FspGetSecurityByName(FileSystem, FileName, &FileAttributes,
+    Result = FspGetSecurityByName(FileSystem, DispatcherContext, FileName, &FileAttributes,
         &SecurityDescriptor, &SecurityDescriptorSize);
     if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
         goto exit;
@@ -210,10 +875,9 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
     {
         if (0 == DesiredAccess)
             Result = STATUS_SUCCESS;
-        else if (AccessCheck(SecurityDescriptor,
-            FSP_FSCTL_TRANSACT_REQ_TOKEN_HANDLE(Request->Req.Create.AccessToken),
+        else if (FspAccessCheckCached(SecurityDescriptor,
+            FSP_FSCTL_TRANSACT_REQ_TOKEN_HANDLE(Request->Req.Create.AccessToken), PTokenStats,
             DesiredAccess,
-            &FspFileGenericMapping,
             PrivilegeSet, &PrivilegeSetLength,
             PGrantedAccess, &AccessStatus))
             Result = AccessStatus ? STATUS_SUCCESS : STATUS_ACCESS_DENIED;
@@ -235,13 +899,13 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
 
             NamedStreamSave = Request->Req.Create.NamedStream;
             Request->Req.Create.NamedStream = 0;
-            Result = FspAccessCheck(FileSystem, Request, TRUE, FALSE,
+            Result = FspAccessCheckScratch(FileSystem, DispatcherContext, Request, TRUE, FALSE,
                 (MAXIMUM_ALLOWED & DesiredAccess) ? (FILE_DELETE_CHILD | FILE_LIST_DIRECTORY) :
                 (
                     ((DELETE & DesiredAccess) ? FILE_DELETE_CHILD : 0) |
                     ((FILE_READ_ATTRIBUTES & DesiredAccess) ? FILE_LIST_DIRECTORY : 0)
                 ),
-                &ParentAccess);
+                &ParentAccess, 0);
             Request->Req.Create.NamedStream = NamedStreamSave;
             if (!NT_SUCCESS(Result))
             {
@@ -256,10 +920,9 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
                 ((FILE_LIST_DIRECTORY & ParentAccess) ? FILE_READ_ATTRIBUTES : 0));
             if (0 != DesiredAccess2)
             {
-                if (AccessCheck(SecurityDescriptor,
-                    FSP_FSCTL_TRANSACT_REQ_TOKEN_HANDLE(Request->Req.Create.AccessToken),
+                if (FspAccessCheckCached(SecurityDescriptor,
+                    FSP_FSCTL_TRANSACT_REQ_TOKEN_HANDLE(Request->Req.Create.AccessToken), PTokenStats,
                     DesiredAccess2,
-                    &FspFileGenericMapping,
                     PrivilegeSet, &PrivilegeSetLength,
                     PGrantedAccess, &AccessStatus))
                     Result = AccessStatus ? STATUS_SUCCESS : STATUS_ACCESS_DENIED;
@@ -376,7 +1039,7 @@ exit:
     else if (0 != PSecurityDescriptor && 0 < SecurityDescriptorSize && NT_SUCCESS(Result))
         *PSecurityDescriptor = SecurityDescriptor;
     else
-        MemFree(SecurityDescriptor);
+        FspScratchFree(DispatcherContext, SecurityDescriptor);
 
     if (CheckParentDirectory)
     {
@@ -391,6 +1054,17 @@ exit:
     return Result;
 }
 
+FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    BOOLEAN CheckParentOrMain, BOOLEAN AllowTraverseCheck,
+    UINT32 DesiredAccess, PUINT32 PGrantedAccess,
+    PSECURITY_DESCRIPTOR *PSecurityDescriptor)
+{
+    /* no dispatcher context: the returned descriptor is heap memory owned by the caller */
+    return FspAccessCheckScratch(FileSystem, 0, Request, CheckParentOrMain, AllowTraverseCheck,
+        DesiredAccess, PGrantedAccess, PSecurityDescriptor);
+}
+
 FSP_API NTSTATUS FspCreateSecurityDescriptor(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request,
     PSECURITY_DESCRIPTOR ParentDescriptor,
@@ -494,4 +1168,8 @@ FSP_API VOID FspDeleteSecurityDescriptor(PSECURITY_DESCRIPTOR SecurityDescriptor
     if ((NTSTATUS (*)())FspCreateSecurityDescriptor == CreateFunc ||
         (NTSTATUS (*)())FspSetSecurityDescriptor == CreateFunc)
         DestroyPrivateObjectSecurity(&SecurityDescriptor);
+    else
+    if ((NTSTATUS (*)())FspInternSecurityDescriptor == CreateFunc)
+        FspInternRelease(CONTAINING_RECORD(SecurityDescriptor,
+            FSP_INTERNED_SECURITY_DESCRIPTOR, SecurityDescriptor));
 }
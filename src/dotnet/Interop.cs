@@ -622,7 +622,15 @@ namespace Fsp.Interop
         internal Proto.OverwriteEx OverwriteEx;
         internal Proto.GetEa GetEa;
         internal Proto.SetEa SetEa;
-        /* NTSTATUS (*Reserved[33])(); */
+        /* NTSTATUS (*DuplicateExtents)(); */
+        /* NTSTATUS (*ReadV)(); */
+        /* NTSTATUS (*WriteV)(); */
+        /* NTSTATUS (*CreateMany)(); */
+        /* VOID (*DeleteMany)(); */
+        /* NTSTATUS (*ReadEx)(); */
+        /* NTSTATUS (*WriteEx)(); */
+        /* NTSTATUS (*ReadDirectoryEx)(); */
+        /* NTSTATUS (*Reserved[25])(); */
     }
 
     [SuppressUnmanagedCodeSecurity]
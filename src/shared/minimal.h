@@ -90,6 +90,17 @@ void *memmove(void *dst, const void *src, size_t siz)
     RtlMoveMemory(dst, src, (DWORD)siz);
     return dst;
 }
+#pragma function(memcmp)
+static inline
+int memcmp(const void *s0, const void *t0, size_t siz)
+{
+    const unsigned char *s = s0, *t = t0;
+    const unsigned char *e = t + siz;
+    int v = 0;
+    while (e > t && 0 == (v = *s - *t))
+        ++s, ++t;
+    return v;
+}
 
 #define WINFSP_SHARED_MINIMAL_STRCMP(NAME, TYPE, CONV)\
     static inline\
@@ -479,6 +479,10 @@ static VOID FspFsvolDeviceFini(PDEVICE_OBJECT DeviceObject)
     if (FsvolDeviceExtension->InitDoneIoq)
         FspIoqDelete(FsvolDeviceExtension->Ioq);
 
+    /* delete the registered buffer pool; all requests that used it are gone with the Ioq */
+    if (0 != FsvolDeviceExtension->RegisteredBuffer)
+        FspRegisteredBufferDelete(FsvolDeviceExtension->RegisteredBuffer);
+
     if (FsvolDeviceExtension->InitDoneCtxTab)
     {
         /*
@@ -641,6 +641,25 @@ VOID FspProcessBufferCollect(HANDLE ProcessId);
 NTSTATUS FspProcessBufferAcquire(SIZE_T BufferSize, PVOID *PBufferCookie, PVOID *PBuffer);
 VOID FspProcessBufferRelease(PVOID BufferCookie, PVOID Buffer);
 
+/* registered buffers */
+typedef struct
+{
+    PEPROCESS Process;
+    PMDL Mdl;
+    PVOID SystemAddress;
+    PVOID volatile UserAddress;
+    ULONG SlotSize;
+    FSP_FSCTL_BUFFER_SLOTS Slots;
+} FSP_REGISTERED_BUFFER;
+NTSTATUS FspRegisteredBufferCreate(ULONG SlotCount, ULONG SlotSize,
+    FSP_REGISTERED_BUFFER **PRegisteredBuffer);
+VOID FspRegisteredBufferDelete(FSP_REGISTERED_BUFFER *RegisteredBuffer);
+VOID FspRegisteredBufferUnmap(FSP_REGISTERED_BUFFER *RegisteredBuffer);
+BOOLEAN FspRegisteredBufferAcquire(FSP_REGISTERED_BUFFER *RegisteredBuffer, SIZE_T BufferSize,
+    PULONG PSlot, PVOID *PSystemAddress, PVOID *PUserAddress);
+VOID FspRegisteredBufferRelease(FSP_REGISTERED_BUFFER *RegisteredBuffer, ULONG Slot,
+    SIZE_T BufferSize);
+
 /* IRP context */
 #define FspIrpTimestampInfinity         ((ULONG)-1L)
 #define FspIrpTimestamp(Irp)            \
@@ -1085,6 +1104,7 @@ typedef struct
     PNOTIFY_SYNC NotifySync;
     LIST_ENTRY NotifyList;
     FSP_STATISTICS *Statistics;
+    FSP_REGISTERED_BUFFER *RegisteredBuffer;
 } FSP_FSVOL_DEVICE_EXTENSION;
 typedef struct
 {
@@ -1679,6 +1699,25 @@ typedef struct
     ULONG LxDeviceIdMinor;
 } FSP_FILE_STAT_LX_INFORMATION, *PFSP_FILE_STAT_LX_INFORMATION;
 
+/* DUPLICATE_EXTENTS_DATA and FILE_SUPPORTS_BLOCK_REFCOUNTING are missing on some WDK's */
+#define FSP_FILE_SUPPORTS_BLOCK_REFCOUNTING 0x08000000
+typedef struct
+{
+    HANDLE FileHandle;
+    LARGE_INTEGER SourceFileOffset;
+    LARGE_INTEGER TargetFileOffset;
+    LARGE_INTEGER ByteCount;
+} FSP_DUPLICATE_EXTENTS_DATA, *PFSP_DUPLICATE_EXTENTS_DATA;
+#if defined(_WIN64)
+typedef struct
+{
+    UINT32 FileHandle;
+    LARGE_INTEGER SourceFileOffset;
+    LARGE_INTEGER TargetFileOffset;
+    LARGE_INTEGER ByteCount;
+} FSP_DUPLICATE_EXTENTS_DATA32, *PFSP_DUPLICATE_EXTENTS_DATA32;
+#endif
+
 /* ATOMIC_CREATE_ECP_CONTEXT is missing on some WDK's */
 #define ATOMIC_CREATE_ECP_IN_FLAG_REPARSE_POINT_SPECIFIED   0x0002
 #define ATOMIC_CREATE_ECP_OUT_FLAG_REPARSE_POINT_SET        0x0002
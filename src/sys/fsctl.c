@@ -39,6 +39,12 @@ static NTSTATUS FspFsvolFileSystemControlGetStatistics(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 static NTSTATUS FspFsvolFileSystemControlGetRetrievalPointers(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+static NTSTATUS FspFsvolFileSystemControlFlushRange(FSP_FILE_NODE *FileNode,
+    UINT64 Offset, UINT64 Length, BOOLEAN FlushAndPurge);
+static NTSTATUS FspFsvolFileSystemControlDuplicateExtents(
+    PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+static NTSTATUS FspFsvolFileSystemControlDuplicateExtentsComplete(
+    PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Response);
 static NTSTATUS FspFsvolFileSystemControl(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 FSP_IOCMPL_DISPATCH FspFsvolFileSystemControlComplete;
@@ -55,6 +61,9 @@ FSP_DRIVER_DISPATCH FspFileSystemControl;
 #pragma alloc_text(PAGE, FspFsvolFileSystemControlQueryPersistentVolumeState)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControlGetStatistics)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControlGetRetrievalPointers)
+#pragma alloc_text(PAGE, FspFsvolFileSystemControlFlushRange)
+#pragma alloc_text(PAGE, FspFsvolFileSystemControlDuplicateExtents)
+#pragma alloc_text(PAGE, FspFsvolFileSystemControlDuplicateExtentsComplete)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControl)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControlComplete)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControlRequestFini)
@@ -64,6 +73,9 @@ FSP_DRIVER_DISPATCH FspFileSystemControl;
 enum
 {
     RequestFileNode                     = 0,
+    /* DuplicateExtents */
+    RequestSourceFileNode               = 1,
+    RequestSourceFileObject             = 2,
 };
 
 static NTSTATUS FspFsctlFileSystemControl(
@@ -670,6 +682,269 @@ static NTSTATUS FspFsvolFileSystemControlGetRetrievalPointers(
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS FspFsvolFileSystemControlFlushRange(FSP_FILE_NODE *FileNode,
+    UINT64 Offset, UINT64 Length, BOOLEAN FlushAndPurge)
+{
+    /*
+     * The FileNode must be acquired exclusive (Full) when calling this function.
+     *
+     * FspFileNodeFlushAndPurgeCache takes a ULONG length; split the range accordingly.
+     */
+
+    PAGED_CODE();
+
+    NTSTATUS Result = STATUS_SUCCESS;
+    ULONG ChunkLength;
+
+    while (0 < Length)
+    {
+        ChunkLength = 0x40000000 < Length ? 0x40000000 : (ULONG)Length;
+
+        Result = FspFileNodeFlushAndPurgeCache(FileNode, Offset, ChunkLength, FlushAndPurge);
+        if (!NT_SUCCESS(Result))
+            break;
+
+        Offset += ChunkLength;
+        Length -= ChunkLength;
+    }
+
+    return Result;
+}
+
+static NTSTATUS FspFsvolFileSystemControlDuplicateExtents(
+    PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
+{
+    /*
+     * FSCTL_DUPLICATE_EXTENTS_TO_FILE copies a range of a source file into a range of the
+     * target file (the file the FSCTL is sent to). Both files must reside on this volume.
+     * The user mode file system receives the FileContext of both files and performs the
+     * copy without the data ever travelling through the kernel/user mode boundary.
+     *
+     * Cached data of the source range is flushed so that the file system sees it; cached
+     * data of the target range is flushed and purged so that subsequent reads see the copy.
+     *
+     * The request carries the source UserContext/UserContext2. The source FileObject stays
+     * referenced and the source FileNode stays acquired shared until the request is freed,
+     * so that the source cannot be closed while the file system is using its contexts.
+     */
+
+    PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    PFILE_OBJECT FileObject = IrpSp->FileObject;
+
+    /* do we support duplicate extents? */
+    if (!FsvolDeviceExtension->VolumeParams.DuplicateExtents)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    /* is this a valid FileObject? */
+    if (!FspFileNodeIsValid(FileObject->FsContext))
+        return STATUS_INVALID_PARAMETER;
+
+    NTSTATUS Result;
+    FSP_FILE_NODE *FileNode = FileObject->FsContext;
+    FSP_FILE_DESC *FileDesc = FileObject->FsContext2;
+    PVOID InputBuffer = Irp->AssociatedIrp.SystemBuffer;
+    ULONG InputBufferLength = IrpSp->Parameters.FileSystemControl.InputBufferLength;
+    HANDLE SourceHandle;
+    LARGE_INTEGER SourceOffset, TargetOffset, ByteCount;
+    PFILE_OBJECT SourceFileObject;
+    FSP_FILE_NODE *SourceFileNode;
+    FSP_FILE_DESC *SourceFileDesc;
+    FSP_FSCTL_DUPLICATE_EXTENTS_DATA *DuplicateExtentsData;
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    BOOLEAN SourceAcquired = FALSE, TargetAcquired = FALSE;
+
+    ASSERT(FileNode == FileDesc->FileNode);
+
+    if (0 == InputBuffer)
+        return STATUS_INVALID_PARAMETER;
+
+#if defined(_WIN64)
+    if (IoIs32bitProcess(Irp))
+    {
+        PFSP_DUPLICATE_EXTENTS_DATA32 Data32 = InputBuffer;
+
+        if (sizeof(FSP_DUPLICATE_EXTENTS_DATA32) > InputBufferLength)
+            return STATUS_INVALID_PARAMETER;
+
+        SourceHandle = (HANDLE)(INT_PTR)(INT32)Data32->FileHandle;
+        SourceOffset = Data32->SourceFileOffset;
+        TargetOffset = Data32->TargetFileOffset;
+        ByteCount = Data32->ByteCount;
+    }
+    else
+#endif
+    {
+        PFSP_DUPLICATE_EXTENTS_DATA Data = InputBuffer;
+
+        if (sizeof(FSP_DUPLICATE_EXTENTS_DATA) > InputBufferLength)
+            return STATUS_INVALID_PARAMETER;
+
+        SourceHandle = Data->FileHandle;
+        SourceOffset = Data->SourceFileOffset;
+        TargetOffset = Data->TargetFileOffset;
+        ByteCount = Data->ByteCount;
+    }
+
+    if (0 > SourceOffset.QuadPart || 0 > TargetOffset.QuadPart || 0 > ByteCount.QuadPart ||
+        MAXLONGLONG - ByteCount.QuadPart < SourceOffset.QuadPart ||
+        MAXLONGLONG - ByteCount.QuadPart < TargetOffset.QuadPart)
+        return STATUS_INVALID_PARAMETER;
+
+    if (FileNode->IsDirectory)
+        return STATUS_INVALID_PARAMETER;
+
+    if (!FlagOn(FileDesc->GrantedAccess, FILE_WRITE_DATA))
+        return STATUS_ACCESS_DENIED;
+
+    Result = ObReferenceObjectByHandle(SourceHandle, FILE_READ_DATA, *IoFileObjectType,
+        Irp->RequestorMode, &SourceFileObject, 0);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    /* the source must be a file on this volume */
+    if (IoGetRelatedDeviceObject(SourceFileObject) != IoGetRelatedDeviceObject(FileObject) ||
+        !FspFileNodeIsValid(SourceFileObject->FsContext) ||
+        ((FSP_FILE_NODE *)SourceFileObject->FsContext)->FsvolDeviceObject != FsvolDeviceObject)
+    {
+        Result = STATUS_NOT_SAME_DEVICE;
+        goto exit;
+    }
+
+    SourceFileNode = SourceFileObject->FsContext;
+    SourceFileDesc = SourceFileObject->FsContext2;
+    ASSERT(SourceFileNode == SourceFileDesc->FileNode);
+
+    if (SourceFileNode->IsDirectory)
+    {
+        Result = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    if (!FlagOn(SourceFileDesc->GrantedAccess, FILE_READ_DATA))
+    {
+        Result = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    if (0 == ByteCount.QuadPart)
+    {
+        Irp->IoStatus.Information = 0;
+        Result = STATUS_SUCCESS;
+        goto exit;
+    }
+
+    if (SourceFileNode != FileNode)
+    {
+        /* acquire both FileNode's in address order to avoid deadlock with a reverse duplicate */
+        if (SourceFileNode > FileNode)
+        {
+            FspFileNodeAcquireExclusive(FileNode, Full);
+            TargetAcquired = TRUE;
+        }
+
+        /* make cached source data visible to the file system; keep the source shared */
+        FspFileNodeAcquireExclusive(SourceFileNode, Full);
+        SourceAcquired = TRUE;
+        Result = FspFsvolFileSystemControlFlushRange(SourceFileNode,
+            SourceOffset.QuadPart, ByteCount.QuadPart, FALSE);
+        FspFileNodeConvertExclusiveToShared(SourceFileNode, Full);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+    }
+
+    if (!TargetAcquired)
+    {
+        FspFileNodeAcquireExclusive(FileNode, Full);
+        TargetAcquired = TRUE;
+    }
+
+    if (SourceFileNode == FileNode)
+    {
+        Result = FspFsvolFileSystemControlFlushRange(FileNode,
+            SourceOffset.QuadPart, ByteCount.QuadPart, FALSE);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+    }
+
+    /* drop cached target data; it is about to be replaced */
+    Result = FspFsvolFileSystemControlFlushRange(FileNode,
+        TargetOffset.QuadPart, ByteCount.QuadPart, TRUE);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = FspIopCreateRequestEx(Irp, &FileNode->FileName, sizeof *DuplicateExtentsData,
+        FspFsvolFileSystemControlRequestFini, &Request);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Request->Kind = FspFsctlTransactFileSystemControlKind;
+    Request->Req.FileSystemControl.UserContext = FileNode->UserContext;
+    Request->Req.FileSystemControl.UserContext2 = FileDesc->UserContext2;
+    Request->Req.FileSystemControl.FsControlCode = FSCTL_DUPLICATE_EXTENTS_TO_FILE;
+    Request->Req.FileSystemControl.Buffer.Offset =
+        (UINT16)FSP_FSCTL_DEFAULT_ALIGN_UP(Request->FileName.Size);
+    Request->Req.FileSystemControl.Buffer.Size = sizeof *DuplicateExtentsData;
+    DuplicateExtentsData = (PVOID)(Request->Buffer + Request->Req.FileSystemControl.Buffer.Offset);
+    DuplicateExtentsData->Source.UserContext = SourceFileNode->UserContext;
+    DuplicateExtentsData->Source.UserContext2 = SourceFileDesc->UserContext2;
+    DuplicateExtentsData->SourceOffset = SourceOffset.QuadPart;
+    DuplicateExtentsData->TargetOffset = TargetOffset.QuadPart;
+    DuplicateExtentsData->Length = ByteCount.QuadPart;
+
+    FspFileNodeSetOwner(FileNode, Full, Request);
+    FspIopRequestContext(Request, RequestFileNode) = FileNode;
+    if (SourceAcquired)
+    {
+        FspFileNodeSetOwner(SourceFileNode, Full, Request);
+        FspIopRequestContext(Request, RequestSourceFileNode) = SourceFileNode;
+    }
+    FspIopRequestContext(Request, RequestSourceFileObject) = SourceFileObject;
+
+    return FSP_STATUS_IOQ_POST;
+
+exit:
+    if (SourceAcquired)
+        FspFileNodeRelease(SourceFileNode, Full);
+    if (TargetAcquired)
+        FspFileNodeRelease(FileNode, Full);
+
+    ObDereferenceObject(SourceFileObject);
+
+    return Result;
+}
+
+static NTSTATUS FspFsvolFileSystemControlDuplicateExtentsComplete(
+    PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    PAGED_CODE();
+
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    PFILE_OBJECT FileObject = IrpSp->FileObject;
+    FSP_FILE_NODE *FileNode = FileObject->FsContext;
+    FSP_FSCTL_TRANSACT_REQ *Request = FspIrpRequest(Irp);
+    FSP_FSCTL_DUPLICATE_EXTENTS_DATA *DuplicateExtentsData =
+        (PVOID)(Request->Buffer + Request->Req.FileSystemControl.Buffer.Offset);
+
+    /* the target file may have been extended; update the file sizes of the cache section */
+    FspFileNodeSetFileInfo(FileNode, FileObject, &Response->Rsp.FileSystemControl.FileInfo, FALSE);
+
+    /* drop any cached target data; the file system has replaced it */
+    FspFsvolFileSystemControlFlushRange(FileNode,
+        DuplicateExtentsData->TargetOffset, DuplicateExtentsData->Length, TRUE);
+
+    /* mark the file object as modified */
+    SetFlag(FileObject->Flags, FO_FILE_MODIFIED);
+
+    FspFileNodeNotifyChange(FileNode,
+        FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE, FILE_ACTION_MODIFIED, FALSE);
+
+    Irp->IoStatus.Information = 0;
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS FspFsvolFileSystemControl(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
 {
@@ -712,6 +987,9 @@ static NTSTATUS FspFsvolFileSystemControl(
         case FSCTL_GET_RETRIEVAL_POINTERS:
             Result = FspFsvolFileSystemControlGetRetrievalPointers(FsvolDeviceObject, Irp, IrpSp);
             break;
+        case FSCTL_DUPLICATE_EXTENTS_TO_FILE:
+            Result = FspFsvolFileSystemControlDuplicateExtents(FsvolDeviceObject, Irp, IrpSp);
+            break;
         }
         break;
     }
@@ -752,6 +1030,9 @@ NTSTATUS FspFsvolFileSystemControlComplete(
         case FSCTL_DELETE_REPARSE_POINT:
             Result = FspFsvolFileSystemControlReparsePointComplete(Irp, Response, TRUE);
             break;
+        case FSCTL_DUPLICATE_EXTENTS_TO_FILE:
+            Result = FspFsvolFileSystemControlDuplicateExtentsComplete(Irp, Response);
+            break;
         }
         break;
     }
@@ -774,9 +1055,17 @@ static VOID FspFsvolFileSystemControlRequestFini(FSP_FSCTL_TRANSACT_REQ *Request
     PAGED_CODE();
 
     FSP_FILE_NODE *FileNode = Context[RequestFileNode];
+    FSP_FILE_NODE *SourceFileNode = Context[RequestSourceFileNode];
+    PFILE_OBJECT SourceFileObject = Context[RequestSourceFileObject];
 
     if (0 != FileNode)
         FspFileNodeReleaseOwner(FileNode, Full, Request);
+
+    if (0 != SourceFileNode)
+        FspFileNodeReleaseOwner(SourceFileNode, Full, Request);
+
+    if (0 != SourceFileObject)
+        ObDereferenceObject(SourceFileObject);
 }
 
 NTSTATUS FspFileSystemControl(
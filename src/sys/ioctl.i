@@ -149,7 +149,7 @@ SYM(FSCTL_REQUEST_OPLOCK)
 //SYM(FSCTL_ADD_OVERLAY)
 //SYM(FSCTL_REMOVE_OVERLAY)
 //SYM(FSCTL_UPDATE_OVERLAY)
-//SYM(FSCTL_DUPLICATE_EXTENTS_TO_FILE)
+SYM(FSCTL_DUPLICATE_EXTENTS_TO_FILE)
 //SYM(FSCTL_SPARSE_OVERALLOCATE)
 //SYM(FSCTL_STORAGE_QOS_CONTROL)
 //SYM(FSCTL_INITIATE_FILE_METADATA_OPTIMIZATION)
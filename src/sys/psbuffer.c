@@ -279,3 +279,167 @@ VOID FspProcessBufferRelease(PVOID BufferCookie, PVOID Buffer)
         ZwFreeVirtualMemory(ZwCurrentProcess(), &Buffer, &BufferSize, MEM_RELEASE);
     }
 }
+
+NTSTATUS FspRegisteredBufferCreate(ULONG SlotCount, ULONG SlotSize,
+    FSP_REGISTERED_BUFFER **PRegisteredBuffer)
+{
+    PAGED_CODE();
+
+    FSP_REGISTERED_BUFFER *RegisteredBuffer;
+    PHYSICAL_ADDRESS LowAddress, HighAddress, SkipBytes;
+    NTSTATUS Result;
+
+    *PRegisteredBuffer = 0;
+
+    ASSERT(0 < SlotCount && FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX >= SlotCount);
+    ASSERT(0 < SlotSize && 0 == SlotSize % PAGE_SIZE);
+
+    RegisteredBuffer = FspAllocNonPaged(sizeof *RegisteredBuffer);
+    if (0 == RegisteredBuffer)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(RegisteredBuffer, sizeof *RegisteredBuffer);
+
+    /*
+     * The pool pages are allocated (and therefore pinned) by us rather than by the
+     * file system process. This way the kernel side of a copy always goes through
+     * SystemAddress, which remains valid for the lifetime of the pool regardless
+     * of what happens to the user mode view.
+     */
+    LowAddress.QuadPart = 0;
+    HighAddress.QuadPart = -1LL;
+    SkipBytes.QuadPart = 0;
+    RegisteredBuffer->Mdl = MmAllocatePagesForMdlEx(LowAddress, HighAddress, SkipBytes,
+        (SIZE_T)SlotCount * SlotSize, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+    if (0 == RegisteredBuffer->Mdl)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    RegisteredBuffer->SystemAddress = MmGetSystemAddressForMdlSafe(RegisteredBuffer->Mdl,
+        NormalPagePriority);
+    if (0 == RegisteredBuffer->SystemAddress)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    Result = FspMapLockedPagesInUserMode(RegisteredBuffer->Mdl,
+        (PVOID *)&RegisteredBuffer->UserAddress, 0);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    /* get a pointer to the current process so that we can unmap the pool later */
+    RegisteredBuffer->Process = PsGetCurrentProcess();
+    ObReferenceObject(RegisteredBuffer->Process);
+
+    RegisteredBuffer->SlotSize = SlotSize;
+    FspFsctlBufferSlotsInitialize(&RegisteredBuffer->Slots, SlotCount);
+
+    *PRegisteredBuffer = RegisteredBuffer;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (!NT_SUCCESS(Result))
+    {
+        FspRegisteredBufferUnmap(RegisteredBuffer);
+        FspRegisteredBufferDelete(RegisteredBuffer);
+    }
+
+    return Result;
+}
+
+VOID FspRegisteredBufferDelete(FSP_REGISTERED_BUFFER *RegisteredBuffer)
+{
+    PAGED_CODE();
+
+    /*
+     * The user mode view must have been removed by FspRegisteredBufferUnmap. We may be
+     * called when the volume device is finalized, in an arbitrary process and long after
+     * the file system process has exited; we must not touch its address space here.
+     */
+    ASSERT(0 == RegisteredBuffer->UserAddress);
+
+    if (0 != RegisteredBuffer->Mdl)
+    {
+        if (0 != RegisteredBuffer->SystemAddress)
+            MmUnmapLockedPages(RegisteredBuffer->SystemAddress, RegisteredBuffer->Mdl);
+        MmFreePagesFromMdl(RegisteredBuffer->Mdl);
+        ExFreePool(RegisteredBuffer->Mdl);
+    }
+
+    if (0 != RegisteredBuffer->Process)
+        ObDereferenceObject(RegisteredBuffer->Process);
+
+    FspFree(RegisteredBuffer);
+}
+
+VOID FspRegisteredBufferUnmap(FSP_REGISTERED_BUFFER *RegisteredBuffer)
+{
+    PAGED_CODE();
+
+    /*
+     * Remove the user mode view of the pool. This is done during cleanup of the volume
+     * handle, which normally happens in the file system process (when it closes the handle
+     * or exits); it is also done when volume creation fails. In-flight requests that still
+     * own a slot only touch the pool through SystemAddress, which is not affected.
+     *
+     * If the volume handle was duplicated into another process, cleanup may happen there.
+     * In this case we attach to the file system process, but only while it is still running;
+     * once it has exited the view has gone away with its address space.
+     */
+    PVOID UserAddress = InterlockedExchangePointer(&RegisteredBuffer->UserAddress, 0);
+    if (0 != UserAddress)
+    {
+        KAPC_STATE ApcState;
+        BOOLEAN Attach;
+
+        ASSERT(0 != RegisteredBuffer->Process);
+        Attach = RegisteredBuffer->Process != PsGetCurrentProcess();
+
+        if (Attach && STATUS_PENDING != PsGetProcessExitStatus(RegisteredBuffer->Process))
+            return;
+
+        if (Attach)
+            KeStackAttachProcess(RegisteredBuffer->Process, &ApcState);
+        MmUnmapLockedPages(UserAddress, RegisteredBuffer->Mdl);
+        if (Attach)
+            KeUnstackDetachProcess(&ApcState);
+    }
+}
+
+BOOLEAN FspRegisteredBufferAcquire(FSP_REGISTERED_BUFFER *RegisteredBuffer, SIZE_T BufferSize,
+    PULONG PSlot, PVOID *PSystemAddress, PVOID *PUserAddress)
+{
+    PUINT8 UserAddress;
+    UINT32 Slot;
+
+    if (RegisteredBuffer->SlotSize < BufferSize ||
+        RegisteredBuffer->Process != PsGetCurrentProcess())
+        return FALSE;
+
+    UserAddress = RegisteredBuffer->UserAddress;
+    if (0 == UserAddress)
+        return FALSE;
+
+    if (!FspFsctlBufferSlotsAcquire(&RegisteredBuffer->Slots, &Slot))
+        return FALSE;
+
+    *PSlot = Slot;
+    *PSystemAddress = (PUINT8)RegisteredBuffer->SystemAddress + (SIZE_T)Slot * RegisteredBuffer->SlotSize;
+    *PUserAddress = UserAddress + (SIZE_T)Slot * RegisteredBuffer->SlotSize;
+
+    return TRUE;
+}
+
+VOID FspRegisteredBufferRelease(FSP_REGISTERED_BUFFER *RegisteredBuffer, ULONG Slot,
+    SIZE_T BufferSize)
+{
+    /* do not let the next request (or the file system) see this request's data */
+    ASSERT(RegisteredBuffer->SlotSize >= BufferSize);
+    RtlZeroMemory((PUINT8)RegisteredBuffer->SystemAddress + (SIZE_T)Slot * RegisteredBuffer->SlotSize,
+        BufferSize);
+
+    FspFsctlBufferSlotsRelease(&RegisteredBuffer->Slots, Slot);
+}
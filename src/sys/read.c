@@ -52,8 +52,10 @@ enum
     RequestSafeMdl                      = 1,
     RequestAddress                      = 2,
     RequestProcess                      = 3,
+    RequestRegisteredBuffer             = 3,
 };
 FSP_FSCTL_STATIC_ASSERT(RequestCookie == RequestSafeMdl, "");
+FSP_FSCTL_STATIC_ASSERT(RequestProcess == RequestRegisteredBuffer, "");
 
 static NTSTATUS FspFsvolRead(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
@@ -352,7 +354,31 @@ NTSTATUS FspFsvolReadPrepare(
 {
     PAGED_CODE();
 
-    if (FspReadIrpShouldUseProcessBuffer(Irp, Request->Req.Read.Length))
+    FSP_REGISTERED_BUFFER *RegisteredBuffer =
+        FspFsvolDeviceExtension(IoGetCurrentIrpStackLocation(Irp)->DeviceObject)->RegisteredBuffer;
+    ULONG Slot;
+    PVOID SlotSystemAddress, SlotAddress;
+
+    if (0 != RegisteredBuffer &&
+        FspRegisteredBufferAcquire(RegisteredBuffer, Request->Req.Read.Length,
+            &Slot, &SlotSystemAddress, &SlotAddress))
+    {
+        if (0 == MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority))
+        {
+            FspRegisteredBufferRelease(RegisteredBuffer, Slot, 0);
+            return STATUS_INSUFFICIENT_RESOURCES; /* something is seriously screwy! */
+        }
+
+        /* the slot is already mapped in the file system process; no per-request setup */
+        Request->Req.Read.Address = (UINT64)(UINT_PTR)SlotAddress;
+
+        FspIopRequestContext(Request, RequestCookie) = (PVOID)(((UINT_PTR)Slot << 2) | 2);
+        FspIopRequestContext(Request, RequestAddress) = SlotSystemAddress;
+        FspIopRequestContext(Request, RequestRegisteredBuffer) = RegisteredBuffer;
+
+        return STATUS_SUCCESS;
+    }
+    else if (FspReadIrpShouldUseProcessBuffer(Irp, Request->Req.Read.Length))
     {
         NTSTATUS Result;
         PVOID Cookie;
@@ -435,7 +461,15 @@ NTSTATUS FspFsvolReadComplete(
     if (Response->IoStatus.Information > Request->Req.Read.Length)
         FSP_RETURN(Result = STATUS_INTERNAL_ERROR);
 
-    if ((UINT_PTR)FspIopRequestContext(Request, RequestCookie) & 1)
+    if ((UINT_PTR)FspIopRequestContext(Request, RequestCookie) & 2)
+    {
+        PVOID SlotSystemAddress = FspIopRequestContext(Request, RequestAddress);
+        PVOID SystemAddress = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+        ASSERT(0 != SlotSystemAddress);
+        RtlCopyMemory(SystemAddress, SlotSystemAddress, Response->IoStatus.Information);
+    }
+    else if ((UINT_PTR)FspIopRequestContext(Request, RequestCookie) & 1)
     {
         PVOID Address = FspIopRequestContext(Request, RequestAddress);
         PVOID SystemAddress = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
@@ -499,7 +533,15 @@ static VOID FspFsvolReadNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, PV
 
     PIRP Irp = Context[RequestIrp];
 
-    if ((UINT_PTR)Context[RequestCookie] & 1)
+    if ((UINT_PTR)Context[RequestCookie] & 2)
+    {
+        FSP_REGISTERED_BUFFER *RegisteredBuffer = Context[RequestRegisteredBuffer];
+        ULONG Slot = (ULONG)((UINT_PTR)Context[RequestCookie] >> 2);
+
+        ASSERT(0 != RegisteredBuffer);
+        FspRegisteredBufferRelease(RegisteredBuffer, Slot, Request->Req.Read.Length);
+    }
+    else if ((UINT_PTR)Context[RequestCookie] & 1)
     {
         PVOID Cookie = (PVOID)((UINT_PTR)Context[RequestCookie] & ~1);
         PVOID Address = Context[RequestAddress];
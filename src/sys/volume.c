@@ -166,6 +166,28 @@ static NTSTATUS FspVolumeCreateNoLock(
         if (!VolumeParams.EaTimeoutValid)
             VolumeParams.EaTimeout = VolumeParams.FileInfoTimeout;
     }
+    if (sizeof(FSP_FSCTL_VOLUME_PARAMS_V0) >= VolumeParams.Version)
+    {
+        VolumeParams.RegisteredBufferCount = 0;
+        VolumeParams.RegisteredBufferSize = 0;
+    }
+    else if (0 != VolumeParams.RegisteredBufferCount)
+    {
+        if (0 == VolumeParams.RegisteredBufferSize)
+            VolumeParams.RegisteredBufferSize = FSP_FSCTL_REGISTERED_BUFFER_SIZEDEFAULT;
+        else if (FSP_FSCTL_REGISTERED_BUFFER_SIZEMIN > VolumeParams.RegisteredBufferSize)
+            VolumeParams.RegisteredBufferSize = FSP_FSCTL_REGISTERED_BUFFER_SIZEMIN;
+        else if (FSP_FSCTL_REGISTERED_BUFFER_SIZEMAX < VolumeParams.RegisteredBufferSize)
+            VolumeParams.RegisteredBufferSize = FSP_FSCTL_REGISTERED_BUFFER_SIZEMAX;
+        VolumeParams.RegisteredBufferSize = FSP_FSCTL_ALIGN_UP(
+            VolumeParams.RegisteredBufferSize, FSP_FSCTL_REGISTERED_BUFFER_SIZEMIN);
+        if (FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX < VolumeParams.RegisteredBufferCount)
+            VolumeParams.RegisteredBufferCount = FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX;
+        if (FSP_FSCTL_REGISTERED_BUFFER_TOTALMAX / VolumeParams.RegisteredBufferSize <
+            VolumeParams.RegisteredBufferCount)
+            VolumeParams.RegisteredBufferCount =
+                FSP_FSCTL_REGISTERED_BUFFER_TOTALMAX / VolumeParams.RegisteredBufferSize;
+    }
     VolumeParams.VolumeInfoTimeoutValid = 1;
     VolumeParams.DirInfoTimeoutValid = 1;
     VolumeParams.SecurityTimeoutValid = 1;
@@ -272,12 +294,30 @@ static NTSTATUS FspVolumeCreateNoLock(
         FspDeviceDereference(FsvolDeviceObject);
     }
 
+    /* create the registered buffer pool (mapped into the current, i.e. file system, process) */
+    if (NT_SUCCESS(Result) && 0 != FsvolDeviceExtension->VolumeParams.RegisteredBufferCount)
+    {
+        Result = FspRegisteredBufferCreate(
+            FsvolDeviceExtension->VolumeParams.RegisteredBufferCount,
+            FsvolDeviceExtension->VolumeParams.RegisteredBufferSize,
+            &FsvolDeviceExtension->RegisteredBuffer);
+        if (!NT_SUCCESS(Result))
+        {
+            if (0 != FsvrtDeviceObject)
+                FspDeviceDereference(FsvrtDeviceObject);
+            FspDeviceDereference(FsvolDeviceObject);
+            return Result;
+        }
+    }
+
     /* do we need to register with fsmup? */
     if (0 == FsvrtDeviceObject)
     {
         Result = FspMupRegister(FspFsmupDeviceObject, FsvolDeviceObject);
         if (!NT_SUCCESS(Result))
         {
+            if (0 != FsvolDeviceExtension->RegisteredBuffer)
+                FspRegisteredBufferUnmap(FsvolDeviceExtension->RegisteredBuffer);
             FspDeviceDereference(FsvolDeviceObject);
             return Result;
         }
@@ -287,6 +327,8 @@ static NTSTATUS FspVolumeCreateNoLock(
         if (!NT_SUCCESS(Result))
         {
             FspMupUnregister(FspFsmupDeviceObject, FsvolDeviceObject);
+            if (0 != FsvolDeviceExtension->RegisteredBuffer)
+                FspRegisteredBufferUnmap(FsvolDeviceExtension->RegisteredBuffer);
             FspDeviceDereference(FsvolDeviceObject);
             return Result;
         }
@@ -345,6 +387,10 @@ static VOID FspVolumeDeleteNoLock(
     /* stop the I/O queue */
     FspIoqStop(FsvolDeviceExtension->Ioq);
 
+    /* remove the user mode view of the registered buffer pool while we can */
+    if (0 != FsvolDeviceExtension->RegisteredBuffer)
+        FspRegisteredBufferUnmap(FsvolDeviceExtension->RegisteredBuffer);
+
     /* do we have a virtual disk device or are we registered with fsmup? */
     if (0 != FsvolDeviceExtension->FsvrtDeviceObject)
     {
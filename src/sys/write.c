@@ -53,8 +53,10 @@ enum
     RequestSafeMdl                      = 1,
     RequestAddress                      = 2,
     RequestProcess                      = 3,
+    RequestRegisteredBuffer             = 3,
 };
 FSP_FSCTL_STATIC_ASSERT(RequestCookie == RequestSafeMdl, "");
+FSP_FSCTL_STATIC_ASSERT(RequestProcess == RequestRegisteredBuffer, "");
 
 static NTSTATUS FspFsvolWrite(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
@@ -429,7 +431,35 @@ NTSTATUS FspFsvolWritePrepare(
 {
     PAGED_CODE();
 
-    if (FspWriteIrpShouldUseProcessBuffer(Irp, Request->Req.Write.Length))
+    FSP_REGISTERED_BUFFER *RegisteredBuffer =
+        FspFsvolDeviceExtension(IoGetCurrentIrpStackLocation(Irp)->DeviceObject)->RegisteredBuffer;
+    ULONG Slot;
+    PVOID SlotSystemAddress, SlotAddress;
+
+    if (0 != RegisteredBuffer &&
+        FspRegisteredBufferAcquire(RegisteredBuffer, Request->Req.Write.Length,
+            &Slot, &SlotSystemAddress, &SlotAddress))
+    {
+        PVOID SystemAddress = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+        if (0 == SystemAddress)
+        {
+            FspRegisteredBufferRelease(RegisteredBuffer, Slot, 0);
+            return STATUS_INSUFFICIENT_RESOURCES; /* something is seriously screwy! */
+        }
+
+        /* the slot is already mapped in the file system process; no per-request setup */
+        RtlCopyMemory(SlotSystemAddress, SystemAddress, Request->Req.Write.Length);
+
+        Request->Req.Write.Address = (UINT64)(UINT_PTR)SlotAddress;
+
+        FspIopRequestContext(Request, RequestCookie) = (PVOID)(((UINT_PTR)Slot << 2) | 2);
+        FspIopRequestContext(Request, RequestAddress) = SlotSystemAddress;
+        FspIopRequestContext(Request, RequestRegisteredBuffer) = RegisteredBuffer;
+
+        return STATUS_SUCCESS;
+    }
+    else if (FspWriteIrpShouldUseProcessBuffer(Irp, Request->Req.Write.Length))
     {
         NTSTATUS Result;
         PVOID Cookie;
@@ -583,7 +613,15 @@ static VOID FspFsvolWriteNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, P
 
     PIRP Irp = Context[RequestIrp];
 
-    if ((UINT_PTR)Context[RequestCookie] & 1)
+    if ((UINT_PTR)Context[RequestCookie] & 2)
+    {
+        FSP_REGISTERED_BUFFER *RegisteredBuffer = Context[RequestRegisteredBuffer];
+        ULONG Slot = (ULONG)((UINT_PTR)Context[RequestCookie] >> 2);
+
+        ASSERT(0 != RegisteredBuffer);
+        FspRegisteredBufferRelease(RegisteredBuffer, Slot, Request->Req.Write.Length);
+    }
+    else if ((UINT_PTR)Context[RequestCookie] & 1)
     {
         PVOID Cookie = (PVOID)((UINT_PTR)Context[RequestCookie] & ~1);
         PVOID Address = Context[RequestAddress];
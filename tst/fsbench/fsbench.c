@@ -24,39 +24,145 @@
 #include <tlib/testsuite.h>
 
 static ULONG OptFileCount = 1000;
+static ULONG OptFileThreadCount = 1;
 static ULONG OptListCount = 100;
 static ULONG OptRdwrFileSize = 4096 * 1024;
 static ULONG OptRdwrCcCount = 100;
 static ULONG OptRdwrNcCount = 100;
+static ULONG OptRdwrRandomCount = 10000;
+static ULONG OptRdwrQueueDepth = 16;
 static ULONG OptMmapFileSize = 4096 * 1024;
 static ULONG OptMmapCount = 100;
 
+typedef struct
+{
+    VOID (*Fn)(ULONG Index);
+    ULONG First;
+} FILE_THREADED_DATA;
+static DWORD WINAPI file_threaded_thread(PVOID Data0)
+{
+    FILE_THREADED_DATA *Data = Data0;
+
+    for (ULONG Index = Data->First; OptFileCount > Index; Index += OptFileThreadCount)
+        Data->Fn(Index);
+
+    return 0;
+}
+static void file_threaded_dotest(VOID (*Fn)(ULONG Index))
+{
+    /*
+     * Spread the files over OptFileThreadCount threads. With more than one thread the
+     * namespace requests for the test directory are pending concurrently, which lets
+     * the dispatcher group them (see CreateMany/DeleteMany).
+     */
+    HANDLE Threads[MAXIMUM_WAIT_OBJECTS];
+    FILE_THREADED_DATA Data[MAXIMUM_WAIT_OBJECTS];
+    DWORD WaitResult;
+    BOOL Success;
+
+    if (1 == OptFileThreadCount)
+    {
+        for (ULONG Index = 0; OptFileCount > Index; Index++)
+            Fn(Index);
+        return;
+    }
+
+    for (ULONG I = 0; OptFileThreadCount > I; I++)
+    {
+        Data[I].Fn = Fn;
+        Data[I].First = I;
+        Threads[I] = CreateThread(0, 0, file_threaded_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    WaitResult = WaitForMultipleObjects(OptFileThreadCount, Threads, TRUE, INFINITE);
+    ASSERT(WAIT_OBJECT_0 <= WaitResult && WaitResult < WAIT_OBJECT_0 + OptFileThreadCount);
+
+    for (ULONG I = 0; OptFileThreadCount > I; I++)
+    {
+        Success = CloseHandle(Threads[I]);
+        ASSERT(Success);
+    }
+}
+static void file_create_doone(ULONG CreateDisposition, ULONG Index)
+{
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FileName[MAX_PATH];
+
+    StringCbPrintfW(FileName, sizeof FileName, L"fsbench-file%lu", Index);
+    Handle = CreateFileW(FileName,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        0,
+        CreateDisposition, FILE_ATTRIBUTE_NORMAL,
+        0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+}
 static void file_create_dotest(ULONG CreateDisposition)
+{
+    for (ULONG Index = 0; OptFileCount > Index; Index++)
+        file_create_doone(CreateDisposition, Index);
+}
+static VOID file_create_new_doone(ULONG Index)
+{
+    file_create_doone(CREATE_NEW, Index);
+}
+static void file_create_test(void)
+{
+    file_threaded_dotest(file_create_new_doone);
+}
+static void file_open_test(void)
+{
+    file_create_dotest(OPEN_EXISTING);
+}
+static int file_latency_compare(const void *a, const void *b)
+{
+    ULONGLONG x = *(ULONGLONG *)a, y = *(ULONGLONG *)b;
+    return x < y ? -1 : x > y;
+}
+static void file_open_latency_test(void)
 {
     HANDLE Handle;
     BOOL Success;
     WCHAR FileName[MAX_PATH];
+    LARGE_INTEGER Frequency, Start, End;
+    ULONGLONG *Latency;
+
+    Latency = malloc(OptFileCount * sizeof *Latency);
+    ASSERT(0 != Latency);
+
+    QueryPerformanceFrequency(&Frequency);
 
     for (ULONG Index = 0; OptFileCount > Index; Index++)
     {
         StringCbPrintfW(FileName, sizeof FileName, L"fsbench-file%lu", Index);
+        QueryPerformanceCounter(&Start);
         Handle = CreateFileW(FileName,
             GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
             0,
-            CreateDisposition, FILE_ATTRIBUTE_NORMAL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
             0);
+        QueryPerformanceCounter(&End);
         ASSERT(INVALID_HANDLE_VALUE != Handle);
         Success = CloseHandle(Handle);
         ASSERT(Success);
+        Latency[Index] = (End.QuadPart - Start.QuadPart) * 1000000 / Frequency.QuadPart;
     }
-}
-static void file_create_test(void)
-{
-    file_create_dotest(CREATE_NEW);
-}
-static void file_open_test(void)
-{
-    file_create_dotest(OPEN_EXISTING);
+
+    if (0 < OptFileCount)
+    {
+        /* percentiles go to stderr; stdout keeps the usual test output */
+        qsort(Latency, OptFileCount, sizeof *Latency, file_latency_compare);
+        tlib_printf("[p50=%lluus p90=%lluus p99=%lluus max=%lluus] ",
+            Latency[OptFileCount * 50 / 100],
+            Latency[OptFileCount * 90 / 100],
+            Latency[OptFileCount * 99 / 100],
+            Latency[OptFileCount - 1]);
+    }
+
+    free(Latency);
 }
 static void file_overwrite_test(void)
 {
@@ -127,17 +233,18 @@ static void file_list_none_test(void)
             ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
         }
 }
-static void file_delete_test(void)
+static VOID file_delete_doone(ULONG Index)
 {
     BOOL Success;
     WCHAR FileName[MAX_PATH];
 
-    for (ULONG Index = 0; OptFileCount > Index; Index++)
-    {
-        StringCbPrintfW(FileName, sizeof FileName, L"fsbench-file%lu", Index);
-        Success = DeleteFileW(FileName);
-        ASSERT(Success);
-    }
+    StringCbPrintfW(FileName, sizeof FileName, L"fsbench-file%lu", Index);
+    Success = DeleteFileW(FileName);
+    ASSERT(Success);
+}
+static void file_delete_test(void)
+{
+    file_threaded_dotest(file_delete_doone);
 }
 static void file_mkdir_test(void)
 {
@@ -167,6 +274,7 @@ static void file_tests(void)
 {
     TEST(file_create_test);
     TEST(file_open_test);
+    TEST(file_open_latency_test);
     TEST(file_overwrite_test);
     TEST(file_attr_test);
     TEST(file_list_test);
@@ -310,6 +418,151 @@ static void rdwr_nc_read_large_test(void)
     rdwr_dotest(OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_NO_BUFFERING,
         OptRdwrFileSize, 16 * SystemInfo.dwPageSize, OptRdwrNcCount);
 }
+static void rdwr_nc_write_huge_test(void)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    rdwr_dotest(CREATE_NEW, 0 | FILE_FLAG_NO_BUFFERING,
+        OptRdwrFileSize, 256 * SystemInfo.dwPageSize, OptRdwrNcCount);
+}
+static void rdwr_nc_read_huge_test(void)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    rdwr_dotest(OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_NO_BUFFERING,
+        OptRdwrFileSize, 256 * SystemInfo.dwPageSize, OptRdwrNcCount);
+}
+static void rdwr_random_dotest(ULONG CreateDisposition, ULONG CreateFlags,
+    ULONG FileSize, ULONG BufferSize, ULONG QueueDepth, ULONG Count)
+{
+    /*
+     * Keep QueueDepth I/O's of BufferSize at random (aligned) offsets in flight until
+     * Count I/O's have completed. This is the access pattern of a database and is
+     * where batch dispatching and ReadV/WriteV pay off.
+     */
+    WCHAR FileName[MAX_PATH];
+    HANDLE Handle;
+    BOOL Success;
+    PUINT8 Buffer;
+    OVERLAPPED Overlapped[MAXIMUM_WAIT_OBJECTS];
+    HANDLE Events[MAXIMUM_WAIT_OBJECTS];
+    ULONG Slots[MAXIMUM_WAIT_OBJECTS];
+    ULONG ActiveCount, Issued, Completed, Slot, Wait;
+    ULONG Seed = 1, Offset;
+    DWORD BytesTransferred;
+    LARGE_INTEGER Frequency, Start, End;
+
+    if (MAXIMUM_WAIT_OBJECTS < QueueDepth)
+        QueueDepth = MAXIMUM_WAIT_OBJECTS;
+    if (Count < QueueDepth)
+        QueueDepth = Count;
+
+    Buffer = _aligned_malloc(QueueDepth * BufferSize, BufferSize);
+    ASSERT(0 != Buffer);
+    memset(Buffer, 0, QueueDepth * BufferSize);
+
+    StringCbPrintfW(FileName, sizeof FileName, L"fsbench-file");
+    Handle = CreateFileW(FileName,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        0,
+        CreateDisposition,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | CreateFlags,
+        0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    if (CREATE_NEW == CreateDisposition)
+    {
+        BytesTransferred = SetFilePointer(Handle, FileSize, 0, FILE_BEGIN);
+        ASSERT(FileSize == BytesTransferred);
+        SetEndOfFile(Handle);
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+
+    ActiveCount = 0;
+    Issued = 0;
+    Completed = 0;
+    for (Slot = 0; QueueDepth > Slot; Slot++)
+    {
+        Events[Slot] = CreateEventW(0, TRUE, FALSE, 0);
+        ASSERT(0 != Events[Slot]);
+        Slots[Slot] = Slot;
+    }
+    for (;;)
+    {
+        /* start I/O's on free slots */
+        while (QueueDepth > ActiveCount && Count > Issued)
+        {
+            Slot = Slots[ActiveCount];
+            Seed = Seed * 1103515245 + 12345;
+            Offset = (Seed >> 8) % (FileSize / BufferSize) * BufferSize;
+            memset(&Overlapped[Slot], 0, sizeof Overlapped[Slot]);
+            Overlapped[Slot].Offset = Offset;
+            Overlapped[Slot].hEvent = Events[Slot];
+            if (CREATE_NEW == CreateDisposition)
+                Success = WriteFile(Handle, Buffer + Slot * BufferSize, BufferSize, 0, &Overlapped[Slot]);
+            else
+                Success = ReadFile(Handle, Buffer + Slot * BufferSize, BufferSize, 0, &Overlapped[Slot]);
+            ASSERT(Success || ERROR_IO_PENDING == GetLastError());
+            ActiveCount++;
+            Issued++;
+        }
+
+        if (Count == Completed)
+            break;
+
+        /* Slots[0..ActiveCount) are in flight; Events is kept in the same order */
+        {
+            HANDLE ActiveEvents[MAXIMUM_WAIT_OBJECTS];
+            for (ULONG I = 0; ActiveCount > I; I++)
+                ActiveEvents[I] = Events[Slots[I]];
+            Wait = WaitForMultipleObjects(ActiveCount, ActiveEvents, FALSE, INFINITE);
+        }
+        ASSERT(WAIT_OBJECT_0 <= Wait && WAIT_OBJECT_0 + ActiveCount > Wait);
+        Wait -= WAIT_OBJECT_0;
+        Slot = Slots[Wait];
+
+        Success = GetOverlappedResult(Handle, &Overlapped[Slot], &BytesTransferred, FALSE);
+        ASSERT(Success);
+        ASSERT(BufferSize == BytesTransferred);
+        Completed++;
+
+        /* move the completed slot to the free part of Slots */
+        ActiveCount--;
+        Slots[Wait] = Slots[ActiveCount];
+        Slots[ActiveCount] = Slot;
+    }
+
+    QueryPerformanceCounter(&End);
+
+    /* IOPS go to stderr; stdout keeps the usual test output */
+    if (End.QuadPart > Start.QuadPart)
+        tlib_printf("[iops=%llu] ",
+            (ULONGLONG)Count * Frequency.QuadPart / (End.QuadPart - Start.QuadPart));
+
+    for (Slot = 0; QueueDepth > Slot; Slot++)
+        CloseHandle(Events[Slot]);
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    _aligned_free(Buffer);
+}
+static void rdwr_nc_random_write_test(void)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    rdwr_random_dotest(CREATE_NEW, FILE_FLAG_NO_BUFFERING,
+        OptRdwrFileSize, SystemInfo.dwPageSize, OptRdwrQueueDepth, OptRdwrRandomCount);
+}
+static void rdwr_nc_random_read_test(void)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    rdwr_random_dotest(OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_NO_BUFFERING,
+        OptRdwrFileSize, SystemInfo.dwPageSize, OptRdwrQueueDepth, OptRdwrRandomCount);
+}
 static void rdwr_tests(void)
 {
     //TEST(rdwr_cc_write_sector_test);
@@ -324,6 +577,10 @@ static void rdwr_tests(void)
     TEST(rdwr_nc_read_page_test);
     TEST(rdwr_nc_write_large_test);
     TEST(rdwr_nc_read_large_test);
+    TEST(rdwr_nc_write_huge_test);
+    TEST(rdwr_nc_read_huge_test);
+    TEST(rdwr_nc_random_write_test);
+    TEST(rdwr_nc_random_read_test);
 }
 
 static void mmap_dotest(ULONG CreateDisposition, ULONG CreateFlags,
@@ -419,6 +676,15 @@ int main(int argc, char *argv[])
                 OptFileCount = strtoul(a + sizeof "--files=" - 1, 0, 10);
                 rmarg(argv, argc, argi);
             }
+            else if (0 == strncmp("--file-threads=", a, sizeof "--file-threads=" - 1))
+            {
+                OptFileThreadCount = strtoul(a + sizeof "--file-threads=" - 1, 0, 10);
+                if (0 == OptFileThreadCount)
+                    OptFileThreadCount = 1;
+                else if (MAXIMUM_WAIT_OBJECTS < OptFileThreadCount)
+                    OptFileThreadCount = MAXIMUM_WAIT_OBJECTS;
+                rmarg(argv, argc, argi);
+            }
             else if (0 == strncmp("--list=", a, sizeof "--list=" - 1))
             {
                 OptListCount = strtoul(a + sizeof "--list=" - 1, 0, 10);
@@ -434,6 +700,16 @@ int main(int argc, char *argv[])
                 OptRdwrNcCount = strtoul(a + sizeof "--rdwr-nc=" - 1, 0, 10);
                 rmarg(argv, argc, argi);
             }
+            else if (0 == strncmp("--rdwr-random=", a, sizeof "--rdwr-random=" - 1))
+            {
+                OptRdwrRandomCount = strtoul(a + sizeof "--rdwr-random=" - 1, 0, 10);
+                rmarg(argv, argc, argi);
+            }
+            else if (0 == strncmp("--rdwr-qd=", a, sizeof "--rdwr-qd=" - 1))
+            {
+                OptRdwrQueueDepth = strtoul(a + sizeof "--rdwr-qd=" - 1, 0, 10);
+                rmarg(argv, argc, argi);
+            }
             else if (0 == strncmp("--mmap=", a, sizeof "--mmap=" - 1))
             {
                 OptMmapCount = strtoul(a + sizeof "--mmap=" - 1, 0, 10);
@@ -0,0 +1,219 @@
+/**
+ * @file hostbench.cpp
+ *
+ * Compare the user mode dispatch cost of FileSystemHost and FileSystemHostT.
+ *
+ * Both hosts mount the same trivial file system. The benchmarks then feed synthetic
+ * requests straight into the FSP_FILE_SYSTEM operation table, so that the numbers
+ * reflect the DLL and C++ layers only and not the kernel round trip.
+ *
+ * @copyright 2015-2019 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winfsp/winfsp.hpp>
+extern "C" {
+#include <tlib/testsuite.h>
+}
+
+using namespace Fsp;
+
+static ULONG OptCount = 10000000;
+static ULONG OptLength = 4096;
+
+class Benchfs : public FileSystemBase
+{
+public:
+    Benchfs() : _Data()
+    {
+    }
+    NTSTATUS Init(PVOID Host0)
+    {
+        FileSystemHost *Host = (FileSystemHost *)Host0;
+        Host->SetSectorSize(4096);
+        Host->SetSectorsPerAllocationUnit(1);
+        Host->SetFileInfoTimeout(1000);
+        Host->SetFileSystemName(L"benchfs");
+        return STATUS_SUCCESS;
+    }
+    NTSTATUS GetFileInfo(
+        PVOID FileNode,
+        PVOID FileDesc,
+        FileInfo *FileInfo)
+    {
+        memset(FileInfo, 0, sizeof *FileInfo);
+        FileInfo->FileAttributes = FILE_ATTRIBUTE_NORMAL;
+        FileInfo->FileSize = sizeof _Data;
+        FileInfo->AllocationSize = sizeof _Data;
+        return STATUS_SUCCESS;
+    }
+    NTSTATUS Read(
+        PVOID FileNode,
+        PVOID FileDesc,
+        PVOID Buffer,
+        UINT64 Offset,
+        ULONG Length,
+        PULONG PBytesTransferred)
+    {
+        if (Offset >= sizeof _Data)
+            return STATUS_END_OF_FILE;
+        if (Length > sizeof _Data - Offset)
+            Length = (ULONG)(sizeof _Data - Offset);
+        memcpy(Buffer, _Data + Offset, Length);
+        *PBytesTransferred = Length;
+        return STATUS_SUCCESS;
+    }
+    NTSTATUS Write(
+        PVOID FileNode,
+        PVOID FileDesc,
+        PVOID Buffer,
+        UINT64 Offset,
+        ULONG Length,
+        BOOLEAN WriteToEndOfFile,
+        BOOLEAN ConstrainedIo,
+        PULONG PBytesTransferred,
+        FileInfo *FileInfo)
+    {
+        if (WriteToEndOfFile || Offset >= sizeof _Data)
+            return STATUS_DISK_FULL;
+        if (Length > sizeof _Data - Offset)
+            Length = (ULONG)(sizeof _Data - Offset);
+        memcpy(_Data + Offset, Buffer, Length);
+        *PBytesTransferred = Length;
+        return GetFileInfo(FileNode, FileDesc, FileInfo);
+    }
+
+private:
+    UINT8 _Data[64 * 1024];
+};
+
+static Benchfs DynamicFileSystem, StaticFileSystem;
+static FileSystemHost DynamicHost(DynamicFileSystem);
+static FileSystemHostT<Benchfs> StaticHost(StaticFileSystem);
+static UINT8 Buffer[64 * 1024];
+
+static void dispatch_dotest(FileSystemHost &Host, FSP_FSCTL_TRANSACT_KIND Kind)
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    FSP_FSCTL_TRANSACT_REQ Request;
+    FSP_FSCTL_TRANSACT_RSP Response;
+    NTSTATUS Result;
+
+    if (0 == Host.FileSystemHandle())
+    {
+        Result = Host.Mount(0);
+        ASSERT(NT_SUCCESS(Result));
+    }
+    FileSystem = Host.FileSystemHandle();
+
+    memset(&Request, 0, sizeof Request);
+    Request.Size = sizeof Request;
+    Request.Kind = Kind;
+    switch (Kind)
+    {
+    case FspFsctlTransactReadKind:
+        Request.Req.Read.Address = (UINT64)(UINT_PTR)Buffer;
+        Request.Req.Read.Length = OptLength;
+        break;
+    case FspFsctlTransactWriteKind:
+        Request.Req.Write.Address = (UINT64)(UINT_PTR)Buffer;
+        Request.Req.Write.Length = OptLength;
+        break;
+    default:
+        break;
+    }
+
+    for (ULONG Index = 0; OptCount > Index; Index++)
+    {
+        memset(&Response, 0, sizeof Response);
+        Result = FileSystem->Operations[Kind](FileSystem, &Request, &Response);
+        ASSERT(STATUS_SUCCESS == Result);
+    }
+}
+
+static void dynamic_read_test(void)
+{
+    dispatch_dotest(DynamicHost, FspFsctlTransactReadKind);
+}
+static void static_read_test(void)
+{
+    dispatch_dotest(StaticHost, FspFsctlTransactReadKind);
+}
+static void dynamic_write_test(void)
+{
+    dispatch_dotest(DynamicHost, FspFsctlTransactWriteKind);
+}
+static void static_write_test(void)
+{
+    dispatch_dotest(StaticHost, FspFsctlTransactWriteKind);
+}
+static void dynamic_getfileinfo_test(void)
+{
+    dispatch_dotest(DynamicHost, FspFsctlTransactQueryInformationKind);
+}
+static void static_getfileinfo_test(void)
+{
+    dispatch_dotest(StaticHost, FspFsctlTransactQueryInformationKind);
+}
+static void dispatch_tests(void)
+{
+    TEST(dynamic_read_test);
+    TEST(static_read_test);
+    TEST(dynamic_write_test);
+    TEST(static_write_test);
+    TEST(dynamic_getfileinfo_test);
+    TEST(static_getfileinfo_test);
+}
+
+#define rmarg(argv, argc, argi)         \
+    argc--,                             \
+    memmove(argv + argi, argv + argi + 1, (argc - argi) * sizeof(char *)),\
+    argi--,                             \
+    argv[argc] = 0
+int main(int argc, char *argv[])
+{
+    TESTSUITE(dispatch_tests);
+
+    for (int argi = 1; argc > argi; argi++)
+    {
+        const char *a = argv[argi];
+        if ('-' == a[0])
+        {
+            if (0 == strncmp("--count=", a, sizeof "--count=" - 1))
+            {
+                OptCount = strtoul(a + sizeof "--count=" - 1, 0, 10);
+                rmarg(argv, argc, argi);
+            }
+            else if (0 == strncmp("--length=", a, sizeof "--length=" - 1))
+            {
+                OptLength = strtoul(a + sizeof "--length=" - 1, 0, 10);
+                if (OptLength > sizeof Buffer)
+                    OptLength = sizeof Buffer;
+                rmarg(argv, argc, argi);
+            }
+        }
+    }
+
+    tlib_run_tests(argc, argv);
+
+    if (0 != DynamicHost.FileSystemHandle())
+        DynamicHost.Unmount();
+    if (0 != StaticHost.FileSystemHandle())
+        StaticHost.Unmount();
+
+    return 0;
+}
@@ -51,6 +51,11 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
     ULONG SlowioMaxDelay = 0;       /* -M: maximum slow IO delay in millis */
     ULONG SlowioPercentDelay = 0;   /* -P: percent of slow IO to make pending */
     ULONG SlowioRarefyDelay = 0;    /* -R: adjust the rarity of pending slow IO */
+    PWSTR SlowioLatencySpec = 0;    /* -l: slow IO latency model */
+    PWSTR SnapshotPath = 0;         /* -p: snapshot image file */
+    ULONG SnapshotInterval = 0;     /* -T: snapshot interval in millis */
+    ULONG SpillBudget = 0;          /* -b: memory budget for file data in MiB */
+    PWSTR SpillPath = 0;            /* -B: spill file */
     PWSTR FileSystemName = 0;
     PWSTR MountPoint = 0;
     PWSTR VolumePrefix = 0;
@@ -67,12 +72,21 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         {
         case L'?':
             goto usage;
+        case L'b':
+            argtol(SpillBudget);
+            break;
+        case L'B':
+            argtos(SpillPath);
+            break;
         case L'd':
             argtol(DebugFlags);
             break;
         case L'D':
             argtos(DebugLogFile);
             break;
+        case L'e':
+            OtherFlags |= MemfsDedup;
+            break;
         case L'f':
             OtherFlags = MemfsFlushAndPurgeOnCleanup;
             break;
@@ -82,6 +96,9 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         case L'i':
             OtherFlags = MemfsCaseInsensitive;
             break;
+        case L'l':
+            argtos(SlowioLatencySpec);
+            break;
         case L'm':
             argtos(MountPoint);
             break;
@@ -91,9 +108,18 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         case L'n':
             argtol(MaxFileNodes);
             break;
+        case L'N':
+            OtherFlags |= MemfsNegativeLookupCache;
+            break;
+        case L'p':
+            argtos(SnapshotPath);
+            break;
         case L'P':
             argtol(SlowioPercentDelay);
             break;
+        case L'r':
+            OtherFlags |= MemfsRegisteredBuffers;
+            break;
         case L'R':
             argtol(SlowioRarefyDelay);
             break;
@@ -106,6 +132,9 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         case L't':
             argtol(FileInfoTimeout);
             break;
+        case L'T':
+            argtol(SnapshotInterval);
+            break;
         case L'u':
             argtos(VolumePrefix);
             if (0 != VolumePrefix && L'\0' != VolumePrefix[0])
@@ -164,6 +193,36 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 
     FspFileSystemSetDebugLog(MemfsFileSystem(Memfs), DebugFlags);
 
+    if (0 != SlowioLatencySpec)
+    {
+        Result = MemfsSlowioConfigure(Memfs, SlowioLatencySpec);
+        if (!NT_SUCCESS(Result))
+        {
+            fail(L"invalid slow IO latency model %s", SlowioLatencySpec);
+            goto exit;
+        }
+    }
+
+    if (0 != SpillPath)
+    {
+        Result = MemfsSpillConfigure(Memfs, SpillBudget * 1024ULL * 1024ULL, SpillPath);
+        if (!NT_SUCCESS(Result))
+        {
+            fail(L"cannot create MEMFS spill file %s", SpillPath);
+            goto exit;
+        }
+    }
+
+    if (0 != SnapshotPath)
+    {
+        Result = MemfsSnapshotConfigure(Memfs, SnapshotPath, SnapshotInterval);
+        if (!NT_SUCCESS(Result))
+        {
+            fail(L"cannot load MEMFS snapshot %s", SnapshotPath);
+            goto exit;
+        }
+    }
+
     if (0 != MountPoint && L'\0' != MountPoint[0])
     {
         Result = FspFileSystemSetMountPoint(MemfsFileSystem(Memfs),
@@ -209,12 +268,20 @@ usage:
         "    -D DebugLogFile     [file path; use - for stderr]\n"
         "    -i                  [case insensitive file system]\n"
         "    -f                  [flush and purge cache on cleanup]\n"
+        "    -e                  [share identical file data blocks (dedup)]\n"
+        "    -r                  [register a pool of buffers for large reads/writes]\n"
+        "    -N                  [cache name lookup misses for FileInfoTimeout]\n"
         "    -t FileInfoTimeout  [millis]\n"
         "    -n MaxFileNodes\n"
         "    -s MaxFileSize      [bytes]\n"
         "    -M MaxDelay         [maximum slow IO delay in millis]\n"
         "    -P PercentDelay     [percent of slow IO to make pending]\n"
         "    -R RarefyDelay      [adjust the rarity of pending slow IO]\n"
+        "    -l LatencyModel     [slow IO latency; e.g. lognormal:2,0.5;write=fixed:5]\n"
+        "    -p SnapshotPath     [snapshot image file; loaded on start, saved on stop]\n"
+        "    -T SnapshotInterval [millis; also save snapshot periodically]\n"
+        "    -b MemoryBudget     [MiB; file data beyond this is spilled (requires -B)]\n"
+        "    -B SpillPath        [spill file; created on start, deleted on exit]\n"
         "    -F FileSystemName\n"
         "    -S RootSddl         [file rights: FA, etc; NO generic rights: GA, etc.]\n"
         "    -u \\Server\\Share    [UNC prefix (single backslash)]\n"
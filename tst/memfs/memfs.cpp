@@ -24,11 +24,13 @@
 #include <sddl.h>
 #include <VersionHelpers.h>
 #include <cassert>
+#include <cmath>
 #include <map>
 #include <unordered_map>
-
-/* SLOWIO */
-#include <thread>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 #define MEMFS_MAX_PATH                  512
 FSP_FSCTL_STATIC_ASSERT(MEMFS_MAX_PATH > MAX_PATH,
@@ -74,6 +76,37 @@ FSP_FSCTL_STATIC_ASSERT(MEMFS_MAX_PATH > MAX_PATH,
  */
 #define MEMFS_WSL
 
+/*
+ * Define the MEMFS_SNAPSHOT macro to include snapshot image (persistence) support.
+ */
+#define MEMFS_SNAPSHOT
+
+/*
+ * Define the MEMFS_DEDUP macro to include content deduplication (block sharing) support.
+ */
+#define MEMFS_DEDUP
+
+/*
+ * Define the MEMFS_SPILL macro to include support for spilling file data to a backing file.
+ * Requires MEMFS_DEDUP.
+ */
+#define MEMFS_SPILL
+
+/*
+ * Define the MEMFS_DUPLICATE_EXTENTS macro to include FSCTL_DUPLICATE_EXTENTS_TO_FILE support.
+ */
+#define MEMFS_DUPLICATE_EXTENTS
+
+/*
+ * Define the MEMFS_VECTORED_IO macro to include ReadV/WriteV (batch dispatching) support.
+ */
+#define MEMFS_VECTORED_IO
+
+/*
+ * Define the MEMFS_NAMESPACE_BATCH macro to include CreateMany/DeleteMany (batch dispatching) support.
+ */
+#define MEMFS_NAMESPACE_BATCH
+
  /*
  * Define the DEBUG_BUFFER_CHECK macro on Windows 8 or above. This includes
  * a check for the Write buffer to ensure that it is read-only.
@@ -168,12 +201,93 @@ UINT64 MemfsGetSystemTime(VOID)
     return ((PLARGE_INTEGER)&FileTime)->QuadPart;
 }
 
+/*
+ * File name comparison
+ *
+ * Case-insensitive comparisons use ordinal (upcase table) semantics, which is what NTFS
+ * does. Path components that consist entirely of ASCII characters are compared using a
+ * compact upcase table; only components that contain non-ASCII characters are handed to
+ * CompareStringOrdinal. Common prefixes are skipped 8 characters at a time using SSE2
+ * where available.
+ */
+
+static const UINT8 MemfsUpcaseAscii[128] =
+{
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+    0x60, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+};
+
+static inline
+int MemfsFileNameMismatch(PWSTR p, PWSTR q, int len)
+{
+    int i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    for (; len - 8 >= i; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((__m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(q + i));
+        if (0xffff != _mm_movemask_epi8(_mm_cmpeq_epi16(a, b)))
+            break;
+    }
+#endif
+
+    for (; len > i && p[i] == q[i]; i++)
+        ;
+
+    return i;
+}
+
+static inline
+int MemfsFileNamePartCompare(PWSTR p, int plen, PWSTR q, int qlen, BOOLEAN CaseInsensitive)
+{
+    WCHAR c, d;
+    int i, len, res;
+
+    len = plen < qlen ? plen : qlen;
+
+    i = MemfsFileNameMismatch(p, q, len);
+
+    if (CaseInsensitive)
+    {
+        for (; len > i; i++)
+        {
+            c = p[i];
+            d = q[i];
+            if (c == d)
+                continue;
+            if (0x80 <= (c | d))
+            {
+                /* non-ASCII: let the system upcase table decide the rest of the component */
+                res = CompareStringOrdinal(p + i, plen - i, q + i, qlen - i, TRUE);
+                if (0 != res)
+                    return res - 2;
+                res = _wcsnicmp(p + i, q + i, len - i);
+                return 0 != res ? res : plen - qlen;
+            }
+            res = MemfsUpcaseAscii[c] - MemfsUpcaseAscii[d];
+            if (0 != res)
+                return res;
+        }
+    }
+    else if (len > i)
+        return p[i] - q[i];
+
+    return plen - qlen;
+}
+
 static inline
 int MemfsFileNameCompare(PWSTR a, int alen, PWSTR b, int blen, BOOLEAN CaseInsensitive)
 {
     PWSTR p, endp, partp, q, endq, partq;
     WCHAR c, d;
-    int plen, qlen, len, res;
+    int plen, qlen, res;
 
     if (-1 == alen)
         alen = lstrlenW(a);
@@ -209,22 +323,7 @@ int MemfsFileNameCompare(PWSTR a, int alen, PWSTR b, int blen, BOOLEAN CaseInsen
         plen = (int)(p - partp);
         qlen = (int)(q - partq);
 
-        len = plen < qlen ? plen : qlen;
-
-        if (CaseInsensitive)
-        {
-            res = CompareStringW(LOCALE_INVARIANT, NORM_IGNORECASE, partp, plen, partq, qlen);
-            if (0 != res)
-                res -= 2;
-            else
-                res = _wcsnicmp(partp, partq, len);
-        }
-        else
-            res = wcsncmp(partp, partq, len);
-
-        if (0 == res)
-            res = plen - qlen;
-
+        res = MemfsFileNamePartCompare(partp, plen, partq, qlen, CaseInsensitive);
         if (0 != res)
             return res;
     }
@@ -277,6 +376,416 @@ struct MEMFS_FILE_NODE_EA_LESS
 typedef std::map<PSTR, FILE_FULL_EA_INFORMATION *, MEMFS_FILE_NODE_EA_LESS> MEMFS_FILE_NODE_EA_MAP;
 #endif
 
+#if defined(MEMFS_DEDUP)
+/*
+ * DEDUP
+ *
+ * In deduplicating mode file data is kept in fixed size blocks rather than in a single
+ * contiguous buffer. Blocks are reference counted and shared copy-on-write between file
+ * nodes. A null block reads as zeroes and is only allocated when it is written to.
+ *
+ * When a file that has been written is cleaned up, its blocks are hashed and looked up in
+ * a content index; a block whose contents are already present in the index is replaced by
+ * a reference to the indexed block. Block aligned ranges that are copied with
+ * FSCTL_DUPLICATE_EXTENTS_TO_FILE are shared without copying any data (see DuplicateExtents).
+ *
+ * Block reference counts, the content index and the block slots of file nodes are only
+ * modified while holding the block store lock exclusive; block data is read and written
+ * while holding it shared. A block is written in place only when it is referenced once and
+ * is not in the index; otherwise it is copied first. A range that is shared while its source
+ * is being written may capture a partial write, as would a concurrent read.
+ *
+ * When a memory budget is configured (see MemfsSpillConfigure), resident blocks are also
+ * kept in a list ordered by recency of use. After a read or write leaves more blocks in
+ * memory than the budget allows, the least recently used blocks are written to a spill
+ * file and their data is freed; a block that is accessed while spilled is read back.
+ * Reading back is done while holding the store lock exclusive. Spill file writes are done
+ * without the store lock: the block being spilled holds an extra reference for the duration
+ * of the write, so that it is copied rather than written in place. Only one thread trims
+ * the store at a time.
+ */
+
+#define MEMFS_BLOCK_SIZE                (64 * 1024)
+
+typedef struct _MEMFS_BLOCK_STORE MEMFS_BLOCK_STORE;
+typedef struct _MEMFS_BLOCK
+{
+    MEMFS_BLOCK_STORE *Store;
+    ULONG RefCount;
+    BOOLEAN Indexed;
+#if defined(MEMFS_SPILL)
+    BOOLEAN Dirty;                      /* data differs from the spill file copy */
+    UINT64 SpillSlot;                   /* spill file slot + 1; 0 if none */
+    struct _MEMFS_BLOCK *LruPrev, *LruNext;
+#endif
+    UINT64 Hash;
+    PUINT8 Data;                        /* MEMFS_BLOCK_SIZE bytes; 0 if spilled */
+} MEMFS_BLOCK;
+typedef std::unordered_map<UINT64, MEMFS_BLOCK *> MEMFS_BLOCK_INDEX;
+struct _MEMFS_BLOCK_STORE
+{
+    SRWLOCK Lock;
+    MEMFS_BLOCK_INDEX *Index;
+    UINT64 PhysicalBlocks;
+    UINT64 LogicalBlocks;
+    UINT64 IndexedBlocks;
+#if defined(MEMFS_SPILL)
+    HANDLE SpillFile;
+    WCHAR SpillVolume[MAX_PATH];        /* volume of the spill file; for free space */
+    UINT64 BudgetBlocks;                /* 0: unlimited */
+    UINT64 ResidentBlocks;
+    UINT64 SpilledBlocks;               /* spill file slots in use */
+    UINT64 NextSpillSlot;
+    std::vector<UINT64> *FreeSpillSlots;
+    SRWLOCK TrimLock;
+    SRWLOCK LruLock;
+    MEMFS_BLOCK *LruHead, *LruTail;     /* resident blocks, most recently used first */
+    volatile LONG64 Hits;
+    UINT64 Misses;
+    UINT64 Evictions;
+#endif
+};
+
+static inline
+UINT64 MemfsBlockHash(MEMFS_BLOCK *Block)
+{
+    /* FNV-1a over 64-bit words; collisions are resolved by comparing block contents */
+    PUINT64 P = (PUINT64)Block->Data, EndP = P + MEMFS_BLOCK_SIZE / sizeof(UINT64);
+    UINT64 H = 0xcbf29ce484222325ULL;
+
+    for (; EndP > P; P++)
+        H = (H ^ *P) * 0x100000001b3ULL;
+
+    return H;
+}
+
+static inline
+VOID MemfsBlockUnindex(MEMFS_BLOCK *Block)
+{
+    /* store lock must be held */
+    if (Block->Indexed)
+    {
+        Block->Store->Index->erase(Block->Hash);
+        Block->Store->IndexedBlocks--;
+        Block->Indexed = FALSE;
+    }
+}
+
+#if defined(MEMFS_SPILL)
+static inline
+VOID MemfsBlockLruInsert(MEMFS_BLOCK *Block)
+{
+    /* store lock must be held exclusive */
+    MEMFS_BLOCK_STORE *Store = Block->Store;
+
+    Block->LruPrev = 0;
+    Block->LruNext = Store->LruHead;
+    if (0 != Store->LruHead)
+        Store->LruHead->LruPrev = Block;
+    else
+        Store->LruTail = Block;
+    Store->LruHead = Block;
+    Store->ResidentBlocks++;
+}
+
+static inline
+VOID MemfsBlockLruRemove(MEMFS_BLOCK *Block)
+{
+    /* store lock must be held exclusive */
+    MEMFS_BLOCK_STORE *Store = Block->Store;
+
+    if (0 != Block->LruPrev)
+        Block->LruPrev->LruNext = Block->LruNext;
+    else
+        Store->LruHead = Block->LruNext;
+    if (0 != Block->LruNext)
+        Block->LruNext->LruPrev = Block->LruPrev;
+    else
+        Store->LruTail = Block->LruPrev;
+    Block->LruPrev = Block->LruNext = 0;
+    Store->ResidentBlocks--;
+}
+
+static inline
+VOID MemfsBlockTouch(MEMFS_BLOCK *Block)
+{
+    /* store lock must be held (shared is enough); the LRU list has its own lock */
+    MEMFS_BLOCK_STORE *Store = Block->Store;
+
+    if (0 == Store->BudgetBlocks)
+        return;
+
+    InterlockedIncrement64(&Store->Hits);
+    if (Store->LruHead == Block)
+        return;
+
+    AcquireSRWLockExclusive(&Store->LruLock);
+    if (Store->LruHead != Block)
+    {
+        Block->LruPrev->LruNext = Block->LruNext;
+        if (0 != Block->LruNext)
+            Block->LruNext->LruPrev = Block->LruPrev;
+        else
+            Store->LruTail = Block->LruPrev;
+        Block->LruPrev = 0;
+        Block->LruNext = Store->LruHead;
+        Store->LruHead->LruPrev = Block;
+        Store->LruHead = Block;
+    }
+    ReleaseSRWLockExclusive(&Store->LruLock);
+}
+#endif
+
+static inline
+VOID MemfsBlockAttach(MEMFS_BLOCK *Block)
+{
+    /* store lock must be held exclusive; Block is new and is being placed in a slot */
+    Block->Store->PhysicalBlocks++;
+    Block->Store->LogicalBlocks++;
+#if defined(MEMFS_SPILL)
+    MemfsBlockLruInsert(Block);
+#endif
+}
+
+static inline
+MEMFS_BLOCK *MemfsBlockDereference(MEMFS_BLOCK *Block)
+{
+    /* store lock must be held exclusive; returns the block if it must be freed */
+    Block->Store->LogicalBlocks--;
+    if (0 != --Block->RefCount)
+        return 0;
+
+    MemfsBlockUnindex(Block);
+    Block->Store->PhysicalBlocks--;
+#if defined(MEMFS_SPILL)
+    if (0 != Block->Data)
+        MemfsBlockLruRemove(Block);
+    if (0 != Block->SpillSlot)
+    {
+        try
+        {
+            Block->Store->FreeSpillSlots->push_back(Block->SpillSlot - 1);
+        }
+        catch (...)
+        {
+            /* the slot is lost until the spill file is recreated */
+        }
+        Block->Store->SpilledBlocks--;
+    }
+#endif
+
+    return Block;
+}
+
+static inline
+MEMFS_BLOCK *MemfsBlockAlloc(MEMFS_BLOCK_STORE *Store)
+{
+    MEMFS_BLOCK *Block;
+
+    Block = (MEMFS_BLOCK *)malloc(sizeof *Block);
+    if (0 == Block)
+        return 0;
+
+    memset(Block, 0, sizeof *Block);
+    Block->Store = Store;
+    Block->RefCount = 1;
+#if defined(MEMFS_SPILL)
+    Block->Dirty = TRUE;
+#endif
+
+    Block->Data = (PUINT8)LargeHeapAlloc(MEMFS_BLOCK_SIZE);
+    if (0 == Block->Data)
+    {
+        free(Block);
+        return 0;
+    }
+
+    return Block;
+}
+
+static inline
+VOID MemfsBlockFree(MEMFS_BLOCK *Block)
+{
+    LargeHeapFree(Block->Data);
+    free(Block);
+}
+
+#if defined(MEMFS_SPILL)
+static NTSTATUS MemfsBlockFault(MEMFS_BLOCK *Block)
+{
+    /* store lock must be held exclusive */
+    MEMFS_BLOCK_STORE *Store = Block->Store;
+    OVERLAPPED Overlapped = { 0 };
+    UINT64 Offset;
+    DWORD BytesTransferred;
+    PUINT8 Data;
+
+    if (0 != Block->Data)
+        return STATUS_SUCCESS;
+
+    Data = (PUINT8)LargeHeapAlloc(MEMFS_BLOCK_SIZE);
+    if (0 == Data)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Offset = (Block->SpillSlot - 1) * MEMFS_BLOCK_SIZE;
+    Overlapped.Offset = (DWORD)Offset;
+    Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+    if (!ReadFile(Store->SpillFile, Data, MEMFS_BLOCK_SIZE, &BytesTransferred, &Overlapped) ||
+        MEMFS_BLOCK_SIZE != BytesTransferred)
+    {
+        LargeHeapFree(Data);
+        return STATUS_UNEXPECTED_IO_ERROR;
+    }
+
+    Block->Data = Data;
+    Block->Dirty = FALSE;
+    MemfsBlockLruInsert(Block);
+    Store->Misses++;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID MemfsBlockStoreTrim(MEMFS_BLOCK_STORE *Store)
+{
+    /*
+     * Evict least recently used blocks until the store is within its budget. A block is
+     * written to the spill file only if it has no copy there or if it has been modified
+     * since it was last written; its slot is kept while it is resident so that a clean
+     * block can be evicted again without any I/O.
+     *
+     * The spill file write is done without holding the store lock, so that readers are
+     * not stalled behind it. The block is referenced during the write; a writer that finds
+     * it referenced more than once makes a private copy instead of writing it in place, so
+     * the block data does not change while it is being written out.
+     */
+    MEMFS_BLOCK *Block, *FreeBlock;
+    OVERLAPPED Overlapped;
+    UINT64 Slot, Offset;
+    DWORD BytesTransferred;
+    BOOLEAN Success;
+
+    if (0 == Store->BudgetBlocks || Store->ResidentBlocks <= Store->BudgetBlocks)
+        return;
+
+    /* if another thread is trimming, let it do the work */
+    if (!TryAcquireSRWLockExclusive(&Store->TrimLock))
+        return;
+
+    AcquireSRWLockExclusive(&Store->Lock);
+    while (Store->ResidentBlocks > Store->BudgetBlocks && 0 != (Block = Store->LruTail))
+    {
+        if (0 == Block->SpillSlot)
+        {
+            if (!Store->FreeSpillSlots->empty())
+            {
+                Slot = Store->FreeSpillSlots->back();
+                Store->FreeSpillSlots->pop_back();
+            }
+            else
+                Slot = Store->NextSpillSlot++;
+            Block->SpillSlot = Slot + 1;
+            Block->Dirty = TRUE;
+            Store->SpilledBlocks++;
+        }
+
+        if (Block->Dirty)
+        {
+            Block->RefCount++;
+            Store->LogicalBlocks++;
+            ReleaseSRWLockExclusive(&Store->Lock);
+
+            Offset = (Block->SpillSlot - 1) * MEMFS_BLOCK_SIZE;
+            memset(&Overlapped, 0, sizeof Overlapped);
+            Overlapped.Offset = (DWORD)Offset;
+            Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+            Success = WriteFile(Store->SpillFile, Block->Data, MEMFS_BLOCK_SIZE, &BytesTransferred,
+                &Overlapped) && MEMFS_BLOCK_SIZE == BytesTransferred;
+            if (!Success)
+                FspDebugLog(__FUNCTION__ ": cannot write spill file (Error=%lu)\n", GetLastError());
+
+            AcquireSRWLockExclusive(&Store->Lock);
+            FreeBlock = MemfsBlockDereference(Block);
+            if (0 != FreeBlock)
+            {
+                /* the block was released by its last file while it was being written */
+                ReleaseSRWLockExclusive(&Store->Lock);
+                MemfsBlockFree(FreeBlock);
+                AcquireSRWLockExclusive(&Store->Lock);
+                continue;
+            }
+            if (!Success)
+                /* cannot spill; remain over budget until the next attempt */
+                break;
+            Block->Dirty = FALSE;
+        }
+
+        MemfsBlockLruRemove(Block);
+        LargeHeapFree(Block->Data);
+        Block->Data = 0;
+        Store->Evictions++;
+    }
+    ReleaseSRWLockExclusive(&Store->Lock);
+
+    ReleaseSRWLockExclusive(&Store->TrimLock);
+}
+#endif
+
+static VOID MemfsBlockArrayRelease(MEMFS_BLOCK **Blocks, ULONG BlockIndex, ULONG BlockCount)
+{
+    MEMFS_BLOCK_STORE *Store;
+    MEMFS_BLOCK *Block;
+
+    for (; BlockCount > BlockIndex; BlockIndex++)
+    {
+        if (0 == Blocks[BlockIndex])
+            continue;
+
+        Store = Blocks[BlockIndex]->Store;
+        AcquireSRWLockExclusive(&Store->Lock);
+        Block = MemfsBlockDereference(Blocks[BlockIndex]);
+        Blocks[BlockIndex] = 0;
+        ReleaseSRWLockExclusive(&Store->Lock);
+
+        if (0 != Block)
+            MemfsBlockFree(Block);
+    }
+}
+
+static NTSTATUS MemfsBlockStoreInitialize(MEMFS_BLOCK_STORE *Store)
+{
+    InitializeSRWLock(&Store->Lock);
+#if defined(MEMFS_SPILL)
+    InitializeSRWLock(&Store->TrimLock);
+    InitializeSRWLock(&Store->LruLock);
+#endif
+
+    try
+    {
+        Store->Index = new MEMFS_BLOCK_INDEX;
+#if defined(MEMFS_SPILL)
+        Store->FreeSpillSlots = new std::vector<UINT64>;
+#endif
+    }
+    catch (...)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID MemfsBlockStoreFinalize(MEMFS_BLOCK_STORE *Store)
+{
+    /* all blocks must have been released */
+    delete Store->Index;
+#if defined(MEMFS_SPILL)
+    delete Store->FreeSpillSlots;
+    if (0 != Store->SpillFile)
+        CloseHandle(Store->SpillFile);
+#endif
+}
+#endif
+
 typedef struct _MEMFS_FILE_NODE
 {
     WCHAR FileName[MEMFS_MAX_PATH];
@@ -295,6 +804,13 @@ typedef struct _MEMFS_FILE_NODE
 #if defined(MEMFS_NAMED_STREAMS)
     struct _MEMFS_FILE_NODE *MainFileNode;
 #endif
+#if defined(MEMFS_SNAPSHOT)
+    BOOLEAN FileDataIsMapped;
+#endif
+#if defined(MEMFS_DEDUP)
+    MEMFS_BLOCK **Blocks;
+    ULONG BlockCount;
+#endif
 } MEMFS_FILE_NODE;
 
 struct MEMFS_FILE_NODE_LESS
@@ -320,16 +836,34 @@ typedef struct _MEMFS
     ULONG SlowioMaxDelay;
     ULONG SlowioPercentDelay;
     ULONG SlowioRarefyDelay;
-    volatile LONG SlowioThreadsRunning;
+    struct _MEMFS_SLOWIO *Slowio;
+#endif
+#if defined(MEMFS_SNAPSHOT)
+    PWSTR SnapshotPath;
+    ULONG SnapshotInterval;
+    HANDLE SnapshotFile;
+    HANDLE SnapshotMapping;
+    PVOID SnapshotView;
+    BOOLEAN SnapshotFileIsAside;
+    SRWLOCK SnapshotLock;
+    HANDLE SnapshotThread;
+    HANDLE SnapshotStopEvent;
+    HANDLE SnapshotRequestEvent;
+#endif
+#if defined(MEMFS_DEDUP)
+    BOOLEAN BlockMode;                  /* file data is kept in MEMFS_BLOCK's */
+    BOOLEAN Dedup;
+    MEMFS_BLOCK_STORE BlockStore;
 #endif
     UINT16 VolumeLabelLength;
     WCHAR VolumeLabel[32];
 } MEMFS;
 
+static UINT64 MemfsFileNodeIndexNumber = 1;
+
 static inline
 NTSTATUS MemfsFileNodeCreate(PWSTR FileName, MEMFS_FILE_NODE **PFileNode)
 {
-    static UINT64 IndexNumber = 1;
     MEMFS_FILE_NODE *FileNode;
 
     *PFileNode = 0;
@@ -344,7 +878,7 @@ NTSTATUS MemfsFileNodeCreate(PWSTR FileName, MEMFS_FILE_NODE **PFileNode)
     FileNode->FileInfo.LastAccessTime =
     FileNode->FileInfo.LastWriteTime =
     FileNode->FileInfo.ChangeTime = MemfsGetSystemTime();
-    FileNode->FileInfo.IndexNumber = IndexNumber++;
+    FileNode->FileInfo.IndexNumber = MemfsFileNodeIndexNumber++;
 
     *PFileNode = FileNode;
 
@@ -375,9 +909,19 @@ VOID MemfsFileNodeDelete(MEMFS_FILE_NODE *FileNode)
 #endif
 #if defined(MEMFS_REPARSE_POINTS)
     free(FileNode->ReparseData);
+#endif
+#if defined(MEMFS_SNAPSHOT)
+    if (!FileNode->FileDataIsMapped)
 #endif
     LargeHeapFree(FileNode->FileData);
-    free(FileNode->FileSecurity);
+#if defined(MEMFS_DEDUP)
+    if (0 != FileNode->Blocks)
+    {
+        MemfsBlockArrayRelease(FileNode->Blocks, 0, FileNode->BlockCount);
+        free(FileNode->Blocks);
+    }
+#endif
+    FspDeleteSecurityDescriptor(FileNode->FileSecurity, (NTSTATUS (*)())FspInternSecurityDescriptor);
     free(FileNode);
 }
 
@@ -394,33 +938,408 @@ VOID MemfsFileNodeDereference(MEMFS_FILE_NODE *FileNode)
         MemfsFileNodeDelete(FileNode);
 }
 
-static inline
-VOID MemfsFileNodeGetFileInfo(MEMFS_FILE_NODE *FileNode, FSP_FSCTL_FILE_INFO *FileInfo)
+/*
+ * File data
+ *
+ * File data is either a contiguous LargeHeap buffer (FileData) or, in deduplicating mode,
+ * an array of shared blocks (Blocks). The functions below hide the difference.
+ */
+
+static NTSTATUS MemfsFileNodeReallocData(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode, UINT64 NewSize)
 {
-#if defined(MEMFS_NAMED_STREAMS)
-    if (0 == FileNode->MainFileNode)
-        *FileInfo = FileNode->FileInfo;
-    else
+    /* FileNode->FileInfo.AllocationSize is still the old allocation size */
+#if defined(MEMFS_DEDUP)
+    if (Memfs->BlockMode)
     {
-        *FileInfo = FileNode->MainFileNode->FileInfo;
-        FileInfo->FileAttributes &= ~FILE_ATTRIBUTE_DIRECTORY;
-            /* named streams cannot be directories */
-        FileInfo->AllocationSize = FileNode->FileInfo.AllocationSize;
-        FileInfo->FileSize = FileNode->FileInfo.FileSize;
-    }
-#else
-    *FileInfo = FileNode->FileInfo;
-#endif
-}
+        MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+        ULONG BlockCount = (ULONG)((NewSize + MEMFS_BLOCK_SIZE - 1) / MEMFS_BLOCK_SIZE);
+        ULONG OldBlockCount = FileNode->BlockCount;
+        MEMFS_BLOCK **Blocks = 0, **OldBlocks = FileNode->Blocks;
 
-#if defined(MEMFS_EA)
-static inline
-NTSTATUS MemfsFileNodeGetEaMap(MEMFS_FILE_NODE *FileNode, MEMFS_FILE_NODE_EA_MAP **PEaMap)
-{
-#if defined(MEMFS_NAMED_STREAMS)
-    if (0 != FileNode->MainFileNode)
-        FileNode = FileNode->MainFileNode;
-#endif
+        if (OldBlockCount == BlockCount)
+            return STATUS_SUCCESS;
+
+        if (0 != BlockCount)
+        {
+            Blocks = (MEMFS_BLOCK **)malloc(BlockCount * sizeof(MEMFS_BLOCK *));
+            if (0 == Blocks)
+                return STATUS_INSUFFICIENT_RESOURCES;
+            memset(Blocks, 0, BlockCount * sizeof(MEMFS_BLOCK *));
+        }
+
+        AcquireSRWLockExclusive(&Store->Lock);
+        if (0 != OldBlocks)
+            memcpy(Blocks, OldBlocks,
+                (OldBlockCount < BlockCount ? OldBlockCount : BlockCount) * sizeof(MEMFS_BLOCK *));
+        FileNode->Blocks = Blocks;
+        FileNode->BlockCount = BlockCount;
+        ReleaseSRWLockExclusive(&Store->Lock);
+
+        if (0 != OldBlocks)
+        {
+            MemfsBlockArrayRelease(OldBlocks, BlockCount, OldBlockCount);
+            free(OldBlocks);
+        }
+
+        return STATUS_SUCCESS;
+    }
+#endif
+
+    PVOID FileData;
+#if defined(MEMFS_SNAPSHOT)
+    if (FileNode->FileDataIsMapped)
+    {
+        /* file data lives in the snapshot image; move it to the heap */
+        FileData = LargeHeapRealloc(0, (size_t)NewSize);
+        if (0 == FileData && 0 != NewSize)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        memcpy(FileData, FileNode->FileData, (size_t)(
+            FileNode->FileInfo.AllocationSize < NewSize ?
+                FileNode->FileInfo.AllocationSize : NewSize));
+        FileNode->FileDataIsMapped = FALSE;
+    }
+    else
+#endif
+    {
+        FileData = LargeHeapRealloc(FileNode->FileData, (size_t)NewSize);
+        if (0 == FileData && 0 != NewSize)
+            return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    FileNode->FileData = FileData;
+
+    return STATUS_SUCCESS;
+}
+
+#if defined(MEMFS_DEDUP)
+#if defined(MEMFS_SPILL)
+static NTSTATUS MemfsFileNodeFaultBlock(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode, ULONG Index)
+{
+    /* bring block Index of FileNode back from the spill file; the caller retries */
+    MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+    MEMFS_BLOCK *Block;
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    AcquireSRWLockExclusive(&Store->Lock);
+    Block = FileNode->BlockCount > Index ? FileNode->Blocks[Index] : 0;
+    if (0 != Block)
+        Result = MemfsBlockFault(Block);
+    ReleaseSRWLockExclusive(&Store->Lock);
+
+    return Result;
+}
+#endif
+
+static NTSTATUS MemfsFileNodePrepareBlock(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode, ULONG Index)
+{
+    /* make block Index of FileNode private to it, so that it can be written in place */
+    MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+    MEMFS_BLOCK *Block, *NewBlock, *OldBlock = 0;
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    AcquireSRWLockExclusive(&Store->Lock);
+    Block = FileNode->BlockCount > Index ? FileNode->Blocks[Index] : 0;
+    if (FileNode->BlockCount <= Index || (0 != Block && 1 == Block->RefCount))
+    {
+        /* make sure that nobody finds the block by its (old) contents */
+        if (0 != Block)
+            MemfsBlockUnindex(Block);
+        ReleaseSRWLockExclusive(&Store->Lock);
+        return STATUS_SUCCESS;
+    }
+    ReleaseSRWLockExclusive(&Store->Lock);
+
+    NewBlock = MemfsBlockAlloc(Store);
+    if (0 == NewBlock)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    /*
+     * The copy is made while holding the lock exclusive, because a shared block may
+     * otherwise be spilled (or unshared and written) while we are reading it. If the
+     * slot changed since we looked at it, the new block is discarded and the caller
+     * retries.
+     */
+    AcquireSRWLockExclusive(&Store->Lock);
+    Block = FileNode->BlockCount > Index ? FileNode->Blocks[Index] : 0;
+    if (FileNode->BlockCount > Index && (0 == Block || 1 != Block->RefCount))
+    {
+#if defined(MEMFS_SPILL)
+        if (0 != Block)
+            Result = MemfsBlockFault(Block);
+        if (NT_SUCCESS(Result))
+#endif
+        {
+            if (0 != Block)
+                memcpy(NewBlock->Data, Block->Data, MEMFS_BLOCK_SIZE);
+            else
+                memset(NewBlock->Data, 0, MEMFS_BLOCK_SIZE);
+            FileNode->Blocks[Index] = NewBlock;
+            MemfsBlockAttach(NewBlock);
+            if (0 != Block)
+                OldBlock = MemfsBlockDereference(Block);
+            NewBlock = 0;
+        }
+    }
+    ReleaseSRWLockExclusive(&Store->Lock);
+
+    if (0 != NewBlock)
+        MemfsBlockFree(NewBlock);
+    if (0 != OldBlock)
+        MemfsBlockFree(OldBlock);
+
+    return Result;
+}
+
+static VOID MemfsFileNodeDeduplicateBlock(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode, ULONG Index)
+{
+    MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+    MEMFS_BLOCK *Block, *OldBlock = 0;
+    MEMFS_BLOCK_INDEX::iterator Iter;
+    UINT64 Hash;
+
+    /* spilled blocks are not deduplicated; they are not worth reading back for it */
+    AcquireSRWLockShared(&Store->Lock);
+    Block = FileNode->BlockCount > Index ? FileNode->Blocks[Index] : 0;
+    Hash = 0 != Block && 0 != Block->Data && !Block->Indexed ? MemfsBlockHash(Block) : 0;
+    ReleaseSRWLockShared(&Store->Lock);
+    if (0 == Block || 0 == Hash)
+        return;
+
+    AcquireSRWLockExclusive(&Store->Lock);
+    if (FileNode->BlockCount <= Index || Block != FileNode->Blocks[Index] ||
+        0 == Block->Data || Block->Indexed)
+        ;
+    else if (Store->Index->end() == (Iter = Store->Index->find(Hash)))
+    {
+        /* a write may have slipped in after hashing; indexing a block under its
+         * stale hash is harmless since index hits are verified by comparison */
+        try
+        {
+            Store->Index->insert(MEMFS_BLOCK_INDEX::value_type(Hash, Block));
+            Block->Hash = Hash;
+            Block->Indexed = TRUE;
+            Store->IndexedBlocks++;
+        }
+        catch (...)
+        {
+            /* not indexing a block is harmless */
+        }
+    }
+    else if (Iter->second != Block && 0 != Iter->second->Data &&
+        0 == memcmp(Iter->second->Data, Block->Data, MEMFS_BLOCK_SIZE))
+    {
+        Iter->second->RefCount++;
+        Store->LogicalBlocks++;
+        FileNode->Blocks[Index] = Iter->second;
+        OldBlock = MemfsBlockDereference(Block);
+    }
+    ReleaseSRWLockExclusive(&Store->Lock);
+
+    if (0 != OldBlock)
+        MemfsBlockFree(OldBlock);
+}
+#endif
+
+static NTSTATUS MemfsFileNodeReadData(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode,
+    PVOID Buffer, UINT64 Offset, SIZE_T Length)
+{
+#if defined(MEMFS_DEDUP)
+    if (Memfs->BlockMode)
+    {
+        MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+        MEMFS_BLOCK *Block;
+        PUINT8 P = (PUINT8)Buffer;
+        SIZE_T BlockOffset, Part;
+        ULONG Index;
+        NTSTATUS Result = STATUS_SUCCESS;
+
+        for (; 0 < Length; P += Part, Offset += Part, Length -= Part)
+        {
+            Index = (ULONG)(Offset / MEMFS_BLOCK_SIZE);
+            BlockOffset = (SIZE_T)(Offset % MEMFS_BLOCK_SIZE);
+            Part = MEMFS_BLOCK_SIZE - BlockOffset;
+            if (Part > Length)
+                Part = Length;
+
+            for (;;)
+            {
+                AcquireSRWLockShared(&Store->Lock);
+                Block = FileNode->BlockCount > Index ? FileNode->Blocks[Index] : 0;
+#if defined(MEMFS_SPILL)
+                if (0 != Block && 0 == Block->Data)
+                {
+                    ReleaseSRWLockShared(&Store->Lock);
+                    Result = MemfsFileNodeFaultBlock(Memfs, FileNode, Index);
+                    if (!NT_SUCCESS(Result))
+                        goto exit;
+                    continue;
+                }
+                if (0 != Block)
+                    MemfsBlockTouch(Block);
+#endif
+                if (0 != Block)
+                    memcpy(P, Block->Data + BlockOffset, Part);
+                else
+                    memset(P, 0, Part);
+                ReleaseSRWLockShared(&Store->Lock);
+                break;
+            }
+        }
+
+#if defined(MEMFS_SPILL)
+    exit:
+        MemfsBlockStoreTrim(Store);
+#endif
+
+        return Result;
+    }
+#endif
+
+    memcpy(Buffer, (PUINT8)FileNode->FileData + Offset, Length);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS MemfsFileNodeWriteData(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode,
+    PVOID Buffer, UINT64 Offset, SIZE_T Length)
+{
+    /* a null Buffer writes zeroes */
+#if defined(MEMFS_DEDUP)
+    if (Memfs->BlockMode)
+    {
+        MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+        MEMFS_BLOCK *Block;
+        PUINT8 P = (PUINT8)Buffer;
+        SIZE_T BlockOffset, Part;
+        ULONG Index;
+#if defined(MEMFS_SPILL)
+        BOOLEAN Spilled;
+#endif
+        NTSTATUS Result = STATUS_SUCCESS;
+
+        for (; 0 < Length; P += 0 != P ? Part : 0, Offset += Part, Length -= Part)
+        {
+            Index = (ULONG)(Offset / MEMFS_BLOCK_SIZE);
+            BlockOffset = (SIZE_T)(Offset % MEMFS_BLOCK_SIZE);
+            Part = MEMFS_BLOCK_SIZE - BlockOffset;
+            if (Part > Length)
+                Part = Length;
+
+            for (;;)
+            {
+                AcquireSRWLockShared(&Store->Lock);
+                Block = FileNode->BlockCount > Index ? FileNode->Blocks[Index] : 0;
+                if (0 == P && 0 == Block)
+                {
+                    /* null blocks read as zeroes already */
+                    ReleaseSRWLockShared(&Store->Lock);
+                    break;
+                }
+                if (0 != Block && 1 == Block->RefCount && !Block->Indexed
+#if defined(MEMFS_SPILL)
+                    && 0 != Block->Data
+#endif
+                    )
+                {
+                    if (0 != P)
+                        memcpy(Block->Data + BlockOffset, P, Part);
+                    else
+                        memset(Block->Data + BlockOffset, 0, Part);
+#if defined(MEMFS_SPILL)
+                    Block->Dirty = TRUE;
+                    MemfsBlockTouch(Block);
+#endif
+                    ReleaseSRWLockShared(&Store->Lock);
+                    break;
+                }
+#if defined(MEMFS_SPILL)
+                Spilled = 0 != Block && 1 == Block->RefCount && 0 == Block->Data;
+#endif
+                ReleaseSRWLockShared(&Store->Lock);
+
+                if (0 == P && MEMFS_BLOCK_SIZE == Part)
+                {
+                    /* zeroing a whole block: drop it instead */
+                    AcquireSRWLockExclusive(&Store->Lock);
+                    Block = FileNode->BlockCount > Index ? FileNode->Blocks[Index] : 0;
+                    if (0 != Block)
+                    {
+                        FileNode->Blocks[Index] = 0;
+                        Block = MemfsBlockDereference(Block);
+                    }
+                    ReleaseSRWLockExclusive(&Store->Lock);
+                    if (0 != Block)
+                        MemfsBlockFree(Block);
+                    break;
+                }
+
+                if (FileNode->BlockCount <= Index)
+                    break;
+
+#if defined(MEMFS_SPILL)
+                if (Spilled)
+                    Result = MemfsFileNodeFaultBlock(Memfs, FileNode, Index);
+                else
+#endif
+                Result = MemfsFileNodePrepareBlock(Memfs, FileNode, Index);
+                if (!NT_SUCCESS(Result))
+                    goto exit;
+            }
+        }
+
+    exit:
+#if defined(MEMFS_SPILL)
+        MemfsBlockStoreTrim(Store);
+#endif
+
+        return Result;
+    }
+#endif
+
+    if (0 != Buffer)
+        memcpy((PUINT8)FileNode->FileData + Offset, Buffer, Length);
+    else
+        memset((PUINT8)FileNode->FileData + Offset, 0, Length);
+
+    return STATUS_SUCCESS;
+}
+
+#if defined(MEMFS_DEDUP)
+static VOID MemfsFileNodeDeduplicate(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode)
+{
+    for (ULONG Index = 0; FileNode->BlockCount > Index; Index++)
+        MemfsFileNodeDeduplicateBlock(Memfs, FileNode, Index);
+}
+#endif
+
+static inline
+VOID MemfsFileNodeGetFileInfo(MEMFS_FILE_NODE *FileNode, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 == FileNode->MainFileNode)
+        *FileInfo = FileNode->FileInfo;
+    else
+    {
+        *FileInfo = FileNode->MainFileNode->FileInfo;
+        FileInfo->FileAttributes &= ~FILE_ATTRIBUTE_DIRECTORY;
+            /* named streams cannot be directories */
+        FileInfo->AllocationSize = FileNode->FileInfo.AllocationSize;
+        FileInfo->FileSize = FileNode->FileInfo.FileSize;
+    }
+#else
+    *FileInfo = FileNode->FileInfo;
+#endif
+}
+
+#if defined(MEMFS_EA)
+static inline
+NTSTATUS MemfsFileNodeGetEaMap(MEMFS_FILE_NODE *FileNode, MEMFS_FILE_NODE_EA_MAP **PEaMap)
+{
+#if defined(MEMFS_NAMED_STREAMS)
+    if (0 != FileNode->MainFileNode)
+        FileNode = FileNode->MainFileNode;
+#endif
 
     *PEaMap = FileNode->EaMap;
     if (0 != *PEaMap)
@@ -739,213 +1658,1277 @@ BOOLEAN MemfsFileNodeMapEnumerateChildren(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMF
             if (!EnumFn(iter->second, Context))
                 return FALSE;
         }
-    }
-    return TRUE;
-}
+    }
+    return TRUE;
+}
+
+#if defined(MEMFS_NAMED_STREAMS)
+static inline
+BOOLEAN MemfsFileNodeMapEnumerateNamedStreams(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
+    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
+{
+    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(FileNode->FileName);
+    for (; FileNodeMap->end() != iter; ++iter)
+    {
+        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
+            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
+            break;
+        if (L':' != iter->second->FileName[wcslen(FileNode->FileName)])
+            break;
+        if (!EnumFn(iter->second, Context))
+            return FALSE;
+    }
+    return TRUE;
+}
+#endif
+
+static inline
+BOOLEAN MemfsFileNodeMapEnumerateDescendants(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
+    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
+{
+    WCHAR Root[2] = L"\\";
+    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->lower_bound(FileNode->FileName);
+    for (; FileNodeMap->end() != iter; ++iter)
+    {
+        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
+            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
+            break;
+        if (!EnumFn(iter->second, Context))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+typedef struct _MEMFS_FILE_NODE_MAP_ENUM_CONTEXT
+{
+    BOOLEAN Reference;
+    MEMFS_FILE_NODE **FileNodes;
+    ULONG Capacity, Count;
+} MEMFS_FILE_NODE_MAP_ENUM_CONTEXT;
+
+static inline
+BOOLEAN MemfsFileNodeMapEnumerateFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
+{
+    MEMFS_FILE_NODE_MAP_ENUM_CONTEXT *Context = (MEMFS_FILE_NODE_MAP_ENUM_CONTEXT *)Context0;
+
+    if (Context->Capacity <= Context->Count)
+    {
+        ULONG Capacity = 0 != Context->Capacity ? Context->Capacity * 2 : 16;
+        PVOID P = realloc(Context->FileNodes, Capacity * sizeof Context->FileNodes[0]);
+        if (0 == P)
+        {
+            FspDebugLog(__FUNCTION__ ": cannot allocate memory; aborting\n");
+            abort();
+        }
+
+        Context->FileNodes = (MEMFS_FILE_NODE **)P;
+        Context->Capacity = Capacity;
+    }
+
+    Context->FileNodes[Context->Count++] = FileNode;
+    if (Context->Reference)
+        MemfsFileNodeReference(FileNode);
+
+    return TRUE;
+}
+
+static inline
+VOID MemfsFileNodeMapEnumerateFree(MEMFS_FILE_NODE_MAP_ENUM_CONTEXT *Context)
+{
+    if (Context->Reference)
+    {
+        for (ULONG Index = 0; Context->Count > Index; Index++)
+        {
+            MEMFS_FILE_NODE *FileNode = Context->FileNodes[Index];
+            MemfsFileNodeDereference(FileNode);
+        }
+    }
+    free(Context->FileNodes);
+}
+
+#ifdef MEMFS_SLOWIO
+/*
+ * SLOWIO
+ *
+ * This is included for two uses:
+ *
+ * 1) For testing winfsp, by allowing memfs to act more like a non-ram file system,
+ *    with some IO taking many milliseconds, and some IO completion delayed.
+ *
+ * 2) As sample code for how to use winfsp's STATUS_PENDING capabilities.
+ *
+ * The delay of each Read, Write and ReadDirectory is drawn from a latency model that is
+ * configured per operation kind (see MemfsSlowioConfigure). A delay is either slept in the
+ * dispatcher thread, or, for the percentage of operations that are made pending, the
+ * operation is queued on a timer wheel. A single completion thread advances the wheel in
+ * millisecond ticks, performs the expired operations and completes them using
+ * FspFileSystemSendResponse. Completion times are as accurate as the system timer
+ * resolution permits (see timeBeginPeriod).
+ */
+
+#define MEMFS_SLOWIO_WHEEL_SIZE         1024 /* ticks (millis) */
+
+enum
+{
+    MEMFS_SLOWIO_MODEL_NONE = 0,
+    MEMFS_SLOWIO_MODEL_RAREFIED,        /* rand(MaxDelay) >> rand(RarefyDelay); the original model */
+    MEMFS_SLOWIO_MODEL_FIXED,
+    MEMFS_SLOWIO_MODEL_UNIFORM,
+    MEMFS_SLOWIO_MODEL_LOGNORMAL,
+    MEMFS_SLOWIO_MODEL_TRACE,
+};
+enum
+{
+    MEMFS_SLOWIO_READ = 0,
+    MEMFS_SLOWIO_WRITE,
+    MEMFS_SLOWIO_READ_DIRECTORY,
+    MEMFS_SLOWIO_KIND_COUNT,
+};
+static PWSTR SlowioKindNames[MEMFS_SLOWIO_KIND_COUNT] = { L"read", L"write", L"readdir" };
+
+typedef struct _MEMFS_SLOWIO_MODEL
+{
+    ULONG Type;
+    double Param[2];                    /* micros; lognormal: median micros, sigma */
+    PULONG Trace;                       /* micros */
+    ULONG TraceCount;
+    volatile LONG TraceIndex;
+} MEMFS_SLOWIO_MODEL;
+
+typedef struct _MEMFS_SLOWIO_REQUEST
+{
+    struct _MEMFS_SLOWIO_REQUEST *Next;
+    UINT64 DueTick;
+    UINT32 Kind;
+    UINT64 Hint;
+    MEMFS_FILE_NODE *FileNode;
+    PVOID Buffer;
+    UINT64 Offset;
+    UINT64 EndOffset;
+    ULONG BytesTransferred;
+} MEMFS_SLOWIO_REQUEST;
+
+typedef struct _MEMFS_SLOWIO
+{
+    MEMFS_SLOWIO_MODEL Model[MEMFS_SLOWIO_KIND_COUNT];
+    SRWLOCK Lock;
+    MEMFS_SLOWIO_REQUEST *Wheel[MEMFS_SLOWIO_WHEEL_SIZE];
+    ULONG PendingCount;
+    UINT64 Tick;                        /* last tick that has been processed */
+    UINT64 Frequency;
+    UINT64 StartCounter;
+    HANDLE Thread;
+    HANDLE StopEvent;
+    HANDLE WorkEvent;
+} MEMFS_SLOWIO;
+
+static inline UINT64 Hash(UINT64 x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    x =  x ^ (x >> 31);
+    return x;
+}
+
+static inline UINT64 PseudoRandom64(VOID)
+{
+    /* John Oberschelp's PRNG */
+    static UINT64 spin = 0;
+    InterlockedIncrement(&spin);
+    return Hash(spin);
+}
+
+static inline ULONG PseudoRandom(ULONG to)
+{
+    return PseudoRandom64() % to;
+}
+
+static inline double PseudoRandomUnit(VOID)
+{
+    /* uniform in (0, 1] */
+    return ((PseudoRandom64() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static inline ULONG SlowioKindIndex(UINT32 Kind)
+{
+    switch (Kind)
+    {
+    case FspFsctlTransactReadKind:
+        return MEMFS_SLOWIO_READ;
+    case FspFsctlTransactWriteKind:
+        return MEMFS_SLOWIO_WRITE;
+    default:
+        return MEMFS_SLOWIO_READ_DIRECTORY;
+    }
+}
+
+static UINT64 SlowioDelay(MEMFS *Memfs, UINT32 Kind)
+{
+    /* returns micros */
+    MEMFS_SLOWIO_MODEL *Model = &Memfs->Slowio->Model[SlowioKindIndex(Kind)];
+    double Delay;
+
+    switch (Model->Type)
+    {
+    case MEMFS_SLOWIO_MODEL_RAREFIED:
+        return 1000ULL * (PseudoRandom(Memfs->SlowioMaxDelay + 1) >>
+            PseudoRandom(Memfs->SlowioRarefyDelay + 1));
+    case MEMFS_SLOWIO_MODEL_FIXED:
+        Delay = Model->Param[0];
+        break;
+    case MEMFS_SLOWIO_MODEL_UNIFORM:
+        Delay = Model->Param[0] + (Model->Param[1] - Model->Param[0]) * (1.0 - PseudoRandomUnit());
+        break;
+    case MEMFS_SLOWIO_MODEL_LOGNORMAL:
+        /* Box-Muller; log(Delay) is normal with mean log(median) */
+        Delay = Model->Param[0] * exp(Model->Param[1] *
+            sqrt(-2.0 * log(PseudoRandomUnit())) * cos(2.0 * 3.14159265358979323846 * PseudoRandomUnit()));
+        break;
+    case MEMFS_SLOWIO_MODEL_TRACE:
+        return Model->Trace[(ULONG)InterlockedIncrement(&Model->TraceIndex) % Model->TraceCount];
+    default:
+        return 0;
+    }
+
+    return 0 < Delay ? (UINT64)Delay : 0;
+}
+
+static inline UINT64 SlowioGetTick(MEMFS_SLOWIO *Slowio)
+{
+    LARGE_INTEGER Counter;
+    QueryPerformanceCounter(&Counter);
+    return (Counter.QuadPart - Slowio->StartCounter) * 1000 / Slowio->Frequency;
+}
+
+static inline BOOLEAN SlowioReturnPending(FSP_FILE_SYSTEM *FileSystem)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    if (0 == Memfs->Slowio)
+        return FALSE;
+    return PseudoRandom(100) < Memfs->SlowioPercentDelay;
+}
+
+static inline VOID SlowioSnooze(FSP_FILE_SYSTEM *FileSystem, UINT32 Kind)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    if (0 == Memfs->Slowio)
+        return;
+    UINT64 micros = SlowioDelay(Memfs, Kind);
+    if (0 != micros)
+        Sleep((DWORD)((micros + 999) / 1000));
+}
+
+static BOOLEAN SlowioPostRequest(
+    FSP_FILE_SYSTEM *FileSystem,
+    UINT32 Kind,
+    UINT64 Hint,
+    MEMFS_FILE_NODE *FileNode,
+    PVOID Buffer,
+    UINT64 Offset,
+    UINT64 EndOffset,
+    ULONG BytesTransferred)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    MEMFS_SLOWIO *Slowio = Memfs->Slowio;
+    MEMFS_SLOWIO_REQUEST *Request;
+    UINT64 DelayTicks, DueTick;
+    BOOLEAN WasIdle;
+
+    Request = (MEMFS_SLOWIO_REQUEST *)malloc(sizeof *Request);
+    if (0 == Request)
+        return FALSE;
+
+    DelayTicks = (SlowioDelay(Memfs, Kind) + 999) / 1000;
+
+    Request->Kind = Kind;
+    Request->Hint = Hint;
+    Request->FileNode = FileNode;
+    Request->Buffer = Buffer;
+    Request->Offset = Offset;
+    Request->EndOffset = EndOffset;
+    Request->BytesTransferred = BytesTransferred;
+
+    AcquireSRWLockExclusive(&Slowio->Lock);
+    DueTick = SlowioGetTick(Slowio) + DelayTicks;
+    if (DueTick <= Slowio->Tick)
+        DueTick = Slowio->Tick + 1; /* must land on a tick that has not been processed */
+    Request->DueTick = DueTick;
+    Request->Next = Slowio->Wheel[DueTick % MEMFS_SLOWIO_WHEEL_SIZE];
+    Slowio->Wheel[DueTick % MEMFS_SLOWIO_WHEEL_SIZE] = Request;
+    WasIdle = 0 == Slowio->PendingCount++;
+    ReleaseSRWLockExclusive(&Slowio->Lock);
+
+    if (WasIdle)
+        SetEvent(Slowio->WorkEvent);
+
+    return TRUE;
+}
+
+static VOID SlowioCompleteRequest(FSP_FILE_SYSTEM *FileSystem, MEMFS_SLOWIO_REQUEST *Request)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    FSP_FSCTL_TRANSACT_RSP ResponseBuf;
+    NTSTATUS Result = STATUS_SUCCESS;
+    ULONG BytesTransferred;
+
+    memset(&ResponseBuf, 0, sizeof ResponseBuf);
+    ResponseBuf.Size = sizeof ResponseBuf;
+    ResponseBuf.Kind = Request->Kind;
+    ResponseBuf.Hint = Request->Hint;                       // IRP that is being completed
+
+    switch (Request->Kind)
+    {
+    case FspFsctlTransactReadKind:
+        Result = MemfsFileNodeReadData(Memfs, Request->FileNode,
+            Request->Buffer, Request->Offset, (size_t)(Request->EndOffset - Request->Offset));
+        BytesTransferred = NT_SUCCESS(Result) ? (ULONG)(Request->EndOffset - Request->Offset) : 0;
+        break;
+    case FspFsctlTransactWriteKind:
+        Result = MemfsFileNodeWriteData(Memfs, Request->FileNode,
+            Request->Buffer, Request->Offset, (size_t)(Request->EndOffset - Request->Offset));
+        BytesTransferred = NT_SUCCESS(Result) ? (ULONG)(Request->EndOffset - Request->Offset) : 0;
+        MemfsFileNodeGetFileInfo(Request->FileNode, &ResponseBuf.Rsp.Write.FileInfo);
+        break;
+    default:
+        /* directory info has already been placed in the buffer */
+        BytesTransferred = Request->BytesTransferred;
+        break;
+    }
+
+    ResponseBuf.IoStatus.Status = Result;
+    ResponseBuf.IoStatus.Information = BytesTransferred;    // bytes transferred
+    FspFileSystemSendResponse(FileSystem, &ResponseBuf);
+}
+
+static DWORD WINAPI SlowioThread(PVOID FileSystem0)
+{
+    FSP_FILE_SYSTEM *FileSystem = (FSP_FILE_SYSTEM *)FileSystem0;
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    MEMFS_SLOWIO *Slowio = Memfs->Slowio;
+    HANDLE WaitObjects[2] = { Slowio->StopEvent, Slowio->WorkEvent };
+    MEMFS_SLOWIO_REQUEST *Expired, *Request, **P;
+    UINT64 Now, Tick;
+    ULONG Count;
+    DWORD WaitResult;
+    BOOLEAN Stop = FALSE;
+
+    while (!Stop)
+    {
+        AcquireSRWLockShared(&Slowio->Lock);
+        Count = Slowio->PendingCount;
+        ReleaseSRWLockShared(&Slowio->Lock);
+
+        WaitResult = WaitForMultipleObjects(2, WaitObjects, FALSE, 0 != Count ? 1 : INFINITE);
+        Stop = WAIT_OBJECT_0 + 1 != WaitResult && WAIT_TIMEOUT != WaitResult;
+
+        /* visit the slots of the ticks that have elapsed; when stopping expire everything */
+        Expired = 0;
+        AcquireSRWLockExclusive(&Slowio->Lock);
+        Now = SlowioGetTick(Slowio);
+        Count = Stop || MEMFS_SLOWIO_WHEEL_SIZE <= Now - Slowio->Tick ?
+            MEMFS_SLOWIO_WHEEL_SIZE : (ULONG)(Now - Slowio->Tick);
+        for (Tick = Slowio->Tick + 1; 0 < Count; Tick++, Count--)
+            for (P = &Slowio->Wheel[Tick % MEMFS_SLOWIO_WHEEL_SIZE]; 0 != (Request = *P);)
+                if (Stop || Request->DueTick <= Now)
+                {
+                    *P = Request->Next;
+                    Request->Next = Expired;
+                    Expired = Request;
+                    Slowio->PendingCount--;
+                }
+                else
+                    P = &Request->Next;
+        Slowio->Tick = Now;
+        ReleaseSRWLockExclusive(&Slowio->Lock);
+
+        while (0 != (Request = Expired))
+        {
+            Expired = Request->Next;
+            SlowioCompleteRequest(FileSystem, Request);
+            free(Request);
+        }
+    }
+
+    return 0;
+}
+
+static NTSTATUS SlowioCreate(MEMFS *Memfs)
+{
+    MEMFS_SLOWIO *Slowio;
+    LARGE_INTEGER Frequency;
+
+    if (0 != Memfs->Slowio)
+        return STATUS_SUCCESS;
+
+    Slowio = (MEMFS_SLOWIO *)malloc(sizeof *Slowio);
+    if (0 == Slowio)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(Slowio, 0, sizeof *Slowio);
+    InitializeSRWLock(&Slowio->Lock);
+    QueryPerformanceFrequency(&Frequency);
+    Slowio->Frequency = Frequency.QuadPart;
+    for (ULONG Index = 0; MEMFS_SLOWIO_KIND_COUNT > Index; Index++)
+        Slowio->Model[Index].Type = 0 != Memfs->SlowioMaxDelay ?
+            MEMFS_SLOWIO_MODEL_RAREFIED : MEMFS_SLOWIO_MODEL_NONE;
+    Slowio->StopEvent = CreateEventW(0, TRUE, FALSE, 0);
+    Slowio->WorkEvent = CreateEventW(0, FALSE, FALSE, 0);
+    Memfs->Slowio = Slowio;
+
+    if (0 == Slowio->StopEvent || 0 == Slowio->WorkEvent)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID SlowioDelete(MEMFS *Memfs)
+{
+    MEMFS_SLOWIO *Slowio = Memfs->Slowio;
+
+    if (0 == Slowio)
+        return;
+
+    for (ULONG Index = 0; MEMFS_SLOWIO_KIND_COUNT > Index; Index++)
+        free(Slowio->Model[Index].Trace);
+    if (0 != Slowio->StopEvent)
+        CloseHandle(Slowio->StopEvent);
+    if (0 != Slowio->WorkEvent)
+        CloseHandle(Slowio->WorkEvent);
+    free(Slowio);
+
+    Memfs->Slowio = 0;
+}
+
+static NTSTATUS SlowioStart(FSP_FILE_SYSTEM *FileSystem)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    MEMFS_SLOWIO *Slowio = Memfs->Slowio;
+    LARGE_INTEGER Counter;
+
+    if (0 == Slowio)
+        return STATUS_SUCCESS;
+
+    QueryPerformanceCounter(&Counter);
+    Slowio->StartCounter = Counter.QuadPart;
+    Slowio->Tick = 0;
+    ResetEvent(Slowio->StopEvent);
+
+    Slowio->Thread = CreateThread(0, 0, SlowioThread, FileSystem, 0, 0);
+    if (0 == Slowio->Thread)
+        return FspNtStatusFromWin32(GetLastError());
+
+    return STATUS_SUCCESS;
+}
+
+static VOID SlowioStop(FSP_FILE_SYSTEM *FileSystem)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    MEMFS_SLOWIO *Slowio = Memfs->Slowio;
+
+    if (0 == Slowio || 0 == Slowio->Thread)
+        return;
+
+    /* the completion thread completes all queued requests before it exits */
+    SetEvent(Slowio->StopEvent);
+    WaitForSingleObject(Slowio->Thread, INFINITE);
+    CloseHandle(Slowio->Thread);
+    Slowio->Thread = 0;
+}
+
+static NTSTATUS SlowioLoadTrace(PWSTR TracePath, ULONG KindIndex, MEMFS_SLOWIO_MODEL *Model)
+{
+    /*
+     * A trace file is a text file with one delay in millis per line. A line may start
+     * with an operation kind (read, write, readdir), in which case it only applies to
+     * operations of that kind. Lines that cannot be parsed are ignored.
+     */
+    HANDLE Handle;
+    LARGE_INTEGER FileSize;
+    PSTR Text = 0, P, EndP, Line;
+    DWORD BytesTransferred;
+    PULONG Trace = 0;
+    ULONG TraceCount = 0, Kind;
+    double Delay;
+    NTSTATUS Result;
+
+    Handle = CreateFileW(TracePath,
+        GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return FspNtStatusFromWin32(GetLastError());
+
+    if (!GetFileSizeEx(Handle, &FileSize))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    if (16 * 1024 * 1024 < FileSize.QuadPart)
+    {
+        Result = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    Text = (PSTR)malloc((size_t)FileSize.QuadPart + 1);
+    Trace = (PULONG)malloc(((size_t)FileSize.QuadPart / 2 + 1) * sizeof(ULONG));
+    if (0 == Text || 0 == Trace)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+    if (!ReadFile(Handle, Text, (DWORD)FileSize.QuadPart, &BytesTransferred, 0))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    Text[BytesTransferred] = '\0';
+
+    for (P = Text, EndP = Text + BytesTransferred; EndP > P; P++)
+    {
+        Line = P;
+        for (; EndP > P && '\n' != *P; P++)
+            ;
+        *P = '\0';
+
+        while (' ' == *Line || '\t' == *Line)
+            Line++;
+        Kind = KindIndex;
+        for (ULONG Index = 0; MEMFS_SLOWIO_KIND_COUNT > Index; Index++)
+        {
+            size_t Length = wcslen(SlowioKindNames[Index]);
+            ULONG I;
+            for (I = 0; Length > I && (WCHAR)(Line[I] | 0x20) == SlowioKindNames[Index][I]; I++)
+                ;
+            if (Length == I && (' ' == Line[Length] || '\t' == Line[Length]))
+            {
+                Kind = Index;
+                Line += Length;
+                break;
+            }
+        }
+        if (Kind != KindIndex)
+            continue;
+
+        Delay = strtod(Line, &P);
+        if (P != Line && 0 <= Delay && (' ' == *P || '\t' == *P || '\r' == *P || '\0' == *P))
+            Trace[TraceCount++] = (ULONG)(Delay * 1000);
+        P = Line + strlen(Line);
+    }
+
+    if (0 == TraceCount)
+    {
+        Result = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    free(Model->Trace);
+    Model->Trace = Trace;
+    Model->TraceCount = TraceCount;
+    Model->TraceIndex = -1;
+    Trace = 0;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    free(Trace);
+    free(Text);
+    CloseHandle(Handle);
+
+    return Result;
+}
+
+static BOOLEAN SlowioParseNumber(PWSTR *PP, WCHAR Terminator, double *PValue)
+{
+    PWSTR P = *PP, EndP;
+
+    *PValue = wcstod(P, &EndP);
+    if (EndP == P || Terminator != *EndP || 0 > *PValue)
+        return FALSE;
+
+    *PP = EndP + (L'\0' != Terminator);
+    return TRUE;
+}
+
+static NTSTATUS SlowioParseModel(PWSTR Spec, ULONG KindIndex, MEMFS_SLOWIO_MODEL *Model)
+{
+    PWSTR P;
+    ULONG Type;
+    double A, B = 0;
+    NTSTATUS Result;
+
+    if (0 == _wcsnicmp(Spec, L"trace:", 6))
+    {
+        Result = SlowioLoadTrace(Spec + 6, KindIndex, Model);
+        if (NT_SUCCESS(Result))
+            Model->Type = MEMFS_SLOWIO_MODEL_TRACE;
+        return Result;
+    }
+
+    if (0 == _wcsnicmp(Spec, L"fixed:", 6))
+    {
+        Type = MEMFS_SLOWIO_MODEL_FIXED;
+        P = Spec + 6;
+        if (!SlowioParseNumber(&P, L'\0', &A))
+            return STATUS_INVALID_PARAMETER;
+    }
+    else if (0 == _wcsnicmp(Spec, L"uniform:", 8))
+    {
+        Type = MEMFS_SLOWIO_MODEL_UNIFORM;
+        P = Spec + 8;
+        if (!SlowioParseNumber(&P, L'-', &A) || !SlowioParseNumber(&P, L'\0', &B) || B < A)
+            return STATUS_INVALID_PARAMETER;
+        B *= 1000;
+    }
+    else if (0 == _wcsnicmp(Spec, L"lognormal:", 10))
+    {
+        Type = MEMFS_SLOWIO_MODEL_LOGNORMAL;
+        P = Spec + 10;
+        if (!SlowioParseNumber(&P, L',', &A) || !SlowioParseNumber(&P, L'\0', &B))
+            return STATUS_INVALID_PARAMETER;
+    }
+    else
+        return STATUS_INVALID_PARAMETER;
+
+    Model->Type = Type;
+    Model->Param[0] = A * 1000;
+    Model->Param[1] = B;
+
+    return STATUS_SUCCESS;
+}
+#endif
+
+#if defined(MEMFS_SNAPSHOT)
+/*
+ * SNAPSHOT
+ *
+ * A snapshot image is a single file that contains a header, followed by one record per
+ * file node, followed by the file data region. Records are written in FileNodeMap order,
+ * so that a directory precedes its children and a main stream precedes its named streams.
+ * Each record holds the FileInfo, file name, security descriptor, reparse data and EA of
+ * a file node; file data is referenced by offset into the data region.
+ *
+ * When an image is loaded it is mapped copy-on-write and file data is left in the mapping,
+ * so that it is faulted in by the OS as it is accessed. File data is moved to the heap only
+ * when the allocation size of a file changes. Writes to unmoved file data are absorbed by
+ * the copy-on-write mapping and never reach the image.
+ *
+ * Snapshots are taken with all file system operations excluded (see MemfsEnterOperation).
+ * They are consistent with respect to the namespace; file data that is being written by
+ * a pending (SLOWIO) write at the time of a snapshot may be captured partially.
+ */
+
+#define MEMFS_SNAPSHOT_VERSION          1
+#define MEMFS_SNAPSHOT_ALIGNMENT        16
+
+typedef struct _MEMFS_SNAPSHOT_HEADER
+{
+    UINT8 Signature[8];                 /* "MEMFSIMG" */
+    UINT32 Version;
+    UINT32 CaseInsensitive;
+    UINT64 NodeCount;
+    UINT64 DataOffset;
+    UINT64 ImageSize;
+    UINT64 IndexNumber;
+    UINT16 VolumeLabelLength;
+    WCHAR VolumeLabel[32];
+} MEMFS_SNAPSHOT_HEADER;
+
+typedef struct _MEMFS_SNAPSHOT_RECORD
+{
+    UINT32 Size;
+    UINT32 FileNameSize;
+    UINT32 FileSecuritySize;
+    UINT32 ReparseDataSize;
+    UINT32 EaSize;
+    UINT32 Reserved;
+    UINT64 FileDataOffset;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    /* followed by FileName, FileSecurity, ReparseData, Ea; each aligned */
+} MEMFS_SNAPSHOT_RECORD;
+
+static const UINT8 MemfsSnapshotSignature[8] = { 'M', 'E', 'M', 'F', 'S', 'I', 'M', 'G' };
+
+static inline
+PWSTR MemfsSnapshotPathWithSuffix(PWSTR Path, PWSTR Suffix)
+{
+    size_t PathLength = wcslen(Path);
+    size_t SuffixLength = wcslen(Suffix);
+    PWSTR Result = (PWSTR)malloc((PathLength + SuffixLength + 1) * sizeof(WCHAR));
+    if (0 == Result)
+        return 0;
+    memcpy(Result, Path, PathLength * sizeof(WCHAR));
+    memcpy(Result + PathLength, Suffix, (SuffixLength + 1) * sizeof(WCHAR));
+    return Result;
+}
+
+#if defined(MEMFS_EA)
+static ULONG MemfsSnapshotEaSize(MEMFS_FILE_NODE *FileNode)
+{
+    ULONG EaSize = 0;
+
+    if (0 != FileNode->EaMap)
+    {
+        for (MEMFS_FILE_NODE_EA_MAP::iterator p = FileNode->EaMap->begin(), q = FileNode->EaMap->end();
+            p != q; ++p)
+            EaSize += FSP_FSCTL_ALIGN_UP(FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) +
+                p->second->EaNameLength + 1 + p->second->EaValueLength, sizeof(ULONG));
+    }
+
+    return EaSize;
+}
+#endif
+
+static BOOLEAN MemfsSnapshotWriteFile(HANDLE Handle, PVOID Buffer, UINT64 Length)
+{
+    DWORD BytesTransferred;
+
+    for (PUINT8 P = (PUINT8)Buffer; 0 != Length;)
+    {
+        DWORD Chunk = 0x40000000 < Length ? 0x40000000 : (DWORD)Length;
+        if (!WriteFile(Handle, P, Chunk, &BytesTransferred, 0))
+            return FALSE;
+        P += BytesTransferred;
+        Length -= BytesTransferred;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN MemfsSnapshotWriteFileData(MEMFS *Memfs, HANDLE Handle, MEMFS_FILE_NODE *FileNode)
+{
+#if defined(MEMFS_DEDUP)
+    if (Memfs->BlockMode)
+    {
+        /* go through MemfsFileNodeReadData so that spilled blocks are read back */
+        UINT64 Offset = 0, Length = FileNode->FileInfo.AllocationSize;
+        PVOID Buffer;
+        BOOLEAN Success = TRUE;
+
+        if (0 == Length)
+            return TRUE;
+
+        Buffer = malloc(MEMFS_BLOCK_SIZE);
+        if (0 == Buffer)
+            return FALSE;
+
+        while (0 != Length)
+        {
+            DWORD Part = MEMFS_BLOCK_SIZE < Length ? MEMFS_BLOCK_SIZE : (DWORD)Length;
+            if (!NT_SUCCESS(MemfsFileNodeReadData(Memfs, FileNode, Buffer, Offset, Part)))
+            {
+                /* do not write a snapshot with holes in it */
+                SetLastError(ERROR_READ_FAULT);
+                Success = FALSE;
+                break;
+            }
+            if (!MemfsSnapshotWriteFile(Handle, Buffer, Part))
+            {
+                Success = FALSE;
+                break;
+            }
+            Offset += Part;
+            Length -= Part;
+        }
+
+        free(Buffer);
+
+        return Success;
+    }
+#endif
+
+    return MemfsSnapshotWriteFile(Handle, FileNode->FileData, FileNode->FileInfo.AllocationSize);
+}
+
+static NTSTATUS MemfsSnapshotWrite(MEMFS *Memfs)
+{
+    static UINT8 Padding[MEMFS_SNAPSHOT_ALIGNMENT];
+    MEMFS_FILE_NODE_MAP *FileNodeMap = Memfs->FileNodeMap;
+    PWSTR TempPath = 0, AsidePath = 0;
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    MEMFS_SNAPSHOT_HEADER *Header;
+    MEMFS_SNAPSHOT_RECORD *Record;
+    PUINT8 Meta = 0, P;
+    UINT64 MetaSize, DataSize, DataOffset;
+    NTSTATUS Result;
+
+    TempPath = MemfsSnapshotPathWithSuffix(Memfs->SnapshotPath, L".tmp");
+    AsidePath = MemfsSnapshotPathWithSuffix(Memfs->SnapshotPath, L".old");
+    if (0 == TempPath || 0 == AsidePath)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    /* pass 1: compute the size of the metadata and data regions */
+    MetaSize = sizeof(MEMFS_SNAPSHOT_HEADER);
+    DataSize = 0;
+    for (MEMFS_FILE_NODE_MAP::iterator p = FileNodeMap->begin(), q = FileNodeMap->end(); p != q; ++p)
+    {
+        MEMFS_FILE_NODE *FileNode = p->second;
+        MetaSize += FSP_FSCTL_ALIGN_UP(sizeof(MEMFS_SNAPSHOT_RECORD), MEMFS_SNAPSHOT_ALIGNMENT) +
+            FSP_FSCTL_ALIGN_UP(wcslen(FileNode->FileName) * sizeof(WCHAR), MEMFS_SNAPSHOT_ALIGNMENT) +
+            FSP_FSCTL_ALIGN_UP(FileNode->FileSecuritySize, MEMFS_SNAPSHOT_ALIGNMENT);
+#if defined(MEMFS_REPARSE_POINTS)
+        MetaSize += FSP_FSCTL_ALIGN_UP(FileNode->ReparseDataSize, MEMFS_SNAPSHOT_ALIGNMENT);
+#endif
+#if defined(MEMFS_EA)
+        MetaSize += FSP_FSCTL_ALIGN_UP(MemfsSnapshotEaSize(FileNode), MEMFS_SNAPSHOT_ALIGNMENT);
+#endif
+        DataSize += FSP_FSCTL_ALIGN_UP(FileNode->FileInfo.AllocationSize, MEMFS_SNAPSHOT_ALIGNMENT);
+    }
+    DataOffset = FSP_FSCTL_ALIGN_UP(MetaSize, 4096);
+
+    Meta = (PUINT8)calloc(1, (size_t)DataOffset);
+    if (0 == Meta)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    /* pass 2: fill in the metadata region */
+    Header = (MEMFS_SNAPSHOT_HEADER *)Meta;
+    memcpy(Header->Signature, MemfsSnapshotSignature, sizeof Header->Signature);
+    Header->Version = MEMFS_SNAPSHOT_VERSION;
+    Header->CaseInsensitive = MemfsFileNodeMapIsCaseInsensitive(FileNodeMap);
+    Header->NodeCount = MemfsFileNodeMapCount(FileNodeMap);
+    Header->DataOffset = DataOffset;
+    Header->ImageSize = DataOffset + DataSize;
+    Header->IndexNumber = MemfsFileNodeIndexNumber;
+    Header->VolumeLabelLength = Memfs->VolumeLabelLength;
+    memcpy(Header->VolumeLabel, Memfs->VolumeLabel, Memfs->VolumeLabelLength);
+    P = Meta + sizeof(MEMFS_SNAPSHOT_HEADER);
+    DataSize = 0;
+    for (MEMFS_FILE_NODE_MAP::iterator p = FileNodeMap->begin(), q = FileNodeMap->end(); p != q; ++p)
+    {
+        MEMFS_FILE_NODE *FileNode = p->second;
+        PUINT8 RecordP = P;
+
+        Record = (MEMFS_SNAPSHOT_RECORD *)RecordP;
+        Record->FileNameSize = (UINT32)(wcslen(FileNode->FileName) * sizeof(WCHAR));
+        Record->FileSecuritySize = (UINT32)FileNode->FileSecuritySize;
+        Record->FileDataOffset = DataSize;
+        Record->FileInfo = FileNode->FileInfo;
+        P += FSP_FSCTL_ALIGN_UP(sizeof(MEMFS_SNAPSHOT_RECORD), MEMFS_SNAPSHOT_ALIGNMENT);
+
+        memcpy(P, FileNode->FileName, Record->FileNameSize);
+        P += FSP_FSCTL_ALIGN_UP(Record->FileNameSize, MEMFS_SNAPSHOT_ALIGNMENT);
+        memcpy(P, FileNode->FileSecurity, Record->FileSecuritySize);
+        P += FSP_FSCTL_ALIGN_UP(Record->FileSecuritySize, MEMFS_SNAPSHOT_ALIGNMENT);
+#if defined(MEMFS_REPARSE_POINTS)
+        Record->ReparseDataSize = (UINT32)FileNode->ReparseDataSize;
+        memcpy(P, FileNode->ReparseData, Record->ReparseDataSize);
+        P += FSP_FSCTL_ALIGN_UP(Record->ReparseDataSize, MEMFS_SNAPSHOT_ALIGNMENT);
+#endif
+#if defined(MEMFS_EA)
+        if (0 != FileNode->EaMap)
+        {
+            ULONG EaSize = MemfsSnapshotEaSize(FileNode), BytesTransferred = 0;
+            for (MEMFS_FILE_NODE_EA_MAP::iterator e = FileNode->EaMap->begin(), f = FileNode->EaMap->end();
+                e != f; ++e)
+                FspFileSystemAddEa(e->second, (PFILE_FULL_EA_INFORMATION)P, EaSize, &BytesTransferred);
+            FspFileSystemAddEa(0, (PFILE_FULL_EA_INFORMATION)P, EaSize, &BytesTransferred);
+            Record->EaSize = BytesTransferred;
+            P += FSP_FSCTL_ALIGN_UP(EaSize, MEMFS_SNAPSHOT_ALIGNMENT);
+        }
+#endif
+
+        Record->Size = (UINT32)(P - RecordP);
+        DataSize += FSP_FSCTL_ALIGN_UP(FileNode->FileInfo.AllocationSize, MEMFS_SNAPSHOT_ALIGNMENT);
+    }
+
+    Handle = CreateFileW(TempPath,
+        GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    /* pass 3: write the metadata region followed by the data region */
+    if (!MemfsSnapshotWriteFile(Handle, Meta, DataOffset))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    for (MEMFS_FILE_NODE_MAP::iterator p = FileNodeMap->begin(), q = FileNodeMap->end(); p != q; ++p)
+    {
+        MEMFS_FILE_NODE *FileNode = p->second;
+        UINT64 Length = FileNode->FileInfo.AllocationSize;
+        if (!MemfsSnapshotWriteFileData(Memfs, Handle, FileNode) ||
+            !MemfsSnapshotWriteFile(Handle, Padding,
+                FSP_FSCTL_ALIGN_UP(Length, MEMFS_SNAPSHOT_ALIGNMENT) - Length))
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+    }
+
+    if (!FlushFileBuffers(Handle))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    CloseHandle(Handle);
+    Handle = INVALID_HANDLE_VALUE;
+
+    /*
+     * The image that we loaded from may still be mapped and therefore cannot be replaced.
+     * It was opened with FILE_SHARE_DELETE, so we can rename it out of the way; it is
+     * deleted when the mapping goes away.
+     */
+    if (0 != Memfs->SnapshotView && !Memfs->SnapshotFileIsAside)
+    {
+        if (!MoveFileExW(Memfs->SnapshotPath, AsidePath, MOVEFILE_REPLACE_EXISTING))
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+        Memfs->SnapshotFileIsAside = TRUE;
+    }
+
+    if (!MoveFileExW(TempPath, Memfs->SnapshotPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (INVALID_HANDLE_VALUE != Handle)
+    {
+        CloseHandle(Handle);
+        DeleteFileW(TempPath);
+    }
+
+    free(Meta);
+    free(AsidePath);
+    free(TempPath);
+
+    return Result;
+}
+
+static NTSTATUS MemfsSnapshotRead(MEMFS *Memfs)
+{
+    MEMFS_FILE_NODE_MAP *FileNodeMap = 0;
+    MEMFS_FILE_NODE *FileNode;
+    HANDLE Handle = INVALID_HANDLE_VALUE, Mapping = 0;
+    PUINT8 View = 0, P, EndP;
+    LARGE_INTEGER FileSize;
+    MEMFS_SNAPSHOT_HEADER *Header;
+    MEMFS_SNAPSHOT_RECORD *Record;
+    WCHAR FileName[MEMFS_MAX_PATH];
+    UINT64 NodeCount, IndexNumber;
+    BOOLEAN Inserted;
+    NTSTATUS Result;
+
+    Handle = CreateFileW(Memfs->SnapshotPath,
+        GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+    {
+        Result = ERROR_FILE_NOT_FOUND == GetLastError() ?
+            STATUS_SUCCESS : FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    if (!GetFileSizeEx(Handle, &FileSize))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    if ((UINT64)FileSize.QuadPart < sizeof(MEMFS_SNAPSHOT_HEADER))
+    {
+        Result = STATUS_FILE_CORRUPT_ERROR;
+        goto exit;
+    }
+
+    Mapping = CreateFileMappingW(Handle, 0, PAGE_WRITECOPY, 0, 0, 0);
+    if (0 == Mapping)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    View = (PUINT8)MapViewOfFile(Mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (0 == View)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    Header = (MEMFS_SNAPSHOT_HEADER *)View;
+    if (0 != memcmp(Header->Signature, MemfsSnapshotSignature, sizeof Header->Signature) ||
+        MEMFS_SNAPSHOT_VERSION != Header->Version ||
+        Header->ImageSize != (UINT64)FileSize.QuadPart ||
+        Header->DataOffset > Header->ImageSize ||
+        Header->VolumeLabelLength > sizeof Header->VolumeLabel)
+    {
+        Result = STATUS_FILE_CORRUPT_ERROR;
+        goto exit;
+    }
+
+    Result = MemfsFileNodeMapCreate(MemfsFileNodeMapIsCaseInsensitive(Memfs->FileNodeMap),
+        &FileNodeMap);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    IndexNumber = Header->IndexNumber;
+    P = View + sizeof(MEMFS_SNAPSHOT_HEADER);
+    EndP = View + Header->DataOffset;
+    for (NodeCount = Header->NodeCount; 0 < NodeCount; NodeCount--)
+    {
+        PUINT8 RecordP = P;
+
+        Record = (MEMFS_SNAPSHOT_RECORD *)RecordP;
+        if (EndP < P + sizeof(MEMFS_SNAPSHOT_RECORD) ||
+            EndP - P < Record->Size ||
+            sizeof FileName <= Record->FileNameSize ||
+            Record->Size < (UINT64)
+                FSP_FSCTL_ALIGN_UP(sizeof(MEMFS_SNAPSHOT_RECORD), MEMFS_SNAPSHOT_ALIGNMENT) +
+                FSP_FSCTL_ALIGN_UP((UINT64)Record->FileNameSize, MEMFS_SNAPSHOT_ALIGNMENT) +
+                FSP_FSCTL_ALIGN_UP((UINT64)Record->FileSecuritySize, MEMFS_SNAPSHOT_ALIGNMENT) +
+                FSP_FSCTL_ALIGN_UP((UINT64)Record->ReparseDataSize, MEMFS_SNAPSHOT_ALIGNMENT) +
+                FSP_FSCTL_ALIGN_UP((UINT64)Record->EaSize, MEMFS_SNAPSHOT_ALIGNMENT) ||
+            Header->ImageSize - Header->DataOffset < Record->FileDataOffset ||
+            Header->ImageSize - Header->DataOffset - Record->FileDataOffset <
+                Record->FileInfo.AllocationSize)
+        {
+            Result = STATUS_FILE_CORRUPT_ERROR;
+            goto exit;
+        }
+        P += FSP_FSCTL_ALIGN_UP(sizeof(MEMFS_SNAPSHOT_RECORD), MEMFS_SNAPSHOT_ALIGNMENT);
+
+        memcpy(FileName, P, Record->FileNameSize);
+        FileName[Record->FileNameSize / sizeof(WCHAR)] = L'\0';
+        P += FSP_FSCTL_ALIGN_UP(Record->FileNameSize, MEMFS_SNAPSHOT_ALIGNMENT);
+
+        Result = MemfsFileNodeCreate(FileName, &FileNode);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+        FileNode->FileInfo = Record->FileInfo;
+        if (IndexNumber <= FileNode->FileInfo.IndexNumber)
+            IndexNumber = FileNode->FileInfo.IndexNumber + 1;
+
+        if (0 != Record->FileSecuritySize)
+        {
+            Result = FspInternSecurityDescriptor(P, &FileNode->FileSecurity);
+            if (!NT_SUCCESS(Result))
+            {
+                MemfsFileNodeDelete(FileNode);
+                goto exit;
+            }
+            FileNode->FileSecuritySize = Record->FileSecuritySize;
+            P += FSP_FSCTL_ALIGN_UP(Record->FileSecuritySize, MEMFS_SNAPSHOT_ALIGNMENT);
+        }
+
+#if defined(MEMFS_REPARSE_POINTS)
+        if (0 != Record->ReparseDataSize)
+        {
+            FileNode->ReparseData = malloc(Record->ReparseDataSize);
+            if (0 == FileNode->ReparseData)
+            {
+                MemfsFileNodeDelete(FileNode);
+                Result = STATUS_INSUFFICIENT_RESOURCES;
+                goto exit;
+            }
+            FileNode->ReparseDataSize = Record->ReparseDataSize;
+            memcpy(FileNode->ReparseData, P, Record->ReparseDataSize);
+            P += FSP_FSCTL_ALIGN_UP(Record->ReparseDataSize, MEMFS_SNAPSHOT_ALIGNMENT);
+        }
+#endif
+
+#if defined(MEMFS_EA)
+        if (0 != Record->EaSize)
+        {
+            FileNode->FileInfo.EaSize = 0;
+            Result = FspFileSystemEnumerateEa(Memfs->FileSystem, MemfsFileNodeSetEa, FileNode,
+                (PFILE_FULL_EA_INFORMATION)P, Record->EaSize);
+            if (!NT_SUCCESS(Result))
+            {
+                MemfsFileNodeDelete(FileNode);
+                goto exit;
+            }
+        }
+#endif
+
+        if (0 != FileNode->FileInfo.AllocationSize)
+        {
+#if defined(MEMFS_DEDUP)
+            if (Memfs->BlockMode)
+            {
+                /* block mode cannot use the mapping; copy and deduplicate the file data */
+                UINT64 AllocationSize = FileNode->FileInfo.AllocationSize;
+                FileNode->FileInfo.AllocationSize = 0;
+                Result = MemfsFileNodeReallocData(Memfs, FileNode, AllocationSize);
+                if (NT_SUCCESS(Result))
+                    Result = MemfsFileNodeWriteData(Memfs, FileNode,
+                        View + Header->DataOffset + Record->FileDataOffset, 0, (size_t)AllocationSize);
+                if (!NT_SUCCESS(Result))
+                {
+                    MemfsFileNodeDelete(FileNode);
+                    goto exit;
+                }
+                FileNode->FileInfo.AllocationSize = AllocationSize;
+                MemfsFileNodeDeduplicate(Memfs, FileNode);
+            }
+            else
+#endif
+            {
+                FileNode->FileData = View + Header->DataOffset + Record->FileDataOffset;
+                FileNode->FileDataIsMapped = TRUE;
+            }
+        }
+
+#if defined(MEMFS_NAMED_STREAMS)
+        FileNode->MainFileNode = MemfsFileNodeMapGetMain(FileNodeMap, FileNode->FileName);
+#endif
+
+        try
+        {
+            /* insert directly: MemfsFileNodeMapInsert would touch the parent's times */
+            Inserted = FileNodeMap->insert(
+                MEMFS_FILE_NODE_MAP::value_type(FileNode->FileName, FileNode)).second;
+        }
+        catch (...)
+        {
+            MemfsFileNodeDelete(FileNode);
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+        if (!Inserted)
+        {
+            MemfsFileNodeDelete(FileNode);
+            Result = STATUS_OBJECT_NAME_COLLISION;
+            goto exit;
+        }
+        MemfsFileNodeReference(FileNode);
 
-#if defined(MEMFS_NAMED_STREAMS)
-static inline
-BOOLEAN MemfsFileNodeMapEnumerateNamedStreams(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
-{
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
-    {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
-            break;
-        if (L':' != iter->second->FileName[wcslen(FileNode->FileName)])
-            break;
-        if (!EnumFn(iter->second, Context))
-            return FALSE;
+        P = RecordP + Record->Size;
     }
-    return TRUE;
-}
-#endif
 
-static inline
-BOOLEAN MemfsFileNodeMapEnumerateDescendants(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
-{
-    WCHAR Root[2] = L"\\";
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->lower_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
+    if (0 == MemfsFileNodeMapGet(FileNodeMap, L"\\"))
     {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName,
-            MemfsFileNodeMapIsCaseInsensitive(FileNodeMap)))
-            break;
-        if (!EnumFn(iter->second, Context))
-            return FALSE;
+        Result = STATUS_FILE_CORRUPT_ERROR;
+        goto exit;
     }
-    return TRUE;
-}
 
-typedef struct _MEMFS_FILE_NODE_MAP_ENUM_CONTEXT
-{
-    BOOLEAN Reference;
-    MEMFS_FILE_NODE **FileNodes;
-    ULONG Capacity, Count;
-} MEMFS_FILE_NODE_MAP_ENUM_CONTEXT;
+    MemfsFileNodeMapDelete(Memfs->FileNodeMap);
+    Memfs->FileNodeMap = FileNodeMap;
+    FileNodeMap = 0;
+    Memfs->VolumeLabelLength = Header->VolumeLabelLength;
+    memcpy(Memfs->VolumeLabel, Header->VolumeLabel, Header->VolumeLabelLength);
+    if (MemfsFileNodeIndexNumber < IndexNumber)
+        MemfsFileNodeIndexNumber = IndexNumber;
+
+    Memfs->SnapshotFile = Handle;
+    Memfs->SnapshotMapping = Mapping;
+    Memfs->SnapshotView = View;
+    Handle = INVALID_HANDLE_VALUE;
+    Mapping = 0;
+    View = 0;
 
-static inline
-BOOLEAN MemfsFileNodeMapEnumerateFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
-{
-    MEMFS_FILE_NODE_MAP_ENUM_CONTEXT *Context = (MEMFS_FILE_NODE_MAP_ENUM_CONTEXT *)Context0;
+    Result = STATUS_SUCCESS;
 
-    if (Context->Capacity <= Context->Count)
-    {
-        ULONG Capacity = 0 != Context->Capacity ? Context->Capacity * 2 : 16;
-        PVOID P = realloc(Context->FileNodes, Capacity * sizeof Context->FileNodes[0]);
-        if (0 == P)
-        {
-            FspDebugLog(__FUNCTION__ ": cannot allocate memory; aborting\n");
-            abort();
-        }
+exit:
+    if (0 != FileNodeMap)
+        MemfsFileNodeMapDelete(FileNodeMap);
 
-        Context->FileNodes = (MEMFS_FILE_NODE **)P;
-        Context->Capacity = Capacity;
-    }
+    if (0 != View)
+        UnmapViewOfFile(View);
 
-    Context->FileNodes[Context->Count++] = FileNode;
-    if (Context->Reference)
-        MemfsFileNodeReference(FileNode);
+    if (0 != Mapping)
+        CloseHandle(Mapping);
 
-    return TRUE;
+    if (INVALID_HANDLE_VALUE != Handle)
+        CloseHandle(Handle);
+
+    return Result;
 }
 
-static inline
-VOID MemfsFileNodeMapEnumerateFree(MEMFS_FILE_NODE_MAP_ENUM_CONTEXT *Context)
+static VOID MemfsSnapshotUnmap(MEMFS *Memfs)
 {
-    if (Context->Reference)
+    if (0 != Memfs->SnapshotView)
     {
-        for (ULONG Index = 0; Context->Count > Index; Index++)
+        UnmapViewOfFile(Memfs->SnapshotView);
+        CloseHandle(Memfs->SnapshotMapping);
+        CloseHandle(Memfs->SnapshotFile);
+
+        if (Memfs->SnapshotFileIsAside)
         {
-            MEMFS_FILE_NODE *FileNode = Context->FileNodes[Index];
-            MemfsFileNodeDereference(FileNode);
+            PWSTR AsidePath = MemfsSnapshotPathWithSuffix(Memfs->SnapshotPath, L".old");
+            if (0 != AsidePath)
+                DeleteFileW(AsidePath);
+            free(AsidePath);
         }
+
+        Memfs->SnapshotView = 0;
+        Memfs->SnapshotMapping = 0;
+        Memfs->SnapshotFile = 0;
+        Memfs->SnapshotFileIsAside = FALSE;
     }
-    free(Context->FileNodes);
 }
 
-#ifdef MEMFS_SLOWIO
-/*
- * SLOWIO
- *
- * This is included for two uses:
- *
- * 1) For testing winfsp, by allowing memfs to act more like a non-ram file system,
- *    with some IO taking many milliseconds, and some IO completion delayed.
- *
- * 2) As sample code for how to use winfsp's STATUS_PENDING capabilities.
- * 
- */
-
-static inline UINT64 Hash(UINT64 x)
+static DWORD WINAPI MemfsSnapshotThread(PVOID Memfs0)
 {
-    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
-    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
-    x =  x ^ (x >> 31);
-    return x;
-}
+    MEMFS *Memfs = (MEMFS *)Memfs0;
+    HANDLE WaitObjects[2] = { Memfs->SnapshotStopEvent, Memfs->SnapshotRequestEvent };
+    DWORD WaitResult;
+    NTSTATUS Result;
 
-static inline ULONG PseudoRandom(ULONG to)
-{
-    /* John Oberschelp's PRNG */
-    static UINT64 spin = 0;
-    InterlockedIncrement(&spin);
-    return Hash(spin) % to;
-}
+    for (;;)
+    {
+        WaitResult = WaitForMultipleObjects(2, WaitObjects, FALSE,
+            0 != Memfs->SnapshotInterval ? Memfs->SnapshotInterval : INFINITE);
+        if (WAIT_OBJECT_0 + 1 != WaitResult && WAIT_TIMEOUT != WaitResult)
+            break;
 
-static inline BOOLEAN SlowioReturnPending(FSP_FILE_SYSTEM *FileSystem)
-{
-    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    if (0 == Memfs->SlowioMaxDelay)
-        return FALSE;
-    return PseudoRandom(100) < Memfs->SlowioPercentDelay;
-}
+        AcquireSRWLockExclusive(&Memfs->SnapshotLock);
+        Result = MemfsSnapshotWrite(Memfs);
+        ReleaseSRWLockExclusive(&Memfs->SnapshotLock);
 
-static inline VOID SlowioSnooze(FSP_FILE_SYSTEM *FileSystem)
-{
-    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    if (0 == Memfs->SlowioMaxDelay)
-        return;
-    ULONG millis = PseudoRandom(Memfs->SlowioMaxDelay + 1) >> PseudoRandom(Memfs->SlowioRarefyDelay + 1);
-    Sleep(millis);
+        if (!NT_SUCCESS(Result))
+            FspDebugLog(__FUNCTION__ ": cannot write snapshot (Status=%lx)\n", Result);
+    }
+
+    return 0;
 }
+#endif
 
-void SlowioReadThread(
-    FSP_FILE_SYSTEM *FileSystem,
-    MEMFS_FILE_NODE *FileNode,
-    PVOID Buffer, 
-    UINT64 Offset, 
-    UINT64 EndOffset,
-    UINT64 RequestHint)
+/*
+ * Operation guard
+ *
+ * While a snapshot is being taken all file system operations are excluded (not just the
+ * ones that the FINE strategy excludes), because operations such as SetFileSize, SetSecurity
+ * and SetEa reallocate node data without any other guard.
+ */
+
+static NTSTATUS MemfsEnterOperation(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
-    SlowioSnooze(FileSystem);
+#if defined(MEMFS_SNAPSHOT)
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
 
-    memcpy(Buffer, (PUINT8)FileNode->FileData + Offset, (size_t)(EndOffset - Offset));
-    UINT32 BytesTransferred = (ULONG)(EndOffset - Offset);
+    if (0 != Memfs->SnapshotPath)
+        AcquireSRWLockShared(&Memfs->SnapshotLock);
+#endif
 
-    FSP_FSCTL_TRANSACT_RSP ResponseBuf;
-    memset(&ResponseBuf, 0, sizeof ResponseBuf);
-    ResponseBuf.Size = sizeof ResponseBuf;
-    ResponseBuf.Kind = FspFsctlTransactReadKind;
-    ResponseBuf.Hint = RequestHint;                         // IRP that is being completed
-    ResponseBuf.IoStatus.Status = STATUS_SUCCESS;
-    ResponseBuf.IoStatus.Information = BytesTransferred;    // bytes read
-    FspFileSystemSendResponse(FileSystem, &ResponseBuf);
+    FspFileSystemOpEnter(FileSystem, Request, Response);
 
-    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    InterlockedDecrement(&Memfs->SlowioThreadsRunning);
+    return STATUS_SUCCESS;
 }
 
-void SlowioWriteThread(
-    FSP_FILE_SYSTEM *FileSystem,
-    MEMFS_FILE_NODE *FileNode,
-    PVOID Buffer, 
-    UINT64 Offset, 
-    UINT64 EndOffset,
-    UINT64 RequestHint)
+static NTSTATUS MemfsLeaveOperation(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
-    SlowioSnooze(FileSystem);
-
-    memcpy((PUINT8)FileNode->FileData + Offset, Buffer, (size_t)(EndOffset - Offset));
-    UINT32 BytesTransferred = (ULONG)(EndOffset - Offset);
-
-    FSP_FSCTL_TRANSACT_RSP ResponseBuf;
-    memset(&ResponseBuf, 0, sizeof ResponseBuf);
-    ResponseBuf.Size = sizeof ResponseBuf;
-    ResponseBuf.Kind = FspFsctlTransactWriteKind;
-    ResponseBuf.Hint = RequestHint;                         // IRP that is being completed
-    ResponseBuf.IoStatus.Status = STATUS_SUCCESS;
-    ResponseBuf.IoStatus.Information = BytesTransferred;    // bytes written
-    MemfsFileNodeGetFileInfo(FileNode, &ResponseBuf.Rsp.Write.FileInfo);
-    FspFileSystemSendResponse(FileSystem, &ResponseBuf);
+    FspFileSystemOpLeave(FileSystem, Request, Response);
 
+#if defined(MEMFS_SNAPSHOT)
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    InterlockedDecrement(&Memfs->SlowioThreadsRunning);
-}
 
-void SlowioReadDirectoryThread(
-    FSP_FILE_SYSTEM *FileSystem,
-    ULONG BytesTransferred,
-    UINT64 RequestHint)
-{
-    SlowioSnooze(FileSystem);
-
-    FSP_FSCTL_TRANSACT_RSP ResponseBuf;
-    memset(&ResponseBuf, 0, sizeof ResponseBuf);
-    ResponseBuf.Size = sizeof ResponseBuf;
-    ResponseBuf.Kind = FspFsctlTransactQueryDirectoryKind;
-    ResponseBuf.Hint = RequestHint;                         // IRP that is being completed
-    ResponseBuf.IoStatus.Status = STATUS_SUCCESS;
-    ResponseBuf.IoStatus.Information = BytesTransferred;    // bytes of directory info read
-    FspFileSystemSendResponse(FileSystem, &ResponseBuf);
+    if (0 != Memfs->SnapshotPath)
+        ReleaseSRWLockShared(&Memfs->SnapshotLock);
+#endif
 
-    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    InterlockedDecrement(&Memfs->SlowioThreadsRunning);
+    return STATUS_SUCCESS;
 }
-#endif
 
 /*
  * FSP_FILE_SYSTEM_INTERFACE
@@ -968,6 +2951,26 @@ static NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
     VolumeInfo->TotalSize = Memfs->MaxFileNodes * (UINT64)Memfs->MaxFileSize;
     VolumeInfo->FreeSize = (Memfs->MaxFileNodes - MemfsFileNodeMapCount(Memfs->FileNodeMap)) *
         (UINT64)Memfs->MaxFileSize;
+
+#if defined(MEMFS_SPILL)
+    if (0 != Memfs->BlockStore.SpillFile)
+    {
+        /* file data is bounded by the memory budget plus the free space for spilling */
+        MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+        ULARGE_INTEGER SpillFreeSize;
+        UINT64 FreeSize;
+
+        AcquireSRWLockShared(&Store->Lock);
+        FreeSize = Store->BudgetBlocks > Store->ResidentBlocks ?
+            (Store->BudgetBlocks - Store->ResidentBlocks) * MEMFS_BLOCK_SIZE : 0;
+        ReleaseSRWLockShared(&Store->Lock);
+        if (GetDiskFreeSpaceExW(Store->SpillVolume, &SpillFreeSize, 0, 0))
+            FreeSize += SpillFreeSize.QuadPart;
+
+        if (VolumeInfo->FreeSize > FreeSize)
+            VolumeInfo->FreeSize = FreeSize;
+    }
+#endif
     VolumeInfo->VolumeLabelLength = Memfs->VolumeLabelLength;
     memcpy(VolumeInfo->VolumeLabel, Memfs->VolumeLabel, Memfs->VolumeLabelLength);
 
@@ -1124,14 +3127,14 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
 
     if (0 != SecurityDescriptor)
     {
-        FileNode->FileSecuritySize = GetSecurityDescriptorLength(SecurityDescriptor);
-        FileNode->FileSecurity = (PSECURITY_DESCRIPTOR)malloc(FileNode->FileSecuritySize);
-        if (0 == FileNode->FileSecurity)
+        /* most files end up with one of a few security descriptors: share them */
+        Result = FspInternSecurityDescriptor(SecurityDescriptor, &FileNode->FileSecurity);
+        if (!NT_SUCCESS(Result))
         {
             MemfsFileNodeDelete(FileNode);
-            return STATUS_INSUFFICIENT_RESOURCES;
+            return Result;
         }
-        memcpy(FileNode->FileSecurity, SecurityDescriptor, FileNode->FileSecuritySize);
+        FileNode->FileSecuritySize = GetSecurityDescriptorLength(SecurityDescriptor);
     }
 
 #if defined(MEMFS_EA) || defined(MEMFS_WSL)
@@ -1174,16 +3177,16 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
     }
 #endif
 
-    FileNode->FileInfo.AllocationSize = AllocationSize;
-    if (0 != FileNode->FileInfo.AllocationSize)
+    if (0 != AllocationSize)
     {
-        FileNode->FileData = LargeHeapAlloc((size_t)FileNode->FileInfo.AllocationSize);
-        if (0 == FileNode->FileData)
+        Result = MemfsFileNodeReallocData(Memfs, FileNode, AllocationSize);
+        if (!NT_SUCCESS(Result))
         {
             MemfsFileNodeDelete(FileNode);
-            return STATUS_INSUFFICIENT_RESOURCES;
+            return Result;
         }
     }
+    FileNode->FileInfo.AllocationSize = AllocationSize;
 
     Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, FileNode, &Inserted);
     if (!NT_SUCCESS(Result) || !Inserted)
@@ -1362,6 +3365,11 @@ static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem,
         SetFileSizeInternal(FileSystem, FileNode, AllocationSize, TRUE);
     }
 
+#if defined(MEMFS_DEDUP)
+    if (Memfs->Dedup && (Flags & FspCleanupSetLastWriteTime) && !(Flags & FspCleanupDelete))
+        MemfsFileNodeDeduplicate(Memfs, FileNode);
+#endif
+
     if ((Flags & FspCleanupDelete) && !MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode))
     {
 #if defined(MEMFS_NAMED_STREAMS)
@@ -1379,6 +3387,34 @@ static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem,
     }
 }
 
+#if defined(MEMFS_NAMESPACE_BATCH)
+static NTSTATUS CreateMany(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_CREATE_ENTRY *Entries, ULONG EntryCount)
+{
+    for (ULONG Index = 0; EntryCount > Index; Index++)
+    {
+        FSP_FILE_SYSTEM_CREATE_ENTRY *Entry = &Entries[Index];
+
+        Entry->Status = Create(FileSystem,
+            Entry->FileName, Entry->CreateOptions, Entry->GrantedAccess,
+            Entry->FileAttributes, Entry->SecurityDescriptor, Entry->AllocationSize,
+#if defined(MEMFS_EA) || defined(MEMFS_WSL)
+            0, 0, FALSE,
+#endif
+            &Entry->FileContext, &Entry->OpenFileInfo.FileInfo);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID DeleteMany(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_DELETE_ENTRY *Entries, ULONG EntryCount)
+{
+    for (ULONG Index = 0; EntryCount > Index; Index++)
+        Cleanup(FileSystem, Entries[Index].FileContext, Entries[Index].FileName, Entries[Index].Flags);
+}
+#endif
+
 static VOID Close(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode0)
 {
@@ -1389,11 +3425,15 @@ static VOID Close(FSP_FILE_SYSTEM *FileSystem,
 }
 
 static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
+#if defined(MEMFS_SLOWIO)
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+#endif
     PVOID FileNode0, PVOID Buffer, UINT64 Offset, ULONG Length,
     PULONG PBytesTransferred)
 {
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
     UINT64 EndOffset;
+    NTSTATUS Result;
 
     if (Offset >= FileNode->FileInfo.FileSize)
         return STATUS_END_OF_FILE;
@@ -1403,27 +3443,18 @@ static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
         EndOffset = FileNode->FileInfo.FileSize;
 
 #ifdef MEMFS_SLOWIO
-    if (SlowioReturnPending(FileSystem))
-    {
-        MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-        try
-        {
-            InterlockedIncrement(&Memfs->SlowioThreadsRunning);
-            std::thread(SlowioReadThread,
-                FileSystem, FileNode, Buffer, Offset, EndOffset,
-                FspFileSystemGetOperationContext()->Request->Hint).
-                detach();
-            return STATUS_PENDING;
-        }
-        catch (...)
-        {
-            InterlockedDecrement(&Memfs->SlowioThreadsRunning);
-        }
-    }
-    SlowioSnooze(FileSystem);
+    if (SlowioReturnPending(FileSystem) &&
+        SlowioPostRequest(FileSystem, FspFsctlTransactReadKind,
+            OperationContext->Request->Hint,
+            FileNode, Buffer, Offset, EndOffset, 0))
+        return STATUS_PENDING;
+    SlowioSnooze(FileSystem, FspFsctlTransactReadKind);
 #endif
 
-    memcpy(Buffer, (PUINT8)FileNode->FileData + Offset, (size_t)(EndOffset - Offset));
+    Result = MemfsFileNodeReadData((MEMFS *)FileSystem->UserContext, FileNode,
+        Buffer, Offset, (size_t)(EndOffset - Offset));
+    if (!NT_SUCCESS(Result))
+        return Result;
 
     *PBytesTransferred = (ULONG)(EndOffset - Offset);
 
@@ -1431,6 +3462,9 @@ static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
 }
 
 static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
+#if defined(MEMFS_SLOWIO)
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+#endif
     PVOID FileNode0, PVOID Buffer, UINT64 Offset, ULONG Length,
     BOOLEAN WriteToEndOfFile, BOOLEAN ConstrainedIo,
     PULONG PBytesTransferred, FSP_FSCTL_FILE_INFO *FileInfo)
@@ -1477,33 +3511,120 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
     }
 
 #ifdef MEMFS_SLOWIO
-    if (SlowioReturnPending(FileSystem))
+    if (SlowioReturnPending(FileSystem) &&
+        SlowioPostRequest(FileSystem, FspFsctlTransactWriteKind,
+            OperationContext->Request->Hint,
+            FileNode, Buffer, Offset, EndOffset, 0))
+        return STATUS_PENDING;
+    SlowioSnooze(FileSystem, FspFsctlTransactWriteKind);
+#endif
+
+    Result = MemfsFileNodeWriteData((MEMFS *)FileSystem->UserContext, FileNode,
+        Buffer, Offset, (size_t)(EndOffset - Offset));
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    *PBytesTransferred = (ULONG)(EndOffset - Offset);
+    MemfsFileNodeGetFileInfo(FileNode, FileInfo);
+
+    return STATUS_SUCCESS;
+}
+
+#if defined(MEMFS_VECTORED_IO)
+static NTSTATUS ReadV(FSP_FILE_SYSTEM *FileSystem,
+    PVOID FileNode0, FSP_FILE_SYSTEM_IO_SEGMENT *Segments, ULONG SegmentCount)
+{
+    MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    UINT64 EndOffset;
+
+#ifdef MEMFS_SLOWIO
+    SlowioSnooze(FileSystem, FspFsctlTransactReadKind);
+#endif
+
+    for (ULONG Index = 0; SegmentCount > Index; Index++)
     {
-        MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-        try
-        {
-            InterlockedIncrement(&Memfs->SlowioThreadsRunning);
-            std::thread(SlowioWriteThread,
-                FileSystem, FileNode, Buffer, Offset, EndOffset,
-                FspFileSystemGetOperationContext()->Request->Hint).
-                detach();
-            return STATUS_PENDING;
-        }
-        catch (...)
+        FSP_FILE_SYSTEM_IO_SEGMENT *Segment = &Segments[Index];
+
+        if (Segment->Offset >= FileNode->FileInfo.FileSize)
         {
-            InterlockedDecrement(&Memfs->SlowioThreadsRunning);
+            Segment->Status = STATUS_END_OF_FILE;
+            continue;
         }
+
+        EndOffset = Segment->Offset + Segment->Length;
+        if (EndOffset > FileNode->FileInfo.FileSize)
+            EndOffset = FileNode->FileInfo.FileSize;
+
+        Segment->Status = MemfsFileNodeReadData((MEMFS *)FileSystem->UserContext, FileNode,
+            Segment->Buffer, Segment->Offset, (size_t)(EndOffset - Segment->Offset));
+        if (NT_SUCCESS(Segment->Status))
+            Segment->BytesTransferred = (ULONG)(EndOffset - Segment->Offset);
     }
-    SlowioSnooze(FileSystem);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS WriteV(FSP_FILE_SYSTEM *FileSystem,
+    PVOID FileNode0, FSP_FILE_SYSTEM_IO_SEGMENT *Segments, ULONG SegmentCount,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    UINT64 Offset, EndOffset;
+    NTSTATUS Result;
+
+#ifdef MEMFS_SLOWIO
+    SlowioSnooze(FileSystem, FspFsctlTransactWriteKind);
 #endif
 
-    memcpy((PUINT8)FileNode->FileData + Offset, Buffer, (size_t)(EndOffset - Offset));
+    for (ULONG Index = 0; SegmentCount > Index; Index++)
+    {
+        FSP_FILE_SYSTEM_IO_SEGMENT *Segment = &Segments[Index];
+
+        Offset = Segment->Offset;
+        if (Segment->ConstrainedIo)
+        {
+            if (Offset >= FileNode->FileInfo.FileSize)
+            {
+                Segment->Status = STATUS_SUCCESS;
+                continue;
+            }
+            EndOffset = Offset + Segment->Length;
+            if (EndOffset > FileNode->FileInfo.FileSize)
+                EndOffset = FileNode->FileInfo.FileSize;
+        }
+        else
+        {
+            if (Segment->WriteToEndOfFile)
+                Offset = FileNode->FileInfo.FileSize;
+            EndOffset = Offset + Segment->Length;
+            if (EndOffset > FileNode->FileInfo.FileSize)
+            {
+                Result = SetFileSizeInternal(FileSystem, FileNode, EndOffset, FALSE);
+                if (!NT_SUCCESS(Result))
+                {
+                    Segment->Status = Result;
+                    continue;
+                }
+            }
+        }
+
+        Result = MemfsFileNodeWriteData((MEMFS *)FileSystem->UserContext, FileNode,
+            Segment->Buffer, Offset, (size_t)(EndOffset - Offset));
+        if (!NT_SUCCESS(Result))
+        {
+            Segment->Status = Result;
+            continue;
+        }
+
+        Segment->BytesTransferred = (ULONG)(EndOffset - Offset);
+        Segment->Status = STATUS_SUCCESS;
+    }
 
-    *PBytesTransferred = (ULONG)(EndOffset - Offset);
     MemfsFileNodeGetFileInfo(FileNode, FileInfo);
 
     return STATUS_SUCCESS;
 }
+#endif
 
 NTSTATUS Flush(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode0,
@@ -1586,11 +3707,9 @@ static NTSTATUS SetFileSizeInternal(FSP_FILE_SYSTEM *FileSystem,
             if (NewSize > Memfs->MaxFileSize)
                 return STATUS_DISK_FULL;
 
-            PVOID FileData = LargeHeapRealloc(FileNode->FileData, (size_t)NewSize);
-            if (0 == FileData && 0 != NewSize)
-                return STATUS_INSUFFICIENT_RESOURCES;
-
-            FileNode->FileData = FileData;
+            NTSTATUS Result = MemfsFileNodeReallocData(Memfs, FileNode, NewSize);
+            if (!NT_SUCCESS(Result))
+                return Result;
 
             FileNode->FileInfo.AllocationSize = NewSize;
             if (FileNode->FileInfo.FileSize > NewSize)
@@ -1612,8 +3731,12 @@ static NTSTATUS SetFileSizeInternal(FSP_FILE_SYSTEM *FileSystem,
             }
 
             if (FileNode->FileInfo.FileSize < NewSize)
-                memset((PUINT8)FileNode->FileData + FileNode->FileInfo.FileSize, 0,
-                    (size_t)(NewSize - FileNode->FileInfo.FileSize));
+            {
+                NTSTATUS Result = MemfsFileNodeWriteData(Memfs, FileNode,
+                    0, FileNode->FileInfo.FileSize, (size_t)(NewSize - FileNode->FileInfo.FileSize));
+                if (!NT_SUCCESS(Result))
+                    return Result;
+            }
             FileNode->FileInfo.FileSize = NewSize;
         }
     }
@@ -1637,6 +3760,98 @@ static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem,
     return STATUS_SUCCESS;
 }
 
+#if defined(MEMFS_DUPLICATE_EXTENTS)
+static NTSTATUS DuplicateExtents(FSP_FILE_SYSTEM *FileSystem,
+    PVOID FileNode0, PVOID SourceFileNode0,
+    UINT64 SourceOffset, UINT64 TargetOffset, UINT64 Length,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    MEMFS_FILE_NODE *SourceNode = (MEMFS_FILE_NODE *)SourceFileNode0;
+    PVOID Buffer = 0;
+    SIZE_T Part;
+    NTSTATUS Result;
+
+    if (SourceOffset + Length > SourceNode->FileInfo.FileSize)
+        return STATUS_INVALID_PARAMETER;
+
+    /* overlapping ranges within the same file are not supported (same as ReFS) */
+    if (SourceNode == FileNode &&
+        SourceOffset < TargetOffset + Length && TargetOffset < SourceOffset + Length)
+        return STATUS_INVALID_PARAMETER;
+
+    if (TargetOffset + Length > FileNode->FileInfo.FileSize)
+    {
+        Result = SetFileSizeInternal(FileSystem, FileNode, TargetOffset + Length, FALSE);
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
+
+#if defined(MEMFS_DEDUP)
+    if (Memfs->BlockMode &&
+        0 == SourceOffset % MEMFS_BLOCK_SIZE && 0 == TargetOffset % MEMFS_BLOCK_SIZE)
+    {
+        /* share whole blocks; they are copied on write */
+        MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+        MEMFS_BLOCK *Block, *OldBlock;
+        ULONG SourceIndex, TargetIndex;
+
+        for (; MEMFS_BLOCK_SIZE <= Length;
+            SourceOffset += MEMFS_BLOCK_SIZE, TargetOffset += MEMFS_BLOCK_SIZE, Length -= MEMFS_BLOCK_SIZE)
+        {
+            SourceIndex = (ULONG)(SourceOffset / MEMFS_BLOCK_SIZE);
+            TargetIndex = (ULONG)(TargetOffset / MEMFS_BLOCK_SIZE);
+
+            AcquireSRWLockExclusive(&Store->Lock);
+            Block = SourceNode->BlockCount > SourceIndex ? SourceNode->Blocks[SourceIndex] : 0;
+            OldBlock = FileNode->Blocks[TargetIndex];
+            if (0 != Block)
+            {
+                Block->RefCount++;
+                Store->LogicalBlocks++;
+            }
+            FileNode->Blocks[TargetIndex] = Block;
+            if (0 != OldBlock)
+                OldBlock = MemfsBlockDereference(OldBlock);
+            ReleaseSRWLockExclusive(&Store->Lock);
+
+            if (0 != OldBlock)
+                MemfsBlockFree(OldBlock);
+        }
+    }
+#endif
+
+    if (0 < Length)
+    {
+        Buffer = malloc(64 * 1024);
+        if (0 == Buffer)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        for (; 0 < Length; SourceOffset += Part, TargetOffset += Part, Length -= Part)
+        {
+            Part = 64 * 1024 < Length ? 64 * 1024 : (SIZE_T)Length;
+
+            Result = MemfsFileNodeReadData(Memfs, SourceNode, Buffer, SourceOffset, Part);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+            Result = MemfsFileNodeWriteData(Memfs, FileNode, Buffer, TargetOffset, Part);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+        }
+    }
+
+    MemfsFileNodeGetFileInfo(FileNode, FileInfo);
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    free(Buffer);
+
+    return Result;
+}
+#endif
+
 static NTSTATUS CanDelete(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode0, PWSTR FileName)
 {
@@ -1771,16 +3986,12 @@ static NTSTATUS SetSecurity(FSP_FILE_SYSTEM *FileSystem,
         return Result;
 
     FileSecuritySize = GetSecurityDescriptorLength(NewSecurityDescriptor);
-    FileSecurity = (PSECURITY_DESCRIPTOR)malloc(FileSecuritySize);
-    if (0 == FileSecurity)
-    {
-        FspDeleteSecurityDescriptor(NewSecurityDescriptor, (NTSTATUS (*)())FspSetSecurityDescriptor);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-    memcpy(FileSecurity, NewSecurityDescriptor, FileSecuritySize);
+    Result = FspInternSecurityDescriptor(NewSecurityDescriptor, &FileSecurity);
     FspDeleteSecurityDescriptor(NewSecurityDescriptor, (NTSTATUS (*)())FspSetSecurityDescriptor);
+    if (!NT_SUCCESS(Result))
+        return Result;
 
-    free(FileNode->FileSecurity);
+    FspDeleteSecurityDescriptor(FileNode->FileSecurity, (NTSTATUS (*)())FspInternSecurityDescriptor);
     FileNode->FileSecuritySize = FileSecuritySize;
     FileNode->FileSecurity = FileSecurity;
 
@@ -1826,6 +4037,9 @@ static BOOLEAN ReadDirectoryEnumFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
 }
 
 static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
+#if defined(MEMFS_SLOWIO)
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+#endif
     PVOID FileNode0, PWSTR Pattern, PWSTR Marker,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
 {
@@ -1867,23 +4081,12 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
         FspFileSystemAddDirInfo(0, Buffer, Length, PBytesTransferred);
 
 #ifdef MEMFS_SLOWIO
-    if (SlowioReturnPending(FileSystem))
-    {
-        try
-        {
-            InterlockedIncrement(&Memfs->SlowioThreadsRunning);
-            std::thread(SlowioReadDirectoryThread,
-                FileSystem, *PBytesTransferred,
-                FspFileSystemGetOperationContext()->Request->Hint).
-                detach();
-            return STATUS_PENDING;
-        }
-        catch (...)
-        {
-            InterlockedDecrement(&Memfs->SlowioThreadsRunning);
-        }
-    }
-    SlowioSnooze(FileSystem);
+    if (SlowioReturnPending(FileSystem) &&
+        SlowioPostRequest(FileSystem, FspFsctlTransactQueryDirectoryKind,
+            OperationContext->Request->Hint,
+            FileNode, Buffer, 0, 0, *PBytesTransferred))
+        return STATUS_PENDING;
+    SlowioSnooze(FileSystem, FspFsctlTransactQueryDirectoryKind);
 #endif
 
     return STATUS_SUCCESS;
@@ -2136,7 +4339,7 @@ static NTSTATUS GetStreamInfo(FSP_FILE_SYSTEM *FileSystem,
 
 #if defined(MEMFS_CONTROL)
 static NTSTATUS Control(FSP_FILE_SYSTEM *FileSystem,
-    PVOID FileNode, UINT32 ControlCode,
+    PVOID FileNode0, UINT32 ControlCode,
     PVOID InputBuffer, ULONG InputBufferLength,
     PVOID OutputBuffer, ULONG OutputBufferLength, PULONG PBytesTransferred)
 {
@@ -2162,6 +4365,73 @@ static NTSTATUS Control(FSP_FILE_SYSTEM *FileSystem,
         return STATUS_SUCCESS;
     }
 
+#if defined(MEMFS_SNAPSHOT)
+    /* request a snapshot; it is taken asynchronously by the snapshot thread */
+    if (CTL_CODE(0x8000 + 'M', 'S', METHOD_BUFFERED, FILE_ANY_ACCESS) == ControlCode)
+    {
+        MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+
+        if (0 == Memfs->SnapshotRequestEvent)
+            return STATUS_INVALID_DEVICE_REQUEST;
+
+        SetEvent(Memfs->SnapshotRequestEvent);
+
+        *PBytesTransferred = 0;
+        return STATUS_SUCCESS;
+    }
+#endif
+
+#if defined(MEMFS_DEDUP)
+    /* retrieve block sharing statistics */
+    if (CTL_CODE(0x8000 + 'M', 'D', METHOD_BUFFERED, FILE_ANY_ACCESS) == ControlCode)
+    {
+        MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+        MEMFS_DEDUP_STATISTICS *Statistics = (MEMFS_DEDUP_STATISTICS *)OutputBuffer;
+
+        if (!Memfs->BlockMode)
+            return STATUS_INVALID_DEVICE_REQUEST;
+        if (sizeof *Statistics > OutputBufferLength)
+            return STATUS_BUFFER_TOO_SMALL;
+
+        AcquireSRWLockShared(&Memfs->BlockStore.Lock);
+        Statistics->BlockSize = MEMFS_BLOCK_SIZE;
+        Statistics->LogicalBlocks = Memfs->BlockStore.LogicalBlocks;
+        Statistics->PhysicalBlocks = Memfs->BlockStore.PhysicalBlocks;
+        Statistics->IndexedBlocks = Memfs->BlockStore.IndexedBlocks;
+        ReleaseSRWLockShared(&Memfs->BlockStore.Lock);
+
+        *PBytesTransferred = sizeof *Statistics;
+        return STATUS_SUCCESS;
+    }
+#endif
+
+#if defined(MEMFS_SPILL)
+    /* retrieve memory budget and spill statistics */
+    if (CTL_CODE(0x8000 + 'M', 'L', METHOD_BUFFERED, FILE_ANY_ACCESS) == ControlCode)
+    {
+        MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+        MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+        MEMFS_SPILL_STATISTICS *Statistics = (MEMFS_SPILL_STATISTICS *)OutputBuffer;
+
+        if (0 == Store->SpillFile)
+            return STATUS_INVALID_DEVICE_REQUEST;
+        if (sizeof *Statistics > OutputBufferLength)
+            return STATUS_BUFFER_TOO_SMALL;
+
+        AcquireSRWLockShared(&Store->Lock);
+        Statistics->BudgetBytes = Store->BudgetBlocks * MEMFS_BLOCK_SIZE;
+        Statistics->ResidentBytes = Store->ResidentBlocks * MEMFS_BLOCK_SIZE;
+        Statistics->SpilledBytes = Store->SpilledBlocks * MEMFS_BLOCK_SIZE;
+        Statistics->Hits = (UINT64)Store->Hits;
+        Statistics->Misses = Store->Misses;
+        Statistics->Evictions = Store->Evictions;
+        ReleaseSRWLockShared(&Store->Lock);
+
+        *PBytesTransferred = sizeof *Statistics;
+        return STATUS_SUCCESS;
+    }
+#endif
+
     return STATUS_INVALID_DEVICE_REQUEST;
 }
 #endif
@@ -2235,8 +4505,13 @@ static FSP_FILE_SYSTEM_INTERFACE MemfsInterface =
 #endif
     Cleanup,
     Close,
+#if defined(MEMFS_SLOWIO)
+    0,
+    0,
+#else
     Read,
     Write,
+#endif
     Flush,
     GetFileInfo,
     SetBasicInfo,
@@ -2245,7 +4520,11 @@ static FSP_FILE_SYSTEM_INTERFACE MemfsInterface =
     Rename,
     GetSecurity,
     SetSecurity,
+#if defined(MEMFS_SLOWIO)
+    0,
+#else
     ReadDirectory,
+#endif
 #if defined(MEMFS_REPARSE_POINTS)
     ResolveReparsePoints,
     GetReparsePoint,
@@ -2279,10 +4558,38 @@ static FSP_FILE_SYSTEM_INTERFACE MemfsInterface =
 #if defined(MEMFS_EA)
     Overwrite,
     GetEa,
-    SetEa
+    SetEa,
+#else
+    0,
+    0,
+    0,
+    0,
+#endif
+#if defined(MEMFS_DUPLICATE_EXTENTS)
+    DuplicateExtents,
+#else
+    0,
+#endif
+#if defined(MEMFS_VECTORED_IO)
+    ReadV,
+    WriteV,
+#else
+    0,
+    0,
+#endif
+#if defined(MEMFS_NAMESPACE_BATCH)
+    CreateMany,
+    DeleteMany,
 #else
     0,
     0,
+#endif
+#if defined(MEMFS_SLOWIO)
+    Read,
+    Write,
+    ReadDirectory,
+#else
+    0,
     0,
     0,
 #endif
@@ -2342,6 +4649,11 @@ NTSTATUS MemfsCreateFunnel(
     AllocationUnit = MEMFS_SECTOR_SIZE * MEMFS_SECTORS_PER_ALLOCATION_UNIT;
     Memfs->MaxFileSize = (ULONG)((MaxFileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit);
 
+#if defined(MEMFS_DEDUP)
+    Memfs->Dedup = !!(Flags & MemfsDedup);
+    Memfs->BlockMode = Memfs->Dedup;
+#endif
+
 #ifdef MEMFS_SLOWIO
     Memfs->SlowioMaxDelay = SlowioMaxDelay;
     Memfs->SlowioPercentDelay = SlowioPercentDelay;
@@ -2369,6 +4681,7 @@ NTSTATUS MemfsCreateFunnel(
     VolumeParams.PersistentAcls = 1;
     VolumeParams.ReparsePoints = 1;
     VolumeParams.ReparsePointsAccessCheck = 0;
+    VolumeParams.UmReparseCache = 1;
 #if defined(MEMFS_NAMED_STREAMS)
     VolumeParams.NamedStreams = 1;
 #endif
@@ -2385,8 +4698,23 @@ NTSTATUS MemfsCreateFunnel(
 #endif
 #if defined(MEMFS_WSL)
     VolumeParams.WslFeatures = 1;
+#endif
+#if defined(MEMFS_DUPLICATE_EXTENTS)
+    VolumeParams.DuplicateExtents = 1;
+#endif
+#if defined(MEMFS_VECTORED_IO) || defined(MEMFS_NAMESPACE_BATCH)
+    VolumeParams.UmBatchDispatch = 1;
 #endif
     VolumeParams.AllowOpenInKernelMode = 1;
+    if (Flags & MemfsRegisteredBuffers)
+    {
+        /* large reads/writes use a pool of buffers mapped once at mount time */
+        VolumeParams.RegisteredBufferCount = 16;
+        VolumeParams.RegisteredBufferSize = FSP_FSCTL_REGISTERED_BUFFER_SIZEDEFAULT;
+    }
+    if (Flags & MemfsNegativeLookupCache)
+        /* name lookup misses are remembered as long as file info is */
+        VolumeParams.NegativeLookupTimeout = FileInfoTimeout;
     if (0 != VolumePrefix)
         wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR), VolumePrefix);
     wcscpy_s(VolumeParams.FileSystemName, sizeof VolumeParams.FileSystemName / sizeof(WCHAR),
@@ -2409,6 +4737,33 @@ NTSTATUS MemfsCreateFunnel(
     FspFileSystemSetOperationGuardStrategy(Memfs->FileSystem,
         FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE);
 #endif
+    FspFileSystemSetOperationGuard(Memfs->FileSystem, MemfsEnterOperation, MemfsLeaveOperation);
+
+#ifdef MEMFS_SLOWIO
+    if (0 != Memfs->SlowioMaxDelay)
+    {
+        Result = SlowioCreate(Memfs);
+        if (!NT_SUCCESS(Result))
+        {
+            MemfsDelete(Memfs);
+            LocalFree(RootSecurity);
+            return Result;
+        }
+    }
+#endif
+
+#if defined(MEMFS_DEDUP)
+    if (Memfs->BlockMode)
+    {
+        Result = MemfsBlockStoreInitialize(&Memfs->BlockStore);
+        if (!NT_SUCCESS(Result))
+        {
+            MemfsDelete(Memfs);
+            LocalFree(RootSecurity);
+            return Result;
+        }
+    }
+#endif
 
     /*
      * Create root directory.
@@ -2424,16 +4779,15 @@ NTSTATUS MemfsCreateFunnel(
 
     RootNode->FileInfo.FileAttributes = FILE_ATTRIBUTE_DIRECTORY;
 
-    RootNode->FileSecurity = malloc(RootSecuritySize);
-    if (0 == RootNode->FileSecurity)
+    Result = FspInternSecurityDescriptor(RootSecurity, &RootNode->FileSecurity);
+    if (!NT_SUCCESS(Result))
     {
         MemfsFileNodeDelete(RootNode);
         MemfsDelete(Memfs);
         LocalFree(RootSecurity);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        return Result;
     }
     RootNode->FileSecuritySize = RootSecuritySize;
-    memcpy(RootNode->FileSecurity, RootSecurity, RootSecuritySize);
 
     Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, RootNode, &Inserted);
     if (!NT_SUCCESS(Result))
@@ -2457,16 +4811,70 @@ VOID MemfsDelete(MEMFS *Memfs)
 
     MemfsFileNodeMapDelete(Memfs->FileNodeMap);
 
+#if defined(MEMFS_DEDUP)
+    MemfsBlockStoreFinalize(&Memfs->BlockStore);
+#endif
+
+#ifdef MEMFS_SLOWIO
+    SlowioDelete(Memfs);
+#endif
+
+#if defined(MEMFS_SNAPSHOT)
+    MemfsSnapshotUnmap(Memfs);
+    if (0 != Memfs->SnapshotStopEvent)
+        CloseHandle(Memfs->SnapshotStopEvent);
+    if (0 != Memfs->SnapshotRequestEvent)
+        CloseHandle(Memfs->SnapshotRequestEvent);
+    free(Memfs->SnapshotPath);
+#endif
+
     free(Memfs);
 }
 
 NTSTATUS MemfsStart(MEMFS *Memfs)
 {
+    NTSTATUS Result;
+
+#ifdef MEMFS_SLOWIO
+    Result = SlowioStart(Memfs->FileSystem);
+    if (!NT_SUCCESS(Result))
+        return Result;
+#endif
+
+#if defined(MEMFS_SNAPSHOT)
+    if (0 != Memfs->SnapshotPath)
+    {
+        ResetEvent(Memfs->SnapshotStopEvent);
+        Memfs->SnapshotThread = CreateThread(0, 0, MemfsSnapshotThread, Memfs, 0, 0);
+        if (0 == Memfs->SnapshotThread)
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+#ifdef MEMFS_SLOWIO
+            SlowioStop(Memfs->FileSystem);
+#endif
+            return Result;
+        }
+    }
+#endif
+
+    Result = FspFileSystemStartDispatcher(Memfs->FileSystem, 0);
+
+#if defined(MEMFS_SNAPSHOT)
+    if (!NT_SUCCESS(Result) && 0 != Memfs->SnapshotThread)
+    {
+        SetEvent(Memfs->SnapshotStopEvent);
+        WaitForSingleObject(Memfs->SnapshotThread, INFINITE);
+        CloseHandle(Memfs->SnapshotThread);
+        Memfs->SnapshotThread = 0;
+    }
+#endif
+
 #ifdef MEMFS_SLOWIO
-    Memfs->SlowioThreadsRunning = 0;
+    if (!NT_SUCCESS(Result))
+        SlowioStop(Memfs->FileSystem);
 #endif
 
-    return FspFileSystemStartDispatcher(Memfs->FileSystem, 0);
+    return Result;
 }
 
 VOID MemfsStop(MEMFS *Memfs)
@@ -2474,8 +4882,172 @@ VOID MemfsStop(MEMFS *Memfs)
     FspFileSystemStopDispatcher(Memfs->FileSystem);
 
 #ifdef MEMFS_SLOWIO
-    while (Memfs->SlowioThreadsRunning)
-        Sleep(1);
+    SlowioStop(Memfs->FileSystem);
+#endif
+
+#if defined(MEMFS_SNAPSHOT)
+    if (0 != Memfs->SnapshotThread)
+    {
+        SetEvent(Memfs->SnapshotStopEvent);
+        WaitForSingleObject(Memfs->SnapshotThread, INFINITE);
+        CloseHandle(Memfs->SnapshotThread);
+        Memfs->SnapshotThread = 0;
+
+        /* the dispatcher is stopped; no need to exclude file system operations */
+        NTSTATUS Result = MemfsSnapshotWrite(Memfs);
+        if (!NT_SUCCESS(Result))
+            FspDebugLog(__FUNCTION__ ": cannot write snapshot (Status=%lx)\n", Result);
+    }
+#endif
+}
+
+NTSTATUS MemfsSnapshotConfigure(MEMFS *Memfs, PWSTR SnapshotPath, ULONG SnapshotInterval)
+{
+#if defined(MEMFS_SNAPSHOT)
+    NTSTATUS Result;
+
+    if (0 != Memfs->SnapshotPath || 0 == SnapshotPath || L'\0' == SnapshotPath[0])
+        return STATUS_INVALID_PARAMETER;
+
+    Memfs->SnapshotPath = MemfsSnapshotPathWithSuffix(SnapshotPath, L"");
+    Memfs->SnapshotStopEvent = CreateEventW(0, TRUE, FALSE, 0);
+    Memfs->SnapshotRequestEvent = CreateEventW(0, FALSE, FALSE, 0);
+    if (0 == Memfs->SnapshotPath || 0 == Memfs->SnapshotStopEvent || 0 == Memfs->SnapshotRequestEvent)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+    Memfs->SnapshotInterval = SnapshotInterval;
+    InitializeSRWLock(&Memfs->SnapshotLock);
+
+    Result = MemfsSnapshotRead(Memfs);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (!NT_SUCCESS(Result))
+    {
+        if (0 != Memfs->SnapshotStopEvent)
+            CloseHandle(Memfs->SnapshotStopEvent);
+        if (0 != Memfs->SnapshotRequestEvent)
+            CloseHandle(Memfs->SnapshotRequestEvent);
+        free(Memfs->SnapshotPath);
+
+        Memfs->SnapshotStopEvent = 0;
+        Memfs->SnapshotRequestEvent = 0;
+        Memfs->SnapshotPath = 0;
+    }
+
+    return Result;
+#else
+    return STATUS_INVALID_DEVICE_REQUEST;
+#endif
+}
+
+NTSTATUS MemfsSpillConfigure(MEMFS *Memfs, UINT64 MemoryBudget, PWSTR SpillPath)
+{
+#if defined(MEMFS_SPILL)
+    /*
+     * Keep at most MemoryBudget bytes of file data in memory and spill the least recently
+     * used blocks to SpillPath, which is created anew and deleted when the file system is
+     * deleted. Must be called before any files are created (or loaded from a snapshot).
+     */
+    MEMFS_BLOCK_STORE *Store = &Memfs->BlockStore;
+    HANDLE Handle;
+    NTSTATUS Result;
+
+    if (0 != Store->SpillFile || MEMFS_BLOCK_SIZE > MemoryBudget ||
+        0 == SpillPath || L'\0' == SpillPath[0])
+        return STATUS_INVALID_PARAMETER;
+    if (1 != MemfsFileNodeMapCount(Memfs->FileNodeMap))
+        return STATUS_INVALID_DEVICE_STATE;
+
+    if (!GetVolumePathNameW(SpillPath, Store->SpillVolume, MAX_PATH))
+        return FspNtStatusFromWin32(GetLastError());
+
+    if (!Memfs->BlockMode)
+    {
+        Result = MemfsBlockStoreInitialize(Store);
+        if (!NT_SUCCESS(Result))
+            return Result;
+        Memfs->BlockMode = TRUE;
+    }
+
+    Handle = CreateFileW(SpillPath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return FspNtStatusFromWin32(GetLastError());
+
+    Store->SpillFile = Handle;
+    Store->BudgetBlocks = MemoryBudget / MEMFS_BLOCK_SIZE;
+
+    return STATUS_SUCCESS;
+#else
+    return STATUS_INVALID_DEVICE_REQUEST;
+#endif
+}
+
+NTSTATUS MemfsSlowioConfigure(MEMFS *Memfs, PWSTR LatencySpec)
+{
+#ifdef MEMFS_SLOWIO
+    /*
+     * LatencySpec is a list of [KIND=]MODEL items separated by semicolons, where KIND is
+     * one of read, write, readdir (all kinds if omitted) and MODEL is one of:
+     *     fixed:MILLIS
+     *     uniform:MINMILLIS-MAXMILLIS
+     *     lognormal:MEDIANMILLIS,SIGMA
+     *     trace:TRACEFILE
+     * For example: "lognormal:2,0.5;write=trace:disk-trace.txt"
+     */
+    WCHAR Buffer[1024];
+    PWSTR Item, NextItem, Model, P;
+    ULONG KindIndex, KindCount;
+    NTSTATUS Result;
+
+    if (0 == LatencySpec || sizeof Buffer / sizeof(WCHAR) <= wcslen(LatencySpec))
+        return STATUS_INVALID_PARAMETER;
+    wcscpy_s(Buffer, sizeof Buffer / sizeof(WCHAR), LatencySpec);
+
+    Result = SlowioCreate(Memfs);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    for (Item = Buffer; 0 != Item && L'\0' != *Item; Item = NextItem)
+    {
+        NextItem = wcschr(Item, L';');
+        if (0 != NextItem)
+            *NextItem++ = L'\0';
+
+        KindIndex = 0;
+        KindCount = MEMFS_SLOWIO_KIND_COUNT;
+        Model = Item;
+        P = wcschr(Item, L'=');
+        if (0 != P)
+        {
+            *P = L'\0';
+            for (KindIndex = 0; MEMFS_SLOWIO_KIND_COUNT > KindIndex; KindIndex++)
+                if (0 == _wcsicmp(Item, SlowioKindNames[KindIndex]))
+                    break;
+            if (MEMFS_SLOWIO_KIND_COUNT == KindIndex)
+                return STATUS_INVALID_PARAMETER;
+            KindCount = 1;
+            Model = P + 1;
+        }
+
+        for (; 0 < KindCount; KindIndex++, KindCount--)
+        {
+            Result = SlowioParseModel(Model, KindIndex, &Memfs->Slowio->Model[KindIndex]);
+            if (!NT_SUCCESS(Result))
+                return Result;
+        }
+    }
+
+    return STATUS_SUCCESS;
+#else
+    return STATUS_INVALID_DEVICE_REQUEST;
 #endif
 }
 
@@ -37,8 +37,31 @@ enum
     MemfsDeviceMask                     = 0x0000000f,
     MemfsCaseInsensitive                = 0x80000000,
     MemfsFlushAndPurgeOnCleanup         = 0x40000000,
+    MemfsDedup                          = 0x20000000,
+    MemfsRegisteredBuffers              = 0x10000000,
+    MemfsNegativeLookupCache            = 0x08000000,
 };
 
+/* output of the MEMFS dedup statistics control code: CTL_CODE(0x8000 + 'M', 'D', ...) */
+typedef struct _MEMFS_DEDUP_STATISTICS
+{
+    UINT64 BlockSize;
+    UINT64 LogicalBlocks;               /* block references held by files */
+    UINT64 PhysicalBlocks;              /* blocks in memory */
+    UINT64 IndexedBlocks;               /* blocks in the content index */
+} MEMFS_DEDUP_STATISTICS;
+
+/* output of the MEMFS spill statistics control code: CTL_CODE(0x8000 + 'M', 'L', ...) */
+typedef struct _MEMFS_SPILL_STATISTICS
+{
+    UINT64 BudgetBytes;                 /* memory budget for file data */
+    UINT64 ResidentBytes;               /* file data in memory */
+    UINT64 SpilledBytes;                /* file data in the spill file */
+    UINT64 Hits;                        /* block accesses served from memory */
+    UINT64 Misses;                      /* block accesses served from the spill file */
+    UINT64 Evictions;                   /* blocks evicted from memory */
+} MEMFS_SPILL_STATISTICS;
+
 #define MemfsCreate(Flags, FileInfoTimeout, MaxFileNodes, MaxFileSize,             VolumePrefix, RootSddl, PMemfs)\
     MemfsCreateFunnel(\
         Flags,\
@@ -69,6 +92,12 @@ NTSTATUS MemfsStart(MEMFS *Memfs);
 VOID MemfsStop(MEMFS *Memfs);
 FSP_FILE_SYSTEM *MemfsFileSystem(MEMFS *Memfs);
 
+NTSTATUS MemfsSlowioConfigure(MEMFS *Memfs, PWSTR LatencySpec);
+
+NTSTATUS MemfsSnapshotConfigure(MEMFS *Memfs, PWSTR SnapshotPath, ULONG SnapshotInterval);
+
+NTSTATUS MemfsSpillConfigure(MEMFS *Memfs, UINT64 MemoryBudget, PWSTR SpillPath);
+
 NTSTATUS MemfsHeapConfigure(SIZE_T InitialSize, SIZE_T MaximumSize, SIZE_T Alignment);
 
 #ifdef __cplusplus
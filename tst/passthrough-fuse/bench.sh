@@ -0,0 +1,114 @@
+#!/bin/sh
+#
+# bench.sh - compare passthrough-fuse against the file system it passes through to
+#
+# usage: bench.sh [-n Files] [-s SizeMiB] [-o FuseOptions] Binary RootDir MountPoint
+#
+# Mounts RootDir on MountPoint with Binary (e.g. ./passthrough-libfuse built with
+# "make libfuse") and runs the same workloads directly on RootDir (the baseline) and
+# through MountPoint. Results are printed as CSV lines of Test,Target,Seconds, where
+# Target is "direct" or "fuse".
+#
+# The workloads mirror fsbench: create/open/stat/list/delete Files empty files in a
+# single directory, then write and read back a SizeMiB file sequentially. On Linux the
+# default FuseOptions enable large writes and splicing, so that read_buf/write_buf are
+# exercised; override them with -o (use -o "" for none).
+
+set -e
+
+Files=10000
+SizeMiB=256
+case "$(uname -s)" in
+Linux)  FuseOptions="-o big_writes,max_read=131072,splice_read,splice_write,splice_move";;
+*)      FuseOptions="";;
+esac
+
+while getopts n:s:o: Opt; do
+    case $Opt in
+    n)  Files=$OPTARG;;
+    s)  SizeMiB=$OPTARG;;
+    o)  FuseOptions=$OPTARG;;
+    *)  sed -n 's/^# \{0,1\}//;3,5p' "$0" >&2; exit 2;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 3 ] || { sed -n 's/^# \{0,1\}//;3,5p' "$0" >&2; exit 2; }
+
+Binary=$1
+RootDir=$(cd "$2" && pwd)
+MountPoint=$3
+
+now() {
+    date +%s.%N
+}
+
+measure() { # Test Target Command...
+    Test=$1; Target=$2; shift 2
+    Start=$(now)
+    "$@"
+    End=$(now)
+    echo "$Test,$Target,$(echo "$Start $End" | awk '{ printf "%.3f", $2 - $1 }')"
+}
+
+file_create() {
+    i=0; while [ $i -lt $Files ]; do : > "$1/f$i"; i=$((i + 1)); done
+}
+
+file_open() {
+    i=0; while [ $i -lt $Files ]; do read -r _ < "$1/f$i" || :; i=$((i + 1)); done
+}
+
+file_stat() {
+    i=0; while [ $i -lt $Files ]; do [ -e "$1/f$i" ]; i=$((i + 1)); done
+}
+
+file_list() {
+    ls -l "$1" > /dev/null
+}
+
+file_delete() {
+    i=0; while [ $i -lt $Files ]; do rm -f "$1/f$i"; i=$((i + 1)); done
+}
+
+rdwr_write() {
+    dd if=/dev/zero of="$1/big" bs=1048576 count=$SizeMiB conv=fsync 2> /dev/null
+}
+
+rdwr_read() {
+    dd if="$1/big" of=/dev/null bs=1048576 2> /dev/null
+}
+
+run() { # Target Dir
+    mkdir -p "$2"
+    for Test in file_create file_open file_stat file_list file_delete rdwr_write rdwr_read; do
+        measure $Test "$1" $Test "$2"
+    done
+    rm -rf "$2"
+}
+
+unmount() {
+    if [ -n "$FusePid" ]; then
+        if command -v fusermount > /dev/null 2>&1; then
+            fusermount -u "$MountPoint" || :
+        fi
+        kill $FusePid 2> /dev/null || :
+        wait $FusePid 2> /dev/null || :
+        FusePid=
+    fi
+    rm -f "$RootDir/.bench-mounted"
+}
+trap unmount EXIT INT TERM
+
+run direct "$RootDir/bench.direct"
+
+: > "$RootDir/.bench-mounted"
+"$Binary" -f $FuseOptions "$RootDir" "$MountPoint" &
+FusePid=$!
+Wait=0
+until [ -e "$MountPoint/.bench-mounted" ]; do
+    Wait=$((Wait + 1))
+    [ $Wait -lt 100 ] || { echo "cannot mount $MountPoint" >&2; exit 1; }
+    sleep 0.1
+done
+
+run fuse "$MountPoint/bench.fuse"
@@ -25,16 +25,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#if !defined(_WIN64) && !defined(_WIN32) && !defined(__CYGWIN__)
+/* native libfuse 2 (e.g. Linux): the baseline that WinFsp-FUSE numbers are compared against */
+#define PTFS_LIBFUSE
+#define FUSE_USE_VERSION                29
+#endif
+
 #include <fuse.h>
 
 #if defined(_WIN64) || defined(_WIN32)
 #include "winposix.h"
 #else
 #include <dirent.h>
+#include <pthread.h>
+#include <string.h>
 #include <unistd.h>
 #endif
 
+#if defined(PTFS_LIBFUSE)
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <utime.h>
+
+#define fuse_uid_t                      uid_t
+#define fuse_gid_t                      gid_t
+#define fuse_mode_t                     mode_t
+#define fuse_off_t                      off_t
+#define fuse_utimbuf                    utimbuf
+#define fuse_timespec                   timespec
+#define fuse_stat                       stat
+#define fuse_statvfs                    statvfs
+#endif
+
 #define PTFS_UTIMENS
+#if !defined(_WIN64) && !defined(_WIN32)
+#define PTFS_FHTABLE                    /* share backing descriptors between opens */
+#endif
+#if defined(PTFS_LIBFUSE)
+#define PTFS_BUFVEC                     /* read_buf/write_buf; WinFsp-FUSE does not use them */
+#endif
 
 #define FSNAME                          "passthrough"
 #define PROGNAME                        "passthrough-fuse"
@@ -49,6 +79,13 @@
 #define fi_dirp(fi)                     ((DIR *)(intptr_t)fi_fh(fi, ~fi_dirbit))
 #define fi_setfd(fi, fd)                (fi_setfh(fi, fd, 0))
 #define fi_setdirp(fi, dirp)            (fi_setfh(fi, dirp, fi_dirbit))
+#if defined(PTFS_FHTABLE)
+#undef fi_fd
+#define fi_fd(fi)                       (fi_fh(fi, fi_dirbit) ? \
+    dirfd((DIR *)(intptr_t)fi_fh(fi, ~fi_dirbit)) : fi_fhp(fi)->fd)
+#define fi_fhp(fi)                      ((PTFS_FH *)(intptr_t)fi_fh(fi, ~fi_dirbit))
+#define fi_setfhp(fi, fhp)              (fi_setfh(fi, fhp, 0))
+#endif
 
 #define ptfs_impl_fullpath(n)           \
     char full ## n[PATH_MAX];           \
@@ -56,11 +93,145 @@
         return -ENAMETOOLONG;           \
     n = full ## n
 
+#if defined(PTFS_FHTABLE)
+/*
+ * File Handle Table
+ *
+ * Opens of the same path with the same flags share one backing descriptor, which stays
+ * open for as long as any of them does. All I/O is positional (pread/pwrite), so there is
+ * no file offset to share. Opens that create, truncate or append always get a descriptor
+ * of their own. Renames and unlinks drop the affected paths from the table; descriptors
+ * already handed out stay valid, just as they would for any other open file.
+ */
+
+#define PTFS_FH_BUCKETS                 256
+
+typedef struct ptfs_fh
+{
+    struct ptfs_fh *next;
+    unsigned refcnt;                    /* protected by ptfs->fhlock */
+    unsigned hash;
+    int linked;
+    int flags;
+    int fd;
+    char path[];
+} PTFS_FH;
+#endif
+
 typedef struct
 {
     const char *rootdir;
+#if defined(PTFS_FHTABLE)
+    pthread_mutex_t fhlock;
+    PTFS_FH *fhtab[PTFS_FH_BUCKETS];
+#endif
 } PTFS;
 
+#if defined(PTFS_FHTABLE)
+static unsigned ptfs_fh_hash(const char *path)
+{
+    unsigned hash = 2166136261u;
+    for (; '\0' != *path; path++)
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    return hash;
+}
+
+static PTFS_FH *ptfs_fh_open(PTFS *ptfs, const char *path, int flags, fuse_mode_t mode)
+{
+    int shared = 0 == (flags & (O_CREAT | O_EXCL | O_TRUNC | O_APPEND));
+    unsigned hash = ptfs_fh_hash(path);
+    size_t pathlen = strlen(path) + 1;
+    PTFS_FH *fh = 0;
+    int err;
+
+    if (shared)
+    {
+        pthread_mutex_lock(&ptfs->fhlock);
+        for (fh = ptfs->fhtab[hash % PTFS_FH_BUCKETS]; 0 != fh; fh = fh->next)
+            if (fh->hash == hash && fh->flags == flags && 0 == strcmp(fh->path, path))
+            {
+                fh->refcnt++;
+                break;
+            }
+        pthread_mutex_unlock(&ptfs->fhlock);
+        if (0 != fh)
+            return fh;
+    }
+
+    if (0 == (fh = malloc(sizeof *fh + pathlen)))
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    if (-1 == (fh->fd = open(path, flags, mode)))
+    {
+        err = errno;
+        free(fh);
+        errno = err;
+        return 0;
+    }
+    fh->next = 0;
+    fh->refcnt = 1;
+    fh->hash = hash;
+    fh->linked = shared;
+    fh->flags = flags;
+    memcpy(fh->path, path, pathlen);
+
+    if (shared)
+    {
+        /* a racing open of the same path may insert too; either entry is fine */
+        pthread_mutex_lock(&ptfs->fhlock);
+        fh->next = ptfs->fhtab[hash % PTFS_FH_BUCKETS];
+        ptfs->fhtab[hash % PTFS_FH_BUCKETS] = fh;
+        pthread_mutex_unlock(&ptfs->fhlock);
+    }
+
+    return fh;
+}
+
+static void ptfs_fh_close(PTFS *ptfs, PTFS_FH *fh)
+{
+    PTFS_FH **p;
+    unsigned refcnt;
+
+    pthread_mutex_lock(&ptfs->fhlock);
+    refcnt = --fh->refcnt;
+    if (0 == refcnt && fh->linked)
+    {
+        for (p = &ptfs->fhtab[fh->hash % PTFS_FH_BUCKETS]; fh != *p; p = &(*p)->next)
+            ;
+        *p = fh->next;
+    }
+    pthread_mutex_unlock(&ptfs->fhlock);
+
+    if (0 == refcnt)
+    {
+        close(fh->fd);
+        free(fh);
+    }
+}
+
+static void ptfs_fh_invalidate(PTFS *ptfs, const char *path, int subtree)
+{
+    size_t pathlen = strlen(path);
+    unsigned hash = ptfs_fh_hash(path), i, e;
+    PTFS_FH **p, *fh;
+
+    pthread_mutex_lock(&ptfs->fhlock);
+    for (i = subtree ? 0 : hash % PTFS_FH_BUCKETS, e = subtree ? PTFS_FH_BUCKETS : i + 1; e > i; i++)
+        for (p = &ptfs->fhtab[i]; 0 != (fh = *p);)
+            if (0 == strncmp(fh->path, path, pathlen) &&
+                ('\0' == fh->path[pathlen] || (subtree && '/' == fh->path[pathlen])))
+            {
+                *p = fh->next;
+                fh->linked = 0;
+            }
+            else
+                p = &fh->next;
+    pthread_mutex_unlock(&ptfs->fhlock);
+}
+#endif
+
 static int ptfs_getattr(const char *path, struct fuse_stat *stbuf)
 {
     ptfs_impl_fullpath(path);
@@ -79,6 +250,10 @@ static int ptfs_unlink(const char *path)
 {
     ptfs_impl_fullpath(path);
 
+#if defined(PTFS_FHTABLE)
+    ptfs_fh_invalidate(fuse_get_context()->private_data, path, 0);
+#endif
+
     return -1 != unlink(path) ? 0 : -errno;
 }
 
@@ -94,6 +269,11 @@ static int ptfs_rename(const char *oldpath, const char *newpath)
     ptfs_impl_fullpath(newpath);
     ptfs_impl_fullpath(oldpath);
 
+#if defined(PTFS_FHTABLE)
+    ptfs_fh_invalidate(fuse_get_context()->private_data, oldpath, 1);
+    ptfs_fh_invalidate(fuse_get_context()->private_data, newpath, 1);
+#endif
+
     return -1 != rename(oldpath, newpath) ? 0 : -errno;
 }
 
@@ -131,8 +311,14 @@ static int ptfs_open(const char *path, struct fuse_file_info *fi)
 {
     ptfs_impl_fullpath(path);
 
+#if defined(PTFS_FHTABLE)
+    PTFS_FH *fh;
+    return 0 != (fh = ptfs_fh_open(fuse_get_context()->private_data, path, fi->flags, 0)) ?
+        (fi_setfhp(fi, fh), 0) : -errno;
+#else
     int fd;
     return -1 != (fd = open(path, fi->flags)) ? (fi_setfd(fi, fd), 0) : -errno;
+#endif
 }
 
 static int ptfs_read(const char *path, char *buf, size_t size, fuse_off_t off,
@@ -153,6 +339,38 @@ static int ptfs_write(const char *path, const char *buf, size_t size, fuse_off_t
     return -1 != (nb = pwrite(fd, buf, size, off)) ? nb : -errno;
 }
 
+#if defined(PTFS_BUFVEC)
+static int ptfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, fuse_off_t off,
+    struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bufv;
+
+    /* hand libfuse the descriptor; with -o splice_read the data never enters user space */
+    if (0 == (bufv = malloc(sizeof *bufv)))
+        return -ENOMEM;
+
+    *bufv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(size);
+    bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[0].fd = fi_fd(fi);
+    bufv->buf[0].pos = off;
+
+    *bufp = bufv;
+    return 0;
+}
+
+static int ptfs_write_buf(const char *path, struct fuse_bufvec *buf, fuse_off_t off,
+    struct fuse_file_info *fi)
+{
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = fi_fd(fi);
+    dst.buf[0].pos = off;
+
+    return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+#endif
+
 static int ptfs_statfs(const char *path, struct fuse_statvfs *stbuf)
 {
     ptfs_impl_fullpath(path);
@@ -162,9 +380,13 @@ static int ptfs_statfs(const char *path, struct fuse_statvfs *stbuf)
 
 static int ptfs_release(const char *path, struct fuse_file_info *fi)
 {
+#if defined(PTFS_FHTABLE)
+    ptfs_fh_close(fuse_get_context()->private_data, fi_fhp(fi));
+#else
     int fd = fi_fd(fi);
 
     close(fd);
+#endif
     return 0;
 }
 
@@ -218,6 +440,9 @@ static int ptfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, fus
 {
     DIR *dirp = fi_dirp(fi);
     struct dirent *de;
+#if !defined(_WIN64) && !defined(_WIN32)
+    struct fuse_stat stbuf;
+#endif
 
     rewinddir(dirp);
     for (;;)
@@ -227,8 +452,23 @@ static int ptfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, fus
             break;
 #if defined(_WIN64) || defined(_WIN32)
         if (0 != filler(buf, de->d_name, &de->d_stat, 0))
+#elif defined(PTFS_LIBFUSE)
+        /* libfuse 2 only looks at st_ino and st_mode of an entry; the dirent has both */
+        memset(&stbuf, 0, sizeof stbuf);
+        stbuf.st_ino = de->d_ino;
+#if defined(DTTOIF)
+        stbuf.st_mode = DTTOIF(de->d_type);
+#endif
+        if (0 != filler(buf, de->d_name, &stbuf, 0))
 #else
-        if (0 != filler(buf, de->d_name, 0, 0))
+        /* readdir-plus: stat relative to the directory being read; skip entries now gone */
+        if (-1 == fstatat(dirfd(dirp), de->d_name, &stbuf, AT_SYMLINK_NOFOLLOW))
+        {
+            if (ENOENT == errno)
+                continue;
+            return -errno;
+        }
+        if (0 != filler(buf, de->d_name, &stbuf, 0))
 #endif
             return -ENOMEM;
     }
@@ -245,11 +485,12 @@ static int ptfs_releasedir(const char *path, struct fuse_file_info *fi)
 
 static void *ptfs_init(struct fuse_conn_info *conn)
 {
-#if defined(_WIN64) || defined(_WIN32)
 #if defined(FSP_FUSE_CAP_READDIR_PLUS)
     conn->want |= (conn->capable & FSP_FUSE_CAP_READDIR_PLUS);
 #endif
 
+#if defined(_WIN64) || defined(_WIN32)
+
 #if defined(FSP_FUSE_USE_STAT_EX) && defined(FSP_FUSE_CAP_STAT_EX)
     conn->want |= (conn->capable & FSP_FUSE_CAP_STAT_EX);
 #endif
@@ -266,8 +507,14 @@ static int ptfs_create(const char *path, fuse_mode_t mode, struct fuse_file_info
 {
     ptfs_impl_fullpath(path);
 
+#if defined(PTFS_FHTABLE)
+    PTFS_FH *fh;
+    return 0 != (fh = ptfs_fh_open(fuse_get_context()->private_data, path, fi->flags, mode)) ?
+        (fi_setfhp(fi, fh), 0) : -errno;
+#else
     int fd;
     return -1 != (fd = open(path, fi->flags, mode)) ? (fi_setfd(fi, fd), 0) : -errno;
+#endif
 }
 
 static int ptfs_ftruncate(const char *path, fuse_off_t off, struct fuse_file_info *fi)
@@ -327,6 +574,10 @@ static struct fuse_operations ptfs_ops =
     .open = ptfs_open,
     .read = ptfs_read,
     .write = ptfs_write,
+#if defined(PTFS_BUFVEC)
+    .read_buf = ptfs_read_buf,
+    .write_buf = ptfs_write_buf,
+#endif
     .statfs = ptfs_statfs,
     .release = ptfs_release,
     .fsync = ptfs_fsync,
@@ -362,6 +613,10 @@ int main(int argc, char *argv[])
 {
     PTFS ptfs = { 0 };
 
+#if defined(PTFS_FHTABLE)
+    pthread_mutex_init(&ptfs.fhlock, 0);
+#endif
+
     if (3 <= argc && '-' != argv[argc - 2][0] && '-' != argv[argc - 1][0])
     {
         ptfs.rootdir = realpath(argv[argc - 2], 0); /* memory freed at process end */
@@ -33,41 +33,772 @@
 #define ConcatPath(Ptfs, FN, FP)        (0 == StringCbPrintfW(FP, sizeof FP, L"%s%s", Ptfs->Path, FN))
 #define HandleFromContext(FC)           (((PTFS_FILE_CONTEXT *)(FC))->Handle)
 
+#define FILE_NODE_BUCKETS               1024
+#define DIR_QUERY_BUFFER_SIZE           (64 * 1024)
+#define OPEN_CACHE_BUCKETS              512
+#define OPEN_CACHE_SIZEMAX              256
+#define COPY_BUFFER_SIZE                (1024 * 1024)
+
+/*
+ * Overlapped I/O
+ *
+ * With -o backing files are opened for overlapped I/O and bound to an I/O completion port.
+ * Read and Write start the backend I/O and return STATUS_PENDING; a completion thread
+ * sends the response with FspFileSystemSendResponse when the I/O completes. A dispatcher
+ * thread is therefore not tied up for the duration of a backend I/O and the number of
+ * I/Os in flight is bounded by the queue depth rather than the number of threads.
+ *
+ * Open files share a PTFS_FILE_NODE per backing file, which holds the file information
+ * last seen for the file. Writes update it from their own offset and length, so that they
+ * do not need a GetFileSizeEx (ConstrainedIo) or GetFileInformationByHandle afterwards.
+ * Any other operation that queries the backing file refreshes it.
+ */
+
+typedef struct _PTFS_FILE_NODE
+{
+    struct _PTFS_FILE_NODE *Next;
+    DWORD VolumeSerialNumber;
+    UINT64 FileIndex;
+    LONG RefCount;                      /* protected by Ptfs->FileNodeLock */
+    SRWLOCK Lock;
+    FSP_FSCTL_FILE_INFO FileInfo;
+} PTFS_FILE_NODE;
+
+/*
+ * Open cache
+ *
+ * With -c the backing handle that GetSecurityByName opens is kept for a short time (the
+ * cache timeout), together with the file attributes, file information and security
+ * descriptor read through it. A following GetSecurityByName of the same path is answered
+ * from the cache and a following Open reopens the cached handle (ReOpenFile) rather than
+ * the path, and reports the cached file information. So the usual GetSecurityByName/Open
+ * sequence costs a single path open and a single metadata query.
+ *
+ * Entries are keyed by the upcased file name. Operations that delete or rename a file
+ * (SetDelete, Cleanup with delete, Rename) remove its entry (or subtree) before they touch
+ * the backing file, so that a cached handle never keeps a file from being deleted or a
+ * directory from being renamed. Operations on open files invalidate all entries through
+ * generation counts once they are done: changes to attributes or security invalidate
+ * entries altogether, changes to file data only their file information. Expired entries
+ * are closed when later entries are added, and by a timer that runs every cache timeout,
+ * so that an idle file system does not keep handles open.
+ *
+ * Changes made to the backing files by others are not seen. A cached handle is opened with
+ * FILE_SHARE_DELETE, but until it is closed a file that is deleted by others remains in
+ * the delete pending state (its name cannot be reused) and a directory above it cannot be
+ * renamed by others. So the cache timeout bounds both how stale the cached metadata can be
+ * and how long others may be blocked; keep it short (tens of milliseconds).
+ */
+
+typedef struct _PTFS_OPEN_ENTRY
+{
+    struct _PTFS_OPEN_ENTRY *HashNext;
+    LIST_ENTRY ListEntry;               /* in insertion (and therefore expiration) order */
+    ULONG Hash;
+    ULONGLONG ExpirationTime;
+    LONG SecurityGeneration, FileInfoGeneration;
+    HANDLE Handle;                      /* 0 once an Open has reopened it */
+    UINT32 FileAttributes;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    ULONG SecurityDescriptorSize;
+    ULONG KeyLength;
+    WCHAR Key[];
+} PTFS_OPEN_ENTRY;
+
 typedef struct
 {
     FSP_FILE_SYSTEM *FileSystem;
     PWSTR Path;
+    HANDLE Iocp;
+    HANDLE *IoThreads;
+    ULONG IoThreadCount;
+    LONG IoPending;                     /* biased by 1 until PtfsDelete */
+    HANDLE IoIdleEvent;                 /* signaled when IoPending drops to 0 */
+    SRWLOCK FileNodeLock;
+    PTFS_FILE_NODE **FileNodes;
+    LONG RenameCount;
+    ULONG OpenCacheTimeout;
+    SRWLOCK OpenCacheLock;
+    PTFS_OPEN_ENTRY **OpenCacheBuckets;
+    LIST_ENTRY OpenCacheList;
+    ULONG OpenCacheCount;
+    LONG OpenCacheNameGeneration;       /* protected by Ptfs->OpenCacheLock */
+    LONG OpenCacheSecurityGeneration, OpenCacheFileInfoGeneration;
+    PTP_TIMER OpenCacheTimer;
 } PTFS;
 
 typedef struct
 {
     HANDLE Handle;
     PVOID DirBuffer;
+    PTFS_FILE_NODE *FileNode;
+    BOOLEAN SkipCompletionPort;
+    HANDLE DirHandle;                   /* synchronous handle for directory queries */
+    PWSTR DirPath;                      /* final path of the directory; no trailing '\\' */
+    LONG DirPathRenameCount;            /* Ptfs->RenameCount when DirPath was resolved */
+    PUINT8 DirQueryBuffer;              /* DIR_QUERY_BUFFER_SIZE; protected by DirBuffer lock */
 } PTFS_FILE_CONTEXT;
 
-static NTSTATUS GetFileInfoInternal(HANDLE Handle, FSP_FSCTL_FILE_INFO *FileInfo)
+/* DUPLICATE_EXTENTS_DATA is only declared by the SDK for newer _WIN32_WINNT's */
+typedef struct
 {
-    BY_HANDLE_FILE_INFORMATION ByHandleFileInfo;
+    HANDLE FileHandle;
+    LARGE_INTEGER SourceFileOffset;
+    LARGE_INTEGER TargetFileOffset;
+    LARGE_INTEGER ByteCount;
+} PTFS_DUPLICATE_EXTENTS_DATA;
 
-    if (!GetFileInformationByHandle(Handle, &ByHandleFileInfo))
-        return FspNtStatusFromWin32(GetLastError());
+typedef struct
+{
+    OVERLAPPED Overlapped;
+    PTFS_FILE_CONTEXT *FileContext;
+    UINT64 Hint;
+    UINT64 Offset;
+    UINT32 Kind;
+} PTFS_IO_REQUEST;
 
-    FileInfo->FileAttributes = ByHandleFileInfo.dwFileAttributes;
+static VOID GetFileInfoFromByHandle(BY_HANDLE_FILE_INFORMATION *ByHandleFileInfo,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    FileInfo->FileAttributes = ByHandleFileInfo->dwFileAttributes;
     FileInfo->ReparseTag = 0;
     FileInfo->FileSize =
-        ((UINT64)ByHandleFileInfo.nFileSizeHigh << 32) | (UINT64)ByHandleFileInfo.nFileSizeLow;
+        ((UINT64)ByHandleFileInfo->nFileSizeHigh << 32) | (UINT64)ByHandleFileInfo->nFileSizeLow;
     FileInfo->AllocationSize = (FileInfo->FileSize + ALLOCATION_UNIT - 1)
         / ALLOCATION_UNIT * ALLOCATION_UNIT;
-    FileInfo->CreationTime = ((PLARGE_INTEGER)&ByHandleFileInfo.ftCreationTime)->QuadPart;
-    FileInfo->LastAccessTime = ((PLARGE_INTEGER)&ByHandleFileInfo.ftLastAccessTime)->QuadPart;
-    FileInfo->LastWriteTime = ((PLARGE_INTEGER)&ByHandleFileInfo.ftLastWriteTime)->QuadPart;
+    FileInfo->CreationTime = ((PLARGE_INTEGER)&ByHandleFileInfo->ftCreationTime)->QuadPart;
+    FileInfo->LastAccessTime = ((PLARGE_INTEGER)&ByHandleFileInfo->ftLastAccessTime)->QuadPart;
+    FileInfo->LastWriteTime = ((PLARGE_INTEGER)&ByHandleFileInfo->ftLastWriteTime)->QuadPart;
     FileInfo->ChangeTime = FileInfo->LastWriteTime;
-    FileInfo->IndexNumber = 0;
+    FileInfo->IndexNumber =
+        ((UINT64)ByHandleFileInfo->nFileIndexHigh << 32) | (UINT64)ByHandleFileInfo->nFileIndexLow;
     FileInfo->HardLinks = 0;
+}
+
+static NTSTATUS GetFileInfoInternal(HANDLE Handle, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    BY_HANDLE_FILE_INFORMATION ByHandleFileInfo;
+
+    if (!GetFileInformationByHandle(Handle, &ByHandleFileInfo))
+        return FspNtStatusFromWin32(GetLastError());
+
+    GetFileInfoFromByHandle(&ByHandleFileInfo, FileInfo);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS GetFileInfoFromContext(PVOID FileContext0, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    PTFS_FILE_CONTEXT *FileContext = FileContext0;
+    PTFS_FILE_NODE *FileNode = FileContext->FileNode;
+    NTSTATUS Result;
+
+    Result = GetFileInfoInternal(FileContext->Handle, FileInfo);
+    if (NT_SUCCESS(Result) && 0 != FileNode)
+    {
+        AcquireSRWLockExclusive(&FileNode->Lock);
+        FileNode->FileInfo = *FileInfo;
+        ReleaseSRWLockExclusive(&FileNode->Lock);
+    }
+
+    return Result;
+}
+
+static ULONG OpenCacheKey(PWSTR FileName, PWSTR Key, PULONG PHash)
+{
+    int Length;
+    ULONG Hash, I;
+
+    Length = LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE,
+        FileName, -1, Key, FULLPATH_SIZE, 0, 0, 0);
+    if (1 >= Length)
+        return 0;
+    Length--;
+
+    /* FNV-1a */
+    Hash = 2166136261;
+    for (I = 0; (ULONG)Length > I; I++)
+        Hash = (Hash ^ Key[I]) * 16777619;
+
+    *PHash = Hash;
+    return Length;
+}
+
+static VOID OpenCacheFree(PTFS_OPEN_ENTRY *Entry)
+{
+    PTFS_OPEN_ENTRY *Next;
+
+    /* removed entries are chained through HashNext */
+    for (; 0 != Entry; Entry = Next)
+    {
+        Next = Entry->HashNext;
+        if (0 != Entry->Handle)
+            CloseHandle(Entry->Handle);
+        free(Entry->SecurityDescriptor);
+        free(Entry);
+    }
+}
+
+static VOID OpenCacheRemove(PTFS *Ptfs, PTFS_OPEN_ENTRY *Entry, PTFS_OPEN_ENTRY **PRemoved)
+{
+    PTFS_OPEN_ENTRY **P;
+
+    /* caller holds Ptfs->OpenCacheLock exclusive */
+    for (P = &Ptfs->OpenCacheBuckets[Entry->Hash % OPEN_CACHE_BUCKETS]; Entry != *P;
+        P = &(*P)->HashNext)
+        ;
+    *P = Entry->HashNext;
+
+    Entry->ListEntry.Blink->Flink = Entry->ListEntry.Flink;
+    Entry->ListEntry.Flink->Blink = Entry->ListEntry.Blink;
+    Ptfs->OpenCacheCount--;
+
+    Entry->HashNext = *PRemoved;
+    *PRemoved = Entry;
+}
+
+static PTFS_OPEN_ENTRY *OpenCacheLookup(PTFS *Ptfs, PWSTR Key, ULONG KeyLength, ULONG Hash)
+{
+    PTFS_OPEN_ENTRY *Entry;
+
+    /* caller holds Ptfs->OpenCacheLock */
+    for (Entry = Ptfs->OpenCacheBuckets[Hash % OPEN_CACHE_BUCKETS]; 0 != Entry;
+        Entry = Entry->HashNext)
+        if (Entry->Hash == Hash && Entry->KeyLength == KeyLength &&
+            0 == memcmp(Entry->Key, Key, KeyLength * sizeof(WCHAR)))
+            break;
+
+    if (0 == Entry ||
+        Entry->ExpirationTime <= GetTickCount64() ||
+        Entry->SecurityGeneration != Ptfs->OpenCacheSecurityGeneration)
+        return 0;
+
+    return Entry;
+}
+
+static VOID CALLBACK OpenCacheTimerCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Ptfs0,
+    PTP_TIMER Timer)
+{
+    PTFS *Ptfs = Ptfs0;
+    ULONGLONG Now = GetTickCount64();
+    PTFS_OPEN_ENTRY *Removed = 0, *Other;
+
+    /* close the handles of expired entries even when no new entries are added */
+    AcquireSRWLockExclusive(&Ptfs->OpenCacheLock);
+    while (&Ptfs->OpenCacheList != Ptfs->OpenCacheList.Flink)
+    {
+        Other = CONTAINING_RECORD(Ptfs->OpenCacheList.Flink, PTFS_OPEN_ENTRY, ListEntry);
+        if (Other->ExpirationTime > Now)
+            break;
+        OpenCacheRemove(Ptfs, Other, &Removed);
+    }
+    ReleaseSRWLockExclusive(&Ptfs->OpenCacheLock);
+
+    OpenCacheFree(Removed);
+}
+
+static VOID OpenCacheInsert(PTFS *Ptfs, PTFS_OPEN_ENTRY *Entry, LONG NameGeneration)
+{
+    ULONGLONG Now = GetTickCount64();
+    PTFS_OPEN_ENTRY *Removed = 0, *Other, **P;
+
+    AcquireSRWLockExclusive(&Ptfs->OpenCacheLock);
+
+    /* a name was invalidated while the entry was being read; it may be the entry's name */
+    if (NameGeneration != Ptfs->OpenCacheNameGeneration)
+    {
+        ReleaseSRWLockExclusive(&Ptfs->OpenCacheLock);
+        OpenCacheFree(Entry);
+        return;
+    }
+
+    for (Other = Ptfs->OpenCacheBuckets[Entry->Hash % OPEN_CACHE_BUCKETS]; 0 != Other;
+        Other = Other->HashNext)
+        if (Other->Hash == Entry->Hash && Other->KeyLength == Entry->KeyLength &&
+            0 == memcmp(Other->Key, Entry->Key, Entry->KeyLength * sizeof(WCHAR)))
+        {
+            OpenCacheRemove(Ptfs, Other, &Removed);
+            break;
+        }
+
+    /* expire entries (and close their handles) from the oldest; make room if full */
+    while (&Ptfs->OpenCacheList != Ptfs->OpenCacheList.Flink)
+    {
+        Other = CONTAINING_RECORD(Ptfs->OpenCacheList.Flink, PTFS_OPEN_ENTRY, ListEntry);
+        if (Other->ExpirationTime > Now && OPEN_CACHE_SIZEMAX > Ptfs->OpenCacheCount)
+            break;
+        OpenCacheRemove(Ptfs, Other, &Removed);
+    }
+
+    P = &Ptfs->OpenCacheBuckets[Entry->Hash % OPEN_CACHE_BUCKETS];
+    Entry->HashNext = *P;
+    *P = Entry;
+
+    Entry->ListEntry.Flink = &Ptfs->OpenCacheList;
+    Entry->ListEntry.Blink = Ptfs->OpenCacheList.Blink;
+    Ptfs->OpenCacheList.Blink->Flink = &Entry->ListEntry;
+    Ptfs->OpenCacheList.Blink = &Entry->ListEntry;
+    Ptfs->OpenCacheCount++;
+
+    ReleaseSRWLockExclusive(&Ptfs->OpenCacheLock);
+
+    OpenCacheFree(Removed);
+}
+
+static VOID OpenCacheInvalidate(PTFS *Ptfs, PWSTR FileName, BOOLEAN Subtree)
+{
+    WCHAR Key[FULLPATH_SIZE];
+    ULONG KeyLength, Hash;
+    PLIST_ENTRY ListEntry, NextEntry;
+    PTFS_OPEN_ENTRY *Removed = 0, *Entry;
+
+    if (0 == Ptfs->OpenCacheTimeout)
+        return;
+
+    KeyLength = OpenCacheKey(FileName, Key, &Hash);
+    if (0 == KeyLength)
+    {
+        /* cannot compute the key; drop everything */
+        KeyLength = 1;
+        Key[0] = L'\\';
+        Subtree = TRUE;
+    }
+
+    AcquireSRWLockExclusive(&Ptfs->OpenCacheLock);
+
+    Ptfs->OpenCacheNameGeneration++;
+
+    if (Subtree)
+    {
+        if (1 == KeyLength)
+            KeyLength = 0;              /* root: every entry is in the subtree */
+        for (ListEntry = Ptfs->OpenCacheList.Flink; &Ptfs->OpenCacheList != ListEntry;
+            ListEntry = NextEntry)
+        {
+            NextEntry = ListEntry->Flink;
+            Entry = CONTAINING_RECORD(ListEntry, PTFS_OPEN_ENTRY, ListEntry);
+            if (Entry->KeyLength >= KeyLength &&
+                0 == memcmp(Entry->Key, Key, KeyLength * sizeof(WCHAR)) &&
+                (Entry->KeyLength == KeyLength || L'\\' == Entry->Key[KeyLength]))
+                OpenCacheRemove(Ptfs, Entry, &Removed);
+        }
+    }
+    else
+    {
+        for (Entry = Ptfs->OpenCacheBuckets[Hash % OPEN_CACHE_BUCKETS]; 0 != Entry;
+            Entry = Entry->HashNext)
+            if (Entry->Hash == Hash && Entry->KeyLength == KeyLength &&
+                0 == memcmp(Entry->Key, Key, KeyLength * sizeof(WCHAR)))
+            {
+                OpenCacheRemove(Ptfs, Entry, &Removed);
+                break;
+            }
+    }
+
+    ReleaseSRWLockExclusive(&Ptfs->OpenCacheLock);
+
+    OpenCacheFree(Removed);
+}
+
+static VOID OpenCacheInvalidateAll(PTFS *Ptfs, BOOLEAN SecurityChanged)
+{
+    if (0 == Ptfs->OpenCacheTimeout)
+        return;
+
+    if (SecurityChanged)
+        InterlockedIncrement(&Ptfs->OpenCacheSecurityGeneration);
+    InterlockedIncrement(&Ptfs->OpenCacheFileInfoGeneration);
+}
+
+static NTSTATUS OpenCacheCopyOut(PTFS_OPEN_ENTRY *Entry, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
+{
+    if (0 != PFileAttributes)
+        *PFileAttributes = Entry->FileAttributes;
+
+    if (0 != PSecurityDescriptorSize)
+    {
+        if (Entry->SecurityDescriptorSize > *PSecurityDescriptorSize)
+        {
+            *PSecurityDescriptorSize = Entry->SecurityDescriptorSize;
+            return STATUS_BUFFER_OVERFLOW;
+        }
+
+        *PSecurityDescriptorSize = Entry->SecurityDescriptorSize;
+        if (0 != SecurityDescriptor)
+            memcpy(SecurityDescriptor, Entry->SecurityDescriptor, Entry->SecurityDescriptorSize);
+    }
 
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS OpenCacheGetSecurityByName(PTFS *Ptfs, PWSTR FileName, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
+{
+    LONG NameGeneration = Ptfs->OpenCacheNameGeneration;
+    LONG SecurityGeneration = Ptfs->OpenCacheSecurityGeneration;
+    LONG FileInfoGeneration = Ptfs->OpenCacheFileInfoGeneration;
+    WCHAR FullPath[FULLPATH_SIZE], Key[FULLPATH_SIZE];
+    ULONG KeyLength, Hash;
+    BY_HANDLE_FILE_INFORMATION ByHandleFileInfo;
+    DWORD SecurityDescriptorSize, SecurityDescriptorSizeNeeded;
+    PTFS_OPEN_ENTRY *Entry;
+    NTSTATUS Result;
+
+    if (!ConcatPath(Ptfs, FileName, FullPath))
+        return STATUS_OBJECT_NAME_INVALID;
+
+    KeyLength = OpenCacheKey(FileName, Key, &Hash);
+    if (0 == KeyLength)
+        return STATUS_OBJECT_NAME_INVALID;
+
+    AcquireSRWLockShared(&Ptfs->OpenCacheLock);
+    Entry = OpenCacheLookup(Ptfs, Key, KeyLength, Hash);
+    if (0 != Entry)
+        Result = OpenCacheCopyOut(Entry,
+            PFileAttributes, SecurityDescriptor, PSecurityDescriptorSize);
+    ReleaseSRWLockShared(&Ptfs->OpenCacheLock);
+    if (0 != Entry)
+        return Result;
+
+    Entry = malloc(sizeof *Entry + KeyLength * sizeof(WCHAR));
+    if (0 == Entry)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    memset(Entry, 0, sizeof *Entry);
+    Entry->Hash = Hash;
+    Entry->KeyLength = KeyLength;
+    memcpy(Entry->Key, Key, KeyLength * sizeof(WCHAR));
+
+    Entry->Handle = CreateFileW(FullPath,
+        FILE_READ_ATTRIBUTES | READ_CONTROL,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    if (INVALID_HANDLE_VALUE == Entry->Handle)
+    {
+        Entry->Handle = 0;
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    if (!GetFileInformationByHandle(Entry->Handle, &ByHandleFileInfo))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    GetFileInfoFromByHandle(&ByHandleFileInfo, &Entry->FileInfo);
+    Entry->FileAttributes = ByHandleFileInfo.dwFileAttributes;
+
+    for (SecurityDescriptorSize = 512;; SecurityDescriptorSize = SecurityDescriptorSizeNeeded)
+    {
+        free(Entry->SecurityDescriptor);
+        Entry->SecurityDescriptor = malloc(SecurityDescriptorSize);
+        if (0 == Entry->SecurityDescriptor)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+
+        if (GetKernelObjectSecurity(Entry->Handle,
+            OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION,
+            Entry->SecurityDescriptor, SecurityDescriptorSize, &SecurityDescriptorSizeNeeded))
+            break;
+        if (ERROR_INSUFFICIENT_BUFFER != GetLastError())
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+    }
+    Entry->SecurityDescriptorSize = GetSecurityDescriptorLength(Entry->SecurityDescriptor);
+
+    Entry->ExpirationTime = GetTickCount64() + Ptfs->OpenCacheTimeout;
+    Entry->SecurityGeneration = SecurityGeneration;
+    Entry->FileInfoGeneration = FileInfoGeneration;
+
+    Result = OpenCacheCopyOut(Entry,
+        PFileAttributes, SecurityDescriptor, PSecurityDescriptorSize);
+
+    OpenCacheInsert(Ptfs, Entry, NameGeneration);
+    Entry = 0;
+
+exit:
+    OpenCacheFree(Entry);
+
+    return Result;
+}
+
+static HANDLE OpenCacheReopen(PTFS *Ptfs, PWSTR FileName,
+    UINT32 GrantedAccess, ULONG CreateFlags,
+    FSP_FSCTL_FILE_INFO *FileInfo, PBOOLEAN PFileInfoValid)
+{
+    WCHAR Key[FULLPATH_SIZE];
+    ULONG KeyLength, Hash;
+    PTFS_OPEN_ENTRY *Entry;
+    HANDLE QueryHandle = 0, Handle;
+
+    *PFileInfoValid = FALSE;
+
+    KeyLength = OpenCacheKey(FileName, Key, &Hash);
+    if (0 == KeyLength)
+        return INVALID_HANDLE_VALUE;
+
+    /* take the query handle; later GetSecurityByName calls are still answered by the entry */
+    AcquireSRWLockExclusive(&Ptfs->OpenCacheLock);
+    Entry = OpenCacheLookup(Ptfs, Key, KeyLength, Hash);
+    if (0 != Entry && 0 != Entry->Handle)
+    {
+        QueryHandle = Entry->Handle;
+        Entry->Handle = 0;
+        if (Entry->FileInfoGeneration == Ptfs->OpenCacheFileInfoGeneration)
+        {
+            *FileInfo = Entry->FileInfo;
+            *PFileInfoValid = TRUE;
+        }
+    }
+    ReleaseSRWLockExclusive(&Ptfs->OpenCacheLock);
+
+    if (0 == QueryHandle)
+        return INVALID_HANDLE_VALUE;
+
+    /* relative open of the same file; no path lookup */
+    Handle = ReOpenFile(QueryHandle,
+        GrantedAccess, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, CreateFlags);
+    CloseHandle(QueryHandle);
+
+    if (INVALID_HANDLE_VALUE == Handle)
+        *PFileInfoValid = FALSE;
+
+    return Handle;
+}
+
+static NTSTATUS OpenFileNode(PTFS *Ptfs, PTFS_FILE_CONTEXT *FileContext,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    BY_HANDLE_FILE_INFORMATION ByHandleFileInfo;
+    UINT64 FileIndex;
+    PTFS_FILE_NODE *FileNode, **P;
+
+    if (0 == CreateIoCompletionPort(FileContext->Handle, Ptfs->Iocp, 0, 0))
+        return FspNtStatusFromWin32(GetLastError());
+
+    /* synchronously completed I/O is then finished by the dispatcher thread itself */
+    FileContext->SkipCompletionPort = !!SetFileCompletionNotificationModes(FileContext->Handle,
+        FILE_SKIP_COMPLETION_PORT_ON_SUCCESS | FILE_SKIP_SET_EVENT_ON_HANDLE);
+
+    if (!GetFileInformationByHandle(FileContext->Handle, &ByHandleFileInfo))
+        return FspNtStatusFromWin32(GetLastError());
+
+    GetFileInfoFromByHandle(&ByHandleFileInfo, FileInfo);
+
+    FileIndex = ((UINT64)ByHandleFileInfo.nFileIndexHigh << 32) | ByHandleFileInfo.nFileIndexLow;
+    P = &Ptfs->FileNodes[FileIndex % FILE_NODE_BUCKETS];
+
+    AcquireSRWLockExclusive(&Ptfs->FileNodeLock);
+    for (FileNode = *P; 0 != FileNode; FileNode = FileNode->Next)
+        if (FileNode->FileIndex == FileIndex &&
+            FileNode->VolumeSerialNumber == ByHandleFileInfo.dwVolumeSerialNumber)
+            break;
+    if (0 == FileNode)
+    {
+        FileNode = malloc(sizeof *FileNode);
+        if (0 == FileNode)
+        {
+            ReleaseSRWLockExclusive(&Ptfs->FileNodeLock);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        memset(FileNode, 0, sizeof *FileNode);
+        FileNode->VolumeSerialNumber = ByHandleFileInfo.dwVolumeSerialNumber;
+        FileNode->FileIndex = FileIndex;
+        InitializeSRWLock(&FileNode->Lock);
+        FileNode->Next = *P;
+        *P = FileNode;
+    }
+    FileNode->RefCount++;
+    ReleaseSRWLockExclusive(&Ptfs->FileNodeLock);
+
+    /* the backing file is the truth when it is opened; no I/O on it is in flight */
+    AcquireSRWLockExclusive(&FileNode->Lock);
+    FileNode->FileInfo = *FileInfo;
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    FileContext->FileNode = FileNode;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS OpenOverlapped(PTFS *Ptfs, PTFS_FILE_CONTEXT *FileContext,
+    PVOID *PFileContext, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    NTSTATUS Result;
+
+    Result = OpenFileNode(Ptfs, FileContext, FileInfo);
+    if (!NT_SUCCESS(Result))
+    {
+        CloseHandle(FileContext->Handle);
+        free(FileContext);
+        return Result;
+    }
+
+    *PFileContext = FileContext;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID CloseFileNode(PTFS *Ptfs, PTFS_FILE_NODE *FileNode)
+{
+    PTFS_FILE_NODE **P;
+
+    AcquireSRWLockExclusive(&Ptfs->FileNodeLock);
+    if (0 == --FileNode->RefCount)
+    {
+        for (P = &Ptfs->FileNodes[FileNode->FileIndex % FILE_NODE_BUCKETS]; FileNode != *P;
+            P = &(*P)->Next)
+            ;
+        *P = FileNode->Next;
+    }
+    else
+        FileNode = 0;
+    ReleaseSRWLockExclusive(&Ptfs->FileNodeLock);
+
+    free(FileNode);
+}
+
+static NTSTATUS WriteFileNode(PTFS_FILE_CONTEXT *FileContext,
+    UINT64 Offset, ULONG BytesTransferred, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    PTFS_FILE_NODE *FileNode = FileContext->FileNode;
+    FILETIME Now;
+
+    /* the offset of a write to end of file is not known; ask the backing file */
+    if ((UINT64)-1LL == Offset)
+        return GetFileInfoFromContext(FileContext, FileInfo);
+
+    GetSystemTimeAsFileTime(&Now);
+
+    AcquireSRWLockExclusive(&FileNode->Lock);
+    if (FileNode->FileInfo.FileSize < Offset + BytesTransferred)
+    {
+        FileNode->FileInfo.FileSize = Offset + BytesTransferred;
+        FileNode->FileInfo.AllocationSize = (FileNode->FileInfo.FileSize + ALLOCATION_UNIT - 1)
+            / ALLOCATION_UNIT * ALLOCATION_UNIT;
+    }
+    FileNode->FileInfo.LastWriteTime = ((PLARGE_INTEGER)&Now)->QuadPart;
+    FileNode->FileInfo.ChangeTime = FileNode->FileInfo.LastWriteTime;
+    *FileInfo = FileNode->FileInfo;
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    return STATUS_SUCCESS;
+}
+
+static inline VOID IoPendingRelease(PTFS *Ptfs)
+{
+    /* the count only drops to 0 after PtfsDelete has removed its bias */
+    if (0 == InterlockedDecrement(&Ptfs->IoPending))
+        SetEvent(Ptfs->IoIdleEvent);
+}
+
+static VOID CompleteIo(PTFS *Ptfs, PTFS_IO_REQUEST *Request,
+    NTSTATUS Result, ULONG BytesTransferred)
+{
+    FSP_FSCTL_TRANSACT_RSP ResponseBuf;
+
+    memset(&ResponseBuf, 0, sizeof ResponseBuf);
+    ResponseBuf.Size = sizeof ResponseBuf;
+    ResponseBuf.Kind = Request->Kind;
+    ResponseBuf.Hint = Request->Hint;
+
+    if (NT_SUCCESS(Result) && FspFsctlTransactWriteKind == Request->Kind)
+    {
+        OpenCacheInvalidateAll(Ptfs, FALSE);
+        Result = WriteFileNode(Request->FileContext,
+            Request->Offset, BytesTransferred, &ResponseBuf.Rsp.Write.FileInfo);
+    }
+
+    ResponseBuf.IoStatus.Status = Result;
+    ResponseBuf.IoStatus.Information = NT_SUCCESS(Result) ? BytesTransferred : 0;
+    FspFileSystemSendResponse(Ptfs->FileSystem, &ResponseBuf);
+
+    free(Request);
+    IoPendingRelease(Ptfs);
+}
+
+static DWORD WINAPI IoCompletionThread(PVOID Ptfs0)
+{
+    PTFS *Ptfs = Ptfs0;
+    DWORD BytesTransferred;
+    ULONG_PTR CompletionKey;
+    OVERLAPPED *Overlapped;
+    BOOL Success;
+
+    for (;;)
+    {
+        Success = GetQueuedCompletionStatus(Ptfs->Iocp,
+            &BytesTransferred, &CompletionKey, &Overlapped, INFINITE);
+        if (0 == Overlapped)
+            break;              /* PtfsDelete posted a null packet, or the port is gone */
+
+        CompleteIo(Ptfs, CONTAINING_RECORD(Overlapped, PTFS_IO_REQUEST, Overlapped),
+            Success ? STATUS_SUCCESS : FspNtStatusFromWin32(GetLastError()), BytesTransferred);
+    }
+
+    return 0;
+}
+
+static NTSTATUS StartIo(FSP_FILE_SYSTEM *FileSystem,
+    PTFS_FILE_CONTEXT *FileContext, UINT32 Kind, UINT64 Hint,
+    PVOID Buffer, UINT64 Offset, ULONG Length,
+    PULONG PBytesTransferred, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    PTFS *Ptfs = (PTFS *)FileSystem->UserContext;
+    PTFS_IO_REQUEST *Request;
+    DWORD BytesTransferred;
+    BOOL Success;
+    NTSTATUS Result;
+
+    Request = malloc(sizeof *Request);
+    if (0 == Request)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(Request, 0, sizeof *Request);
+    Request->Overlapped.Offset = (DWORD)Offset;
+    Request->Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+    Request->FileContext = FileContext;
+    Request->Hint = Hint;
+    Request->Offset = Offset;
+    Request->Kind = Kind;
+
+    InterlockedIncrement(&Ptfs->IoPending);
+
+    if (FspFsctlTransactReadKind == Kind)
+        Success = ReadFile(FileContext->Handle, Buffer, Length, 0, &Request->Overlapped);
+    else
+        Success = WriteFile(FileContext->Handle, Buffer, Length, 0, &Request->Overlapped);
+
+    /* a completion packet is queued unless the I/O failed or was skipped on success */
+    if (Success ? !FileContext->SkipCompletionPort : ERROR_IO_PENDING == GetLastError())
+        return STATUS_PENDING;
+
+    if (Success && GetOverlappedResult(FileContext->Handle, &Request->Overlapped,
+        &BytesTransferred, FALSE))
+    {
+        *PBytesTransferred = BytesTransferred;
+        Result = STATUS_SUCCESS;
+        if (FspFsctlTransactWriteKind == Kind)
+        {
+            OpenCacheInvalidateAll(Ptfs, FALSE);
+            Result = WriteFileNode(FileContext, Offset, BytesTransferred, FileInfo);
+        }
+    }
+    else
+        Result = FspNtStatusFromWin32(GetLastError());
+
+    free(Request);
+    IoPendingRelease(Ptfs);
+
+    return Result;
+}
+
 static NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_VOLUME_INFO *VolumeInfo)
 {
@@ -106,6 +837,10 @@ static NTSTATUS GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
     DWORD SecurityDescriptorSizeNeeded;
     NTSTATUS Result;
 
+    if (0 != Ptfs->OpenCacheTimeout)
+        return OpenCacheGetSecurityByName(Ptfs, FileName,
+            PFileAttributes, SecurityDescriptor, PSecurityDescriptorSize);
+
     if (!ConcatPath(Ptfs, FileName, FullPath))
         return STATUS_OBJECT_NAME_INVALID;
 
@@ -197,6 +932,9 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
     if (0 == FileAttributes)
         FileAttributes = FILE_ATTRIBUTE_NORMAL;
 
+    if (0 != Ptfs->Iocp)
+        CreateFlags |= FILE_FLAG_OVERLAPPED;
+
     FileContext->Handle = CreateFileW(FullPath,
         GrantedAccess, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, &SecurityAttributes,
         CREATE_NEW, CreateFlags | FileAttributes, 0);
@@ -206,6 +944,9 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
         return FspNtStatusFromWin32(GetLastError());
     }
 
+    if (0 != Ptfs->Iocp)
+        return OpenOverlapped(Ptfs, FileContext, PFileContext, FileInfo);
+
     *PFileContext = FileContext;
 
     return GetFileInfoInternal(FileContext->Handle, FileInfo);
@@ -219,6 +960,7 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem,
     WCHAR FullPath[FULLPATH_SIZE];
     ULONG CreateFlags;
     PTFS_FILE_CONTEXT *FileContext;
+    BOOLEAN FileInfoValid = FALSE;
 
     if (!ConcatPath(Ptfs, FileName, FullPath))
         return STATUS_OBJECT_NAME_INVALID;
@@ -231,18 +973,31 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem,
     CreateFlags = FILE_FLAG_BACKUP_SEMANTICS;
     if (CreateOptions & FILE_DELETE_ON_CLOSE)
         CreateFlags |= FILE_FLAG_DELETE_ON_CLOSE;
+    if (0 != Ptfs->Iocp)
+        CreateFlags |= FILE_FLAG_OVERLAPPED;
 
-    FileContext->Handle = CreateFileW(FullPath,
-        GrantedAccess, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
-        OPEN_EXISTING, CreateFlags, 0);
+    FileContext->Handle = INVALID_HANDLE_VALUE;
+    if (0 != Ptfs->OpenCacheTimeout)
+        FileContext->Handle = OpenCacheReopen(Ptfs, FileName, GrantedAccess, CreateFlags,
+            FileInfo, &FileInfoValid);
+    if (INVALID_HANDLE_VALUE == FileContext->Handle)
+        FileContext->Handle = CreateFileW(FullPath,
+            GrantedAccess, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+            OPEN_EXISTING, CreateFlags, 0);
     if (INVALID_HANDLE_VALUE == FileContext->Handle)
     {
         free(FileContext);
         return FspNtStatusFromWin32(GetLastError());
     }
 
+    if (0 != Ptfs->Iocp)
+        return OpenOverlapped(Ptfs, FileContext, PFileContext, FileInfo);
+
     *PFileContext = FileContext;
 
+    if (FileInfoValid)
+        return STATUS_SUCCESS;
+
     return GetFileInfoInternal(FileContext->Handle, FileInfo);
 }
 
@@ -284,7 +1039,9 @@ static NTSTATUS Overwrite(FSP_FILE_SYSTEM *FileSystem,
         FileAllocationInfo, &AllocationInfo, sizeof AllocationInfo))
         return FspNtStatusFromWin32(GetLastError());
 
-    return GetFileInfoInternal(Handle, FileInfo);
+    OpenCacheInvalidateAll((PTFS *)FileSystem->UserContext, TRUE);
+
+    return GetFileInfoFromContext(FileContext, FileInfo);
 }
 
 static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem,
@@ -294,6 +1051,9 @@ static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem,
 
     if (Flags & FspCleanupDelete)
     {
+        /* a cached handle would keep the file from being deleted */
+        OpenCacheInvalidate((PTFS *)FileSystem->UserContext, FileName, FALSE);
+
         CloseHandle(Handle);
 
         /* this will make all future uses of Handle to fail with STATUS_INVALID_HANDLE */
@@ -304,58 +1064,257 @@ static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem,
 static VOID Close(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileContext0)
 {
-    PTFS_FILE_CONTEXT *FileContext = FileContext0;
-    HANDLE Handle = HandleFromContext(FileContext);
+    PTFS *Ptfs = (PTFS *)FileSystem->UserContext;
+    PTFS_FILE_CONTEXT *FileContext = FileContext0;
+    HANDLE Handle = HandleFromContext(FileContext);
+
+    CloseHandle(Handle);
+
+    if (0 != FileContext->FileNode)
+        CloseFileNode(Ptfs, FileContext->FileNode);
+
+    if (0 != FileContext->DirHandle)
+        CloseHandle(FileContext->DirHandle);
+    free(FileContext->DirPath);
+    free(FileContext->DirQueryBuffer);
+
+    FspFileSystemDeleteDirectoryBuffer(&FileContext->DirBuffer);
+    free(FileContext);
+}
+
+static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+    PVOID FileContext, PVOID Buffer, UINT64 Offset, ULONG Length,
+    PULONG PBytesTransferred)
+{
+    PTFS *Ptfs = (PTFS *)FileSystem->UserContext;
+    HANDLE Handle = HandleFromContext(FileContext);
+    OVERLAPPED Overlapped = { 0 };
+
+    if (0 != Ptfs->Iocp)
+        return StartIo(FileSystem, FileContext,
+            FspFsctlTransactReadKind, OperationContext->Request->Hint,
+            Buffer, Offset, Length, PBytesTransferred, 0);
+
+    Overlapped.Offset = (DWORD)Offset;
+    Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+
+    if (!ReadFile(Handle, Buffer, Length, PBytesTransferred, &Overlapped))
+        return FspNtStatusFromWin32(GetLastError());
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_OPERATION_CONTEXT *OperationContext,
+    PVOID FileContext, PVOID Buffer, UINT64 Offset, ULONG Length,
+    BOOLEAN WriteToEndOfFile, BOOLEAN ConstrainedIo,
+    PULONG PBytesTransferred, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    PTFS *Ptfs = (PTFS *)FileSystem->UserContext;
+    PTFS_FILE_NODE *FileNode = ((PTFS_FILE_CONTEXT *)FileContext)->FileNode;
+    HANDLE Handle = HandleFromContext(FileContext);
+    LARGE_INTEGER FileSize;
+    OVERLAPPED Overlapped = { 0 };
+
+    if (ConstrainedIo)
+    {
+        if (0 != FileNode)
+        {
+            AcquireSRWLockShared(&FileNode->Lock);
+            FileSize.QuadPart = FileNode->FileInfo.FileSize;
+            ReleaseSRWLockShared(&FileNode->Lock);
+        }
+        else if (!GetFileSizeEx(Handle, &FileSize))
+            return FspNtStatusFromWin32(GetLastError());
+
+        if (Offset >= (UINT64)FileSize.QuadPart)
+            return STATUS_SUCCESS;
+        if (Offset + Length > (UINT64)FileSize.QuadPart)
+            Length = (ULONG)((UINT64)FileSize.QuadPart - Offset);
+    }
+
+    if (0 != Ptfs->Iocp)
+        return StartIo(FileSystem, FileContext,
+            FspFsctlTransactWriteKind, OperationContext->Request->Hint,
+            Buffer, Offset, Length, PBytesTransferred, FileInfo);
+
+    Overlapped.Offset = (DWORD)Offset;
+    Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+
+    if (!WriteFile(Handle, Buffer, Length, PBytesTransferred, &Overlapped))
+        return FspNtStatusFromWin32(GetLastError());
+
+    OpenCacheInvalidateAll(Ptfs, FALSE);
+
+    return GetFileInfoFromContext(FileContext, FileInfo);
+}
+
+static BOOL SynchronousIo(HANDLE Handle, BOOLEAN IsWrite, PVOID Buffer, UINT64 Offset, ULONG Length,
+    PDWORD PBytesTransferred, HANDLE Event)
+{
+    OVERLAPPED Overlapped = { 0 };
+
+    /*
+     * The handle may have been opened for overlapped I/O (-o), so always wait for the I/O.
+     * Setting the low-order bit of hEvent keeps the completion from being queued to the
+     * completion port.
+     */
+    Overlapped.Offset = (DWORD)Offset;
+    Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+    Overlapped.hEvent = (HANDLE)((UINT_PTR)Event | 1);
+
+    if (!(IsWrite ?
+        WriteFile(Handle, Buffer, Length, 0, &Overlapped) :
+        ReadFile(Handle, Buffer, Length, 0, &Overlapped)) &&
+        ERROR_IO_PENDING != GetLastError())
+        return FALSE;
+
+    return GetOverlappedResult(Handle, &Overlapped, PBytesTransferred, TRUE);
+}
+
+static HANDLE IoEvent(ULONG Index)
+{
+    /* per dispatcher thread events for vectored I/O; they are closed when the process exits */
+    static __declspec(thread) HANDLE Events[FSP_FILE_SYSTEM_IO_SEGMENT_MAX];
 
-    CloseHandle(Handle);
+    if (0 == Events[Index])
+        Events[Index] = CreateEventW(0, TRUE, FALSE, 0);
 
-    FspFileSystemDeleteDirectoryBuffer(&FileContext->DirBuffer);
-    free(FileContext);
+    return Events[Index];
 }
 
-static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
-    PVOID FileContext, PVOID Buffer, UINT64 Offset, ULONG Length,
-    PULONG PBytesTransferred)
+static NTSTATUS ReadV(FSP_FILE_SYSTEM *FileSystem,
+    PVOID FileContext, FSP_FILE_SYSTEM_IO_SEGMENT *Segments, ULONG SegmentCount)
 {
+    PTFS *Ptfs = (PTFS *)FileSystem->UserContext;
     HANDLE Handle = HandleFromContext(FileContext);
-    OVERLAPPED Overlapped = { 0 };
+    OVERLAPPED Overlapped[FSP_FILE_SYSTEM_IO_SEGMENT_MAX];
+    HANDLE Event;
+    DWORD BytesTransferred;
+    ULONG Index;
+
+    /*
+     * With -o all segments are started before any of them is waited for, so that the
+     * backing file system sees them at once. Otherwise the segments are read in turn;
+     * what is saved is the per request round trip to the FSD.
+     */
+    for (Index = 0; SegmentCount > Index; Index++)
+    {
+        memset(&Overlapped[Index], 0, sizeof Overlapped[Index]);
+        Overlapped[Index].Offset = (DWORD)Segments[Index].Offset;
+        Overlapped[Index].OffsetHigh = (DWORD)(Segments[Index].Offset >> 32);
 
-    Overlapped.Offset = (DWORD)Offset;
-    Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+        if (0 != Ptfs->Iocp)
+        {
+            Event = IoEvent(Index);
+            if (0 == Event)
+            {
+                Segments[Index].Status = STATUS_INSUFFICIENT_RESOURCES;
+                continue;
+            }
+            Overlapped[Index].hEvent = (HANDLE)((UINT_PTR)Event | 1);
+
+            if (ReadFile(Handle, Segments[Index].Buffer, Segments[Index].Length, 0,
+                    &Overlapped[Index]) ||
+                ERROR_IO_PENDING == GetLastError())
+                Segments[Index].Status = STATUS_PENDING;
+            else
+                Segments[Index].Status = FspNtStatusFromWin32(GetLastError());
+        }
+        else
+        {
+            if (ReadFile(Handle, Segments[Index].Buffer, Segments[Index].Length, &BytesTransferred,
+                &Overlapped[Index]))
+            {
+                Segments[Index].BytesTransferred = BytesTransferred;
+                Segments[Index].Status = STATUS_SUCCESS;
+            }
+            else
+                Segments[Index].Status = FspNtStatusFromWin32(GetLastError());
+        }
+    }
 
-    if (!ReadFile(Handle, Buffer, Length, PBytesTransferred, &Overlapped))
-        return FspNtStatusFromWin32(GetLastError());
+    for (Index = 0; SegmentCount > Index; Index++)
+    {
+        if (STATUS_PENDING != Segments[Index].Status)
+            continue;
+
+        if (GetOverlappedResult(Handle, &Overlapped[Index], &BytesTransferred, TRUE))
+        {
+            Segments[Index].BytesTransferred = BytesTransferred;
+            Segments[Index].Status = STATUS_SUCCESS;
+        }
+        else
+            Segments[Index].Status = FspNtStatusFromWin32(GetLastError());
+    }
 
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
-    PVOID FileContext, PVOID Buffer, UINT64 Offset, ULONG Length,
-    BOOLEAN WriteToEndOfFile, BOOLEAN ConstrainedIo,
-    PULONG PBytesTransferred, FSP_FSCTL_FILE_INFO *FileInfo)
+static NTSTATUS WriteV(FSP_FILE_SYSTEM *FileSystem,
+    PVOID FileContext, FSP_FILE_SYSTEM_IO_SEGMENT *Segments, ULONG SegmentCount,
+    FSP_FSCTL_FILE_INFO *FileInfo)
 {
+    PTFS *Ptfs = (PTFS *)FileSystem->UserContext;
+    PTFS_FILE_NODE *FileNode = ((PTFS_FILE_CONTEXT *)FileContext)->FileNode;
     HANDLE Handle = HandleFromContext(FileContext);
+    HANDLE Event;
     LARGE_INTEGER FileSize;
-    OVERLAPPED Overlapped = { 0 };
+    UINT64 Offset;
+    ULONG Length, Index;
+    DWORD BytesTransferred;
+    BOOLEAN Written = FALSE;
+
+    /* segments are written in turn, so that overlapping segments are applied in order */
+    Event = IoEvent(0);
+    if (0 == Event)
+        return STATUS_INSUFFICIENT_RESOURCES;
 
-    if (ConstrainedIo)
+    for (Index = 0; SegmentCount > Index; Index++)
     {
-        if (!GetFileSizeEx(Handle, &FileSize))
-            return FspNtStatusFromWin32(GetLastError());
+        Offset = Segments[Index].WriteToEndOfFile ? (UINT64)-1LL : Segments[Index].Offset;
+        Length = Segments[Index].Length;
 
-        if (Offset >= (UINT64)FileSize.QuadPart)
-            return STATUS_SUCCESS;
-        if (Offset + Length > (UINT64)FileSize.QuadPart)
-            Length = (ULONG)((UINT64)FileSize.QuadPart - Offset);
-    }
+        if (Segments[Index].ConstrainedIo)
+        {
+            if (0 != FileNode)
+            {
+                AcquireSRWLockShared(&FileNode->Lock);
+                FileSize.QuadPart = FileNode->FileInfo.FileSize;
+                ReleaseSRWLockShared(&FileNode->Lock);
+            }
+            else if (!GetFileSizeEx(Handle, &FileSize))
+            {
+                Segments[Index].Status = FspNtStatusFromWin32(GetLastError());
+                continue;
+            }
 
-    Overlapped.Offset = (DWORD)Offset;
-    Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+            if (Offset >= (UINT64)FileSize.QuadPart)
+            {
+                Segments[Index].Status = STATUS_SUCCESS;
+                continue;
+            }
+            if (Offset + Length > (UINT64)FileSize.QuadPart)
+                Length = (ULONG)((UINT64)FileSize.QuadPart - Offset);
+        }
 
-    if (!WriteFile(Handle, Buffer, Length, PBytesTransferred, &Overlapped))
-        return FspNtStatusFromWin32(GetLastError());
+        if (!SynchronousIo(Handle, TRUE, Segments[Index].Buffer, Offset, Length,
+            &BytesTransferred, Event))
+        {
+            Segments[Index].Status = FspNtStatusFromWin32(GetLastError());
+            continue;
+        }
+
+        Segments[Index].BytesTransferred = BytesTransferred;
+        Segments[Index].Status = STATUS_SUCCESS;
+        Written = TRUE;
+    }
+
+    if (Written)
+        OpenCacheInvalidateAll(Ptfs, FALSE);
 
-    return GetFileInfoInternal(Handle, FileInfo);
+    return GetFileInfoFromContext(FileContext, FileInfo);
 }
 
 NTSTATUS Flush(FSP_FILE_SYSTEM *FileSystem,
@@ -371,7 +1330,7 @@ NTSTATUS Flush(FSP_FILE_SYSTEM *FileSystem,
     if (!FlushFileBuffers(Handle))
         return FspNtStatusFromWin32(GetLastError());
 
-    return GetFileInfoInternal(Handle, FileInfo);
+    return GetFileInfoFromContext(FileContext, FileInfo);
 }
 
 static NTSTATUS GetFileInfo(FSP_FILE_SYSTEM *FileSystem,
@@ -380,7 +1339,7 @@ static NTSTATUS GetFileInfo(FSP_FILE_SYSTEM *FileSystem,
 {
     HANDLE Handle = HandleFromContext(FileContext);
 
-    return GetFileInfoInternal(Handle, FileInfo);
+    return GetFileInfoFromContext(FileContext, FileInfo);
 }
 
 static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
@@ -406,7 +1365,9 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
         FileBasicInfo, &BasicInfo, sizeof BasicInfo))
         return FspNtStatusFromWin32(GetLastError());
 
-    return GetFileInfoInternal(Handle, FileInfo);
+    OpenCacheInvalidateAll((PTFS *)FileSystem->UserContext, TRUE);
+
+    return GetFileInfoFromContext(FileContext, FileInfo);
 }
 
 static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem,
@@ -445,7 +1406,9 @@ static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem,
             return FspNtStatusFromWin32(GetLastError());
     }
 
-    return GetFileInfoInternal(Handle, FileInfo);
+    OpenCacheInvalidateAll((PTFS *)FileSystem->UserContext, FALSE);
+
+    return GetFileInfoFromContext(FileContext, FileInfo);
 }
 
 static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem,
@@ -461,9 +1424,18 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem,
     if (!ConcatPath(Ptfs, NewFileName, NewFullPath))
         return STATUS_OBJECT_NAME_INVALID;
 
+    /* cached handles within the renamed directory or to the replaced file fail the move */
+    OpenCacheInvalidate(Ptfs, FileName, TRUE);
+    OpenCacheInvalidate(Ptfs, NewFileName, TRUE);
+
     if (!MoveFileExW(FullPath, NewFullPath, ReplaceIfExists ? MOVEFILE_REPLACE_EXISTING : 0))
         return FspNtStatusFromWin32(GetLastError());
 
+    /* entries read while the rename was in progress name the file by its old name */
+    OpenCacheInvalidate(Ptfs, FileName, TRUE);
+
+    InterlockedIncrement(&Ptfs->RenameCount);
+
     return STATUS_SUCCESS;
 }
 
@@ -496,20 +1468,71 @@ static NTSTATUS SetSecurity(FSP_FILE_SYSTEM *FileSystem,
     if (!SetKernelObjectSecurity(Handle, SecurityInformation, ModificationDescriptor))
         return FspNtStatusFromWin32(GetLastError());
 
+    OpenCacheInvalidateAll((PTFS *)FileSystem->UserContext, TRUE);
+
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
-    PVOID FileContext0, PWSTR Pattern, PWSTR Marker,
-    PVOID Buffer, ULONG BufferLength, PULONG PBytesTransferred)
+static NTSTATUS GetDirectoryPath(PTFS *Ptfs, PTFS_FILE_CONTEXT *FileContext)
 {
-    PTFS *Ptfs = (PTFS *)FileSystem->UserContext;
-    PTFS_FILE_CONTEXT *FileContext = FileContext0;
-    HANDLE Handle = HandleFromContext(FileContext);
-    WCHAR FullPath[FULLPATH_SIZE];
+    LONG RenameCount = Ptfs->RenameCount;
+    ULONG Length;
+
+    /* the path of any directory may change when a directory is renamed */
+    if (0 != FileContext->DirPath && FileContext->DirPathRenameCount == RenameCount)
+        return STATUS_SUCCESS;
+
+    if (0 == FileContext->DirPath)
+    {
+        FileContext->DirPath = malloc(FULLPATH_SIZE * sizeof(WCHAR));
+        if (0 == FileContext->DirPath)
+            return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Length = GetFinalPathNameByHandleW(FileContext->Handle,
+        FileContext->DirPath, FULLPATH_SIZE - 1, 0);
+    if (0 == Length)
+        return FspNtStatusFromWin32(GetLastError());
+    if (FULLPATH_SIZE - 1 <= Length)
+        return STATUS_OBJECT_NAME_INVALID;
+
+    if (L'\\' == FileContext->DirPath[Length - 1])
+        FileContext->DirPath[--Length] = L'\0';
+    FileContext->DirPathRenameCount = RenameCount;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS OpenDirectoryHandle(PTFS *Ptfs, PTFS_FILE_CONTEXT *FileContext)
+{
+    HANDLE Handle;
+    NTSTATUS Result;
+
+    Result = GetDirectoryPath(Ptfs, FileContext);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    Handle = CreateFileW(FileContext->DirPath,
+        FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return FspNtStatusFromWin32(GetLastError());
+
+    FileContext->DirHandle = Handle;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS ReadDirectoryByHandle(PTFS *Ptfs, PTFS_FILE_CONTEXT *FileContext,
+    PWSTR Pattern)
+{
+    HANDLE Handle;
+    FILE_INFO_BY_HANDLE_CLASS InfoClass;
+    PUINT8 QueryBuffer;
+    FILE_ID_BOTH_DIR_INFO *QueryInfo;
     ULONG Length, PatternLength;
-    HANDLE FindHandle;
-    WIN32_FIND_DATAW FindData;
+    BOOL Success;
+    DWORD LastError;
     union
     {
         UINT8 B[FIELD_OFFSET(FSP_FSCTL_DIR_INFO, FileNameBuf) + MAX_PATH * sizeof(WCHAR)];
@@ -518,57 +1541,113 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D;
     NTSTATUS DirBufferResult;
 
-    DirBufferResult = STATUS_SUCCESS;
-    if (FspFileSystemAcquireDirectoryBuffer(&FileContext->DirBuffer, 0 == Marker, &DirBufferResult))
+    /*
+     * Directory queries on an overlapped handle may complete asynchronously; in that case
+     * (or if the handle was not opened for listing) use a handle of our own.
+     */
+    Handle = 0 != FileContext->DirHandle || 0 != Ptfs->Iocp ?
+        FileContext->DirHandle : FileContext->Handle;
+
+    /*
+     * The bulk query has no pattern. Match the pattern here instead, against the long and
+     * the short name like the file system below would; entries that do not match are not
+     * added to the directory buffer.
+     */
+    if (0 != Pattern && L'*' == Pattern[0] && L'\0' == Pattern[1])
+        Pattern = 0;
+    PatternLength = 0 != Pattern ? (ULONG)wcslen(Pattern) : 0;
+
+    /* the query buffer is allocated once per handle and kept until Close */
+    if (0 == FileContext->DirQueryBuffer)
     {
-        if (0 == Pattern)
-            Pattern = L"*";
-        PatternLength = (ULONG)wcslen(Pattern);
+        FileContext->DirQueryBuffer = malloc(DIR_QUERY_BUFFER_SIZE);
+        if (0 == FileContext->DirQueryBuffer)
+        {
+            DirBufferResult = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+    }
+    QueryBuffer = FileContext->DirQueryBuffer;
 
-        Length = GetFinalPathNameByHandleW(Handle, FullPath, FULLPATH_SIZE - 1, 0);
-        if (0 == Length)
-            DirBufferResult = FspNtStatusFromWin32(GetLastError());
-        else if (Length + 1 + PatternLength >= FULLPATH_SIZE)
-            DirBufferResult = STATUS_OBJECT_NAME_INVALID;
-        if (!NT_SUCCESS(DirBufferResult))
+    for (InfoClass = FileIdBothDirectoryRestartInfo;; InfoClass = FileIdBothDirectoryInfo)
+    {
+        Success = 0 != Handle &&
+            GetFileInformationByHandleEx(Handle, InfoClass, QueryBuffer, DIR_QUERY_BUFFER_SIZE);
+        if (!Success && FileIdBothDirectoryRestartInfo == InfoClass && 0 == FileContext->DirHandle &&
+            (0 == Handle || ERROR_ACCESS_DENIED == GetLastError()))
         {
-            FspFileSystemReleaseDirectoryBuffer(&FileContext->DirBuffer);
-            return DirBufferResult;
+            DirBufferResult = OpenDirectoryHandle(Ptfs, FileContext);
+            if (!NT_SUCCESS(DirBufferResult))
+                goto exit;
+
+            Handle = FileContext->DirHandle;
+            Success = GetFileInformationByHandleEx(Handle,
+                InfoClass, QueryBuffer, DIR_QUERY_BUFFER_SIZE);
         }
+        if (!Success)
+        {
+            LastError = GetLastError();
+            if (ERROR_NO_MORE_FILES == LastError)
+                break;
 
-        if (L'\\' != FullPath[Length - 1])
-            FullPath[Length++] = L'\\';
-        memcpy(FullPath + Length, Pattern, PatternLength * sizeof(WCHAR));
-        FullPath[Length + PatternLength] = L'\0';
+            DirBufferResult = FspNtStatusFromWin32(LastError);
+            goto exit;
+        }
 
-        FindHandle = FindFirstFileW(FullPath, &FindData);
-        if (INVALID_HANDLE_VALUE != FindHandle)
+        for (QueryInfo = (FILE_ID_BOTH_DIR_INFO *)QueryBuffer;;
+            QueryInfo = (FILE_ID_BOTH_DIR_INFO *)((PUINT8)QueryInfo + QueryInfo->NextEntryOffset))
         {
-            do
-            {
-                memset(DirInfo, 0, sizeof *DirInfo);
-                Length = (ULONG)wcslen(FindData.cFileName);
-                DirInfo->Size = (UINT16)(FIELD_OFFSET(FSP_FSCTL_DIR_INFO, FileNameBuf) + Length * sizeof(WCHAR));
-                DirInfo->FileInfo.FileAttributes = FindData.dwFileAttributes;
-                DirInfo->FileInfo.ReparseTag = 0;
-                DirInfo->FileInfo.FileSize =
-                    ((UINT64)FindData.nFileSizeHigh << 32) | (UINT64)FindData.nFileSizeLow;
-                DirInfo->FileInfo.AllocationSize = (DirInfo->FileInfo.FileSize + ALLOCATION_UNIT - 1)
-                    / ALLOCATION_UNIT * ALLOCATION_UNIT;
-                DirInfo->FileInfo.CreationTime = ((PLARGE_INTEGER)&FindData.ftCreationTime)->QuadPart;
-                DirInfo->FileInfo.LastAccessTime = ((PLARGE_INTEGER)&FindData.ftLastAccessTime)->QuadPart;
-                DirInfo->FileInfo.LastWriteTime = ((PLARGE_INTEGER)&FindData.ftLastWriteTime)->QuadPart;
-                DirInfo->FileInfo.ChangeTime = DirInfo->FileInfo.LastWriteTime;
-                DirInfo->FileInfo.IndexNumber = 0;
-                DirInfo->FileInfo.HardLinks = 0;
-                memcpy(DirInfo->FileNameBuf, FindData.cFileName, Length * sizeof(WCHAR));
-
-                if (!FspFileSystemFillDirectoryBuffer(&FileContext->DirBuffer, DirInfo, &DirBufferResult))
-                    break;
-            } while (FindNextFileW(FindHandle, &FindData));
-
-            FindClose(FindHandle);
+            if (0 != Pattern &&
+                !FspPathIsNameInExpression(Pattern, PatternLength,
+                    QueryInfo->FileName, QueryInfo->FileNameLength / sizeof(WCHAR), TRUE) &&
+                !(0 != QueryInfo->ShortNameLength &&
+                    FspPathIsNameInExpression(Pattern, PatternLength,
+                        QueryInfo->ShortName, QueryInfo->ShortNameLength / sizeof(WCHAR), TRUE)))
+                goto next;
+
+            memset(DirInfo, 0, sizeof *DirInfo);
+            Length = QueryInfo->FileNameLength;
+            DirInfo->Size = (UINT16)(FIELD_OFFSET(FSP_FSCTL_DIR_INFO, FileNameBuf) + Length);
+            DirInfo->FileInfo.FileAttributes = QueryInfo->FileAttributes;
+            DirInfo->FileInfo.ReparseTag = 0;
+            DirInfo->FileInfo.FileSize = QueryInfo->EndOfFile.QuadPart;
+            DirInfo->FileInfo.AllocationSize = (DirInfo->FileInfo.FileSize + ALLOCATION_UNIT - 1)
+                / ALLOCATION_UNIT * ALLOCATION_UNIT;
+            DirInfo->FileInfo.CreationTime = QueryInfo->CreationTime.QuadPart;
+            DirInfo->FileInfo.LastAccessTime = QueryInfo->LastAccessTime.QuadPart;
+            DirInfo->FileInfo.LastWriteTime = QueryInfo->LastWriteTime.QuadPart;
+            DirInfo->FileInfo.ChangeTime = DirInfo->FileInfo.LastWriteTime;
+            DirInfo->FileInfo.IndexNumber = QueryInfo->FileId.QuadPart;
+            DirInfo->FileInfo.HardLinks = 0;
+            memcpy(DirInfo->FileNameBuf, QueryInfo->FileName, Length);
+
+            if (!FspFileSystemFillDirectoryBuffer(&FileContext->DirBuffer, DirInfo, &DirBufferResult))
+                goto exit;
+
+        next:
+            if (0 == QueryInfo->NextEntryOffset)
+                break;
         }
+    }
+
+    DirBufferResult = STATUS_SUCCESS;
+
+exit:
+    return DirBufferResult;
+}
+
+static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
+    PVOID FileContext0, PWSTR Pattern, PWSTR Marker,
+    PVOID Buffer, ULONG BufferLength, PULONG PBytesTransferred)
+{
+    PTFS *Ptfs = (PTFS *)FileSystem->UserContext;
+    PTFS_FILE_CONTEXT *FileContext = FileContext0;
+    NTSTATUS DirBufferResult;
+
+    DirBufferResult = STATUS_SUCCESS;
+    if (FspFileSystemAcquireDirectoryBuffer(&FileContext->DirBuffer, 0 == Marker, &DirBufferResult))
+    {
+        DirBufferResult = ReadDirectoryByHandle(Ptfs, FileContext, Pattern);
 
         FspFileSystemReleaseDirectoryBuffer(&FileContext->DirBuffer);
     }
@@ -588,6 +1667,8 @@ static NTSTATUS SetDelete(FSP_FILE_SYSTEM *FileSystem,
     HANDLE Handle = HandleFromContext(FileContext);
     FILE_DISPOSITION_INFO DispositionInfo;
 
+    OpenCacheInvalidate((PTFS *)FileSystem->UserContext, FileName, FALSE);
+
     DispositionInfo.DeleteFile = DeleteFile;
 
     if (!SetFileInformationByHandle(Handle,
@@ -597,6 +1678,129 @@ static NTSTATUS SetDelete(FSP_FILE_SYSTEM *FileSystem,
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS DuplicateExtents(FSP_FILE_SYSTEM *FileSystem,
+    PVOID FileContext, PVOID SourceFileContext,
+    UINT64 SourceOffset, UINT64 TargetOffset, UINT64 Length,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    HANDLE Handle = HandleFromContext(FileContext);
+    HANDLE SourceHandle = HandleFromContext(SourceFileContext);
+    BY_HANDLE_FILE_INFORMATION ByHandleFileInfo, SourceByHandleFileInfo;
+    UINT64 FileSize, SourceFileSize;
+    FILE_END_OF_FILE_INFO EndOfFileInfo;
+    PTFS_DUPLICATE_EXTENTS_DATA DuplicateExtentsData;
+    OVERLAPPED Overlapped = { 0 };
+    HANDLE Event = 0;
+    PVOID Buffer = 0;
+    DWORD Part, BytesTransferred;
+    DWORD LastError;
+    NTSTATUS Result;
+
+    if (!GetFileInformationByHandle(Handle, &ByHandleFileInfo) ||
+        !GetFileInformationByHandle(SourceHandle, &SourceByHandleFileInfo))
+        return FspNtStatusFromWin32(GetLastError());
+
+    FileSize =
+        ((UINT64)ByHandleFileInfo.nFileSizeHigh << 32) | (UINT64)ByHandleFileInfo.nFileSizeLow;
+    SourceFileSize =
+        ((UINT64)SourceByHandleFileInfo.nFileSizeHigh << 32) | (UINT64)SourceByHandleFileInfo.nFileSizeLow;
+
+    if (SourceOffset + Length > SourceFileSize)
+        return STATUS_INVALID_PARAMETER;
+
+    /* overlapping ranges within the same file are not supported (same as ReFS) */
+    if (ByHandleFileInfo.dwVolumeSerialNumber == SourceByHandleFileInfo.dwVolumeSerialNumber &&
+        ByHandleFileInfo.nFileIndexHigh == SourceByHandleFileInfo.nFileIndexHigh &&
+        ByHandleFileInfo.nFileIndexLow == SourceByHandleFileInfo.nFileIndexLow &&
+        SourceOffset < TargetOffset + Length && TargetOffset < SourceOffset + Length)
+        return STATUS_INVALID_PARAMETER;
+
+    /* the backing file system requires that the target range is within the target file */
+    if (TargetOffset + Length > FileSize)
+    {
+        EndOfFileInfo.EndOfFile.QuadPart = TargetOffset + Length;
+
+        if (!SetFileInformationByHandle(Handle,
+            FileEndOfFileInfo, &EndOfFileInfo, sizeof EndOfFileInfo))
+            return FspNtStatusFromWin32(GetLastError());
+    }
+
+    Event = CreateEventW(0, TRUE, FALSE, 0);
+    if (0 == Event)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    /* let the backing file system clone the range (ReFS block cloning) */
+    DuplicateExtentsData.FileHandle = SourceHandle;
+    DuplicateExtentsData.SourceFileOffset.QuadPart = SourceOffset;
+    DuplicateExtentsData.TargetFileOffset.QuadPart = TargetOffset;
+    DuplicateExtentsData.ByteCount.QuadPart = Length;
+
+    Overlapped.hEvent = (HANDLE)((UINT_PTR)Event | 1);
+    if (DeviceIoControl(Handle, FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+            &DuplicateExtentsData, sizeof DuplicateExtentsData, 0, 0, 0, &Overlapped) ||
+        (ERROR_IO_PENDING == GetLastError() &&
+            GetOverlappedResult(Handle, &Overlapped, &BytesTransferred, TRUE)))
+    {
+        Result = STATUS_SUCCESS;
+        goto exit;
+    }
+
+    /*
+     * The backing file system cannot clone (NTFS) or cannot clone this range (ReFS requires
+     * cluster alignment). Copy the data here; it still does not cross into the kernel.
+     */
+    LastError = GetLastError();
+    if (ERROR_INVALID_FUNCTION != LastError &&
+        ERROR_NOT_SUPPORTED != LastError &&
+        ERROR_INVALID_PARAMETER != LastError)
+    {
+        Result = FspNtStatusFromWin32(LastError);
+        goto exit;
+    }
+
+    Buffer = malloc(COPY_BUFFER_SIZE);
+    if (0 == Buffer)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    for (; 0 < Length; SourceOffset += Part, TargetOffset += Part, Length -= Part)
+    {
+        Part = COPY_BUFFER_SIZE < Length ? COPY_BUFFER_SIZE : (DWORD)Length;
+
+        if (!SynchronousIo(SourceHandle, FALSE, Buffer, SourceOffset, Part, &BytesTransferred, Event) ||
+            !SynchronousIo(Handle, TRUE, Buffer, TargetOffset, BytesTransferred, &BytesTransferred, Event))
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+
+        /* the source file was truncated while we were copying */
+        if (Part != BytesTransferred)
+            break;
+    }
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    free(Buffer);
+
+    if (0 != Event)
+        CloseHandle(Event);
+
+    OpenCacheInvalidateAll((PTFS *)FileSystem->UserContext, FALSE);
+
+    /* refresh the file information of the target (and its file node with -o) */
+    if (NT_SUCCESS(Result))
+        Result = GetFileInfoFromContext(FileContext, FileInfo);
+
+    return Result;
+}
+
 static FSP_FILE_SYSTEM_INTERFACE PtfsInterface =
 {
     .GetVolumeInfo = GetVolumeInfo,
@@ -607,8 +1811,6 @@ static FSP_FILE_SYSTEM_INTERFACE PtfsInterface =
     .Overwrite = Overwrite,
     .Cleanup = Cleanup,
     .Close = Close,
-    .Read = Read,
-    .Write = Write,
     .Flush = Flush,
     .GetFileInfo = GetFileInfo,
     .SetBasicInfo = SetBasicInfo,
@@ -618,18 +1820,26 @@ static FSP_FILE_SYSTEM_INTERFACE PtfsInterface =
     .SetSecurity = SetSecurity,
     .ReadDirectory = ReadDirectory,
     .SetDelete = SetDelete,
+    .DuplicateExtents = DuplicateExtents,
+    .ReadV = ReadV,
+    .WriteV = WriteV,
+    .ReadEx = Read,
+    .WriteEx = Write,
 };
 
 static VOID PtfsDelete(PTFS *Ptfs);
 
 static NTSTATUS PtfsCreate(PWSTR Path, PWSTR VolumePrefix, PWSTR MountPoint, UINT32 DebugFlags,
-    PTFS **PPtfs)
+    BOOLEAN Overlapped, ULONG OpenCacheTimeout, PTFS **PPtfs)
 {
+    SYSTEM_INFO SystemInfo;
+    ULONG I;
     WCHAR FullPath[MAX_PATH];
     ULONG Length;
     HANDLE Handle;
     FILETIME CreationTime;
     DWORD LastError;
+    LARGE_INTEGER DueTime;
     FSP_FSCTL_VOLUME_PARAMS VolumeParams;
     PTFS *Ptfs = 0;
     NTSTATUS Result;
@@ -680,6 +1890,75 @@ static NTSTATUS PtfsCreate(PWSTR Path, PWSTR VolumePrefix, PWSTR MountPoint, UIN
     }
     memcpy(Ptfs->Path, FullPath, Length);
 
+    InitializeSRWLock(&Ptfs->OpenCacheLock);
+    Ptfs->OpenCacheList.Flink = Ptfs->OpenCacheList.Blink = &Ptfs->OpenCacheList;
+    if (0 != OpenCacheTimeout)
+    {
+        Ptfs->OpenCacheBuckets = malloc(OPEN_CACHE_BUCKETS * sizeof *Ptfs->OpenCacheBuckets);
+        if (0 == Ptfs->OpenCacheBuckets)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+        memset(Ptfs->OpenCacheBuckets, 0, OPEN_CACHE_BUCKETS * sizeof *Ptfs->OpenCacheBuckets);
+        Ptfs->OpenCacheTimeout = OpenCacheTimeout;
+
+        Ptfs->OpenCacheTimer = CreateThreadpoolTimer(OpenCacheTimerCallback, Ptfs, 0);
+        if (0 == Ptfs->OpenCacheTimer)
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+        DueTime.QuadPart = -(LONGLONG)OpenCacheTimeout * 10000;
+        SetThreadpoolTimer(Ptfs->OpenCacheTimer,
+            (PFILETIME)&DueTime, OpenCacheTimeout, OpenCacheTimeout / 4);
+    }
+
+    if (Overlapped)
+    {
+        Ptfs->FileNodes = malloc(FILE_NODE_BUCKETS * sizeof *Ptfs->FileNodes);
+        if (0 == Ptfs->FileNodes)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+        memset(Ptfs->FileNodes, 0, FILE_NODE_BUCKETS * sizeof *Ptfs->FileNodes);
+        InitializeSRWLock(&Ptfs->FileNodeLock);
+
+        Ptfs->IoIdleEvent = CreateEventW(0, TRUE, FALSE, 0);
+        if (0 == Ptfs->IoIdleEvent)
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+        Ptfs->IoPending = 1;
+
+        Ptfs->Iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, 0, 0, 0);
+        if (0 == Ptfs->Iocp)
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+
+        GetSystemInfo(&SystemInfo);
+        Ptfs->IoThreads = malloc(SystemInfo.dwNumberOfProcessors * sizeof *Ptfs->IoThreads);
+        if (0 == Ptfs->IoThreads)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+        for (I = 0; SystemInfo.dwNumberOfProcessors > I; I++)
+        {
+            Ptfs->IoThreads[I] = CreateThread(0, 0, IoCompletionThread, Ptfs, 0, 0);
+            if (0 == Ptfs->IoThreads[I])
+            {
+                Result = FspNtStatusFromWin32(GetLastError());
+                goto exit;
+            }
+            Ptfs->IoThreadCount++;
+        }
+    }
+
     memset(&VolumeParams, 0, sizeof VolumeParams);
     VolumeParams.SectorSize = ALLOCATION_UNIT;
     VolumeParams.SectorsPerAllocationUnit = 1;
@@ -694,6 +1973,8 @@ static NTSTATUS PtfsCreate(PWSTR Path, PWSTR VolumePrefix, PWSTR MountPoint, UIN
     VolumeParams.PassQueryDirectoryPattern = 1;
     VolumeParams.FlushAndPurgeOnCleanup = 1;
     VolumeParams.UmFileContextIsUserContext2 = 1;
+    VolumeParams.UmBatchDispatch = 1;
+    VolumeParams.DuplicateExtents = 1;
     if (0 != VolumePrefix)
         wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR), VolumePrefix);
     wcscpy_s(VolumeParams.FileSystemName, sizeof VolumeParams.FileSystemName / sizeof(WCHAR),
@@ -727,9 +2008,63 @@ exit:
 
 static VOID PtfsDelete(PTFS *Ptfs)
 {
+    PTFS_FILE_NODE *FileNode;
+    PTFS_OPEN_ENTRY *Removed = 0;
+    ULONG I;
+
+    if (0 != Ptfs->Iocp)
+    {
+        /* backend I/O always completes; let it, then stop the completion threads */
+        if (0 != InterlockedDecrement(&Ptfs->IoPending))
+            WaitForSingleObject(Ptfs->IoIdleEvent, INFINITE);
+        for (I = 0; Ptfs->IoThreadCount > I; I++)
+            PostQueuedCompletionStatus(Ptfs->Iocp, 0, 0, 0);
+        for (I = 0; Ptfs->IoThreadCount > I; I++)
+        {
+            WaitForSingleObject(Ptfs->IoThreads[I], INFINITE);
+            CloseHandle(Ptfs->IoThreads[I]);
+        }
+        CloseHandle(Ptfs->Iocp);
+    }
+
+    if (0 != Ptfs->IoThreads)
+        free(Ptfs->IoThreads);
+
+    if (0 != Ptfs->IoIdleEvent)
+        CloseHandle(Ptfs->IoIdleEvent);
+
+    if (0 != Ptfs->FileNodes)
+    {
+        /* nodes of files that are still open when the file system is deleted */
+        for (I = 0; FILE_NODE_BUCKETS > I; I++)
+            while (0 != (FileNode = Ptfs->FileNodes[I]))
+            {
+                Ptfs->FileNodes[I] = FileNode->Next;
+                free(FileNode);
+            }
+        free(Ptfs->FileNodes);
+    }
+
     if (0 != Ptfs->FileSystem)
         FspFileSystemDelete(Ptfs->FileSystem);
 
+    if (0 != Ptfs->OpenCacheTimer)
+    {
+        SetThreadpoolTimer(Ptfs->OpenCacheTimer, 0, 0, 0);
+        WaitForThreadpoolTimerCallbacks(Ptfs->OpenCacheTimer, TRUE);
+        CloseThreadpoolTimer(Ptfs->OpenCacheTimer);
+    }
+
+    if (0 != Ptfs->OpenCacheBuckets)
+    {
+        while (&Ptfs->OpenCacheList != Ptfs->OpenCacheList.Flink)
+            OpenCacheRemove(Ptfs,
+                CONTAINING_RECORD(Ptfs->OpenCacheList.Flink, PTFS_OPEN_ENTRY, ListEntry),
+                &Removed);
+        OpenCacheFree(Removed);
+        free(Ptfs->OpenCacheBuckets);
+    }
+
     if (0 != Ptfs->Path)
         free(Ptfs->Path);
 
@@ -786,6 +2121,8 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
     PWSTR VolumePrefix = 0;
     PWSTR PassThrough = 0;
     PWSTR MountPoint = 0;
+    BOOLEAN Overlapped = FALSE;
+    ULONG OpenCacheTimeout = 0;
     HANDLE DebugLogHandle = INVALID_HANDLE_VALUE;
     WCHAR PassThroughBuf[MAX_PATH];
     PTFS *Ptfs = 0;
@@ -799,6 +2136,9 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         {
         case L'?':
             goto usage;
+        case L'c':
+            argtol(OpenCacheTimeout);
+            break;
         case L'd':
             argtol(DebugFlags);
             break;
@@ -808,6 +2148,9 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         case L'm':
             argtos(MountPoint);
             break;
+        case L'o':
+            Overlapped = TRUE;
+            break;
         case L'p':
             argtos(PassThrough);
             break;
@@ -870,7 +2213,8 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         FspDebugLogSetHandle(DebugLogHandle);
     }
 
-    Result = PtfsCreate(PassThrough, VolumePrefix, MountPoint, DebugFlags, &Ptfs);
+    Result = PtfsCreate(PassThrough, VolumePrefix, MountPoint, DebugFlags,
+        Overlapped, OpenCacheTimeout, &Ptfs);
     if (!NT_SUCCESS(Result))
     {
         fail(L"cannot create file system");
@@ -886,8 +2230,9 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 
     MountPoint = FspFileSystemMountPoint(Ptfs->FileSystem);
 
-    info(L"%s%s%s -p %s -m %s",
+    info(L"%s%s%s%s -p %s -m %s",
         L"" PROGNAME,
+        Overlapped ? L" -o" : L"",
         0 != VolumePrefix && L'\0' != VolumePrefix[0] ? L" -u " : L"",
             0 != VolumePrefix && L'\0' != VolumePrefix[0] ? VolumePrefix : L"",
         PassThrough,
@@ -907,8 +2252,12 @@ usage:
         "usage: %s OPTIONS\n"
         "\n"
         "options:\n"
+        "    -c OpenCacheTimeout [millis; cache handles/metadata of recently opened files;\n"
+        "                         cached handles delay deletes/renames of backing files by\n"
+        "                         others for about this long; keep it short]\n"
         "    -d DebugFlags       [-1: enable all debug logs]\n"
         "    -D DebugLogFile     [file path; use - for stderr]\n"
+        "    -o                  [overlapped I/O; complete reads/writes asynchronously]\n"
         "    -u \\Server\\Share    [UNC prefix (single backslash)]\n"
         "    -p Directory        [directory to expose as pass through file system]\n"
         "    -m MountPoint       [X:|*|directory]\n";
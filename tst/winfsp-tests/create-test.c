@@ -834,6 +834,242 @@ void create_notraverse_test(void)
         create_notraverse_dotest(MemfsNet, L"\\\\memfs\\share");
 }
 
+void create_notraverse_cache_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_start(Flags);
+
+    static PWSTR Sddl = L"D:P(A;;FA;;;WD)";
+    static PWSTR DaclSddl = L"D:P(A;;GRGWSD;;;WD)";
+    PSECURITY_DESCRIPTOR SecurityDescriptor, DaclSecurityDescriptor;
+    SECURITY_ATTRIBUTES SecurityAttributes = { 0 };
+    LUID Luid;
+    TOKEN_PRIVILEGES Privileges;
+    HANDLE Handle, Token;
+    BOOLEAN Success;
+    WCHAR FilePath[MAX_PATH];
+
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl, SDDL_REVISION_1, &SecurityDescriptor, 0);
+    ASSERT(Success);
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(DaclSddl, SDDL_REVISION_1, &DaclSecurityDescriptor, 0);
+    ASSERT(Success);
+
+    SecurityAttributes.nLength = sizeof SecurityAttributes;
+    SecurityAttributes.lpSecurityDescriptor = SecurityDescriptor;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Success = CreateDirectoryW(FilePath, &SecurityAttributes);
+    ASSERT(Success);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1\\dir2",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Success = CreateDirectoryW(FilePath, &SecurityAttributes);
+    ASSERT(Success);
+
+    Success = LookupPrivilegeValueW(0, SE_CHANGE_NOTIFY_NAME, &Luid);
+    ASSERT(Success);
+    Success = OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &Token);
+    ASSERT(Success);
+    Privileges.PrivilegeCount = 1;
+    Privileges.Privileges[0].Attributes = 0;
+    Privileges.Privileges[0].Luid = Luid;
+    Success = AdjustTokenPrivileges(Token, FALSE, &Privileges, 0, 0, 0);
+    ASSERT(Success);
+
+    /* traverse dir1 and dir2 repeatedly; the second time around the traverse check is cached */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1\\dir2\\dir3",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Success = CreateDirectoryW(FilePath, &SecurityAttributes);
+    ASSERT(Success);
+
+    Handle = CreateFileW(FilePath,
+        FILE_READ_ATTRIBUTES, 0, 0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    /* taking away traverse access from dir1 must be seen by the next open */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Success = SetFileSecurityW(FilePath, DACL_SECURITY_INFORMATION, DaclSecurityDescriptor);
+    ASSERT(Success);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1\\dir2\\dir3",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        FILE_READ_ATTRIBUTES, 0, 0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    ASSERT(INVALID_HANDLE_VALUE == Handle);
+    ASSERT(ERROR_ACCESS_DENIED == GetLastError());
+
+    Privileges.PrivilegeCount = 1;
+    Privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    Privileges.Privileges[0].Luid = Luid;
+    Success = AdjustTokenPrivileges(Token, FALSE, &Privileges, 0, 0, 0);
+    ASSERT(Success);
+
+    CloseHandle(Token);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1\\dir2\\dir3",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        DELETE, 0, 0, OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1\\dir2",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        DELETE, 0, 0, OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        DELETE, 0, 0, OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    LocalFree(DaclSecurityDescriptor);
+    LocalFree(SecurityDescriptor);
+
+    memfs_stop(memfs);
+}
+
+void create_notraverse_cache_test(void)
+{
+    if (OptNoTraverseToken)
+        /* this test needs traverse access privilege in order to work */
+        return;
+
+    if (OptShareName)
+        /* see create_notraverse_test */
+        return;
+
+    if (NtfsTests)
+    {
+        WCHAR DirBuf[MAX_PATH];
+        GetTestDirectory(DirBuf);
+        create_notraverse_cache_dotest(-1, DirBuf);
+    }
+    if (WinFspDiskTests)
+        create_notraverse_cache_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        create_notraverse_cache_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+void create_negative_cache_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_start_ex(Flags | MemfsNegativeLookupCache, 1000);
+
+    HANDLE Handle;
+    BOOLEAN Success;
+    WCHAR FilePath[MAX_PATH], File2Path[MAX_PATH];
+
+    /* probe for a missing file repeatedly; the second time around the miss is cached */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE == Handle);
+    ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE == Handle);
+    ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+
+    /* creating the file must be seen by the next open */
+    Handle = CreateFileW(FilePath,
+        GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    /* renaming a file into the directory must be seen by the next open */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Success = CreateDirectoryW(FilePath, 0);
+    ASSERT(Success);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1\\file1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    StringCbPrintfW(File2Path, sizeof File2Path, L"%s%s\\file1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(File2Path,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE == Handle);
+    ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+
+    Success = MoveFileExW(FilePath, File2Path, 0);
+    ASSERT(Success);
+
+    Handle = CreateFileW(File2Path,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    /* deleting a file makes it missing again */
+    Success = DeleteFileW(File2Path);
+    ASSERT(Success);
+
+    Handle = CreateFileW(File2Path,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE == Handle);
+    ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Success = RemoveDirectoryW(FilePath);
+    ASSERT(Success);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Success = DeleteFileW(FilePath);
+    ASSERT(Success);
+
+    memfs_stop(memfs);
+}
+
+void create_negative_cache_test(void)
+{
+    if (NtfsTests)
+    {
+        WCHAR DirBuf[MAX_PATH];
+        GetTestDirectory(DirBuf);
+        create_negative_cache_dotest(-1, DirBuf);
+    }
+    if (WinFspDiskTests)
+        create_negative_cache_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        create_negative_cache_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
 void create_backup_dotest(ULONG Flags, PWSTR Prefix)
 {
     void *memfs = memfs_start(Flags);
@@ -1333,6 +1569,9 @@ void create_tests(void)
     TEST(create_sd_test);
     if (!OptNoTraverseToken && !OptShareName)
         TEST(create_notraverse_test);
+    if (!OptNoTraverseToken && !OptShareName)
+        TEST(create_notraverse_cache_test);
+    TEST(create_negative_cache_test);
     TEST(create_backup_test);
     TEST(create_restore_test);
     TEST(create_share_test);
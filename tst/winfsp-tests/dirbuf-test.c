@@ -21,6 +21,7 @@
 
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
+#include <strsafe.h>
 #include <time.h>
 
 #include "winfsp-tests.h"
@@ -318,6 +319,82 @@ static void dirbuf_fill_test(void)
         dirbuf_fill_dotest(seed + I, 10000);
 }
 
+static void dirbuf_find_test(void)
+{
+    PVOID DirBuffer = 0;
+    NTSTATUS Result;
+    BOOLEAN Success;
+    union
+    {
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+        FSP_FSCTL_DIR_INFO D;
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.D;
+    WCHAR FileName[MAX_PATH];
+    ULONG Count = 1000;
+
+    Success = FspFileSystemFindDirectoryBuffer(&DirBuffer, L"file0", FALSE, DirInfo);
+    ASSERT(!Success);
+
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectoryBuffer(&DirBuffer, FALSE, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    for (ULONG I = 0; Count > I; I++)
+    {
+        memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+        StringCbPrintfW(FileName, sizeof FileName, L"File%u.Txt", I);
+        DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + wcslen(FileName) * sizeof(WCHAR));
+        memcpy(DirInfo->FileNameBuf, FileName, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+        DirInfo->FileInfo.FileSize = I;
+        Success = FspFileSystemFillDirectoryBuffer(&DirBuffer, DirInfo, &Result);
+        ASSERT(Success);
+        ASSERT(STATUS_SUCCESS == Result);
+    }
+
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
+
+    for (ULONG I = 0; Count > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"File%u.Txt", I);
+        memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+        Success = FspFileSystemFindDirectoryBuffer(&DirBuffer, FileName, FALSE, DirInfo);
+        ASSERT(Success);
+        ASSERT(I == DirInfo->FileInfo.FileSize);
+        ASSERT(wcslen(FileName) * sizeof(WCHAR) == DirInfo->Size - sizeof *DirInfo);
+        ASSERT(0 == memcmp(FileName, DirInfo->FileNameBuf, DirInfo->Size - sizeof *DirInfo));
+
+        StringCbPrintfW(FileName, sizeof FileName, L"FILE%u.TXT", I);
+        Success = FspFileSystemFindDirectoryBuffer(&DirBuffer, FileName, FALSE, DirInfo);
+        ASSERT(!Success);
+
+        memset(&DirInfoBuf, 0, sizeof DirInfoBuf);
+        Success = FspFileSystemFindDirectoryBuffer(&DirBuffer, FileName, TRUE, DirInfo);
+        ASSERT(Success);
+        ASSERT(I == DirInfo->FileInfo.FileSize);
+        StringCbPrintfW(FileName, sizeof FileName, L"File%u.Txt", I);
+        ASSERT(0 == memcmp(FileName, DirInfo->FileNameBuf, DirInfo->Size - sizeof *DirInfo));
+    }
+
+    Success = FspFileSystemFindDirectoryBuffer(&DirBuffer, L"File1000.Txt", TRUE, DirInfo);
+    ASSERT(!Success);
+    Success = FspFileSystemFindDirectoryBuffer(&DirBuffer, L"File1", TRUE, DirInfo);
+    ASSERT(!Success);
+
+    /* a reset discards the index */
+    Result = STATUS_UNSUCCESSFUL;
+    Success = FspFileSystemAcquireDirectoryBuffer(&DirBuffer, TRUE, &Result);
+    ASSERT(Success);
+    ASSERT(STATUS_SUCCESS == Result);
+    FspFileSystemReleaseDirectoryBuffer(&DirBuffer);
+
+    Success = FspFileSystemFindDirectoryBuffer(&DirBuffer, L"File0.Txt", FALSE, DirInfo);
+    ASSERT(!Success);
+
+    FspFileSystemDeleteDirectoryBuffer(&DirBuffer);
+}
+
 void dirbuf_tests(void)
 {
     if (OptExternal)
@@ -326,4 +403,5 @@ void dirbuf_tests(void)
     TEST(dirbuf_empty_test);
     TEST(dirbuf_dots_test);
     TEST(dirbuf_fill_test);
+    TEST(dirbuf_find_test);
 }
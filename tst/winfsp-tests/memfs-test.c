@@ -22,6 +22,7 @@
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
 #include <process.h>
+#include <strsafe.h>
 #include "memfs.h"
 
 #include "winfsp-tests.h"
@@ -110,10 +111,441 @@ void memfs_test(void)
         memfs_dotest(MemfsNet);
 }
 
+static void memfs_snapshot_dotest(ULONG Flags, PWSTR Prefix)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    WCHAR TempPath[MAX_PATH], SnapshotPath[MAX_PATH], FilePath[1024];
+    HANDLE Handle;
+    BOOL Success;
+    CHAR Buffer[64];
+    DWORD BytesTransferred;
+    int Pass;
+
+    Success = 0 != GetTempPathW(MAX_PATH, TempPath);
+    ASSERT(Success);
+    StringCbPrintfW(SnapshotPath, sizeof SnapshotPath, L"%swinfsp-tests-memfs-%lx.img",
+        TempPath, GetCurrentProcessId());
+
+    for (Pass = 0; 2 > Pass; Pass++)
+    {
+        Result = MemfsCreateFunnel(
+            Flags |
+                (OptCaseInsensitive ? MemfsCaseInsensitive : 0) |
+                (OptFlushAndPurgeOnCleanup ? MemfsFlushAndPurgeOnCleanup : 0),
+            1000,
+            1024,
+            1024 * 1024,
+            0, 0, 0,
+            0,
+            MemfsNet == Flags ? L"\\memfs\\share" : 0,
+            0,
+            &Memfs);
+        ASSERT(NT_SUCCESS(Result));
+
+        Result = MemfsSnapshotConfigure(Memfs, SnapshotPath, 0);
+        ASSERT(NT_SUCCESS(Result));
+
+        Result = MemfsStart(Memfs);
+        ASSERT(NT_SUCCESS(Result));
+
+        if (0 == Pass)
+        {
+            StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1",
+                Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+            Success = CreateDirectoryW(FilePath, 0);
+            ASSERT(Success);
+
+            StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1\\file0",
+                Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+            Handle = CreateFileW(FilePath,
+                GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+            ASSERT(INVALID_HANDLE_VALUE != Handle);
+            Success = WriteFile(Handle, "Snapshot Contents", 17, &BytesTransferred, 0);
+            ASSERT(Success);
+            ASSERT(17 == BytesTransferred);
+            Success = CloseHandle(Handle);
+            ASSERT(Success);
+        }
+        else
+        {
+            StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1\\file0",
+                Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+            Handle = CreateFileW(FilePath,
+                GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+            ASSERT(INVALID_HANDLE_VALUE != Handle);
+            Success = ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+            ASSERT(Success);
+            ASSERT(17 == BytesTransferred);
+            ASSERT(0 == memcmp("Snapshot Contents", Buffer, BytesTransferred));
+            Success = CloseHandle(Handle);
+            ASSERT(Success);
+        }
+
+        MemfsStop(Memfs);
+        MemfsDelete(Memfs);
+    }
+
+    Success = DeleteFileW(SnapshotPath);
+    ASSERT(Success);
+}
+
+void memfs_snapshot_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_snapshot_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        memfs_snapshot_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+static void memfs_dedup_dotest(ULONG Flags, PWSTR Prefix)
+{
+    /* DUPLICATE_EXTENTS_DATA is only declared by the SDK for newer _WIN32_WINNT's */
+    struct
+    {
+        HANDLE FileHandle;
+        LARGE_INTEGER SourceFileOffset;
+        LARGE_INTEGER TargetFileOffset;
+        LARGE_INTEGER ByteCount;
+    } DuplicateExtentsData;
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    WCHAR FilePath[1024];
+    HANDLE Handle, SourceHandle;
+    BOOL Success;
+    PUINT8 Buffer, ReadBuffer;
+    ULONG BufferSize = 4 * 64 * 1024;
+    DWORD BytesTransferred;
+    MEMFS_DEDUP_STATISTICS Statistics;
+    int Index;
+
+    Result = MemfsCreateFunnel(
+        Flags | MemfsDedup |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0) |
+            (OptFlushAndPurgeOnCleanup ? MemfsFlushAndPurgeOnCleanup : 0),
+        1000,
+        1024,
+        1024 * 1024,
+        0, 0, 0,
+        0,
+        MemfsNet == Flags ? L"\\memfs\\share" : 0,
+        0,
+        &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = MemfsStart(Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    Buffer = VirtualAlloc(0, 2 * BufferSize, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != Buffer);
+    ReadBuffer = Buffer + BufferSize;
+    for (Index = 0; (int)BufferSize > Index; Index++)
+        Buffer[Index] = (UINT8)(Index / (64 * 1024) + Index);
+
+    /* two files with identical contents: blocks are shared after cleanup */
+    for (Index = 0; 2 > Index; Index++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file%d",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName,
+            Index);
+        Handle = CreateFileW(FilePath,
+            GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+        Success = WriteFile(Handle, Buffer, BufferSize, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(BufferSize == BytesTransferred);
+        Success = CloseHandle(Handle);
+        ASSERT(Success);
+    }
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file2",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    Success = DeviceIoControl(Handle,
+        CTL_CODE(0x8000 + 'M', 'D', METHOD_BUFFERED, FILE_ANY_ACCESS),
+        0, 0,
+        &Statistics, sizeof Statistics,
+        &BytesTransferred,
+        0);
+    ASSERT(Success);
+    ASSERT(sizeof Statistics == BytesTransferred);
+    ASSERT(64 * 1024 == Statistics.BlockSize);
+    ASSERT(8 == Statistics.LogicalBlocks);
+    ASSERT(4 == Statistics.PhysicalBlocks);
+
+    /* clone file0 into file2: no data is copied */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+    SourceHandle = CreateFileW(FilePath,
+        GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != SourceHandle);
+
+    DuplicateExtentsData.FileHandle = SourceHandle;
+    DuplicateExtentsData.SourceFileOffset.QuadPart = 0;
+    DuplicateExtentsData.TargetFileOffset.QuadPart = 0;
+    DuplicateExtentsData.ByteCount.QuadPart = BufferSize;
+    Success = DeviceIoControl(Handle, FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+        &DuplicateExtentsData, sizeof DuplicateExtentsData, 0, 0, &BytesTransferred, 0);
+    ASSERT(Success);
+
+    Success = CloseHandle(SourceHandle);
+    ASSERT(Success);
+
+    Success = DeviceIoControl(Handle,
+        CTL_CODE(0x8000 + 'M', 'D', METHOD_BUFFERED, FILE_ANY_ACCESS),
+        0, 0,
+        &Statistics, sizeof Statistics,
+        &BytesTransferred,
+        0);
+    ASSERT(Success);
+    ASSERT(12 == Statistics.LogicalBlocks);
+    ASSERT(4 == Statistics.PhysicalBlocks);
+
+    /* the FSD sees the new file size without reopening */
+    Success = ReadFile(Handle, ReadBuffer, BufferSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(BufferSize == BytesTransferred);
+    ASSERT(0 == memcmp(Buffer, ReadBuffer, BufferSize));
+
+    /* writing to a shared block copies it */
+    SetFilePointer(Handle, 0, 0, FILE_BEGIN);
+    memset(ReadBuffer, 'X', 512);
+    Success = WriteFile(Handle, ReadBuffer, 512, &BytesTransferred, 0);
+    ASSERT(Success);
+
+    Success = DeviceIoControl(Handle,
+        CTL_CODE(0x8000 + 'M', 'D', METHOD_BUFFERED, FILE_ANY_ACCESS),
+        0, 0,
+        &Statistics, sizeof Statistics,
+        &BytesTransferred,
+        0);
+    ASSERT(Success);
+    ASSERT(12 == Statistics.LogicalBlocks);
+    ASSERT(5 == Statistics.PhysicalBlocks);
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    Success = ReadFile(Handle, ReadBuffer, BufferSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(BufferSize == BytesTransferred);
+    ASSERT(0 == memcmp(Buffer, ReadBuffer, BufferSize));
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+
+    MemfsStop(Memfs);
+    MemfsDelete(Memfs);
+}
+
+void memfs_dedup_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_dedup_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        memfs_dedup_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+static void memfs_slowio_dotest(ULONG Flags, PWSTR Prefix)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    WCHAR FilePath[1024];
+    HANDLE Handle;
+    BOOL Success;
+    CHAR Buffer[64];
+    DWORD BytesTransferred;
+    WIN32_FIND_DATAW FindData;
+
+    Result = MemfsCreateFunnel(
+        Flags |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0) |
+            (OptFlushAndPurgeOnCleanup ? MemfsFlushAndPurgeOnCleanup : 0),
+        1000,
+        1024,
+        1024 * 1024,
+        0,
+        100, /*SlowioPercentDelay*/
+        0,
+        0,
+        MemfsNet == Flags ? L"\\memfs\\share" : 0,
+        0,
+        &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = MemfsSlowioConfigure(Memfs, L"fixed:");
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+    Result = MemfsSlowioConfigure(Memfs, L"uniform:5-1");
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+    Result = MemfsSlowioConfigure(Memfs, L"create=fixed:1");
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    /* every Read/Write/ReadDirectory is completed by the timer wheel */
+    Result = MemfsSlowioConfigure(Memfs, L"lognormal:2,0.5;write=fixed:3;readdir=uniform:0-2");
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = MemfsStart(Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    Success = WriteFile(Handle, "Slowio Contents", 15, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(15 == BytesTransferred);
+    SetFilePointer(Handle, 0, 0, FILE_BEGIN);
+    Success = ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(15 == BytesTransferred);
+    ASSERT(0 == memcmp("Slowio Contents", Buffer, BytesTransferred));
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\*",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+    Handle = FindFirstFileW(FilePath, &FindData);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    Success = FindClose(Handle);
+    ASSERT(Success);
+
+    MemfsStop(Memfs);
+    MemfsDelete(Memfs);
+}
+
+void memfs_slowio_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_slowio_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        memfs_slowio_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+static void memfs_spill_dotest(ULONG Flags, PWSTR Prefix)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    WCHAR TempPath[MAX_PATH], SpillPath[MAX_PATH], FilePath[1024];
+    HANDLE Handle;
+    BOOL Success;
+    PUINT8 Buffer, ReadBuffer;
+    ULONG BufferSize = 8 * 64 * 1024;
+    DWORD BytesTransferred;
+    MEMFS_SPILL_STATISTICS Statistics;
+    ULONG Index;
+
+    Success = 0 != GetTempPathW(MAX_PATH, TempPath);
+    ASSERT(Success);
+    StringCbPrintfW(SpillPath, sizeof SpillPath, L"%swinfsp-tests-memfs-%lx.spill",
+        TempPath, GetCurrentProcessId());
+
+    Result = MemfsCreateFunnel(
+        Flags |
+            (OptCaseInsensitive ? MemfsCaseInsensitive : 0) |
+            (OptFlushAndPurgeOnCleanup ? MemfsFlushAndPurgeOnCleanup : 0),
+        1000,
+        1024,
+        1024 * 1024,
+        0, 0, 0,
+        0,
+        MemfsNet == Flags ? L"\\memfs\\share" : 0,
+        0,
+        &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = MemfsSpillConfigure(Memfs, 1024, SpillPath);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    /* keep 2 blocks in memory */
+    Result = MemfsSpillConfigure(Memfs, 2 * 64 * 1024, SpillPath);
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = MemfsStart(Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    Buffer = VirtualAlloc(0, 2 * BufferSize, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != Buffer);
+    ReadBuffer = Buffer + BufferSize;
+    for (Index = 0; BufferSize > Index; Index++)
+        Buffer[Index] = (UINT8)(Index / (64 * 1024) + Index);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    Success = WriteFile(Handle, Buffer, BufferSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(BufferSize == BytesTransferred);
+
+    Success = DeviceIoControl(Handle,
+        CTL_CODE(0x8000 + 'M', 'L', METHOD_BUFFERED, FILE_ANY_ACCESS),
+        0, 0,
+        &Statistics, sizeof Statistics,
+        &BytesTransferred,
+        0);
+    ASSERT(Success);
+    ASSERT(sizeof Statistics == BytesTransferred);
+    ASSERT(2 * 64 * 1024 == Statistics.BudgetBytes);
+    ASSERT(2 * 64 * 1024 >= Statistics.ResidentBytes);
+    ASSERT(6 * 64 * 1024 <= Statistics.SpilledBytes);
+    ASSERT(6 <= Statistics.Evictions);
+
+    /* reading the file back faults spilled blocks in */
+    SetFilePointer(Handle, 0, 0, FILE_BEGIN);
+    Success = ReadFile(Handle, ReadBuffer, BufferSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(BufferSize == BytesTransferred);
+    ASSERT(0 == memcmp(Buffer, ReadBuffer, BufferSize));
+
+    Success = DeviceIoControl(Handle,
+        CTL_CODE(0x8000 + 'M', 'L', METHOD_BUFFERED, FILE_ANY_ACCESS),
+        0, 0,
+        &Statistics, sizeof Statistics,
+        &BytesTransferred,
+        0);
+    ASSERT(Success);
+    ASSERT(2 * 64 * 1024 >= Statistics.ResidentBytes);
+    ASSERT(6 <= Statistics.Misses);
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+
+    MemfsStop(Memfs);
+    MemfsDelete(Memfs);
+
+    /* the spill file is deleted with the file system */
+    ASSERT(INVALID_FILE_ATTRIBUTES == GetFileAttributesW(SpillPath));
+}
+
+void memfs_spill_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_spill_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        memfs_spill_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
 void memfs_tests(void)
 {
     if (OptExternal)
         return;
 
     TEST(memfs_test);
+    TEST(memfs_snapshot_test);
+    TEST(memfs_dedup_test);
+    TEST(memfs_slowio_test);
+    TEST(memfs_spill_test);
 }
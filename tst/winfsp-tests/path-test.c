@@ -128,6 +128,94 @@ void path_suffix_test(void)
     }
 }
 
+void path_wildcard_test(void)
+{
+    struct
+    {
+        PWSTR Expression, Name;
+        BOOLEAN IgnoreCase, Result;
+    } Tests[] =
+    {
+        { L"", L"", FALSE, TRUE },
+        { L"", L"A", FALSE, FALSE },
+        { L"*", L"", FALSE, FALSE },
+        { L"*", L"A", FALSE, TRUE },
+        { L"A", L"a", FALSE, FALSE },
+        { L"A", L"a", TRUE, TRUE },
+        { L"ABC", L"ABC", FALSE, TRUE },
+        { L"ABC", L"ABCD", FALSE, FALSE },
+        { L"ABC*", L"ABCD", FALSE, TRUE },
+        { L"*.TXT", L"A.TXT", FALSE, TRUE },
+        { L"*.TXT", L"a.txt", TRUE, TRUE },
+        { L"*.txt", L"A.TXT", TRUE, TRUE },
+        { L"*.TXT", L"A.TXTX", FALSE, FALSE },
+        { L"*A*B", L"XAYAB", FALSE, TRUE },
+        { L"A?C", L"ABC", FALSE, TRUE },
+        { L"A?C", L"AC", FALSE, FALSE },
+        { L"<.TXT", L"A.B.TXT", FALSE, TRUE },
+        { L"<", L"A.B", FALSE, FALSE },
+        { L"<", L"AB", FALSE, TRUE },
+        { L"<.<", L"A.B", FALSE, TRUE },
+        { L"FOO\"*", L"FOO", FALSE, TRUE },
+        { L"FOO\"*", L"FOO.BAR", FALSE, TRUE },
+        { L"FOO\"BAR", L"FOO.BAR", FALSE, TRUE },
+        { L"A>>", L"A", FALSE, TRUE },
+        { L"A>>", L"AB", FALSE, TRUE },
+        { L"A>>", L"ABCD", FALSE, FALSE },
+        { L"A>>.TXT", L"A.TXT", FALSE, TRUE },
+        { L"A>>.TXT", L"AB.TXT", FALSE, TRUE },
+    };
+
+    for (size_t i = 0; sizeof Tests / sizeof Tests[0] > i; i++)
+        ASSERT(Tests[i].Result == FspPathIsNameInExpression(
+            Tests[i].Expression, (ULONG)wcslen(Tests[i].Expression),
+            Tests[i].Name, (ULONG)wcslen(Tests[i].Name),
+            Tests[i].IgnoreCase));
+
+    /* compare against ntdll's RtlIsNameInExpression on generated names */
+    BOOLEAN (WINAPI *RtlIsNameInExpression)(
+        PUNICODE_STRING Expression, PUNICODE_STRING Name, BOOLEAN IgnoreCase, PWCH UpcaseTable);
+    *(FARPROC *)&RtlIsNameInExpression =
+        GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "RtlIsNameInExpression");
+    if (0 == RtlIsNameInExpression)
+        return;
+
+    static const WCHAR ExpressionChars[] = L"ab.*?<>\"";
+    static const WCHAR NameChars[] = L"abAB.";
+    WCHAR Expression[8], UpcaseExpression[8], Name[8];
+    UNICODE_STRING ExpressionString, NameString;
+    ULONG Seed = 1;
+
+    for (ULONG i = 0; 100000 > i; i++)
+    {
+        ULONG ExpressionLength = 1 + (Seed = Seed * 1103515245 + 12345) % 7;
+        ULONG NameLength = 1 + (Seed = Seed * 1103515245 + 12345) % 7;
+        for (ULONG j = 0; ExpressionLength > j; j++)
+        {
+            Expression[j] = ExpressionChars[((Seed = Seed * 1103515245 + 12345) >> 8) %
+                (sizeof ExpressionChars / sizeof(WCHAR) - 1)];
+            UpcaseExpression[j] = L'a' <= Expression[j] && Expression[j] <= L'z' ?
+                Expression[j] - L'a' + L'A' : Expression[j];
+        }
+        for (ULONG j = 0; NameLength > j; j++)
+            Name[j] = NameChars[((Seed = Seed * 1103515245 + 12345) >> 8) %
+                (sizeof NameChars / sizeof(WCHAR) - 1)];
+
+        for (int IgnoreCase = 0; 2 > IgnoreCase; IgnoreCase++)
+        {
+            ExpressionString.Length = ExpressionString.MaximumLength =
+                (USHORT)(ExpressionLength * sizeof(WCHAR));
+            ExpressionString.Buffer = IgnoreCase ? UpcaseExpression : Expression;
+            NameString.Length = NameString.MaximumLength = (USHORT)(NameLength * sizeof(WCHAR));
+            NameString.Buffer = Name;
+            ASSERT(
+                !!RtlIsNameInExpression(&ExpressionString, &NameString, (BOOLEAN)IgnoreCase, 0) ==
+                !!FspPathIsNameInExpression(
+                    Expression, ExpressionLength, Name, NameLength, (BOOLEAN)IgnoreCase));
+        }
+    }
+}
+
 void path_tests(void)
 {
     if (OptExternal)
@@ -135,4 +223,5 @@ void path_tests(void)
 
     TEST(path_prefix_test);
     TEST(path_suffix_test);
+    TEST(path_wildcard_test);
 }
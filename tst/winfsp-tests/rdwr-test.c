@@ -21,6 +21,7 @@
 
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
+#include <process.h>
 #include <strsafe.h>
 #include <time.h>
 #include <VersionHelpers.h>
@@ -1111,6 +1112,283 @@ void rdwr_mixed_test(void)
     }
 }
 
+static void rdwr_duplicate_extents_dotest(ULONG Flags, PWSTR VolPrefix, PWSTR Prefix, ULONG FileInfoTimeout)
+{
+    void *memfs = memfs_start_ex(Flags, FileInfoTimeout);
+
+    /* DUPLICATE_EXTENTS_DATA is only declared by the SDK for newer _WIN32_WINNT's */
+    struct
+    {
+        HANDLE FileHandle;
+        LARGE_INTEGER SourceFileOffset;
+        LARGE_INTEGER TargetFileOffset;
+        LARGE_INTEGER ByteCount;
+    } DuplicateExtentsData;
+    HANDLE Handle0, Handle1;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    DWORD FileSystemFlags;
+    PUINT8 Buffer[2];
+    ULONG BufferSize = 3 * 64 * 1024 + 100;
+    DWORD BytesTransferred;
+    LARGE_INTEGER FileSize;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\",
+        VolPrefix ? L"" : L"\\\\?\\GLOBALROOT", VolPrefix ? VolPrefix : memfs_volumename(memfs));
+
+    Success = GetVolumeInformationW(FilePath, 0, 0, 0, 0, &FileSystemFlags, 0, 0);
+    ASSERT(Success);
+    ASSERT(0 != (FileSystemFlags & 0x08000000/*FILE_SUPPORTS_BLOCK_REFCOUNTING*/));
+
+    Buffer[0] = malloc(BufferSize);
+    Buffer[1] = malloc(BufferSize);
+    ASSERT(0 != Buffer[0] && 0 != Buffer[1]);
+
+    srand((unsigned)time(0));
+    for (PUINT8 Bgn = Buffer[0], End = Bgn + BufferSize; End > Bgn; Bgn++)
+        *Bgn = rand();
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle0 = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle0);
+
+    Success = WriteFile(Handle0, Buffer[0], BufferSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(BufferSize == BytesTransferred);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle1 = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle1);
+
+    /* whole blocks, extending the (empty) target */
+    DuplicateExtentsData.FileHandle = Handle0;
+    DuplicateExtentsData.SourceFileOffset.QuadPart = 0;
+    DuplicateExtentsData.TargetFileOffset.QuadPart = 64 * 1024;
+    DuplicateExtentsData.ByteCount.QuadPart = 2 * 64 * 1024;
+    Success = DeviceIoControl(Handle1, FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+        &DuplicateExtentsData, sizeof DuplicateExtentsData, 0, 0, &BytesTransferred, 0);
+    ASSERT(Success);
+
+    Success = GetFileSizeEx(Handle1, &FileSize);
+    ASSERT(Success);
+    ASSERT(3 * 64 * 1024 == FileSize.QuadPart);
+
+    /* bring the target data into the cache; the next copy must not be hidden by it */
+    SetFilePointer(Handle1, 0, 0, FILE_BEGIN);
+    Success = ReadFile(Handle1, Buffer[1], (DWORD)FileSize.QuadPart, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(FileSize.QuadPart == BytesTransferred);
+
+    /* unaligned range, partly overwriting the previous copy */
+    DuplicateExtentsData.SourceFileOffset.QuadPart = 2 * 64 * 1024 + 7;
+    DuplicateExtentsData.TargetFileOffset.QuadPart = 3 * 64 * 1024 - 1000;
+    DuplicateExtentsData.ByteCount.QuadPart = 64 * 1024 + 93;
+    Success = DeviceIoControl(Handle1, FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+        &DuplicateExtentsData, sizeof DuplicateExtentsData, 0, 0, &BytesTransferred, 0);
+    ASSERT(Success);
+
+    Success = GetFileSizeEx(Handle1, &FileSize);
+    ASSERT(Success);
+    ASSERT(3 * 64 * 1024 - 1000 + 64 * 1024 + 93 == FileSize.QuadPart);
+
+    SetFilePointer(Handle1, 0, 0, FILE_BEGIN);
+    memset(Buffer[1], 0xcc, BufferSize);
+    Success = ReadFile(Handle1, Buffer[1], (DWORD)FileSize.QuadPart, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(FileSize.QuadPart == BytesTransferred);
+    for (PUINT8 Bgn = Buffer[1], End = Bgn + 64 * 1024; End > Bgn; Bgn++)
+        ASSERT(0 == *Bgn);
+    ASSERT(0 == memcmp(Buffer[1] + 64 * 1024, Buffer[0], 2 * 64 * 1024 - 1000));
+    ASSERT(0 == memcmp(Buffer[1] + 3 * 64 * 1024 - 1000, Buffer[0] + 2 * 64 * 1024 + 7, 64 * 1024 + 93));
+
+    /* source range past end of file */
+    DuplicateExtentsData.SourceFileOffset.QuadPart = BufferSize - 10;
+    DuplicateExtentsData.TargetFileOffset.QuadPart = 0;
+    DuplicateExtentsData.ByteCount.QuadPart = 11;
+    Success = DeviceIoControl(Handle1, FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+        &DuplicateExtentsData, sizeof DuplicateExtentsData, 0, 0, &BytesTransferred, 0);
+    ASSERT(!Success);
+    ASSERT(ERROR_INVALID_PARAMETER == GetLastError());
+
+    Success = CloseHandle(Handle1);
+    ASSERT(Success);
+
+    Success = CloseHandle(Handle0);
+    ASSERT(Success);
+
+    free(Buffer[1]);
+    free(Buffer[0]);
+
+    memfs_stop(memfs);
+}
+
+void rdwr_duplicate_extents_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        rdwr_duplicate_extents_dotest(MemfsDisk, 0, 0, 1000);
+        rdwr_duplicate_extents_dotest(MemfsDisk, 0, 0, INFINITE);
+    }
+    if (WinFspNetTests)
+    {
+        rdwr_duplicate_extents_dotest(MemfsNet, L"\\\\memfs\\share", L"\\\\memfs\\share", 1000);
+        rdwr_duplicate_extents_dotest(MemfsNet, L"\\\\memfs\\share", L"\\\\memfs\\share", INFINITE);
+    }
+}
+
+static FSP_FSCTL_BUFFER_SLOTS rdwr_buffer_slots;
+static volatile LONG rdwr_buffer_slots_owner[FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX];
+static volatile LONG rdwr_buffer_slots_conflicts, rdwr_buffer_slots_fallbacks;
+
+static unsigned __stdcall rdwr_buffer_slots_thread(void *Data)
+{
+    LONG Id = (LONG)(UINT_PTR)Data;
+    UINT32 Slot;
+
+    for (ULONG I = 0; 10000 > I; I++)
+    {
+        /* same as the driver: no free slot means falling back to a per-request buffer */
+        if (!FspFsctlBufferSlotsAcquire(&rdwr_buffer_slots, &Slot))
+        {
+            InterlockedIncrement(&rdwr_buffer_slots_fallbacks);
+            continue;
+        }
+
+        if (0 != InterlockedCompareExchange(&rdwr_buffer_slots_owner[Slot], Id, 0))
+            InterlockedIncrement(&rdwr_buffer_slots_conflicts);
+        SwitchToThread();
+        if (Id != InterlockedCompareExchange(&rdwr_buffer_slots_owner[Slot], 0, Id))
+            InterlockedIncrement(&rdwr_buffer_slots_conflicts);
+
+        FspFsctlBufferSlotsRelease(&rdwr_buffer_slots, Slot);
+    }
+
+    return 0;
+}
+
+void rdwr_buffer_slots_test(void)
+{
+    HANDLE Threads[8];
+    UINT32 Slot, Slots[FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX];
+    BOOLEAN Success;
+
+    /* exhaust the slots; every slot is handed out exactly once */
+    FspFsctlBufferSlotsInitialize(&rdwr_buffer_slots, FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX + 1);
+    ASSERT(FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX == rdwr_buffer_slots.SlotCount);
+    for (ULONG I = 0; FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX > I; I++)
+    {
+        Success = FspFsctlBufferSlotsAcquire(&rdwr_buffer_slots, &Slots[I]);
+        ASSERT(Success);
+        ASSERT(I == Slots[I]);
+    }
+    Success = FspFsctlBufferSlotsAcquire(&rdwr_buffer_slots, &Slot);
+    ASSERT(!Success);
+
+    /* a released slot is reused */
+    FspFsctlBufferSlotsRelease(&rdwr_buffer_slots, 42);
+    Success = FspFsctlBufferSlotsAcquire(&rdwr_buffer_slots, &Slot);
+    ASSERT(Success);
+    ASSERT(42 == Slot);
+    for (ULONG I = 0; FSP_FSCTL_REGISTERED_BUFFER_COUNTMAX > I; I++)
+        FspFsctlBufferSlotsRelease(&rdwr_buffer_slots, Slots[I]);
+    ASSERT(0 == rdwr_buffer_slots.BusyMask);
+
+    /* more threads than slots: no slot is ever owned by two threads */
+    FspFsctlBufferSlotsInitialize(&rdwr_buffer_slots, 4);
+    rdwr_buffer_slots_conflicts = 0;
+    rdwr_buffer_slots_fallbacks = 0;
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, rdwr_buffer_slots_thread, (PVOID)(UINT_PTR)(I + 1), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    WaitForMultipleObjects(sizeof Threads / sizeof Threads[0], Threads, TRUE, INFINITE);
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+        CloseHandle(Threads[I]);
+    ASSERT(0 == rdwr_buffer_slots_conflicts);
+    ASSERT(0 == rdwr_buffer_slots.BusyMask);
+}
+
+static void rdwr_registered_buffers_dotest(ULONG Flags, PWSTR VolPrefix, PWSTR Prefix, ULONG FileInfoTimeout)
+{
+    void *memfs = memfs_start_ex(Flags | MemfsRegisteredBuffers, FileInfoTimeout);
+
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    PUINT8 Buffer[2];
+    ULONG BufferSize = 4 * 1024 * 1024;
+    ULONG Lengths[] =
+    {
+        4096,                                       /* small: process buffer */
+        256 * 1024,                                 /* registered buffer */
+        FSP_FSCTL_REGISTERED_BUFFER_SIZEDEFAULT,    /* registered buffer (exact fit) */
+        FSP_FSCTL_REGISTERED_BUFFER_SIZEDEFAULT + 4096, /* too large: regular path */
+    };
+    DWORD BytesTransferred;
+
+    Buffer[0] = VirtualAlloc(0, BufferSize, MEM_COMMIT, PAGE_READWRITE);
+    Buffer[1] = VirtualAlloc(0, BufferSize, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != Buffer[0] && 0 != Buffer[1]);
+
+    srand((unsigned)time(0));
+    for (PUINT8 Bgn = Buffer[0], End = Bgn + BufferSize; End > Bgn; Bgn++)
+        *Bgn = rand();
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    for (ULONG I = 0; sizeof Lengths / sizeof Lengths[0] > I; I++)
+    {
+        SetFilePointer(Handle, 0, 0, FILE_BEGIN);
+        Success = WriteFile(Handle, Buffer[0] + I * 4096, Lengths[I], &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(Lengths[I] == BytesTransferred);
+
+        SetFilePointer(Handle, 0, 0, FILE_BEGIN);
+        memset(Buffer[1], 0, Lengths[I]);
+        Success = ReadFile(Handle, Buffer[1], Lengths[I], &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(Lengths[I] == BytesTransferred);
+        ASSERT(0 == memcmp(Buffer[0] + I * 4096, Buffer[1], Lengths[I]));
+    }
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    VirtualFree(Buffer[1], 0, MEM_RELEASE);
+    VirtualFree(Buffer[0], 0, MEM_RELEASE);
+
+    memfs_stop(memfs);
+}
+
+void rdwr_registered_buffers_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        rdwr_registered_buffers_dotest(MemfsDisk, 0, 0, 1000);
+        rdwr_registered_buffers_dotest(MemfsDisk, 0, 0, INFINITE);
+    }
+    if (WinFspNetTests)
+    {
+        rdwr_registered_buffers_dotest(MemfsNet, L"\\\\memfs\\share", L"\\\\memfs\\share", 1000);
+        rdwr_registered_buffers_dotest(MemfsNet, L"\\\\memfs\\share", L"\\\\memfs\\share", INFINITE);
+    }
+}
+
 void rdwr_tests(void)
 {
     TEST(rdwr_noncached_test);
@@ -1130,4 +1408,7 @@ void rdwr_tests(void)
     TEST(rdwr_writethru_overlapped_test);
     TEST(rdwr_mmap_test);
     TEST(rdwr_mixed_test);
+    TEST(rdwr_duplicate_extents_test);
+    TEST(rdwr_buffer_slots_test);
+    TEST(rdwr_registered_buffers_test);
 }
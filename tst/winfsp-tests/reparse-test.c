@@ -513,6 +513,17 @@ static void reparse_symlink_relative_dotest(ULONG Flags, PWSTR Prefix, ULONG Fil
     my_namecheck(L"\\1\\a2\\a1\\1.1\\l1.1.1", L"\\1\\1.1\\1.1.1");
     my_namecheck(L"\\1\\a2\\a1\\l2\\l1\\1.1\\l1.1.1", L"\\1\\1.1\\1.1.1");
 
+    /* retarget a symlink; paths through it must follow the new target */
+    my_symlinkd(L"\\lr", L"\\1");
+    my_namecheck(L"\\lr\\1.2", L"\\1\\1.2");
+    my_namecheck(L"\\lr\\1.2", L"\\1\\1.2");
+    my_rmdir(L"\\lr");
+    my_symlinkd(L"\\lr", L"\\2");
+    my_namecheck(L"\\lr\\2.1", L"\\2\\2.1");
+    my_failcheck(L"\\lr\\1.2");
+    ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+    my_rmdir(L"\\lr");
+
     my_rmdir(L"\\ld");
     my_unlink(L"\\lf");
     my_rmdir(L"\\1\\a2");
@@ -546,10 +557,12 @@ void reparse_symlink_relative_test(void)
     if (WinFspDiskTests)
     {
         reparse_symlink_relative_dotest(MemfsDisk, 0, 0);
+        reparse_symlink_relative_dotest(MemfsDisk, 0, 1000);
     }
     if (WinFspNetTests)
     {
         reparse_symlink_relative_dotest(MemfsNet, L"\\\\memfs\\share", 0);
+        reparse_symlink_relative_dotest(MemfsNet, L"\\\\memfs\\share", 1000);
     }
 }
 
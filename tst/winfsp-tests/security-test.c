@@ -261,8 +261,263 @@ void setsecurity_test(void)
     }
 }
 
+void securityintern_test(void)
+{
+    static PWSTR Sddl0 = L"O:BAG:BAD:P(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;WD)";
+    static PWSTR Sddl1 = L"O:BAG:BAD:P(A;;FA;;;SY)(A;;FA;;;BA)(A;;FR;;;WD)";
+    PSECURITY_DESCRIPTOR SecurityDescriptor0, SecurityDescriptor1, SecurityDescriptor2;
+    PSECURITY_DESCRIPTOR Interned0, Interned1, Interned2;
+    NTSTATUS Result;
+    BOOL Success;
+
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl0, SDDL_REVISION_1, &SecurityDescriptor0, 0);
+    ASSERT(Success);
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl1, SDDL_REVISION_1, &SecurityDescriptor1, 0);
+    ASSERT(Success);
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl0, SDDL_REVISION_1, &SecurityDescriptor2, 0);
+    ASSERT(Success);
+
+    Result = FspInternSecurityDescriptor(SecurityDescriptor0, &Interned0);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 != Interned0 && SecurityDescriptor0 != Interned0);
+    ASSERT(GetSecurityDescriptorLength(SecurityDescriptor0) == GetSecurityDescriptorLength(Interned0));
+    ASSERT(0 == memcmp(SecurityDescriptor0, Interned0, GetSecurityDescriptorLength(Interned0)));
+
+    Result = FspInternSecurityDescriptor(SecurityDescriptor1, &Interned1);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(Interned0 != Interned1);
+
+    Result = FspInternSecurityDescriptor(SecurityDescriptor2, &Interned2);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(Interned0 == Interned2);
+
+    FspDeleteSecurityDescriptor(Interned2, (NTSTATUS (*)())FspInternSecurityDescriptor);
+    FspDeleteSecurityDescriptor(Interned1, (NTSTATUS (*)())FspInternSecurityDescriptor);
+
+    /* still referenced by Interned0 */
+    Result = FspInternSecurityDescriptor(SecurityDescriptor2, &Interned2);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(Interned0 == Interned2);
+
+    FspDeleteSecurityDescriptor(Interned2, (NTSTATUS (*)())FspInternSecurityDescriptor);
+    FspDeleteSecurityDescriptor(Interned0, (NTSTATUS (*)())FspInternSecurityDescriptor);
+
+    Result = FspInternSecurityDescriptor(0, &Interned0);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 == Interned0);
+
+    LocalFree(SecurityDescriptor2);
+    LocalFree(SecurityDescriptor1);
+    LocalFree(SecurityDescriptor0);
+}
+
+static PSECURITY_DESCRIPTOR accesscheck_SecurityDescriptor;
+
+static NTSTATUS accesscheck_GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
+{
+    SIZE_T Length = GetSecurityDescriptorLength(accesscheck_SecurityDescriptor);
+
+    if (0 != PFileAttributes)
+        *PFileAttributes = FILE_ATTRIBUTE_DIRECTORY;
+
+    if (0 != PSecurityDescriptorSize)
+    {
+        if (Length > *PSecurityDescriptorSize)
+        {
+            *PSecurityDescriptorSize = Length;
+            return STATUS_BUFFER_OVERFLOW;
+        }
+
+        *PSecurityDescriptorSize = Length;
+        if (0 != SecurityDescriptor)
+            memcpy(SecurityDescriptor, accesscheck_SecurityDescriptor, Length);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+void accesscheck_test(void)
+{
+    static PWSTR Sddl = L"O:BAG:BAD:P(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;WD)";
+    static WCHAR FileName[] = L"\\file0";
+    FSP_FILE_SYSTEM_INTERFACE Interface;
+    FSP_FILE_SYSTEM FileSystem;
+    union
+    {
+        FSP_FSCTL_TRANSACT_REQ V;
+        UINT8 B[sizeof(FSP_FSCTL_TRANSACT_REQ) + sizeof FileName];
+    } RequestBuf;
+    FSP_FSCTL_TRANSACT_REQ *Request = &RequestBuf.V;
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    UINT32 GrantedAccess;
+    NTSTATUS Result;
+    BOOL Success;
+
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl, SDDL_REVISION_1,
+        &accesscheck_SecurityDescriptor, 0);
+    ASSERT(Success);
+
+    memset(&Interface, 0, sizeof Interface);
+    Interface.GetSecurityByName = accesscheck_GetSecurityByName;
+    memset(&FileSystem, 0, sizeof FileSystem);
+    FileSystem.Interface = &Interface;
+
+    memset(&RequestBuf, 0, sizeof RequestBuf);
+    Request->Size = sizeof RequestBuf;
+    Request->Kind = FspFsctlTransactCreateKind;
+    Request->Req.Create.DesiredAccess = FILE_ADD_FILE;
+    Request->FileName.Offset = 0;
+    Request->FileName.Size = sizeof FileName;
+    memcpy(Request->Buffer, FileName, sizeof FileName);
+
+    /*
+     * The descriptor returned by FspAccessCheckEx belongs to the caller; it must be
+     * heap memory that FspDeleteSecurityDescriptor can free, even when FspAccessCheckEx
+     * is called from a file system's own thread.
+     */
+    SecurityDescriptor = 0;
+    Result = FspAccessCheckEx(&FileSystem, Request, TRUE, FALSE,
+        FILE_ADD_FILE, &GrantedAccess, &SecurityDescriptor);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(FILE_ADD_FILE == GrantedAccess);
+    ASSERT(0 != SecurityDescriptor);
+    ASSERT(GetSecurityDescriptorLength(accesscheck_SecurityDescriptor) ==
+        GetSecurityDescriptorLength(SecurityDescriptor));
+    ASSERT(0 == memcmp(accesscheck_SecurityDescriptor, SecurityDescriptor,
+        GetSecurityDescriptorLength(SecurityDescriptor)));
+    ASSERT(GetSecurityDescriptorLength(SecurityDescriptor) <=
+        HeapSize(GetProcessHeap(), 0, SecurityDescriptor));
+    ASSERT(0 == wcscmp(FileName, (PWSTR)Request->Buffer));
+    FspDeleteSecurityDescriptor(SecurityDescriptor, (NTSTATUS (*)())FspAccessCheckEx);
+
+    /* no descriptor requested: nothing is returned and nothing leaks */
+    Result = FspAccessCheckEx(&FileSystem, Request, TRUE, FALSE,
+        FILE_ADD_FILE, &GrantedAccess, 0);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(FILE_ADD_FILE == GrantedAccess);
+
+    LocalFree(accesscheck_SecurityDescriptor);
+    accesscheck_SecurityDescriptor = 0;
+}
+
+#define SCRATCH_THREAD_MAX              64
+
+static NTSTATUS (*scratch_GetSecurityByName0)(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize);
+static SRWLOCK scratch_Lock = SRWLOCK_INIT;
+static struct
+{
+    DWORD ThreadId;
+    PVOID Buffer;
+    ULONG Count, MismatchCount;
+} scratch_Threads[SCRATCH_THREAD_MAX];
+
+static NTSTATUS scratch_GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
+{
+    DWORD ThreadId = GetCurrentThreadId();
+    ULONG Index;
+
+    if (0 != SecurityDescriptor)
+    {
+        AcquireSRWLockExclusive(&scratch_Lock);
+        for (Index = 0; SCRATCH_THREAD_MAX > Index; Index++)
+        {
+            if (0 == scratch_Threads[Index].ThreadId)
+            {
+                scratch_Threads[Index].ThreadId = ThreadId;
+                scratch_Threads[Index].Buffer = SecurityDescriptor;
+            }
+            if (ThreadId == scratch_Threads[Index].ThreadId)
+            {
+                scratch_Threads[Index].Count++;
+                if (SecurityDescriptor != scratch_Threads[Index].Buffer)
+                    scratch_Threads[Index].MismatchCount++;
+                break;
+            }
+        }
+        ReleaseSRWLockExclusive(&scratch_Lock);
+    }
+
+    return scratch_GetSecurityByName0(FileSystem,
+        FileName, PFileAttributes, SecurityDescriptor, PSecurityDescriptorSize);
+}
+
+static void accesscheck_scratch_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_start(Flags);
+    FSP_FILE_SYSTEM *FileSystem = MemfsFileSystem(memfs);
+    const FSP_FILE_SYSTEM_INTERFACE *Interface0 = FileSystem->Interface;
+    FSP_FILE_SYSTEM_INTERFACE Interface;
+    HANDLE Handle;
+    BOOLEAN Success;
+    WCHAR FilePath[MAX_PATH];
+    ULONG Index, Count;
+
+    memset(scratch_Threads, 0, sizeof scratch_Threads);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    Interface = *Interface0;
+    scratch_GetSecurityByName0 = Interface.GetSecurityByName;
+    Interface.GetSecurityByName = scratch_GetSecurityByName;
+    FileSystem->Interface = &Interface;
+
+    /*
+     * Create requests take their security descriptor buffers from the scratch arena of
+     * the dispatcher thread, which is reset after every request. So every request that a
+     * dispatcher thread processes must see the same buffer; a heap allocation per request
+     * would not.
+     */
+    for (Index = 0; 1000 > Index; Index++)
+    {
+        Handle = CreateFileW(FilePath,
+            GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+        CloseHandle(Handle);
+    }
+
+    FileSystem->Interface = Interface0;
+
+    Count = 0;
+    for (Index = 0; SCRATCH_THREAD_MAX > Index && 0 != scratch_Threads[Index].ThreadId; Index++)
+    {
+        ASSERT(0 == scratch_Threads[Index].MismatchCount);
+        Count += scratch_Threads[Index].Count;
+    }
+    ASSERT(1000 <= Count);
+
+    Success = DeleteFileW(FilePath);
+    ASSERT(Success);
+
+    memfs_stop(memfs);
+}
+
+void accesscheck_scratch_test(void)
+{
+    if (WinFspDiskTests)
+        accesscheck_scratch_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        accesscheck_scratch_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
 void security_tests(void)
 {
     TEST(getsecurity_test);
     TEST(setsecurity_test);
+    TEST(securityintern_test);
+    TEST(accesscheck_test);
+    TEST(accesscheck_scratch_test);
 }